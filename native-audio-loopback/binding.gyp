@@ -0,0 +1,41 @@
+{
+  "targets": [
+    {
+      # In-process capture: the ApplicationLoopback pipeline with an N-API output stage instead of
+      # stdout/shared memory.  WIL comes from the NuGet package the Visual Studio project restores
+      # (nuget restore src-cpp/ApplicationLoopback/ApplicationLoopback.sln).
+      "target_name": "audio_loopback",
+      "conditions": [
+        ["OS=='win'", {
+          "sources": [
+            "src-cpp/AudioLoopbackAddon/Addon.cpp",
+            "src-cpp/AudioLoopbackAddon/AddonSink.cpp",
+            "src-cpp/ApplicationLoopback/AudioSessionMonitor.cpp",
+            "src-cpp/ApplicationLoopback/CaptureHost.cpp",
+            "src-cpp/ApplicationLoopback/CaptureStats.cpp",
+            "src-cpp/ApplicationLoopback/LevelMeter.cpp",
+            "src-cpp/ApplicationLoopback/LoopbackCapture.cpp",
+            "src-cpp/ApplicationLoopback/Mixer.cpp",
+            "src-cpp/ApplicationLoopback/OpusEncoder.cpp",
+            "src-cpp/ApplicationLoopback/OutputWriter.cpp",
+            "src-cpp/ApplicationLoopback/Profiler.cpp",
+            "src-cpp/ApplicationLoopback/Resampler.cpp",
+            "src-cpp/ApplicationLoopback/SilenceDetector.cpp",
+            "src-cpp/ApplicationLoopback/Tracing.cpp"
+          ],
+          "include_dirs": [
+            "src-cpp/ApplicationLoopback",
+            "src-cpp/ApplicationLoopback/packages/Microsoft.Windows.ImplementationLibrary.1.0.210204.1/include"
+          ],
+          "defines": [ "UNICODE", "_UNICODE" ],
+          "libraries": [ "mfplat.lib", "mmdevapi.lib", "mfuuid.lib", "avrt.lib", "advapi32.lib", "ole32.lib", "windowsapp.lib" ],
+          "msvs_settings": {
+            "VCCLCompilerTool": {
+              "AdditionalOptions": [ "/std:c++17", "/EHsc" ]
+            }
+          }
+        }]
+      ]
+    }
+  ]
+}
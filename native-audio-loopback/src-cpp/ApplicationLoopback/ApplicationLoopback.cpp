@@ -7,38 +7,37 @@
 #include <psapi.h>
 #include <tchar.h>
 #include <fcntl.h>
-#include "LoopbackCapture.h"
+#include "CaptureHost.h"
+#include "CaptureOptions.h"
+#include "ControlChannel.h"
+#include "Daemon.h"
 
 int wmain(int argc, wchar_t* argv[])
 {
 	if (argc < 2)
 	{
-		std::wcout << L"Usage: ApplicationLoopback.exe <processId> [include|exclude]\n";
+		PrintUsage();
 		return 0;
 	}
 
-	DWORD processId = wcstoul(argv[1], nullptr, 0);
-	if (processId == 0)
+	CaptureOptions options;
+	if (!ParseCaptureOptions(argc, argv, options))
 	{
-		std::wcerr << L"Invalid process ID.\n";
 		return 1;
 	}
 
-	bool include = true;
-	if (argc >= 3) {
-		if (wcscmp(argv[2], L"exclude") == 0) {
-			include = false;
-		}
-	}
-
 	if (_setmode(_fileno(stdout), _O_BINARY) == -1)
 	{
 		std::wcerr << L"Failed to set mode to binary for stdout.\n";
 		return 1;
 	}
 
-	CLoopbackCapture loopbackCapture;
-	HRESULT hr = loopbackCapture.StartCaptureAsync(processId, include);
+	CCaptureHost host;
+	HRESULT hr = host.Initialize(options);
+	if (SUCCEEDED(hr) && options.ProcessId != 0)
+	{
+		hr = host.StartCapture(0, options);
+	}
 	if (FAILED(hr))
 	{
 		wil::unique_hlocal_string message;
@@ -48,6 +47,21 @@ int wmain(int argc, wchar_t* argv[])
 		return 1;
 	}
 
-	int ch = std::getchar();
+	if (options.Daemon)
+	{
+		hr = RunDaemon(host, options.DaemonPipeName.c_str());
+		if (FAILED(hr))
+		{
+			std::wcerr << L"Daemon failed: 0x" << std::hex << hr << L"\n";
+		}
+	}
+	else
+	{
+		// Without --multi this drives stream 0; quit or end of input shuts down cleanly
+		RunControlChannel(host);
+	}
+
+	// Stop every capture so the output writer can flush what is still buffered
+	host.Shutdown();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <mmdeviceapi.h>
+#include <endpointvolume.h>
+#include <tlhelp32.h>
+
+#include "AudioSessionMonitor.h"
+
+// Endpoints and the process tree are looked at again every this many polls
+#define SESSION_MONITOR_REFRESH_POLLS 16
+
+// Deepest process tree walked when matching a session to a target
+#define SESSION_MONITOR_MAX_TREE_DEPTH 32
+
+CAudioSessionMonitor::~CAudioSessionMonitor()
+{
+	Shutdown();
+}
+
+HRESULT CAudioSessionMonitor::Initialize(UINT32 pollMs)
+{
+	m_PollMs = pollMs;
+	RETURN_IF_FAILED(m_StopEvent.create(wil::EventOptions::ManualReset));
+	RETURN_IF_FAILED(m_WatchEvent.create(wil::EventOptions::None));
+
+	m_MonitorThread.reset(CreateThread(nullptr, 0, CAudioSessionMonitor::MonitorThreadProc, this, 0, nullptr));
+	RETURN_LAST_ERROR_IF(!m_MonitorThread);
+
+	return S_OK;
+}
+
+void CAudioSessionMonitor::Shutdown()
+{
+	if (m_MonitorThread)
+	{
+		m_StopEvent.SetEvent();
+		WaitForSingleObject(m_MonitorThread.get(), INFINITE);
+		m_MonitorThread.reset();
+	}
+
+	auto lock = m_WatchersLock.lock_exclusive();
+	m_Watchers.clear();
+}
+
+void CAudioSessionMonitor::Watch(CAudioActivityListener* pListener, DWORD processId, bool includeProcessTree, float peakThreshold)
+{
+	{
+		auto lock = m_WatchersLock.lock_exclusive();
+		m_Watchers.push_back({ pListener, processId, includeProcessTree, peakThreshold, false });
+	}
+	m_WatchEvent.SetEvent();
+}
+
+void CAudioSessionMonitor::Unwatch(CAudioActivityListener* pListener)
+{
+	auto lock = m_WatchersLock.lock_exclusive();
+	m_Watchers.erase(std::remove_if(m_Watchers.begin(), m_Watchers.end(),
+		[pListener](const Watcher& watcher) { return watcher.Listener == pListener; }), m_Watchers.end());
+}
+
+DWORD WINAPI CAudioSessionMonitor::MonitorThreadProc(LPVOID lpParameter)
+{
+	static_cast<CAudioSessionMonitor*>(lpParameter)->MonitorThread();
+	return 0;
+}
+
+//
+//  MonitorThread()
+//
+//  Polls every m_PollMs while something is watched, and blocks until a Watch or shutdown otherwise,
+//  so a process whose captures are all running costs no wakeups here at all.
+//
+void CAudioSessionMonitor::MonitorThread()
+{
+	const HRESULT hrCom = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+	HANDLE waitHandles[] = { m_StopEvent.get(), m_WatchEvent.get() };
+	UINT32 polls = 0;
+	for (;;)
+	{
+		bool watching = false;
+		{
+			auto lock = m_WatchersLock.lock_shared();
+			watching = !m_Watchers.empty();
+		}
+
+		const DWORD wait = WaitForMultipleObjects(ARRAYSIZE(waitHandles), waitHandles, FALSE, watching ? m_PollMs : INFINITE);
+		if (wait == WAIT_OBJECT_0)
+		{
+			break;
+		}
+		Poll((polls++ % SESSION_MONITOR_REFRESH_POLLS) == 0);
+	}
+
+	// COM objects go before COM does
+	m_Managers.clear();
+	if (SUCCEEDED(hrCom))
+	{
+		CoUninitialize();
+	}
+}
+
+//
+//  Poll()
+//
+//  Collects the peak of every active session, then fires the watches they satisfy.
+//
+void CAudioSessionMonitor::Poll(bool refresh)
+{
+	if (refresh || m_Managers.empty())
+	{
+		RefreshEndpoints();
+		m_ParentsStale = true;
+	}
+
+	m_Sessions.clear();
+	for (const auto& manager : m_Managers)
+	{
+		wil::com_ptr_nothrow<IAudioSessionEnumerator> enumerator;
+		int count = 0;
+		if (FAILED(manager->GetSessionEnumerator(&enumerator)) || FAILED(enumerator->GetCount(&count)))
+		{
+			continue;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			wil::com_ptr_nothrow<IAudioSessionControl> control;
+			wil::com_ptr_nothrow<IAudioSessionControl2> control2;
+			wil::com_ptr_nothrow<IAudioMeterInformation> meter;
+			AudioSessionState state = AudioSessionStateInactive;
+			DWORD processId = 0;
+			float peak = 0.0f;
+			if (FAILED(enumerator->GetSession(i, &control)) || FAILED(control->GetState(&state)) || state != AudioSessionStateActive ||
+				FAILED(control.query_to(&control2)) || FAILED(control2->GetProcessId(&processId)) ||
+				FAILED(control.query_to(&meter)) || FAILED(meter->GetPeakValue(&peak)))
+			{
+				continue;
+			}
+			m_Sessions.push_back({ processId, peak });
+		}
+	}
+
+	auto lock = m_WatchersLock.lock_exclusive();
+	for (auto& watcher : m_Watchers)
+	{
+		if (watcher.Notified)
+		{
+			continue;
+		}
+
+		for (const auto& session : m_Sessions)
+		{
+			if (session.Peak < watcher.PeakThreshold)
+			{
+				continue;
+			}
+
+			// Only sessions of processes other than the target itself need the tree
+			bool inTree = (session.ProcessId == watcher.ProcessId);
+			if (!inTree && session.ProcessId != 0)
+			{
+				if (m_ParentsStale)
+				{
+					RefreshParents();
+				}
+				inTree = IsInProcessTree(session.ProcessId, watcher.ProcessId);
+			}
+
+			if (inTree == watcher.IncludeProcessTree)
+			{
+				watcher.Notified = true;
+				watcher.Listener->OnAudioActivity();
+				break;
+			}
+		}
+	}
+}
+
+void CAudioSessionMonitor::RefreshEndpoints()
+{
+	m_Managers.clear();
+
+	wil::com_ptr_nothrow<IMMDeviceEnumerator> enumerator;
+	wil::com_ptr_nothrow<IMMDeviceCollection> devices;
+	UINT count = 0;
+	if (FAILED(CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&enumerator))) ||
+		FAILED(enumerator->EnumAudioEndpoints(eRender, DEVICE_STATE_ACTIVE, &devices)) || FAILED(devices->GetCount(&count)))
+	{
+		return;
+	}
+
+	for (UINT i = 0; i < count; i++)
+	{
+		wil::com_ptr_nothrow<IMMDevice> device;
+		wil::com_ptr_nothrow<IAudioSessionManager2> manager;
+		if (SUCCEEDED(devices->Item(i, &device)) &&
+			SUCCEEDED(device->Activate(__uuidof(IAudioSessionManager2), CLSCTX_INPROC_SERVER, nullptr, manager.put_void())))
+		{
+			m_Managers.push_back(std::move(manager));
+		}
+	}
+}
+
+void CAudioSessionMonitor::RefreshParents()
+{
+	m_Parents.clear();
+	m_ParentsStale = false;
+
+	wil::unique_hfile snapshot(CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0));
+	if (!snapshot)
+	{
+		return;
+	}
+
+	PROCESSENTRY32W entry = { sizeof(entry) };
+	for (BOOL more = Process32FirstW(snapshot.get(), &entry); more; more = Process32NextW(snapshot.get(), &entry))
+	{
+		m_Parents[entry.th32ProcessID] = entry.th32ParentProcessID;
+	}
+}
+
+bool CAudioSessionMonitor::IsInProcessTree(DWORD processId, DWORD rootProcessId) const
+{
+	for (UINT32 depth = 0; depth < SESSION_MONITOR_MAX_TREE_DEPTH; depth++)
+	{
+		if (processId == rootProcessId)
+		{
+			return true;
+		}
+
+		auto parent = m_Parents.find(processId);
+		if (parent == m_Parents.end() || parent->second == 0 || parent->second == processId)
+		{
+			return false;
+		}
+		processId = parent->second;
+	}
+	return false;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <Windows.h>
+#include <audiopolicy.h>
+#include <unordered_map>
+#include <vector>
+
+#include <wil\com.h>
+#include <wil\resource.h>
+#include <wil\result.h>
+
+//
+//  CAudioActivityListener
+//
+//  Told once, on the monitor's thread, that a watched target has started playing.  The call is made
+//  with the monitor's lock held, so it must only hand off (queue a work item) and never call back
+//  into the monitor.
+//
+class CAudioActivityListener
+{
+public:
+    virtual ~CAudioActivityListener() = default;
+
+    virtual void OnAudioActivity() = 0;
+};
+
+//
+//  CAudioSessionMonitor
+//
+//  Low-rate watch over the render endpoints' audio sessions on behalf of idle captures.  One thread
+//  serves every capture of the process: while anything is watched it polls each session's state and
+//  peak meter every interval, and it sleeps until the next Watch otherwise.  A watch fires when an
+//  active session at or above the watcher's peak threshold belongs to the target's process tree (or,
+//  for an excluding capture, to anything outside it).
+//
+class CAudioSessionMonitor
+{
+public:
+    CAudioSessionMonitor() = default;
+    ~CAudioSessionMonitor();
+
+    HRESULT Initialize(UINT32 pollMs);
+    void Shutdown();
+    bool IsRunning() const { return static_cast<bool>(m_MonitorThread); }
+
+    // Any thread.  Once Unwatch returns the listener is not called any more.
+    void Watch(CAudioActivityListener* pListener, DWORD processId, bool includeProcessTree, float peakThreshold);
+    void Unwatch(CAudioActivityListener* pListener);
+
+private:
+    struct Watcher
+    {
+        CAudioActivityListener* Listener;
+        DWORD ProcessId;
+        bool IncludeProcessTree;
+        float PeakThreshold;
+        bool Notified;
+    };
+
+    struct SessionActivity
+    {
+        DWORD ProcessId;
+        float Peak;
+    };
+
+    static DWORD WINAPI MonitorThreadProc(LPVOID lpParameter);
+    void MonitorThread();
+    void Poll(bool refresh);
+    void RefreshEndpoints();
+    void RefreshParents();
+    bool IsInProcessTree(DWORD processId, DWORD rootProcessId) const;
+
+    UINT32 m_PollMs = 0;
+    wil::unique_event_nothrow m_StopEvent;
+    wil::unique_event_nothrow m_WatchEvent;
+    wil::unique_handle m_MonitorThread;
+
+    wil::srwlock m_WatchersLock;
+    std::vector<Watcher> m_Watchers;
+
+    // Monitor thread only: one session manager per active render endpoint, the sessions heard on the
+    // last poll, and the parent of every process as of the last refresh
+    std::vector<wil::com_ptr_nothrow<IAudioSessionManager2>> m_Managers;
+    std::vector<SessionActivity> m_Sessions;
+    std::unordered_map<DWORD, DWORD> m_Parents;
+    bool m_ParentsStale = true;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <memory>
+#include <new>
+
+#include <wil\result.h>
+
+//
+//  CBufferPool
+//
+//  Fixed number of equally sized buffers, allocated once up front, for stages that hand captured
+//  packets to a consumer by reference instead of copying them into a ring (e.g. the Node addon,
+//  where JavaScript holds a buffer for as long as it likes).  Size it from the capture's largest
+//  packet, m_BufferFrames * nBlockAlign, which OpenSink passes in as cbMaxPacket.
+//
+//  The free list is a lock-free stack of buffer indices that any thread may push to or pop from, so
+//  the real-time capture thread can take a buffer and whichever thread the consumer finishes on can
+//  give it back, neither of them allocating, locking or blocking.  The head carries a tag that every
+//  pop increments, which keeps a pop that raced with a pop/push pair of the same index (ABA) from
+//  succeeding.
+//
+class CBufferPool
+{
+public:
+    static const UINT32 NO_BUFFER = UINT32_MAX;
+
+    CBufferPool() = default;
+    CBufferPool(const CBufferPool&) = delete;
+    CBufferPool& operator=(const CBufferPool&) = delete;
+
+    HRESULT Initialize(UINT32 bufferCount, UINT32 cbBuffer)
+    {
+        RETURN_HR_IF(E_INVALIDARG, bufferCount == 0 || bufferCount == NO_BUFFER || cbBuffer == 0);
+
+        // Buffers start on cache-line boundaries so neighbours filled on different threads don't false-share
+        const size_t cbStride = (static_cast<size_t>(cbBuffer) + 63) & ~static_cast<size_t>(63);
+        m_Storage.reset(new (std::nothrow) BYTE[cbStride * bufferCount + 63]);
+        RETURN_IF_NULL_ALLOC(m_Storage);
+        m_Next.reset(new (std::nothrow) std::atomic<UINT32>[bufferCount]);
+        RETURN_IF_NULL_ALLOC(m_Next);
+
+        m_pBuffers = reinterpret_cast<BYTE*>((reinterpret_cast<UINT_PTR>(m_Storage.get()) + 63) & ~static_cast<UINT_PTR>(63));
+        m_cbStride = cbStride;
+        m_cbBuffer = cbBuffer;
+        m_BufferCount = bufferCount;
+
+        for (UINT32 index = 0; index < bufferCount; index++)
+        {
+            m_Next[index].store((index + 1 < bufferCount) ? index + 1 : NO_BUFFER, std::memory_order_relaxed);
+        }
+        m_Head.store(MakeHead(0, 0), std::memory_order_release);
+        return S_OK;
+    }
+
+    UINT32 GetBufferSize() const { return m_cbBuffer; }
+    UINT32 GetBufferCount() const { return m_BufferCount; }
+    BYTE* GetBuffer(UINT32 index) const { return m_pBuffers + m_cbStride * index; }
+
+    // Returns false when every buffer is out.
+    bool TryAcquire(UINT32& index)
+    {
+        UINT64 head = m_Head.load(std::memory_order_acquire);
+        for (;;)
+        {
+            index = GetIndex(head);
+            if (index == NO_BUFFER)
+            {
+                return false;
+            }
+
+            // m_Next[index] may be stale if another thread popped index meanwhile; the tag makes the
+            // exchange fail in that case.
+            const UINT32 next = m_Next[index].load(std::memory_order_relaxed);
+            if (m_Head.compare_exchange_weak(head, MakeHead(next, GetTag(head) + 1), std::memory_order_acquire, std::memory_order_acquire))
+            {
+                return true;
+            }
+        }
+    }
+
+    void Release(UINT32 index)
+    {
+        UINT64 head = m_Head.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            m_Next[index].store(GetIndex(head), std::memory_order_relaxed);
+            if (m_Head.compare_exchange_weak(head, MakeHead(index, GetTag(head)), std::memory_order_release, std::memory_order_relaxed))
+            {
+                return;
+            }
+        }
+    }
+
+private:
+    static UINT64 MakeHead(UINT32 index, UINT32 tag) { return (static_cast<UINT64>(tag) << 32) | index; }
+    static UINT32 GetIndex(UINT64 head) { return static_cast<UINT32>(head); }
+    static UINT32 GetTag(UINT64 head) { return static_cast<UINT32>(head >> 32); }
+
+    std::unique_ptr<BYTE[]> m_Storage;
+    std::unique_ptr<std::atomic<UINT32>[]> m_Next;
+    BYTE* m_pBuffers = nullptr;
+    size_t m_cbStride = 0;
+    UINT32 m_cbBuffer = 0;
+    UINT32 m_BufferCount = 0;
+
+    alignas(64) std::atomic<UINT64> m_Head{ MakeHead(NO_BUFFER, 0) };
+};
@@ -0,0 +1,287 @@
+#include "CaptureHost.h"
+
+// Stream ids travel in the 16-bit StreamId field of LOOPBACK_FRAME_HEADER.
+#define CAPTURE_MAX_STREAM_ID 0xFFFF
+
+CCaptureHost::~CCaptureHost()
+{
+	Shutdown();
+}
+
+//
+//  Initialize()
+//
+//  Joins the MTA, starts Media Foundation, locks the shared MMCSS work queue and opens the output
+//  channel.  Several streams on one channel need the framed wire format, so --multi frames (see
+//  ParseCaptureOptions) unless --mix sums them into a single stream.
+//
+HRESULT CCaptureHost::Initialize(const CaptureOptions& options, CCaptureSinkProvider* pOutput)
+{
+	m_Options = options;
+
+	CCaptureTrace::Register();
+	m_TraceRegistered = true;
+
+	// Activation completes on an MTA thread; join it explicitly so the main thread is set up once for
+	// every capture the host will ever start.  An embedding host (Electron) may already have made it an
+	// STA; activation completes on an MTA thread regardless, so that's fine too.
+	const HRESULT hrCom = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	if (hrCom != RPC_E_CHANGED_MODE)
+	{
+		RETURN_IF_FAILED(hrCom);
+		m_ComInitialized = true;
+	}
+
+	RETURN_IF_FAILED(MFStartup(MF_VERSION, MFSTARTUP_LITE));
+	m_MFStarted = true;
+
+	// Register MMCSS work queue
+	DWORD dwTaskID = 0;
+	RETURN_IF_FAILED(MFLockSharedWorkQueue(L"Capture", 0, &dwTaskID, &m_dwQueueID));
+
+	const bool framed = m_Options.Framed;
+	if (pOutput != nullptr)
+	{
+		m_pCaptureSinks = pOutput;
+	}
+	else
+	{
+		RETURN_IF_FAILED(m_OutputWriter.Initialize(m_Options.Output, m_Options.SharedMemoryName.c_str(), framed,
+			m_Options.ChunkMs, m_Options.ChunkLatencyMs));
+		m_pCaptureSinks = &m_OutputWriter;
+	}
+
+	if (m_Options.EncodeOpus)
+	{
+		RETURN_IF_FAILED(m_Encoder.Initialize(m_pCaptureSinks, framed, m_Options.OpusFrameMs, m_Options.OpusBitrate));
+		m_pCaptureSinks = &m_Encoder;
+	}
+
+	if (m_Options.OutputRate != 0 || m_Options.OutputChannels != 0)
+	{
+		RETURN_IF_FAILED(m_Resampler.Initialize(m_pCaptureSinks, m_Options.OutputRate, m_Options.OutputChannels, m_Options.Quality));
+		m_pCaptureSinks = &m_Resampler;
+	}
+
+	if (m_Options.Mix)
+	{
+		RETURN_IF_FAILED(m_Mixer.Initialize(m_pCaptureSinks, m_Options.MixLatencyMs));
+		m_pCaptureSinks = &m_Mixer;
+	}
+
+	if (m_Options.StatsIntervalMs != 0)
+	{
+		RETURN_IF_FAILED(m_StatsReporter.Initialize(m_Options.StatsIntervalMs));
+	}
+
+	if (m_Options.ProfileIntervalMs != 0)
+	{
+		RETURN_IF_FAILED(m_ProfileReporter.Initialize(m_Options.ProfileIntervalMs));
+	}
+
+	return S_OK;
+}
+
+//
+//  Shutdown()
+//
+//  Stops every capture that is still running, flushes the output and releases the work queue, MF,
+//  COM and the trace provider.
+//
+void CCaptureHost::Shutdown()
+{
+	while (!m_Streams.empty())
+	{
+		StopCapture(m_Streams.begin()->first);
+	}
+
+	m_StatsReporter.Shutdown();
+	m_SessionMonitor.Shutdown();
+
+	// Upstream stages first, so each one's tail reaches the next before it shuts down
+	m_Mixer.Shutdown();
+	m_Encoder.Shutdown();
+	m_OutputWriter.Shutdown();
+
+	// Last, so the final profile covers everything the stages did on the way out
+	m_ProfileReporter.Shutdown();
+
+	if (m_dwQueueID != 0)
+	{
+		MFUnlockWorkQueue(m_dwQueueID);
+		m_dwQueueID = 0;
+	}
+
+	if (m_MFStarted)
+	{
+		MFShutdown();
+		m_MFStarted = false;
+	}
+
+	if (m_ComInitialized)
+	{
+		CoUninitialize();
+		m_ComInitialized = false;
+	}
+
+	// Every thread that traces has stopped by now
+	if (m_TraceRegistered)
+	{
+		CCaptureTrace::Unregister();
+		m_TraceRegistered = false;
+	}
+}
+
+HRESULT CCaptureHost::StartCapture(UINT32 streamId, const std::vector<DWORD>& processIds, bool includeProcessTree)
+{
+	RETURN_HR_IF(E_INVALIDARG, processIds.empty());
+
+	CaptureOptions options = m_Options;
+	options.ProcessId = processIds[0];
+	options.AdditionalProcessIds.assign(processIds.begin() + 1, processIds.end());
+	options.IncludeProcessTree = includeProcessTree;
+	return StartCapture(streamId, options);
+}
+
+HRESULT CCaptureHost::StartCapture(UINT32 streamId, const CaptureOptions& options)
+{
+	RETURN_HR_IF(E_INVALIDARG, streamId > CAPTURE_MAX_STREAM_ID || options.ProcessId == 0);
+	RETURN_HR_IF(E_INVALIDARG, options.AdditionalProcessIds.size() >= CAPTURE_MAX_TARGETS ||
+		(!options.AdditionalProcessIds.empty() && (!options.IncludeProcessTree || options.MeterIntervalMs != 0)));
+	RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), m_Streams.find(streamId) != m_Streams.end());
+
+	if (options.IdleAfterMs != 0 && !m_SessionMonitor.IsRunning())
+	{
+		RETURN_IF_FAILED(m_SessionMonitor.Initialize(options.IdlePollMs));
+	}
+
+	HostedStream stream;
+	CCaptureSinkProvider* pSinks = m_pCaptureSinks;
+	if (!options.AdditionalProcessIds.empty())
+	{
+		// The targets' captures line up on the merger's timeline and come out as this one stream
+		stream.Merger.reset(new (std::nothrow) CMixer());
+		RETURN_IF_NULL_ALLOC(stream.Merger);
+		RETURN_IF_FAILED(stream.Merger->Initialize(m_pCaptureSinks, options.MixLatencyMs, streamId));
+		pSinks = stream.Merger.get();
+	}
+
+	// Undoes the targets already started if a later one fails
+	auto stopStarted = wil::scope_exit([&]()
+		{
+			StopStream(streamId, stream);
+		});
+
+	std::vector<DWORD> processIds(1, options.ProcessId);
+	processIds.insert(processIds.end(), options.AdditionalProcessIds.begin(), options.AdditionalProcessIds.end());
+	for (DWORD processId : processIds)
+	{
+		CaptureOptions targetOptions = options;
+		targetOptions.ProcessId = processId;
+		targetOptions.AdditionalProcessIds.clear();
+
+		ComPtr<CLoopbackCapture> capture = Make<CLoopbackCapture>();
+		RETURN_IF_NULL_ALLOC(capture);
+		RETURN_IF_FAILED(capture->StartCaptureAsync(targetOptions, streamId, m_dwQueueID, pSinks,
+			(options.IdleAfterMs != 0) ? &m_SessionMonitor : nullptr));
+		m_StatsReporter.Add(streamId, processId, capture->GetStats());
+		m_ProfileReporter.Add(streamId, capture->GetStats());
+		stream.Captures.push_back(std::move(capture));
+	}
+
+	stopStarted.release();
+	m_Streams.emplace(streamId, std::move(stream));
+	return S_OK;
+}
+
+HRESULT CCaptureHost::StopCapture(UINT32 streamId)
+{
+	auto it = m_Streams.find(streamId);
+	RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_FOUND), it == m_Streams.end());
+
+	HostedStream stream = std::move(it->second);
+	m_Streams.erase(it);
+	return StopStream(streamId, stream);
+}
+
+//
+//  StopStream()
+//
+//  Stops every capture of a stream, then lets its merger mix out their tails and close the stream.
+//  Returns the first failure.
+//
+HRESULT CCaptureHost::StopStream(UINT32 streamId, HostedStream& stream)
+{
+	m_StatsReporter.Remove(streamId);
+
+	// The profile keeps counting until the captures have stopped
+	HRESULT hr = S_OK;
+	for (auto& capture : stream.Captures)
+	{
+		const HRESULT hrStop = capture->StopCaptureAsync();
+		if (SUCCEEDED(hr))
+		{
+			hr = hrStop;
+		}
+	}
+	stream.Captures.clear();
+	m_ProfileReporter.Remove(streamId);
+
+	if (stream.Merger)
+	{
+		stream.Merger->Shutdown();
+		stream.Merger.reset();
+	}
+	return hr;
+}
+
+HRESULT CCaptureHost::PauseCapture(UINT32 streamId)
+{
+	auto it = m_Streams.find(streamId);
+	RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_FOUND), it == m_Streams.end());
+
+	for (auto& capture : it->second.Captures)
+	{
+		RETURN_IF_FAILED(capture->PauseCaptureAsync());
+	}
+	return S_OK;
+}
+
+HRESULT CCaptureHost::ResumeCapture(UINT32 streamId)
+{
+	auto it = m_Streams.find(streamId);
+	RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_FOUND), it == m_Streams.end());
+
+	for (auto& capture : it->second.Captures)
+	{
+		RETURN_IF_FAILED(capture->ResumeCaptureAsync());
+	}
+	return S_OK;
+}
+
+HRESULT CCaptureHost::RetargetCapture(UINT32 streamId, DWORD processId, bool includeProcessTree)
+{
+	RETURN_HR_IF(E_INVALIDARG, processId == 0);
+	auto it = m_Streams.find(streamId);
+	RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_FOUND), it == m_Streams.end());
+
+	// Which of a merged stream's targets to replace would be anyone's guess; restart it instead
+	RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), it->second.Captures.size() != 1);
+
+	// A capture whose retarget failed stays listed, in error, until it is stopped
+	CLoopbackCapture* capture = it->second.Captures[0].Get();
+	RETURN_IF_FAILED(capture->RetargetCaptureAsync(processId, includeProcessTree));
+
+	m_StatsReporter.Remove(streamId);
+	m_StatsReporter.Add(streamId, processId, capture->GetStats());
+	return S_OK;
+}
+
+HRESULT CCaptureHost::SetGain(UINT32 streamId, float gain)
+{
+	RETURN_HR_IF(E_NOT_VALID_STATE, !m_Options.Mix);
+	RETURN_HR_IF(E_INVALIDARG, streamId > CAPTURE_MAX_STREAM_ID || !(gain >= 0.0f));
+
+	m_Mixer.SetGain(streamId, gain);
+	return S_OK;
+}
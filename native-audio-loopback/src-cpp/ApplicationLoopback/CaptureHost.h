@@ -0,0 +1,82 @@
+#pragma once
+
+#include <Windows.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <wrl\client.h>
+
+#include "AudioSessionMonitor.h"
+#include "CaptureOptions.h"
+#include "CaptureStats.h"
+#include "LoopbackCapture.h"
+#include "Mixer.h"
+#include "OpusEncoder.h"
+#include "OutputWriter.h"
+#include "Profiler.h"
+#include "Resampler.h"
+#include "Tracing.h"
+
+//
+//  CCaptureHost
+//
+//  Hosts every capture of the process.  Media Foundation is started once, all captures share one
+//  "Capture" MMCSS work queue, and their streams are multiplexed onto one COutputWriter.  Optional
+//  stages sit in between: capture -> [CMixer] -> [CResampler] -> [COpusEncoder] -> COutputWriter.  Not thread safe:
+//  the host is driven from the main thread only.  A stream with several target processes runs one
+//  capture per target and merges them with a CMixer of its own in front of the pipeline.
+//
+class CCaptureHost
+{
+public:
+    CCaptureHost() = default;
+    ~CCaptureHost();
+
+    // pOutput replaces the COutputWriter as the last stage, e.g. for the in-process Node addon.
+    HRESULT Initialize(const CaptureOptions& options, CCaptureSinkProvider* pOutput = nullptr);
+    void Shutdown();
+
+    // processIds[0] is the target; any others are merged into the same stream (include only).
+    HRESULT StartCapture(UINT32 streamId, const std::vector<DWORD>& processIds, bool includeProcessTree);
+    // Starts a capture with its own per-capture settings (format, buffer, engine, silence gate).
+    HRESULT StartCapture(UINT32 streamId, const CaptureOptions& options);
+    HRESULT StopCapture(UINT32 streamId);
+    HRESULT PauseCapture(UINT32 streamId);
+    HRESULT ResumeCapture(UINT32 streamId);
+
+    // Points a capture at another process without stopping its stream.  Not for merged streams.
+    HRESULT RetargetCapture(UINT32 streamId, DWORD processId, bool includeProcessTree);
+
+    // With --mix: linear gain of one capture in the mixed stream.
+    HRESULT SetGain(UINT32 streamId, float gain);
+
+private:
+    struct HostedStream;
+    HRESULT StopStream(UINT32 streamId, HostedStream& stream);
+
+    CaptureOptions m_Options;
+    bool m_TraceRegistered = false;
+    bool m_ComInitialized = false;
+    bool m_MFStarted = false;
+    DWORD m_dwQueueID = 0;
+    COutputWriter m_OutputWriter;
+    COpusEncoder m_Encoder;
+    CResampler m_Resampler;
+    CMixer m_Mixer;
+    CStatsReporter m_StatsReporter;
+    CProfileReporter m_ProfileReporter;
+
+    // Started with the first idle capture (--idle-after-ms) and shared by all of them.
+    CAudioSessionMonitor m_SessionMonitor;
+
+    // First stage of the pipeline; where the captures open their sinks.
+    CCaptureSinkProvider* m_pCaptureSinks = nullptr;
+    struct HostedStream
+    {
+        // One capture per target process, all producing into Merger when there are several.
+        std::vector<Microsoft::WRL::ComPtr<CLoopbackCapture>> Captures;
+        std::unique_ptr<CMixer> Merger;
+    };
+    std::map<UINT32, HostedStream> m_Streams;
+};
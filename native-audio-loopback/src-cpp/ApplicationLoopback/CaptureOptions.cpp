@@ -0,0 +1,505 @@
+#include <wchar.h>
+#include <algorithm>
+#include <iostream>
+
+#include "CaptureOptions.h"
+
+void PrintUsage()
+{
+	std::wcout << L"Usage: ApplicationLoopback.exe <processId>[,<processId>...] [include|exclude] [options]\n"
+		L"       ApplicationLoopback.exe [<processId>[,...] [include|exclude]] --multi [options]\n"
+		L"  Several process IDs are captured as separate trees and merged into one stream (include only)\n"
+		L"  --multi                   Framed output for several captures, controlled over stdin with\n"
+		L"                            \"start <id> <pid>[,<pid>...] [include|exclude]\", \"stop <id>\" and \"quit\";\n"
+		L"                            a process ID on the command line becomes stream 0\n"
+		L"                            \"pause <id>\", \"resume <id>\" and \"retarget <id> <pid> [include|exclude]\"\n"
+		L"                            work in every mode; without --multi the commands come over stdin too,\n"
+		L"                            the capture is stream 0, and \"quit\" or closing stdin stops it\n"
+		L"  --mix                     Like --multi, but mix all captures into one unframed stream;\n"
+		L"                            \"gain <id> <linear gain>\" sets a capture's level\n"
+		L"  --daemon                  Stay resident with MF and activation warmed up; the control commands\n"
+		L"                            come over a named pipe, one client at a time\n"
+		L"  --pipe-name <name>        Pipe for --daemon (default \\\\.\\pipe\\ApplicationLoopback)\n"
+		L"  --mix-latency-ms <ms>     How far the mixer runs behind real time to align captures (default 30)\n"
+		L"  --output stdout|pipe|shm  stdout: CRT stdout (default), pipe: WriteFile on the raw stdout handle,\n"
+		L"                            shm: named shared-memory ring plus \"<name>.DataReady\" event\n"
+		L"  --shm-name <name>         Section name for --output shm (default Local\\ApplicationLoopback.<pid of this process>);\n"
+		L"                            framed streams (--multi, --framed) each get their own \"<name>.<id>\" section\n"
+		L"  --chunk-ms <ms>           Write each stream in chunks of <ms> of audio (1-1000) instead of per packet\n"
+		L"  --chunk-latency-ms <ms>   Longest a partial chunk waits before it is written (default 2 x --chunk-ms)\n"
+		L"  --format pcm16|float      pcm16: 48 kHz stereo 16-bit (default), float: native float32 mix format\n"
+		L"  --encode opus             Emit Opus packets (LOOPBACK_PACKET_HEADER-prefixed unless framed); implies --header\n"
+		L"  --opus-frame-ms <ms>      Opus frame duration: 10, 20, 40 or 60 (default 20)\n"
+		L"  --opus-bitrate <bps>      Opus target bitrate (default 96000)\n"
+		L"  --rate <Hz>               Resample to this rate before encoding and output (8000-192000); implies --header\n"
+		L"  --channels 1|2            Downmix (or copy mono) to this many channels; implies --header\n"
+		L"  --resample-quality fast|balanced|best  Polyphase filter length: 16, 32 (default) or 64 taps\n"
+		L"  --framed                  LOOPBACK_FRAME_HEADER records carrying device/QPC positions and flags, with\n"
+		L"                            suppressed silence sent as LOOPBACK_FRAME_SILENCE records (implied by --multi)\n"
+		L"  --header                  Start the stream with a LOOPBACK_STREAM_HEADER (implied by --format float)\n"
+		L"  --buffer-ms <ms>          Shared-mode buffer duration (default 20)\n"
+		L"  --period-ms <ms>|min      Engine event period via IAudioClient3 (default: engine default period)\n"
+		L"  --engine workqueue|thread workqueue: MF work-queue callbacks (default), thread: dedicated Pro Audio\n"
+		L"                            MMCSS thread per capture waiting on the buffer event\n"
+		L"  --silence-threshold-db <dB> Level below which audio counts as silence (default -70)\n"
+		L"  --silence-hysteresis-db <dB> How far below the threshold an open gate closes (default 6)\n"
+		L"  --silence-detect peak|rms Level measure for the silence gate (default peak)\n"
+		L"  --silence-attack-ms <ms>  Signal needed before the gate opens (default 0)\n"
+		L"  --silence-hangover-ms <ms> Silence needed before the gate closes (default 250)\n"
+		L"  --idle-after-ms <ms>      Stop the audio client after <ms> of silence and start it again only once\n"
+		L"                            the target's audio session is audible; captures start idle (default off)\n"
+		L"  --idle-poll-ms <ms>       How often idle captures check the target's sessions (default 250)\n"
+		L"  --meter <ms>              Send per-channel peak and RMS every <ms> (10-1000) as LOOPBACK_FRAME_METER\n"
+		L"                            records; implies --framed, not with --mix or merged targets\n"
+		L"  --meter-lufs              Add short-term (3 s) loudness to the meter records\n"
+		L"  --meter-only              Send only the meter records, not the audio\n"
+		L"                            (both default --meter to 50)\n"
+		L"  --stats <ms>              Print capture stats as JSON lines on stderr every <ms>\n"
+		L"  --profile <ms>            Print CPU time (capture vs. writer), memory and packet time histogram\n"
+		L"                            as JSON lines on stderr every <ms> and at exit\n";
+}
+
+//
+//  ParseCaptureOptions()
+//
+//  Parses the command line into options.  Reports the first problem on stderr and returns false.
+//
+bool ParseCaptureOptions(int argc, wchar_t* argv[], CaptureOptions& options)
+{
+	int i = 1;
+	if (i < argc && wcsncmp(argv[i], L"--", 2) != 0)
+	{
+		std::vector<DWORD> processIds;
+		if (!ParseProcessIds(argv[i], processIds))
+		{
+			std::wcerr << L"Invalid process ID.\n";
+			return false;
+		}
+		options.ProcessId = processIds[0];
+		options.AdditionalProcessIds.assign(processIds.begin() + 1, processIds.end());
+		i++;
+
+		if (i < argc && wcsncmp(argv[i], L"--", 2) != 0)
+		{
+			options.IncludeProcessTree = (wcscmp(argv[i], L"exclude") != 0);
+			i++;
+		}
+
+		if (!options.IncludeProcessTree && !options.AdditionalProcessIds.empty())
+		{
+			std::wcerr << L"Only one process tree can be excluded.\n";
+			return false;
+		}
+	}
+
+	for (; i < argc; i++)
+	{
+		PCWSTR option = argv[i];
+		PCWSTR value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+		if (wcscmp(option, L"--multi") == 0)
+		{
+			options.MultiProcess = true;
+		}
+		else if (wcscmp(option, L"--mix") == 0)
+		{
+			options.MultiProcess = true;
+			options.Mix = true;
+		}
+		else if (wcscmp(option, L"--daemon") == 0)
+		{
+			options.MultiProcess = true;
+			options.Daemon = true;
+		}
+		else if (wcscmp(option, L"--pipe-name") == 0 && value != nullptr)
+		{
+			options.DaemonPipeName = value;
+			i++;
+		}
+		else if (wcscmp(option, L"--mix-latency-ms") == 0 && value != nullptr)
+		{
+			options.MixLatencyMs = wcstod(value, nullptr);
+			if (options.MixLatencyMs <= 0.0)
+			{
+				std::wcerr << L"Invalid mix latency " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--output") == 0 && value != nullptr)
+		{
+			if (wcscmp(value, L"stdout") == 0)
+			{
+				options.Output = OutputMode::Stdout;
+			}
+			else if (wcscmp(value, L"pipe") == 0)
+			{
+				options.Output = OutputMode::Pipe;
+			}
+			else if (wcscmp(value, L"shm") == 0)
+			{
+				options.Output = OutputMode::SharedMemory;
+			}
+			else
+			{
+				std::wcerr << L"Unknown output mode " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--shm-name") == 0 && value != nullptr)
+		{
+			options.SharedMemoryName = value;
+			i++;
+		}
+		else if (wcscmp(option, L"--chunk-ms") == 0 && value != nullptr)
+		{
+			options.ChunkMs = wcstoul(value, nullptr, 10);
+			if (options.ChunkMs == 0 || options.ChunkMs > 1000)
+			{
+				std::wcerr << L"Invalid chunk duration " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--chunk-latency-ms") == 0 && value != nullptr)
+		{
+			options.ChunkLatencyMs = wcstoul(value, nullptr, 10);
+			if (options.ChunkLatencyMs == 0)
+			{
+				std::wcerr << L"Invalid chunk latency " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--format") == 0 && value != nullptr)
+		{
+			if (wcscmp(value, L"pcm16") == 0)
+			{
+				options.Format = SampleFormat::Int16;
+			}
+			else if (wcscmp(value, L"float") == 0)
+			{
+				options.Format = SampleFormat::Float32;
+				options.WriteStreamHeader = true;
+			}
+			else
+			{
+				std::wcerr << L"Unknown format " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--encode") == 0 && value != nullptr)
+		{
+			if (wcscmp(value, L"opus") != 0)
+			{
+				std::wcerr << L"Unknown encoding " << value << L".\n";
+				return false;
+			}
+			options.EncodeOpus = true;
+			options.WriteStreamHeader = true;
+			i++;
+		}
+		else if (wcscmp(option, L"--opus-frame-ms") == 0 && value != nullptr)
+		{
+			options.OpusFrameMs = wcstoul(value, nullptr, 10);
+			if (options.OpusFrameMs != 10 && options.OpusFrameMs != 20 && options.OpusFrameMs != 40 && options.OpusFrameMs != 60)
+			{
+				std::wcerr << L"Invalid Opus frame duration " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--opus-bitrate") == 0 && value != nullptr)
+		{
+			options.OpusBitrate = wcstoul(value, nullptr, 10);
+			if (options.OpusBitrate < 6000 || options.OpusBitrate > 510000)
+			{
+				std::wcerr << L"Invalid Opus bitrate " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--rate") == 0 && value != nullptr)
+		{
+			options.OutputRate = wcstoul(value, nullptr, 10);
+			if (options.OutputRate < 8000 || options.OutputRate > 192000)
+			{
+				std::wcerr << L"Invalid output rate " << value << L".\n";
+				return false;
+			}
+			options.WriteStreamHeader = true;
+			i++;
+		}
+		else if (wcscmp(option, L"--channels") == 0 && value != nullptr)
+		{
+			options.OutputChannels = wcstoul(value, nullptr, 10);
+			if (options.OutputChannels != 1 && options.OutputChannels != 2)
+			{
+				std::wcerr << L"Invalid channel count " << value << L".\n";
+				return false;
+			}
+			options.WriteStreamHeader = true;
+			i++;
+		}
+		else if (wcscmp(option, L"--resample-quality") == 0 && value != nullptr)
+		{
+			if (wcscmp(value, L"fast") == 0)
+			{
+				options.Quality = ResampleQuality::Fast;
+			}
+			else if (wcscmp(value, L"balanced") == 0)
+			{
+				options.Quality = ResampleQuality::Balanced;
+			}
+			else if (wcscmp(value, L"best") == 0)
+			{
+				options.Quality = ResampleQuality::Best;
+			}
+			else
+			{
+				std::wcerr << L"Unknown resample quality " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--engine") == 0 && value != nullptr)
+		{
+			if (wcscmp(value, L"workqueue") == 0)
+			{
+				options.Engine = CaptureEngine::WorkQueue;
+			}
+			else if (wcscmp(value, L"thread") == 0)
+			{
+				options.Engine = CaptureEngine::Thread;
+			}
+			else
+			{
+				std::wcerr << L"Unknown engine " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--silence-threshold-db") == 0 && value != nullptr)
+		{
+			options.SilenceThresholdDb = wcstod(value, nullptr);
+			if (options.SilenceThresholdDb >= 0.0)
+			{
+				std::wcerr << L"Invalid silence threshold " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--silence-hysteresis-db") == 0 && value != nullptr)
+		{
+			options.SilenceHysteresisDb = wcstod(value, nullptr);
+			if (options.SilenceHysteresisDb < 0.0)
+			{
+				std::wcerr << L"Invalid silence hysteresis " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--silence-detect") == 0 && value != nullptr)
+		{
+			if (wcscmp(value, L"peak") == 0)
+			{
+				options.SilenceDetect = SilenceDetection::Peak;
+			}
+			else if (wcscmp(value, L"rms") == 0)
+			{
+				options.SilenceDetect = SilenceDetection::Rms;
+			}
+			else
+			{
+				std::wcerr << L"Unknown silence detection " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--silence-attack-ms") == 0 && value != nullptr)
+		{
+			options.SilenceAttackMs = wcstod(value, nullptr);
+			if (options.SilenceAttackMs < 0.0)
+			{
+				std::wcerr << L"Invalid silence attack " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--silence-hangover-ms") == 0 && value != nullptr)
+		{
+			options.SilenceHangoverMs = wcstod(value, nullptr);
+			if (options.SilenceHangoverMs < 0.0)
+			{
+				std::wcerr << L"Invalid silence hangover " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--idle-after-ms") == 0 && value != nullptr)
+		{
+			options.IdleAfterMs = wcstoul(value, nullptr, 10);
+			if (options.IdleAfterMs == 0)
+			{
+				std::wcerr << L"Invalid idle time " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--idle-poll-ms") == 0 && value != nullptr)
+		{
+			options.IdlePollMs = wcstoul(value, nullptr, 10);
+			if (options.IdlePollMs == 0)
+			{
+				std::wcerr << L"Invalid idle poll interval " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--meter") == 0 && value != nullptr)
+		{
+			options.MeterIntervalMs = wcstoul(value, nullptr, 10);
+			if (options.MeterIntervalMs < METER_MIN_INTERVAL_MS || options.MeterIntervalMs > METER_MAX_INTERVAL_MS)
+			{
+				std::wcerr << L"Invalid meter interval " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--meter-lufs") == 0)
+		{
+			options.MeterLoudness = true;
+		}
+		else if (wcscmp(option, L"--meter-only") == 0)
+		{
+			options.MeterOnly = true;
+		}
+		else if (wcscmp(option, L"--stats") == 0 && value != nullptr)
+		{
+			options.StatsIntervalMs = wcstoul(value, nullptr, 10);
+			if (options.StatsIntervalMs == 0)
+			{
+				std::wcerr << L"Invalid stats interval " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--profile") == 0 && value != nullptr)
+		{
+			options.ProfileIntervalMs = wcstoul(value, nullptr, 10);
+			if (options.ProfileIntervalMs == 0)
+			{
+				std::wcerr << L"Invalid profile interval " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--framed") == 0)
+		{
+			options.Framed = true;
+		}
+		else if (wcscmp(option, L"--header") == 0)
+		{
+			options.WriteStreamHeader = true;
+		}
+		else if (wcscmp(option, L"--buffer-ms") == 0 && value != nullptr)
+		{
+			options.BufferDurationMs = wcstod(value, nullptr);
+			if (options.BufferDurationMs <= 0.0)
+			{
+				std::wcerr << L"Invalid buffer duration " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--period-ms") == 0 && value != nullptr)
+		{
+			if (wcscmp(value, L"min") == 0)
+			{
+				options.UseMinimumPeriod = true;
+			}
+			else
+			{
+				options.PeriodMs = wcstod(value, nullptr);
+				if (options.PeriodMs <= 0.0)
+				{
+					std::wcerr << L"Invalid period " << value << L".\n";
+					return false;
+				}
+			}
+			i++;
+		}
+		else
+		{
+			std::wcerr << L"Unknown or incomplete option " << option << L".\n";
+			return false;
+		}
+	}
+
+	// Without --multi there is nothing to capture but the process on the command line.
+	if (options.ProcessId == 0 && !options.MultiProcess)
+	{
+		std::wcerr << L"Missing process ID.\n";
+		return false;
+	}
+
+	if ((options.MeterOnly || options.MeterLoudness) && options.MeterIntervalMs == 0)
+	{
+		options.MeterIntervalMs = METER_DEFAULT_INTERVAL_MS;
+	}
+
+	// The mixer has nowhere to put its sources' meters
+	if (options.MeterIntervalMs != 0 && (options.Mix || !options.AdditionalProcessIds.empty()))
+	{
+		std::wcerr << L"--meter can't be combined with --mix or several process IDs.\n";
+		return false;
+	}
+
+	// Several streams on one channel can only be told apart by their records, and meters only exist as records
+	if ((options.MultiProcess && !options.Mix) || options.MeterIntervalMs != 0)
+	{
+		options.Framed = true;
+	}
+
+	if (options.Output == OutputMode::SharedMemory && options.SharedMemoryName.empty())
+	{
+		options.SharedMemoryName = L"Local\\ApplicationLoopback." + std::to_wstring(GetCurrentProcessId());
+	}
+
+	if (options.ChunkMs != 0 && options.ChunkLatencyMs == 0)
+	{
+		options.ChunkLatencyMs = 2 * options.ChunkMs;
+	}
+
+	if (options.Daemon && options.DaemonPipeName.empty())
+	{
+		options.DaemonPipeName = L"\\\\.\\pipe\\ApplicationLoopback";
+	}
+
+	return true;
+}
+
+bool ParseProcessIds(PCWSTR text, std::vector<DWORD>& processIds)
+{
+	processIds.clear();
+	for (PCWSTR p = text; ; p++)
+	{
+		wchar_t* end = nullptr;
+		const DWORD processId = wcstoul(p, &end, 0);
+		if (processId == 0 || end == p || (*end != L',' && *end != L'\0') ||
+			std::find(processIds.begin(), processIds.end(), processId) != processIds.end() ||
+			processIds.size() == CAPTURE_MAX_TARGETS)
+		{
+			return false;
+		}
+		processIds.push_back(processId);
+
+		p = end;
+		if (*p == L'\0')
+		{
+			return true;
+		}
+	}
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+
+#include "LevelMeter.h"
+#include "OutputWriter.h"
+#include "Resampler.h"
+#include "SampleFormat.h"
+#include "SilenceDetector.h"
+
+// Most process trees one stream can merge.
+#define CAPTURE_MAX_TARGETS 16
+
+// How a capture waits for the engine's buffer events.
+enum class CaptureEngine
+{
+    // MFPutWaitingWorkItem on the host's "Capture" MMCSS work queue, re-queued after every event.
+    WorkQueue,
+    // A dedicated "Pro Audio" MMCSS thread per capture, blocked in WaitForMultipleObjects.
+    Thread,
+};
+
+//
+//  CaptureOptions
+//
+//  Everything configurable from the ApplicationLoopback.exe command line.
+//
+struct CaptureOptions
+{
+    DWORD ProcessId = 0;
+    bool IncludeProcessTree = true;
+
+    // More process trees captured alongside ProcessId's, one process-loopback client each, and merged
+    // into the same stream.  Include only: every "everything but X" capture would carry the rest.
+    std::vector<DWORD> AdditionalProcessIds;
+
+    // Host several captures, started and stopped over the stdin control channel, as framed streams.
+    bool MultiProcess = false;
+
+    // Sum every capture into one stream, running MixLatencyMs behind real time to line sources up.
+    bool Mix = false;
+    double MixLatencyMs = 30.0;
+
+    // Stay resident and take control commands over the DaemonPipeName named pipe (implies --multi).
+    bool Daemon = false;
+    std::wstring DaemonPipeName;
+
+    OutputMode Output = OutputMode::Stdout;
+    std::wstring SharedMemoryName;
+
+    // Stdout and Pipe: coalesce each stream's packets into writes of about ChunkMs of audio, flushing a
+    // partial chunk once it has waited ChunkLatencyMs (0: twice ChunkMs).  A ChunkMs of 0 writes
+    // whatever each capture callback produced.
+    UINT32 ChunkMs = 0;
+    UINT32 ChunkLatencyMs = 0;
+
+    // Int16: 48 kHz stereo PCM converted by the engine.  Float32: the engine's own mix format.
+    SampleFormat Format = SampleFormat::Int16;
+    bool WriteStreamHeader = false;
+
+    // LOOPBACK_FRAME_HEADER records with positions, flags and silence markers; implied by --multi.
+    bool Framed = false;
+
+    // Encode to Opus packets of OpusFrameMs at OpusBitrate bits per second before output.
+    bool EncodeOpus = false;
+    UINT32 OpusFrameMs = 20;
+    UINT32 OpusBitrate = 96000;
+
+    // Convert to OutputRate Hz and OutputChannels channels before encoding and output; 0 keeps the
+    // capture's.  Either one implies a stream header, since the stream no longer has the default format.
+    UINT32 OutputRate = 0;
+    UINT32 OutputChannels = 0;
+    ResampleQuality Quality = ResampleQuality::Balanced;
+
+    // Shared-mode buffer duration, and the event period requested through IAudioClient3.  A period of
+    // 0 keeps the engine's default period; UseMinimumPeriod asks for the smallest one the engine offers.
+    double BufferDurationMs = 20.0;
+    double PeriodMs = 0.0;
+    bool UseMinimumPeriod = false;
+
+    CaptureEngine Engine = CaptureEngine::WorkQueue;
+
+    // Silence gate: opens above SilenceThresholdDb (after SilenceAttackMs of signal) and closes once
+    // the level has stayed below SilenceThresholdDb - SilenceHysteresisDb for SilenceHangoverMs.
+    double SilenceThresholdDb = -70.0;
+    double SilenceHysteresisDb = 6.0;
+    SilenceDetection SilenceDetect = SilenceDetection::Peak;
+    double SilenceAttackMs = 0.0;
+    double SilenceHangoverMs = 250.0;
+
+    // Stop the audio client after IdleAfterMs of silence, and only start it (again) once the target's
+    // audio session is audible, checked every IdlePollMs; 0 is off.  Captures then also start idle.
+    UINT32 IdleAfterMs = 0;
+    UINT32 IdlePollMs = 250;
+
+    // Publish each capture's per-channel peak and RMS every MeterIntervalMs as LOOPBACK_FRAME_METER
+    // records (framed output only), with short-term loudness if MeterLoudness is set; 0 is off.
+    // MeterOnly leaves the audio out.  Not for streams that are mixed or merge several targets.
+    UINT32 MeterIntervalMs = 0;
+    bool MeterOnly = false;
+    bool MeterLoudness = false;
+
+    // Print per-capture real-time stats as JSON lines on stderr every StatsIntervalMs; 0 is off.
+    UINT32 StatsIntervalMs = 0;
+
+    // Print the process's CPU time by thread role, memory use and a packet time histogram as JSON
+    // lines on stderr every ProfileIntervalMs and at exit; 0 is off.
+    UINT32 ProfileIntervalMs = 0;
+};
+
+void PrintUsage();
+bool ParseCaptureOptions(int argc, wchar_t* argv[], CaptureOptions& options);
+
+// "<pid>[,<pid>...]": up to CAPTURE_MAX_TARGETS distinct, non-zero process IDs.
+bool ParseProcessIds(PCWSTR text, std::vector<DWORD>& processIds);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Windows.h>
+#include <mmreg.h>
+#include <memory>
+
+#include "StreamProtocol.h"
+
+//
+//  CapturePacketInfo
+//
+//  Where a packet sits in time, as GetBuffer reported it.  Flags are LOOPBACK_FRAME_FLAG_*.
+//
+struct CapturePacketInfo
+{
+    UINT32 Frames = 0;
+    UINT32 Flags = 0;
+    UINT64 DevicePosition = 0;
+    UINT64 QpcPosition = 0;
+};
+
+//
+//  CCaptureSink
+//
+//  Where a CLoopbackCapture delivers its packets: an output stream, or a mixer input.  Every method
+//  is called from the real-time capture callback and must neither block nor allocate.
+//
+class CCaptureSink
+{
+public:
+    virtual ~CCaptureSink() = default;
+
+    // Returns false if the packet had to be dropped.
+    virtual bool WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info) = 0;
+
+    // A packet of info.Frames frames that was suppressed as silent.  Sinks without a way to say so
+    // just drop it.
+    virtual bool WriteSilence(const CapturePacketInfo& info) = 0;
+
+    // Levels of the info.Frames frames up to the last packet written.  Sinks without a way to carry
+    // them (unframed output, mixer inputs) drop them.
+    virtual bool WriteMeter(const LOOPBACK_METER_PAYLOAD& meter, const CapturePacketInfo& info) = 0;
+
+    // Called once per capture callback, after the last packet of that callback.
+    virtual void NotifyDataReady() = 0;
+};
+
+//
+//  CCaptureSinkProvider
+//
+//  Hands out sinks to captures once their format has been negotiated.  cbMinCapacity is how much the
+//  sink should be able to buffer, cbMaxPacket the largest packet it will be handed (a full engine
+//  buffer, m_BufferFrames * nBlockAlign), for sinks that preallocate per-packet storage.  writeHeader
+//  asks for a LOOPBACK_STREAM_HEADER ahead of the samples where the sink has a notion of one.
+//
+class CCaptureSinkProvider
+{
+public:
+    virtual ~CCaptureSinkProvider() = default;
+
+    virtual HRESULT OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 cbMaxPacket, bool writeHeader,
+        std::shared_ptr<CCaptureSink>& sink) = 0;
+
+    // Called once the capture has stopped and will not touch the sink again.
+    virtual void CloseSink(const std::shared_ptr<CCaptureSink>& sink) = 0;
+};
@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <AudioClient.h>
+
+#include "CaptureStats.h"
+
+#define HNS_PER_US 10
+
+//
+//  CCaptureStats
+//
+
+//
+//  RecordPacket()
+//
+//  Counts one packet returned by GetBuffer, its flags, and whether its device position follows on
+//  from the previous packet.  A jump the engine didn't flag as a discontinuity is counted as a gap.
+//
+void CCaptureStats::RecordPacket(UINT32 frames, UINT32 cbData, DWORD captureFlags, UINT64 devicePosition)
+{
+	Increment(m_Packets);
+	Increment(m_Frames, frames);
+	Increment(m_Bytes, cbData);
+
+	if (captureFlags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY)
+	{
+		Increment(m_Discontinuities);
+	}
+	else if (m_HaveDevicePosition && devicePosition != m_NextDevicePosition)
+	{
+		Increment(m_PositionGaps);
+	}
+
+	if (captureFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR)
+	{
+		Increment(m_TimestampErrors);
+	}
+
+	m_NextDevicePosition = devicePosition + frames;
+	m_HaveDevicePosition = true;
+}
+
+// A packet the sink refused because its ring was full: output backpressure.
+void CCaptureStats::RecordWrite(bool written, UINT32 cbData)
+{
+	if (!written)
+	{
+		Increment(m_DroppedPackets);
+		Increment(m_DroppedBytes, cbData);
+	}
+}
+
+void CCaptureStats::RecordLatency(UINT64 latency)
+{
+	Increment(m_LatencySum, latency);
+	Increment(m_LatencySamples);
+	RaiseMax(m_LatencyMax, latency);
+}
+
+void CCaptureStats::RecordCallback(UINT64 callbackTime)
+{
+	Increment(m_Callbacks);
+	RaiseMax(m_CallbackTimeMax, callbackTime);
+}
+
+void CCaptureStats::RecordPacketTime(UINT64 packetTime)
+{
+	const UINT64 us = packetTime / HNS_PER_US;
+	UINT32 bucket = 0;
+	while (bucket < CAPTURE_PACKET_TIME_BUCKETS - 1 && us >= (static_cast<UINT64>(CAPTURE_PACKET_TIME_FIRST_BOUND_US) << bucket))
+	{
+		bucket++;
+	}
+	Increment(m_PacketTimeHistogram[bucket]);
+}
+
+void CCaptureStats::AddPacketTimeHistogram(UINT64 (&histogram)[CAPTURE_PACKET_TIME_BUCKETS]) const
+{
+	for (UINT32 i = 0; i < CAPTURE_PACKET_TIME_BUCKETS; i++)
+	{
+		histogram[i] += m_PacketTimeHistogram[i].load(std::memory_order_relaxed);
+	}
+}
+
+void CCaptureStats::Snapshot(CAPTURE_STATS_SNAPSHOT& snapshot)
+{
+	snapshot.Callbacks = m_Callbacks.load(std::memory_order_relaxed);
+	snapshot.Packets = m_Packets.load(std::memory_order_relaxed);
+	snapshot.Frames = m_Frames.load(std::memory_order_relaxed);
+	snapshot.Bytes = m_Bytes.load(std::memory_order_relaxed);
+	snapshot.SilentSkipped = m_SilentSkipped.load(std::memory_order_relaxed);
+	snapshot.GateOpens = m_GateOpens.load(std::memory_order_relaxed);
+	snapshot.GateCloses = m_GateCloses.load(std::memory_order_relaxed);
+	snapshot.GateOpen = m_GateOpen.load(std::memory_order_relaxed);
+	snapshot.Discontinuities = m_Discontinuities.load(std::memory_order_relaxed);
+	snapshot.TimestampErrors = m_TimestampErrors.load(std::memory_order_relaxed);
+	snapshot.PositionGaps = m_PositionGaps.load(std::memory_order_relaxed);
+	snapshot.DroppedPackets = m_DroppedPackets.load(std::memory_order_relaxed);
+	snapshot.DroppedBytes = m_DroppedBytes.load(std::memory_order_relaxed);
+	snapshot.LatencySum = m_LatencySum.load(std::memory_order_relaxed);
+	snapshot.LatencySamples = m_LatencySamples.load(std::memory_order_relaxed);
+	snapshot.LatencyMax = m_LatencyMax.exchange(0, std::memory_order_relaxed);
+	snapshot.CallbackTimeMax = m_CallbackTimeMax.exchange(0, std::memory_order_relaxed);
+}
+
+//
+//  CStatsReporter
+//
+
+CStatsReporter::~CStatsReporter()
+{
+	Shutdown();
+}
+
+HRESULT CStatsReporter::Initialize(UINT32 intervalMs)
+{
+	m_IntervalMs = intervalMs;
+	RETURN_IF_FAILED(m_StopEvent.create(wil::EventOptions::ManualReset));
+
+	m_ReporterThread.reset(CreateThread(nullptr, 0, CStatsReporter::ReporterThreadProc, this, 0, nullptr));
+	RETURN_LAST_ERROR_IF(!m_ReporterThread);
+
+	return S_OK;
+}
+
+void CStatsReporter::Shutdown()
+{
+	if (m_ReporterThread)
+	{
+		m_StopEvent.SetEvent();
+		WaitForSingleObject(m_ReporterThread.get(), INFINITE);
+		m_ReporterThread.reset();
+	}
+
+	auto lock = m_EntriesLock.lock_exclusive();
+	m_Entries.clear();
+}
+
+void CStatsReporter::Add(UINT32 streamId, DWORD processId, const std::shared_ptr<CCaptureStats>& stats)
+{
+	if (!m_ReporterThread)
+	{
+		return;
+	}
+
+	auto lock = m_EntriesLock.lock_exclusive();
+	m_Entries.push_back({ streamId, processId, stats, {} });
+}
+
+void CStatsReporter::Remove(UINT32 streamId)
+{
+	auto lock = m_EntriesLock.lock_exclusive();
+	m_Entries.erase(std::remove_if(m_Entries.begin(), m_Entries.end(),
+		[streamId](const Entry& entry) { return entry.StreamId == streamId; }), m_Entries.end());
+}
+
+DWORD WINAPI CStatsReporter::ReporterThreadProc(LPVOID lpParameter)
+{
+	static_cast<CStatsReporter*>(lpParameter)->ReporterThread();
+	return 0;
+}
+
+void CStatsReporter::ReporterThread()
+{
+	ULONGLONG lastTick = GetTickCount64();
+	while (WaitForSingleObject(m_StopEvent.get(), m_IntervalMs) == WAIT_TIMEOUT)
+	{
+		// Rates use the time that actually passed, not the nominal interval
+		const ULONGLONG tick = GetTickCount64();
+		const double intervalSec = (std::max)(tick - lastTick, 1ULL) / 1000.0;
+		lastTick = tick;
+
+		auto lock = m_EntriesLock.lock_exclusive();
+		for (auto& entry : m_Entries)
+		{
+			Report(entry, intervalSec);
+		}
+	}
+}
+
+//
+//  Report()
+//
+//  Prints one stats line for the entry.  The line is built first and written in one go so it
+//  doesn't interleave with control channel replies on stderr.
+//
+void CStatsReporter::Report(Entry& entry, double intervalSec)
+{
+	CAPTURE_STATS_SNAPSHOT current;
+	entry.Stats->Snapshot(current);
+	const CAPTURE_STATS_SNAPSHOT& previous = entry.Previous;
+
+	const UINT64 latencySamples = current.LatencySamples - previous.LatencySamples;
+	const UINT64 latencyAvg = (latencySamples != 0) ? (current.LatencySum - previous.LatencySum) / latencySamples : 0;
+
+	std::wostringstream line;
+	line << std::fixed << std::setprecision(1)
+		<< L"{\"event\":\"stats\",\"stream\":" << entry.StreamId
+		<< L",\"pid\":" << entry.ProcessId
+		<< L",\"intervalMs\":" << static_cast<UINT64>(intervalSec * 1000.0)
+		<< L",\"callbacksPerSec\":" << (current.Callbacks - previous.Callbacks) / intervalSec
+		<< L",\"packetsPerSec\":" << (current.Packets - previous.Packets) / intervalSec
+		<< L",\"framesPerSec\":" << (current.Frames - previous.Frames) / intervalSec
+		<< L",\"latencyAvgUs\":" << latencyAvg / HNS_PER_US
+		<< L",\"latencyMaxUs\":" << current.LatencyMax / HNS_PER_US
+		<< L",\"callbackMaxUs\":" << current.CallbackTimeMax / HNS_PER_US
+		<< L",\"discontinuities\":" << current.Discontinuities
+		<< L",\"timestampErrors\":" << current.TimestampErrors
+		<< L",\"positionGaps\":" << current.PositionGaps
+		<< L",\"silentSkipped\":" << current.SilentSkipped
+		<< L",\"gateOpen\":" << (current.GateOpen ? L"true" : L"false")
+		<< L",\"gateOpens\":" << current.GateOpens
+		<< L",\"gateCloses\":" << current.GateCloses
+		<< L",\"droppedPackets\":" << current.DroppedPackets
+		<< L",\"droppedBytes\":" << current.DroppedBytes
+		<< L"}\n";
+	std::wcerr << line.str() << std::flush;
+
+	entry.Previous = current;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <wil\resource.h>
+#include <wil\result.h>
+
+// Packet processing time histogram: bucket i counts packets under (8 << i) us, the last one the rest.
+#define CAPTURE_PACKET_TIME_BUCKETS 10
+#define CAPTURE_PACKET_TIME_FIRST_BOUND_US 8
+
+//
+//  CAPTURE_STATS_SNAPSHOT
+//
+//  Counters are totals since the capture started; the two maxima cover the time since the previous
+//  snapshot.  Times are in 100-ns units.
+//
+struct CAPTURE_STATS_SNAPSHOT
+{
+    UINT64 Callbacks;
+    UINT64 Packets;
+    UINT64 Frames;
+    UINT64 Bytes;
+    UINT64 SilentSkipped;
+    UINT64 GateOpens;
+    UINT64 GateCloses;
+    // Whether the silence gate is open now
+    bool GateOpen;
+    UINT64 Discontinuities;
+    UINT64 TimestampErrors;
+    UINT64 PositionGaps;
+    UINT64 DroppedPackets;
+    UINT64 DroppedBytes;
+    UINT64 LatencySum;
+    UINT64 LatencySamples;
+    UINT64 LatencyMax;
+    UINT64 CallbackTimeMax;
+};
+
+//
+//  CCaptureStats
+//
+//  What one capture's real-time path has been doing.  The capture callback is the only writer and
+//  only ever does relaxed stores; the stats reporter reads from its own thread.  A maximum reset by
+//  the reader can race with the writer raising it, which at worst loses one sample of a maximum.
+//
+class CCaptureStats
+{
+public:
+    // Capture thread only.
+    void RecordPacket(UINT32 frames, UINT32 cbData, DWORD captureFlags, UINT64 devicePosition);
+    void RecordWrite(bool written, UINT32 cbData);
+    void RecordLatency(UINT64 latency);
+    void RecordSilentSkip() { Increment(m_SilentSkipped); }
+    void RecordGateTransition(bool opened)
+    {
+        Increment(opened ? m_GateOpens : m_GateCloses);
+        m_GateOpen.store(opened, std::memory_order_relaxed);
+    }
+    // The gate's state without a transition: a reactivation initializes it closed again.
+    void RecordGateState(bool open) { m_GateOpen.store(open, std::memory_order_relaxed); }
+    void RecordCallback(UINT64 callbackTime);
+    void RecordPacketTime(UINT64 packetTime);
+
+    // Any thread.
+    void Snapshot(CAPTURE_STATS_SNAPSHOT& snapshot);
+    // Adds the packet time histogram's totals to histogram.  Leaves the snapshot's maxima alone.
+    void AddPacketTimeHistogram(UINT64 (&histogram)[CAPTURE_PACKET_TIME_BUCKETS]) const;
+
+private:
+    static void Increment(std::atomic<UINT64>& counter, UINT64 value = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static void RaiseMax(std::atomic<UINT64>& maximum, UINT64 value)
+    {
+        if (value > maximum.load(std::memory_order_relaxed))
+        {
+            maximum.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    std::atomic<UINT64> m_Callbacks{ 0 };
+    std::atomic<UINT64> m_Packets{ 0 };
+    std::atomic<UINT64> m_Frames{ 0 };
+    std::atomic<UINT64> m_Bytes{ 0 };
+    std::atomic<UINT64> m_SilentSkipped{ 0 };
+    std::atomic<UINT64> m_GateOpens{ 0 };
+    std::atomic<UINT64> m_GateCloses{ 0 };
+    std::atomic<bool> m_GateOpen{ false };
+    std::atomic<UINT64> m_Discontinuities{ 0 };
+    std::atomic<UINT64> m_TimestampErrors{ 0 };
+    std::atomic<UINT64> m_PositionGaps{ 0 };
+    std::atomic<UINT64> m_DroppedPackets{ 0 };
+    std::atomic<UINT64> m_DroppedBytes{ 0 };
+    std::atomic<UINT64> m_LatencySum{ 0 };
+    std::atomic<UINT64> m_LatencySamples{ 0 };
+    std::atomic<UINT64> m_LatencyMax{ 0 };
+    std::atomic<UINT64> m_CallbackTimeMax{ 0 };
+    std::atomic<UINT64> m_PacketTimeHistogram[CAPTURE_PACKET_TIME_BUCKETS] = {};
+
+    // Capture thread only: device position the next packet should start at, once known.
+    UINT64 m_NextDevicePosition = 0;
+    bool m_HaveDevicePosition = false;
+};
+
+//
+//  CStatsReporter
+//
+//  With --stats, prints one JSON line per capture to stderr every interval:
+//
+//      {"event":"stats","stream":0,"pid":1234,"intervalMs":1000,"callbacksPerSec":100.0,
+//       "packetsPerSec":100.0,"framesPerSec":48000.0,"latencyAvgUs":10500,"latencyMaxUs":12100,
+//       "callbackMaxUs":85,"discontinuities":0,"timestampErrors":0,"positionGaps":0,
+//       "silentSkipped":12,"gateOpen":true,"gateOpens":3,"gateCloses":2,"droppedPackets":0,
+//       "droppedBytes":0}
+//
+//  Rates and maxima cover the last interval; the counts are totals.  Latency is how long after the
+//  engine captured a packet's first frame (its QPC position) the packet was handed to the sink.
+//
+class CStatsReporter
+{
+public:
+    CStatsReporter() = default;
+    ~CStatsReporter();
+
+    HRESULT Initialize(UINT32 intervalMs);
+    void Shutdown();
+
+    // Main thread.  Ignored unless the reporter was initialized.
+    void Add(UINT32 streamId, DWORD processId, const std::shared_ptr<CCaptureStats>& stats);
+    void Remove(UINT32 streamId);
+
+private:
+    struct Entry
+    {
+        UINT32 StreamId;
+        DWORD ProcessId;
+        std::shared_ptr<CCaptureStats> Stats;
+        CAPTURE_STATS_SNAPSHOT Previous;
+    };
+
+    static DWORD WINAPI ReporterThreadProc(LPVOID lpParameter);
+    void ReporterThread();
+    void Report(Entry& entry, double intervalSec);
+
+    UINT32 m_IntervalMs = 0;
+    wil::unique_event_nothrow m_StopEvent;
+    wil::unique_handle m_ReporterThread;
+
+    wil::srwlock m_EntriesLock;
+    std::vector<Entry> m_Entries;
+};
@@ -0,0 +1,115 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "ControlChannel.h"
+
+// Replies share stderr with the stats and status lines written from other threads, so each one is
+// built first and written in one go.
+static void WriteReply(std::wostream& reply, const std::wostringstream& line)
+{
+	reply << line.str() << std::flush;
+}
+
+static void ReportResult(std::wostream& reply, PCWSTR verb, UINT32 streamId, HRESULT hr)
+{
+	std::wostringstream line;
+	if (SUCCEEDED(hr))
+	{
+		line << verb << L" " << streamId << L"\n";
+	}
+	else
+	{
+		line << L"error " << streamId << L" 0x" << std::hex << hr << L"\n";
+	}
+	WriteReply(reply, line);
+}
+
+static void ReportInvalidCommand(std::wostream& reply, const std::wstring& command)
+{
+	std::wostringstream line;
+	line << L"Invalid command " << command << L".\n";
+	WriteReply(reply, line);
+}
+
+bool ExecuteControlCommand(CCaptureHost& host, const std::wstring& line, std::wostream& reply, std::set<UINT32>& streams)
+{
+	std::wistringstream command(line);
+	std::wstring verb;
+	if (!(command >> verb))
+	{
+		return true;
+	}
+
+	if (verb == L"quit")
+	{
+		return false;
+	}
+
+	UINT32 streamId = 0;
+	if (!(command >> streamId))
+	{
+		ReportInvalidCommand(reply, line);
+		return true;
+	}
+
+	if (verb == L"start")
+	{
+		std::wstring targets;
+		std::wstring mode;
+		command >> targets >> mode;
+
+		std::vector<DWORD> processIds;
+		HRESULT hr = ParseProcessIds(targets.c_str(), processIds) ?
+			host.StartCapture(streamId, processIds, mode != L"exclude") : E_INVALIDARG;
+		if (SUCCEEDED(hr))
+		{
+			streams.insert(streamId);
+		}
+		ReportResult(reply, L"started", streamId, hr);
+	}
+	else if (verb == L"retarget")
+	{
+		DWORD processId = 0;
+		std::wstring mode;
+		command >> processId >> mode;
+		ReportResult(reply, L"retargeted", streamId, host.RetargetCapture(streamId, processId, mode != L"exclude"));
+	}
+	else if (verb == L"pause")
+	{
+		ReportResult(reply, L"paused", streamId, host.PauseCapture(streamId));
+	}
+	else if (verb == L"resume")
+	{
+		ReportResult(reply, L"resumed", streamId, host.ResumeCapture(streamId));
+	}
+	else if (verb == L"gain")
+	{
+		float gain = -1.0f;
+		command >> gain;
+		ReportResult(reply, L"gain", streamId, host.SetGain(streamId, gain));
+	}
+	else if (verb == L"stop")
+	{
+		streams.erase(streamId);
+		ReportResult(reply, L"stopped", streamId, host.StopCapture(streamId));
+	}
+	else
+	{
+		ReportInvalidCommand(reply, line);
+	}
+	return true;
+}
+
+void RunControlChannel(CCaptureHost& host)
+{
+	std::set<UINT32> streams;
+	std::wstring line;
+	while (std::getline(std::wcin, line))
+	{
+		if (!ExecuteControlCommand(host, line, std::wcerr, streams))
+		{
+			break;
+		}
+	}
+}
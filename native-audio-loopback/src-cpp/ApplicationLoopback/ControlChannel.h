@@ -0,0 +1,33 @@
+#pragma once
+
+#include <iosfwd>
+#include <set>
+#include <string>
+
+#include "CaptureHost.h"
+
+//
+//  Line-based control channel for --multi, read from stdin (or, with --daemon, from a named pipe):
+//
+//      start <streamId> <processId>[,<processId>...] [include|exclude]
+//      stop <streamId>
+//      pause <streamId>
+//      resume <streamId>
+//      retarget <streamId> <processId> [include|exclude]
+//      gain <streamId> <linear gain>       (--mix only)
+//      quit
+//
+//  Every command is answered with "started <id>", "stopped <id>", "paused <id>", "resumed <id>",
+//  "retargeted <id>", "gain <id>" or "error <id> 0x<hr>".  Without --multi the same channel drives
+//  the single capture, which is stream 0.  Captures that lose their device or target in between say
+//  so with {"event":"status",...} lines of their own (see CLoopbackCapture).  A start with several
+//  process IDs merges their trees into the one stream; such a stream can't be excluding or retargeted.
+//
+
+// Runs one command line, writing its answer to reply.  Streams started and stopped are tracked in
+// streams, so the caller knows what to stop when its client goes away.  Returns false for quit.
+bool ExecuteControlCommand(CCaptureHost& host, const std::wstring& line, std::wostream& reply, std::set<UINT32>& streams);
+
+// Reads commands from stdin and answers on stderr.  End of input counts as quit.  Returns once the
+// channel is closed; the captures are still running.
+void RunControlChannel(CCaptureHost& host);
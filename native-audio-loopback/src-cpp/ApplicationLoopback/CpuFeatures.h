@@ -0,0 +1,36 @@
+#pragma once
+
+#include <intrin.h>
+
+//
+//  IsAvx2Supported()
+//
+//  True when both the CPU and the OS (saved YMM state) support AVX2.  Checked once per process; the
+//  SIMD kernels use it to choose their implementation when a stream is set up, never per packet.
+//
+inline bool IsAvx2Supported()
+{
+    static const bool supported = []()
+    {
+        int cpuInfo[4] = {};
+        __cpuid(cpuInfo, 0);
+        if (cpuInfo[0] < 7)
+        {
+            return false;
+        }
+
+        // OSXSAVE and AVX, then make sure the OS actually saves XMM and YMM state
+        __cpuid(cpuInfo, 1);
+        const bool osxsave = (cpuInfo[2] & (1 << 27)) != 0;
+        const bool avx = (cpuInfo[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+        {
+            return false;
+        }
+
+        __cpuidex(cpuInfo, 7, 0);
+        return (cpuInfo[1] & (1 << 5)) != 0;
+    }();
+
+    return supported;
+}
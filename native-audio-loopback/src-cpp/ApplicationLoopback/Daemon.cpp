@@ -0,0 +1,205 @@
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include <wrl\implements.h>
+#include <wil\com.h>
+#include <wil\resource.h>
+#include <wil\result.h>
+
+#include "ControlChannel.h"
+#include "Daemon.h"
+
+using namespace Microsoft::WRL;
+
+// Pipe buffer sizes, and the longest command line a client may send
+#define DAEMON_PIPE_BUFFER_SIZE 4096
+#define DAEMON_MAX_LINE 1024
+
+// How long startup waits for the warm-up activation before listening anyway
+#define DAEMON_WARM_UP_TIMEOUT_MS 5000
+
+//
+//  CWarmUpActivation
+//
+//  Completion handler for the warm-up activation.  Only the result is kept; the audio client is
+//  released without ever being initialized.
+//
+class CWarmUpActivation :
+	public RuntimeClass< RuntimeClassFlags< ClassicCom >, FtmBase, IActivateAudioInterfaceCompletionHandler >
+{
+public:
+	HRESULT Initialize()
+	{
+		return m_hCompleted.create(wil::EventOptions::None);
+	}
+
+	STDMETHOD(ActivateCompleted)(IActivateAudioInterfaceAsyncOperation* operation)
+	{
+		HRESULT hrActivateResult = E_UNEXPECTED;
+		wil::com_ptr_nothrow<IUnknown> punkAudioInterface;
+		HRESULT hr = operation->GetActivateResult(&hrActivateResult, &punkAudioInterface);
+		m_Result = SUCCEEDED(hr) ? hrActivateResult : hr;
+		m_hCompleted.SetEvent();
+		return S_OK;
+	}
+
+	bool Wait(DWORD timeoutMs) { return m_hCompleted.wait(timeoutMs); }
+	HRESULT GetResult() const { return m_Result; }
+
+private:
+	wil::unique_event_nothrow m_hCompleted;
+	HRESULT m_Result = E_PENDING;
+};
+
+//
+//  WarmUpActivation()
+//
+//  Activates a process loopback client for this process and throws it away.  The first activation in
+//  a process loads the audio client stack and connects to the audio service; doing it here moves that
+//  cost off the first real capture.
+//
+static HRESULT WarmUpActivation()
+{
+	ComPtr<CWarmUpActivation> handler = Make<CWarmUpActivation>();
+	RETURN_IF_NULL_ALLOC(handler);
+	RETURN_IF_FAILED(handler->Initialize());
+
+	AUDIOCLIENT_ACTIVATION_PARAMS audioclientActivationParams = {};
+	audioclientActivationParams.ActivationType = AUDIOCLIENT_ACTIVATION_TYPE_PROCESS_LOOPBACK;
+	audioclientActivationParams.ProcessLoopbackParams.ProcessLoopbackMode = PROCESS_LOOPBACK_MODE_INCLUDE_TARGET_PROCESS_TREE;
+	audioclientActivationParams.ProcessLoopbackParams.TargetProcessId = GetCurrentProcessId();
+
+	PROPVARIANT activateParams = {};
+	activateParams.vt = VT_BLOB;
+	activateParams.blob.cbSize = sizeof(audioclientActivationParams);
+	activateParams.blob.pBlobData = (BYTE*)&audioclientActivationParams;
+
+	wil::com_ptr_nothrow<IActivateAudioInterfaceAsyncOperation> asyncOp;
+	RETURN_IF_FAILED(ActivateAudioInterfaceAsync(VIRTUAL_AUDIO_DEVICE_PROCESS_LOOPBACK, __uuidof(IAudioClient), &activateParams, handler.Get(), &asyncOp));
+
+	// The operation holds its own reference on the handler, so giving up early is safe
+	RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_TIMEOUT), !handler->Wait(DAEMON_WARM_UP_TIMEOUT_MS));
+	return handler->GetResult();
+}
+
+static std::wstring Utf8ToWide(const std::string& text)
+{
+	std::wstring wide;
+	const int cch = MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), nullptr, 0);
+	if (cch > 0)
+	{
+		wide.resize(cch);
+		MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), &wide[0], cch);
+	}
+	return wide;
+}
+
+static bool WriteReply(HANDLE hPipe, const std::wstring& reply)
+{
+	if (reply.empty())
+	{
+		return true;
+	}
+
+	std::string utf8;
+	const int cb = WideCharToMultiByte(CP_UTF8, 0, reply.data(), static_cast<int>(reply.size()), nullptr, 0, nullptr, nullptr);
+	if (cb > 0)
+	{
+		utf8.resize(cb);
+		WideCharToMultiByte(CP_UTF8, 0, reply.data(), static_cast<int>(reply.size()), &utf8[0], cb, nullptr, nullptr);
+	}
+
+	DWORD cbWritten = 0;
+	return WriteFile(hPipe, utf8.data(), static_cast<DWORD>(utf8.size()), &cbWritten, nullptr) && cbWritten == utf8.size();
+}
+
+//
+//  RunSession()
+//
+//  Serves one connected client until it disconnects or sends quit.  Returns false for quit.
+//
+static bool RunSession(CCaptureHost& host, HANDLE hPipe)
+{
+	std::set<UINT32> streams;
+	std::string pending;
+	bool quit = false;
+
+	char buffer[DAEMON_PIPE_BUFFER_SIZE];
+	DWORD cbRead = 0;
+	while (!quit && ReadFile(hPipe, buffer, sizeof(buffer), &cbRead, nullptr) && cbRead > 0)
+	{
+		pending.append(buffer, cbRead);
+
+		size_t end;
+		while (!quit && (end = pending.find('\n')) != std::string::npos)
+		{
+			std::string line = pending.substr(0, end);
+			pending.erase(0, end + 1);
+			if (!line.empty() && line.back() == '\r')
+			{
+				line.pop_back();
+			}
+
+			std::wostringstream reply;
+			quit = !ExecuteControlCommand(host, Utf8ToWide(line), reply, streams);
+			WriteReply(hPipe, reply.str());
+		}
+
+		if (pending.size() > DAEMON_MAX_LINE)
+		{
+			std::wcerr << L"Dropping client: command line too long.\n";
+			break;
+		}
+	}
+
+	// A session's captures die with it, so a client that crashes doesn't leave them running
+	for (UINT32 streamId : streams)
+	{
+		host.StopCapture(streamId);
+	}
+
+	return !quit;
+}
+
+//
+//  RunDaemon()
+//
+//  Warms up activation, then serves clients on one pipe instance until one of them sends quit.
+//  FILE_FLAG_FIRST_PIPE_INSTANCE makes a second daemon on the same name fail instead of sharing it.
+//
+HRESULT RunDaemon(CCaptureHost& host, PCWSTR pipeName)
+{
+	HRESULT hr = WarmUpActivation();
+	if (FAILED(hr))
+	{
+		// Not fatal: the first capture just pays for the cold activation itself
+		std::wcerr << L"Warm-up activation failed: 0x" << std::hex << hr << std::dec << L"\n";
+	}
+
+	wil::unique_hfile pipe(CreateNamedPipeW(pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+		1, DAEMON_PIPE_BUFFER_SIZE, DAEMON_PIPE_BUFFER_SIZE, 0, nullptr));
+	RETURN_LAST_ERROR_IF(!pipe);
+
+	std::wcerr << L"listening " << pipeName << L"\n";
+
+	for (;;)
+	{
+		if (!ConnectNamedPipe(pipe.get(), nullptr) && GetLastError() != ERROR_PIPE_CONNECTED)
+		{
+			RETURN_LAST_ERROR();
+		}
+
+		const bool keepRunning = RunSession(host, pipe.get());
+
+		FlushFileBuffers(pipe.get());
+		DisconnectNamedPipe(pipe.get());
+
+		if (!keepRunning)
+		{
+			return S_OK;
+		}
+	}
+}
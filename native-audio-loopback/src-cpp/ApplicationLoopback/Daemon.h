@@ -0,0 +1,15 @@
+#pragma once
+
+#include "CaptureHost.h"
+
+//
+//  Daemon mode (--daemon)
+//
+//  Keeps one warm CCaptureHost alive across capture sessions.  Media Foundation, COM and the MMCSS
+//  work queue are set up once at startup, and a throwaway process loopback activation loads the audio
+//  stack, so starting a capture only costs the activation for its target process.  Clients connect to
+//  the named pipe one at a time and speak the ControlChannel.h protocol in UTF-8 lines; replies come
+//  back on the pipe.  Captures a client started are stopped when it disconnects.  Audio still goes to
+//  the configured --output as framed streams.  Returns when a client sends quit.
+//
+HRESULT RunDaemon(CCaptureHost& host, PCWSTR pipeName);
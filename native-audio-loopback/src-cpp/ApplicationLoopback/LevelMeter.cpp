@@ -0,0 +1,377 @@
+#include <AudioClient.h>
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <wil\result.h>
+
+#include "LevelMeter.h"
+#include "SampleKernels.h"
+
+#define PI 3.14159265358979323846
+
+//
+//  Kernels
+//
+//  MeasureLevels() is the generic pass, one channel at a time over the interleaved frames.  The
+//  stereo SSE2 kernels load whole frames instead: the left channel lands in the even lanes and the
+//  right one in the odd lanes, so the peaks and sums fold apart once at the end of the packet.
+//  Per-packet float sums are added into the interval's double totals.
+//
+
+template <SampleFormat Format, UINT32 Channels>
+static void MeasureLevels(const BYTE* pData, UINT32 frames, UINT32 channels, UINT32 measured, float* pPeaks, double* pSumSquares)
+{
+	typedef SampleTraits<Format> Traits;
+	const UINT32 stride = (Channels != SAMPLE_KERNEL_ANY_CHANNELS) ? Channels : channels;
+	const UINT32 count = (Channels != SAMPLE_KERNEL_ANY_CHANNELS) ? Channels : measured;
+
+	for (UINT32 c = 0; c < count; c++)
+	{
+		const typename Traits::Type* p = reinterpret_cast<const typename Traits::Type*>(pData) + c;
+		float peak = pPeaks[c];
+		double sum = 0.0;
+		for (UINT32 f = 0; f < frames; f++, p += stride)
+		{
+			const float sample = Traits::ToFloat(*p);
+			peak = (std::max)(peak, fabsf(sample));
+			sum += static_cast<double>(sample) * sample;
+		}
+		pPeaks[c] = peak;
+		pSumSquares[c] += sum;
+	}
+}
+
+static void MeasureStereoFloat32Sse2(const BYTE* pData, UINT32 frames, UINT32 channels, UINT32 measured, float* pPeaks, double* pSumSquares)
+{
+	const float* p = reinterpret_cast<const float*>(pData);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 peak = _mm_setzero_ps();
+	__m128 sum = _mm_setzero_ps();
+
+	UINT32 f = 0;
+	for (; f + 2 <= frames; f += 2)
+	{
+		const __m128 v = _mm_loadu_ps(p + 2 * f);
+		peak = _mm_max_ps(peak, _mm_and_ps(v, absMask));
+		sum = _mm_add_ps(sum, _mm_mul_ps(v, v));
+	}
+
+	float peaks[4];
+	float sums[4];
+	_mm_storeu_ps(peaks, peak);
+	_mm_storeu_ps(sums, sum);
+	for (UINT32 c = 0; c < 2; c++)
+	{
+		pPeaks[c] = (std::max)(pPeaks[c], (std::max)(peaks[c], peaks[c + 2]));
+		pSumSquares[c] += static_cast<double>(sums[c]) + sums[c + 2];
+	}
+
+	MeasureLevels<SampleFormat::Float32, 2>(reinterpret_cast<const BYTE*>(p + 2 * f), frames - f, channels, measured, pPeaks, pSumSquares);
+}
+
+static void MeasureStereoInt16Sse2(const BYTE* pData, UINT32 frames, UINT32 channels, UINT32 measured, float* pPeaks, double* pSumSquares)
+{
+	const INT16* p = reinterpret_cast<const INT16*>(pData);
+	const __m128i leftMask = _mm_set1_epi32(0x0000FFFF);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i maximum = _mm_setzero_si128();
+	__m128i minimum = _mm_setzero_si128();
+	__m128i sumLeft = _mm_setzero_si128();
+	__m128i sumRight = _mm_setzero_si128();
+
+	UINT32 f = 0;
+	for (; f + 4 <= frames; f += 4)
+	{
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2 * f));
+		maximum = _mm_max_epi16(maximum, v);
+		minimum = _mm_min_epi16(minimum, v);
+
+		// With the other channel's half of each 32-bit lane zeroed, madd leaves one square per lane,
+		// at most 2^30; widened to 64-bit lanes as in the silence detector's RMS kernels.
+		const __m128i left = _mm_and_si128(v, leftMask);
+		const __m128i right = _mm_andnot_si128(leftMask, v);
+		const __m128i leftSquares = _mm_madd_epi16(left, left);
+		const __m128i rightSquares = _mm_madd_epi16(right, right);
+		sumLeft = _mm_add_epi64(sumLeft, _mm_add_epi64(_mm_unpacklo_epi32(leftSquares, zero), _mm_unpackhi_epi32(leftSquares, zero)));
+		sumRight = _mm_add_epi64(sumRight, _mm_add_epi64(_mm_unpacklo_epi32(rightSquares, zero), _mm_unpackhi_epi32(rightSquares, zero)));
+	}
+
+	INT16 maxima[8];
+	INT16 minima[8];
+	UINT64 sums[2][2];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(maxima), maximum);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(minima), minimum);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(sums[0]), sumLeft);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(sums[1]), sumRight);
+	for (UINT32 c = 0; c < 2; c++)
+	{
+		INT32 magnitude = 0;
+		for (UINT32 lane = c; lane < 8; lane += 2)
+		{
+			magnitude = (std::max)(magnitude, (std::max)(static_cast<INT32>(maxima[lane]), -static_cast<INT32>(minima[lane])));
+		}
+		pPeaks[c] = (std::max)(pPeaks[c], magnitude * (1.0f / 32768.0f));
+		pSumSquares[c] += static_cast<double>(sums[c][0] + sums[c][1]) * (1.0 / (32768.0 * 32768.0));
+	}
+
+	MeasureLevels<SampleFormat::Int16, 2>(reinterpret_cast<const BYTE*>(p + 2 * f), frames - f, channels, measured, pPeaks, pSumSquares);
+}
+
+//
+//  K-weighting
+//
+//  ITU-R BS.1770's pre-filter (a high shelf for the head) and RLB high-pass, derived for the stream's
+//  rate from their analog prototypes rather than taken from the 48 kHz table.
+//
+
+static void SetShelf(double samplesPerSec, double (&b)[3], double (&a)[2])
+{
+	const double f0 = 1681.974450955533;
+	const double gainDb = 3.999843853973347;
+	const double q = 0.7071752369554196;
+
+	const double k = tan(PI * f0 / samplesPerSec);
+	const double vh = pow(10.0, gainDb / 20.0);
+	const double vb = pow(vh, 0.4996667741545416);
+	const double a0 = 1.0 + k / q + k * k;
+
+	b[0] = (vh + vb * k / q + k * k) / a0;
+	b[1] = 2.0 * (k * k - vh) / a0;
+	b[2] = (vh - vb * k / q + k * k) / a0;
+	a[0] = 2.0 * (k * k - 1.0) / a0;
+	a[1] = (1.0 - k / q + k * k) / a0;
+}
+
+static void SetHighPass(double samplesPerSec, double (&b)[3], double (&a)[2])
+{
+	const double f0 = 38.13547087602444;
+	const double q = 0.5003270373238773;
+
+	const double k = tan(PI * f0 / samplesPerSec);
+	const double a0 = 1.0 + k / q + k * k;
+
+	b[0] = 1.0;
+	b[1] = -2.0;
+	b[2] = 1.0;
+	a[0] = 2.0 * (k * k - 1.0) / a0;
+	a[1] = (1.0 - k / q + k * k) / a0;
+}
+
+//
+//  Initialize()
+//
+//  Picks the level kernel and, with loudness, sets up the filters and channel weights.  Only the
+//  16-bit and float encodings the capture negotiates are supported.
+//
+HRESULT CLevelMeter::Initialize(const WAVEFORMATEX* format, UINT32 intervalMs, bool loudness)
+{
+	const SampleFormat sampleFormat = GetSampleFormat(format);
+	RETURN_HR_IF(AUDCLNT_E_UNSUPPORTED_FORMAT, (sampleFormat != SampleFormat::Int16 && sampleFormat != SampleFormat::Float32) ||
+		format->nChannels == 0);
+	RETURN_HR_IF(E_INVALIDARG, intervalMs < METER_MIN_INTERVAL_MS || intervalMs > METER_MAX_INTERVAL_MS);
+
+	m_Channels = format->nChannels;
+	m_Measured = (std::min)(m_Channels, static_cast<UINT32>(LOOPBACK_METER_MAX_CHANNELS));
+	m_IntervalFrames = (std::max)(static_cast<UINT32>(static_cast<UINT64>(format->nSamplesPerSec) * intervalMs / 1000), 1u);
+
+	const bool isFloat = (sampleFormat == SampleFormat::Float32);
+	switch (m_Channels)
+	{
+	case 1:
+		m_pfnMeasure = isFloat ? MeasureLevels<SampleFormat::Float32, 1> : MeasureLevels<SampleFormat::Int16, 1>;
+		break;
+	case 2:
+		m_pfnMeasure = isFloat ? MeasureStereoFloat32Sse2 : MeasureStereoInt16Sse2;
+		break;
+	case 6:
+		m_pfnMeasure = isFloat ? MeasureLevels<SampleFormat::Float32, 6> : MeasureLevels<SampleFormat::Int16, 6>;
+		break;
+	case 8:
+		m_pfnMeasure = isFloat ? MeasureLevels<SampleFormat::Float32, 8> : MeasureLevels<SampleFormat::Int16, 8>;
+		break;
+	default:
+		m_pfnMeasure = isFloat ? MeasureLevels<SampleFormat::Float32, SAMPLE_KERNEL_ANY_CHANNELS> :
+			MeasureLevels<SampleFormat::Int16, SAMPLE_KERNEL_ANY_CHANNELS>;
+		break;
+	}
+
+	m_Frames = 0;
+	m_Info = CapturePacketInfo();
+	std::fill(std::begin(m_Peaks), std::end(m_Peaks), 0.0f);
+	std::fill(std::begin(m_SumSquares), std::end(m_SumSquares), 0.0);
+
+	m_pfnWeight = nullptr;
+	if (!loudness)
+	{
+		return S_OK;
+	}
+
+	m_pfnWeight = isFloat ? &CLevelMeter::WeightLoudness<SampleFormat::Float32> : &CLevelMeter::WeightLoudness<SampleFormat::Int16>;
+
+	double shelfB[3], shelfA[2], highPassB[3], highPassA[2];
+	SetShelf(format->nSamplesPerSec, shelfB, shelfA);
+	SetHighPass(format->nSamplesPerSec, highPassB, highPassA);
+
+	// Without a channel mask every channel counts fully
+	DWORD channelMask = 0;
+	if (format->wFormatTag == WAVE_FORMAT_EXTENSIBLE && format->cbSize >= (sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX)))
+	{
+		channelMask = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(format)->dwChannelMask;
+	}
+
+	UINT32 c = 0;
+	for (DWORD speaker = 1; speaker != 0 && c < m_Measured; speaker <<= 1)
+	{
+		if (channelMask & speaker)
+		{
+			m_Weights[c++] = (speaker == SPEAKER_LOW_FREQUENCY) ? 0.0 :
+				(speaker & (SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_CENTER)) ? 1.0 : 1.41;
+		}
+	}
+	for (; c < m_Measured; c++)
+	{
+		m_Weights[c] = 1.0;
+	}
+
+	for (c = 0; c < m_Measured; c++)
+	{
+		m_Shelf[c] = { shelfB[0], shelfB[1], shelfB[2], shelfA[0], shelfA[1], 0.0, 0.0, 0.0, 0.0 };
+		m_HighPass[c] = { highPassB[0], highPassB[1], highPassB[2], highPassA[0], highPassA[1], 0.0, 0.0, 0.0, 0.0 };
+	}
+
+	m_BlockFrames = (std::max)(static_cast<UINT32>(format->nSamplesPerSec * METER_LOUDNESS_BLOCK_MS / 1000), 1u);
+	m_BlockFramesDone = 0;
+	m_BlockSum = 0.0;
+	m_NextBlock = 0;
+	m_BlockCount = 0;
+	return S_OK;
+}
+
+bool CLevelMeter::Process(const BYTE* pData, UINT32 frames, bool engineSilent, const CapturePacketInfo& info,
+	LOOPBACK_METER_PAYLOAD& meter, CapturePacketInfo& meterInfo)
+{
+	if (m_Frames == 0)
+	{
+		m_Info = info;
+		m_Info.Flags = 0;
+	}
+	m_Info.Flags |= info.Flags;
+	m_Frames += frames;
+
+	// A silent packet's samples are zeros, whatever the buffer holds
+	if (!engineSilent)
+	{
+		m_pfnMeasure(pData, frames, m_Channels, m_Measured, m_Peaks, m_SumSquares);
+	}
+	if (m_pfnWeight != nullptr)
+	{
+		if (engineSilent)
+		{
+			WeightSilence(frames);
+		}
+		else
+		{
+			(this->*m_pfnWeight)(pData, frames);
+		}
+	}
+
+	if (m_Frames < m_IntervalFrames)
+	{
+		return false;
+	}
+
+	meter = {};
+	meter.Channels = static_cast<UINT16>(m_Measured);
+	meter.ShortTermLufs = GetShortTermLoudness();
+	for (UINT32 c = 0; c < m_Measured; c++)
+	{
+		meter.Peak[c] = m_Peaks[c];
+		meter.Rms[c] = static_cast<float>(sqrt(m_SumSquares[c] / m_Frames));
+	}
+
+	meterInfo = m_Info;
+	meterInfo.Frames = m_Frames;
+
+	m_Frames = 0;
+	std::fill(std::begin(m_Peaks), std::end(m_Peaks), 0.0f);
+	std::fill(std::begin(m_SumSquares), std::end(m_SumSquares), 0.0);
+	return true;
+}
+
+//
+//  WeightLoudness()
+//
+//  Runs every measured channel through the K-weighting filters and adds the weighted squares to the
+//  current 100 ms block, ending blocks on the exact frame.
+//
+template <SampleFormat Format>
+void CLevelMeter::WeightLoudness(const BYTE* pData, UINT32 frames)
+{
+	typedef SampleTraits<Format> Traits;
+	const typename Traits::Type* p = reinterpret_cast<const typename Traits::Type*>(pData);
+
+	for (UINT32 f = 0; f < frames; f++, p += m_Channels)
+	{
+		double sum = 0.0;
+		for (UINT32 c = 0; c < m_Measured; c++)
+		{
+			const double weighted = m_HighPass[c].Process(m_Shelf[c].Process(Traits::ToFloat(p[c])));
+			sum += m_Weights[c] * weighted * weighted;
+		}
+		m_BlockSum += sum;
+
+		if (++m_BlockFramesDone == m_BlockFrames)
+		{
+			EndLoudnessBlock();
+		}
+	}
+}
+
+// Engine-silent packets count as zeros without being filtered; the filters start over after them.
+void CLevelMeter::WeightSilence(UINT32 frames)
+{
+	for (UINT32 c = 0; c < m_Measured; c++)
+	{
+		m_Shelf[c].X1 = m_Shelf[c].X2 = m_Shelf[c].Y1 = m_Shelf[c].Y2 = 0.0;
+		m_HighPass[c].X1 = m_HighPass[c].X2 = m_HighPass[c].Y1 = m_HighPass[c].Y2 = 0.0;
+	}
+
+	while (frames > 0)
+	{
+		const UINT32 blockFrames = (std::min)(frames, m_BlockFrames - m_BlockFramesDone);
+		m_BlockFramesDone += blockFrames;
+		frames -= blockFrames;
+
+		if (m_BlockFramesDone == m_BlockFrames)
+		{
+			EndLoudnessBlock();
+		}
+	}
+}
+
+void CLevelMeter::EndLoudnessBlock()
+{
+	m_Blocks[m_NextBlock] = m_BlockSum / m_BlockFrames;
+	m_NextBlock = (m_NextBlock + 1) % METER_LOUDNESS_BLOCKS;
+	m_BlockCount = (std::min)(m_BlockCount + 1, static_cast<UINT32>(METER_LOUDNESS_BLOCKS));
+	m_BlockFramesDone = 0;
+	m_BlockSum = 0.0;
+}
+
+// Over the blocks so far until the window has filled.
+float CLevelMeter::GetShortTermLoudness() const
+{
+	double sum = 0.0;
+	for (UINT32 i = 0; i < m_BlockCount; i++)
+	{
+		sum += m_Blocks[i];
+	}
+
+	if (m_pfnWeight == nullptr || m_BlockCount == 0 || sum <= 0.0)
+	{
+		return std::numeric_limits<float>::quiet_NaN();
+	}
+	return static_cast<float>(-0.691 + 10.0 * log10(sum / m_BlockCount));
+}
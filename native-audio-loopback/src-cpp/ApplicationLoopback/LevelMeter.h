@@ -0,0 +1,96 @@
+#pragma once
+
+#include <Windows.h>
+#include <mmreg.h>
+
+#include "CaptureSink.h"
+#include "SampleFormat.h"
+#include "StreamProtocol.h"
+
+// Interval of --meter-only and --meter-lufs when --meter doesn't give one.
+#define METER_DEFAULT_INTERVAL_MS 50
+#define METER_MIN_INTERVAL_MS 10
+#define METER_MAX_INTERVAL_MS 1000
+
+// Short-term loudness: 100 ms blocks, 30 of them for the 3 s window.
+#define METER_LOUDNESS_BLOCK_MS 100
+#define METER_LOUDNESS_BLOCKS 30
+
+//
+//  CLevelMeter
+//
+//  Measures a capture's levels in the capture callback, so a consumer that only wants a level
+//  indicator gets a LOOPBACK_FRAME_METER record per interval instead of the samples.  Every packet
+//  goes through one pass that keeps each channel's peak and sum of squares; the kernel for the
+//  stream's encoding and channel count is picked when the stream opens, with SSE2 flavors for stereo
+//  (the engine's usual layout) that read the interleaved channels in alternate lanes, and
+//  SampleKernels.h instantiations for the rest.  Packets the engine flagged as silent aren't
+//  scanned.  Optionally the samples also go through the BS.1770 K-weighting filters for short-term
+//  loudness, which is scalar per-sample work and costs more than the levels.
+//
+//  An interval ends on the packet that completes it, so records cover whole packets.  Capture
+//  thread only, apart from Initialize, and neither blocks nor allocates.
+//
+class CLevelMeter
+{
+public:
+    HRESULT Initialize(const WAVEFORMATEX* format, UINT32 intervalMs, bool loudness);
+
+    // Adds one packet.  Returns true, with the record to write, once the interval is complete.
+    bool Process(const BYTE* pData, UINT32 frames, bool engineSilent, const CapturePacketInfo& info,
+        LOOPBACK_METER_PAYLOAD& meter, CapturePacketInfo& meterInfo);
+
+private:
+    // Raises pPeaks[c] to the largest magnitude and adds the sum of squares to pSumSquares[c], both
+    // at unity full scale, for the first measured channels of channels.
+    typedef void (*PFN_MEASURE)(const BYTE* pData, UINT32 frames, UINT32 channels, UINT32 measured,
+        float* pPeaks, double* pSumSquares);
+    typedef void (CLevelMeter::*PFN_WEIGHT)(const BYTE* pData, UINT32 frames);
+
+    // Direct form I biquad with its state; the K-weighting filter is two of them in a row.
+    struct Biquad
+    {
+        double B0, B1, B2, A1, A2;
+        double X1, X2, Y1, Y2;
+
+        double Process(double x)
+        {
+            const double y = B0 * x + B1 * X1 + B2 * X2 - A1 * Y1 - A2 * Y2;
+            X2 = X1;
+            X1 = x;
+            Y2 = Y1;
+            Y1 = y;
+            return y;
+        }
+    };
+
+    template <SampleFormat Format>
+    void WeightLoudness(const BYTE* pData, UINT32 frames);
+    void WeightSilence(UINT32 frames);
+    void EndLoudnessBlock();
+    float GetShortTermLoudness() const;
+
+    PFN_MEASURE m_pfnMeasure = nullptr;
+    UINT32 m_Channels = 0;
+    UINT32 m_Measured = 0;
+    UINT32 m_IntervalFrames = 0;
+
+    // The interval so far
+    UINT32 m_Frames = 0;
+    CapturePacketInfo m_Info;
+    float m_Peaks[LOOPBACK_METER_MAX_CHANNELS] = {};
+    double m_SumSquares[LOOPBACK_METER_MAX_CHANNELS] = {};
+
+    // Loudness; m_pfnWeight is null without it.  Channel weights are BS.1770's: 0 for the LFE, 1.41
+    // for the surrounds.
+    PFN_WEIGHT m_pfnWeight = nullptr;
+    Biquad m_Shelf[LOOPBACK_METER_MAX_CHANNELS] = {};
+    Biquad m_HighPass[LOOPBACK_METER_MAX_CHANNELS] = {};
+    double m_Weights[LOOPBACK_METER_MAX_CHANNELS] = {};
+    UINT32 m_BlockFrames = 0;
+    UINT32 m_BlockFramesDone = 0;
+    double m_BlockSum = 0.0;
+    double m_Blocks[METER_LOUDNESS_BLOCKS] = {};
+    UINT32 m_NextBlock = 0;
+    UINT32 m_BlockCount = 0;
+};
@@ -0,0 +1,833 @@
+// LoopbackBenchmark.cpp : Capture benchmark and soak test for ApplicationLoopback.exe.
+//
+//  Every scenario starts one render helper per session (this executable with --render), each playing
+//  a known signal into the default render endpoint: silence with a short tone burst every
+//  BENCH_MARKER_INTERVAL_MS.  The helper reports the QPC time each burst reached the engine on its
+//  stdout.  ApplicationLoopback.exe --multi then captures every helper through the output mode under
+//  test, and the framed stream is read back here, so each burst's onset can be matched with its render
+//  time.  Per scenario this reports:
+//
+//      latency     render time to the moment the record reached this process (p50, p95, max), and
+//                  render time to the QPC position GetBuffer stamped the onset with (engine)
+//      markers     bursts found / bursts rendered during the measurement
+//      glitches    records flagged as discontinuous or not following on from the previous record's
+//                  device position, per stream and minute
+//      throughput  payload bytes read per second, across all streams
+//      cpu         ApplicationLoopback.exe's kernel + user time per stream, in percent of one core
+//
+//  A long --duration-ms makes it a soak test.
+//
+
+#include <Windows.h>
+#include <AudioClient.h>
+#include <mmdeviceapi.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <wil\com.h>
+#include <wil\resource.h>
+#include <wil\result.h>
+
+#include "QpcClock.h"
+#include "RingBuffer.h"
+#include "SampleFormat.h"
+#include "SharedRing.h"
+#include "StreamProtocol.h"
+
+// The test signal: a BENCH_MARKER_MS burst of BENCH_MARKER_HZ every BENCH_MARKER_INTERVAL_MS
+#define BENCH_MARKER_INTERVAL_MS 250
+#define BENCH_MARKER_MS 10
+#define BENCH_MARKER_HZ 1000.0
+#define BENCH_MARKER_AMPLITUDE 0.5
+
+// A burst starts at the first sample at least this loud after half an interval of quiet
+#define BENCH_ONSET_THRESHOLD 0.1
+
+#define BENCH_RENDER_BUFFER_MS 20
+
+// Captures run this long before measuring starts, and helpers keep playing this long after it ends
+#define BENCH_SETTLE_MS 1000
+#define BENCH_START_TIMEOUT_MS 10000
+#define BENCH_EXIT_TIMEOUT_MS 10000
+
+#define BENCH_PI 3.14159265358979323846
+
+struct BenchmarkOptions
+{
+	std::wstring CapturePath;
+	UINT32 DurationMs = 10000;
+	std::vector<UINT32> Sessions{ 1, 4, 16 };
+	std::vector<std::wstring> Outputs{ L"stdout", L"pipe", L"shm" };
+	// Passed on to ApplicationLoopback.exe, e.g. "--engine thread"
+	std::wstring CaptureArguments;
+	bool Verbose = false;
+};
+
+//
+//  Render helper (--render)
+//
+
+// Plays the test signal for durationMs and prints "marker <index> <qpc>" for every burst.
+static HRESULT RunRenderer(UINT32 durationMs)
+{
+	RETURN_IF_FAILED(CoInitializeEx(nullptr, COINIT_MULTITHREADED));
+	auto uninitialize = wil::scope_exit([] { CoUninitialize(); });
+
+	wil::com_ptr_nothrow<IMMDeviceEnumerator> enumerator;
+	RETURN_IF_FAILED(CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&enumerator)));
+
+	wil::com_ptr_nothrow<IMMDevice> device;
+	RETURN_IF_FAILED(enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device));
+
+	wil::com_ptr_nothrow<IAudioClient> audioClient;
+	RETURN_IF_FAILED(device->Activate(__uuidof(IAudioClient), CLSCTX_INPROC_SERVER, nullptr, audioClient.put_void()));
+
+	wil::unique_cotaskmem_ptr<WAVEFORMATEX> format;
+	RETURN_IF_FAILED(audioClient->GetMixFormat(wil::out_param(format)));
+	const SampleFormat sampleFormat = GetSampleFormat(format.get());
+	RETURN_HR_IF(AUDCLNT_E_UNSUPPORTED_FORMAT, sampleFormat != SampleFormat::Float32 && sampleFormat != SampleFormat::Int16);
+
+	wil::unique_event_nothrow bufferEvent;
+	RETURN_IF_FAILED(bufferEvent.create(wil::EventOptions::None));
+	RETURN_IF_FAILED(audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+		BENCH_RENDER_BUFFER_MS * 10000LL, 0, format.get(), nullptr));
+	RETURN_IF_FAILED(audioClient->SetEventHandle(bufferEvent.get()));
+
+	UINT32 bufferFrames = 0;
+	RETURN_IF_FAILED(audioClient->GetBufferSize(&bufferFrames));
+	wil::com_ptr_nothrow<IAudioRenderClient> renderClient;
+	RETURN_IF_FAILED(audioClient->GetService(IID_PPV_ARGS(&renderClient)));
+
+	const UINT32 rate = format->nSamplesPerSec;
+	const UINT32 channels = format->nChannels;
+	const UINT64 intervalFrames = static_cast<UINT64>(rate) * BENCH_MARKER_INTERVAL_MS / 1000;
+	const UINT64 markerFrames = static_cast<UINT64>(rate) * BENCH_MARKER_MS / 1000;
+	const UINT64 totalFrames = static_cast<UINT64>(rate) * durationMs / 1000;
+
+	RETURN_IF_FAILED(audioClient->Start());
+
+	UINT64 written = 0;
+	while (written < totalFrames)
+	{
+		RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_TIMEOUT), WaitForSingleObject(bufferEvent.get(), 1000) != WAIT_OBJECT_0);
+
+		UINT32 padding = 0;
+		RETURN_IF_FAILED(audioClient->GetCurrentPadding(&padding));
+		const UINT32 frames = bufferFrames - padding;
+		if (frames == 0)
+		{
+			continue;
+		}
+
+		BYTE* pData = nullptr;
+		RETURN_IF_FAILED(renderClient->GetBuffer(frames, &pData));
+
+		// A burst that starts in this chunk reaches the engine once everything queued ahead of it has
+		const UINT64 now = GetQpcPosition();
+		INT64 markerIndex = -1;
+		UINT64 markerQpc = 0;
+		for (UINT32 f = 0; f < frames; f++)
+		{
+			const UINT64 frame = written + f;
+			const UINT64 position = frame % intervalFrames;
+			const double value = (position < markerFrames) ?
+				BENCH_MARKER_AMPLITUDE * sin(2.0 * BENCH_PI * BENCH_MARKER_HZ * position / rate) : 0.0;
+			if (position == 0)
+			{
+				markerIndex = static_cast<INT64>(frame / intervalFrames);
+				markerQpc = now + (static_cast<UINT64>(padding) + f) * QPC_HNS_PER_SEC / rate;
+			}
+
+			for (UINT32 c = 0; c < channels; c++)
+			{
+				if (sampleFormat == SampleFormat::Float32)
+				{
+					reinterpret_cast<float*>(pData)[f * channels + c] = static_cast<float>(value);
+				}
+				else
+				{
+					reinterpret_cast<INT16*>(pData)[f * channels + c] = static_cast<INT16>(value * 32767.0);
+				}
+			}
+		}
+
+		RETURN_IF_FAILED(renderClient->ReleaseBuffer(frames, 0));
+		written += frames;
+
+		if (markerIndex >= 0)
+		{
+			printf("marker %lld %llu\n", markerIndex, markerQpc);
+			fflush(stdout);
+		}
+	}
+
+	// Let the last buffer play out
+	Sleep(BENCH_RENDER_BUFFER_MS * 2);
+	audioClient->Stop();
+	return S_OK;
+}
+
+//
+//  Child processes
+//
+
+struct ChildProcess
+{
+	wil::unique_process_information Process;
+	wil::unique_handle Stdin;
+	wil::unique_handle Stdout;
+	wil::unique_handle Stderr;
+};
+
+// Our end of the pipe stays private; the child's end is inheritable.
+static HRESULT CreateChildPipe(bool childReads, wil::unique_handle& ours, wil::unique_handle& theirs)
+{
+	SECURITY_ATTRIBUTES attributes = { sizeof(attributes), nullptr, TRUE };
+	HANDLE hRead = nullptr;
+	HANDLE hWrite = nullptr;
+	RETURN_IF_WIN32_BOOL_FALSE(CreatePipe(&hRead, &hWrite, &attributes, 0));
+	ours.reset(childReads ? hWrite : hRead);
+	theirs.reset(childReads ? hRead : hWrite);
+	RETURN_IF_WIN32_BOOL_FALSE(SetHandleInformation(ours.get(), HANDLE_FLAG_INHERIT, 0));
+	return S_OK;
+}
+
+static HRESULT LaunchChild(const std::wstring& commandLine, bool redirectStdin, bool redirectStderr, ChildProcess& child)
+{
+	wil::unique_handle childStdin;
+	wil::unique_handle childStdout;
+	wil::unique_handle childStderr;
+	if (redirectStdin)
+	{
+		RETURN_IF_FAILED(CreateChildPipe(true, child.Stdin, childStdin));
+	}
+	RETURN_IF_FAILED(CreateChildPipe(false, child.Stdout, childStdout));
+	if (redirectStderr)
+	{
+		RETURN_IF_FAILED(CreateChildPipe(false, child.Stderr, childStderr));
+	}
+
+	STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+	startupInfo.dwFlags = STARTF_USESTDHANDLES;
+	startupInfo.hStdInput = childStdin.get();
+	startupInfo.hStdOutput = childStdout.get();
+	startupInfo.hStdError = redirectStderr ? childStderr.get() : GetStdHandle(STD_ERROR_HANDLE);
+
+	std::wstring mutableCommandLine = commandLine;
+	RETURN_IF_WIN32_BOOL_FALSE(CreateProcessW(nullptr, &mutableCommandLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr,
+		&startupInfo, &child.Process));
+	return S_OK;
+}
+
+static void WriteLine(HANDLE hPipe, const std::string& line)
+{
+	DWORD written = 0;
+	WriteFile(hPipe, line.data(), static_cast<DWORD>(line.size()), &written, nullptr);
+}
+
+// Calls onLine for every line the pipe delivers until it is closed.
+template <typename Callback>
+static void ReadLines(HANDLE hPipe, Callback onLine)
+{
+	std::string pending;
+	char buffer[4096];
+	DWORD read = 0;
+	while (ReadFile(hPipe, buffer, sizeof(buffer), &read, nullptr) && read > 0)
+	{
+		pending.append(buffer, read);
+		size_t end = 0;
+		while ((end = pending.find('\n')) != std::string::npos)
+		{
+			std::string line = pending.substr(0, end);
+			if (!line.empty() && line.back() == '\r')
+			{
+				line.pop_back();
+			}
+			onLine(line);
+			pending.erase(0, end + 1);
+		}
+	}
+}
+
+static UINT64 GetProcessCpuTime(HANDLE hProcess)
+{
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(hProcess, &creation, &exit, &kernel, &user))
+	{
+		return 0;
+	}
+	const UINT64 kernelTime = (static_cast<UINT64>(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+	const UINT64 userTime = (static_cast<UINT64>(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+	return kernelTime + userTime;
+}
+
+//
+//  CStreamMeter
+//
+//  Consumes one capture stream's framed records on its reader thread.  Records only count while
+//  the measurement window is open; results are read once the reader has finished.
+//
+class CStreamMeter
+{
+public:
+	struct Onset
+	{
+		UINT64 EngineQpc;
+		UINT64 DeliveredQpc;
+	};
+
+	void SetMeasuring(bool measuring) { m_Measuring.store(measuring, std::memory_order_release); }
+
+	void OnRecord(const LOOPBACK_FRAME_HEADER& header, const BYTE* pPayload)
+	{
+		const UINT64 delivered = GetQpcPosition();
+		if (header.Type == LOOPBACK_FRAME_FORMAT && header.PayloadSize >= sizeof(LOOPBACK_STREAM_HEADER))
+		{
+			memcpy(&m_Format, pPayload, sizeof(m_Format));
+			return;
+		}
+		if (header.Type != LOOPBACK_FRAME_AUDIO && header.Type != LOOPBACK_FRAME_SILENCE)
+		{
+			return;
+		}
+
+		const bool measuring = m_Measuring.load(std::memory_order_acquire);
+		const bool gap = m_HavePosition && header.DevicePosition != m_NextPosition;
+		if (measuring)
+		{
+			m_Records++;
+			m_Bytes += header.PayloadSize;
+			m_Frames += header.FrameCount;
+			if (gap || (header.Flags & LOOPBACK_FRAME_FLAG_DISCONTINUITY))
+			{
+				m_Glitches++;
+			}
+		}
+		m_NextPosition = header.DevicePosition + header.FrameCount;
+		m_HavePosition = true;
+
+		if (header.Type == LOOPBACK_FRAME_SILENCE)
+		{
+			m_QuietFrames += header.FrameCount;
+			return;
+		}
+		DetectOnsets(header, pPayload, delivered, measuring);
+	}
+
+	const std::vector<Onset>& GetOnsets() const { return m_Onsets; }
+	UINT64 GetBytes() const { return m_Bytes; }
+	UINT64 GetGlitches() const { return m_Glitches; }
+
+private:
+	void DetectOnsets(const LOOPBACK_FRAME_HEADER& header, const BYTE* pPayload, UINT64 delivered, bool measuring)
+	{
+		const UINT32 rate = m_Format.SamplesPerSec;
+		const bool isFloat = (m_Format.FormatTag == WAVE_FORMAT_IEEE_FLOAT && m_Format.BitsPerSample == 32);
+		const bool isInt16 = (m_Format.FormatTag == WAVE_FORMAT_PCM && m_Format.BitsPerSample == 16);
+		if (rate == 0 || m_Format.Channels == 0 || (!isFloat && !isInt16))
+		{
+			return;
+		}
+
+		const UINT64 quietNeeded = static_cast<UINT64>(rate) * BENCH_MARKER_INTERVAL_MS / 2000;
+		for (UINT32 f = 0; f < header.FrameCount; f++)
+		{
+			const size_t index = static_cast<size_t>(f) * m_Format.Channels;
+			const double value = isFloat ? reinterpret_cast<const float*>(pPayload)[index] :
+				reinterpret_cast<const INT16*>(pPayload)[index] / 32768.0;
+
+			if (fabs(value) < BENCH_ONSET_THRESHOLD)
+			{
+				m_QuietFrames++;
+				continue;
+			}
+			if (m_QuietFrames >= quietNeeded && measuring && !(header.Flags & LOOPBACK_FRAME_FLAG_TIMESTAMP_ERROR))
+			{
+				m_Onsets.push_back({ header.QpcPosition + static_cast<UINT64>(f) * QPC_HNS_PER_SEC / rate, delivered });
+			}
+			m_QuietFrames = 0;
+		}
+	}
+
+	std::atomic<bool> m_Measuring{ false };
+	LOOPBACK_STREAM_HEADER m_Format{};
+	bool m_HavePosition = false;
+	UINT64 m_NextPosition = 0;
+	UINT64 m_QuietFrames = 0;
+	UINT64 m_Records = 0;
+	UINT64 m_Bytes = 0;
+	UINT64 m_Frames = 0;
+	UINT64 m_Glitches = 0;
+	std::vector<Onset> m_Onsets;
+};
+
+// stdout and pipe modes: every stream's records interleave on the child's stdout.
+static void ReadFramedPipe(HANDLE hPipe, std::vector<std::unique_ptr<CStreamMeter>>& meters)
+{
+	std::vector<BYTE> pending;
+	BYTE buffer[64 * 1024];
+	DWORD read = 0;
+	while (ReadFile(hPipe, buffer, sizeof(buffer), &read, nullptr) && read > 0)
+	{
+		pending.insert(pending.end(), buffer, buffer + read);
+
+		size_t offset = 0;
+		while (pending.size() - offset >= sizeof(LOOPBACK_FRAME_HEADER))
+		{
+			LOOPBACK_FRAME_HEADER header;
+			memcpy(&header, pending.data() + offset, sizeof(header));
+			if (header.Magic != LOOPBACK_FRAME_MAGIC)
+			{
+				std::wcerr << L"Lost framing on the capture's stdout\n";
+				return;
+			}
+			if (pending.size() - offset < sizeof(header) + header.PayloadSize)
+			{
+				break;
+			}
+			if (header.StreamId < meters.size())
+			{
+				meters[header.StreamId]->OnRecord(header, pending.data() + offset + sizeof(header));
+			}
+			offset += sizeof(header) + header.PayloadSize;
+		}
+		pending.erase(pending.begin(), pending.begin() + offset);
+	}
+}
+
+// shm mode: each stream has its own "<name>.<id>" section, which only exists once the capture has started.
+static void ReadSharedRing(const std::wstring& name, CStreamMeter& meter, const std::atomic<bool>& stop)
+{
+	// The writer stamps Magic and creates the event after the section itself
+	wil::unique_handle mapping;
+	wil::unique_mapview_ptr<LOOPBACK_SHARED_RING_HEADER> view;
+	wil::unique_event_nothrow dataReady;
+	while (!dataReady)
+	{
+		if (stop.load(std::memory_order_acquire))
+		{
+			return;
+		}
+		if (!mapping)
+		{
+			mapping.reset(OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, name.c_str()));
+		}
+		if (mapping && !view)
+		{
+			view.reset(static_cast<LOOPBACK_SHARED_RING_HEADER*>(MapViewOfFile(mapping.get(), FILE_MAP_ALL_ACCESS, 0, 0, 0)));
+		}
+		if (!view || view->Magic != LOOPBACK_SHARED_RING_MAGIC || !dataReady.try_open((name + LOOPBACK_SHARED_RING_EVENT_SUFFIX).c_str(), SYNCHRONIZE))
+		{
+			Sleep(10);
+		}
+	}
+
+	LOOPBACK_SHARED_RING_HEADER* header = view.get();
+	CPacketRing ring;
+	ring.Attach(reinterpret_cast<BYTE*>(header) + header->HeaderSize, header->Capacity, &header->WritePosition, &header->ReadPosition);
+
+	// Records are committed whole, so a readable header means its payload is there too
+	std::vector<BYTE> payload;
+	for (;;)
+	{
+		const bool stopping = stop.load(std::memory_order_acquire);
+		while (ring.GetReadAvailable() >= sizeof(LOOPBACK_FRAME_HEADER))
+		{
+			LOOPBACK_FRAME_HEADER record;
+			ring.Read(&record, sizeof(record));
+			payload.resize(record.PayloadSize);
+			if (record.PayloadSize > 0)
+			{
+				ring.Read(payload.data(), record.PayloadSize);
+			}
+			meter.OnRecord(record, payload.data());
+		}
+		if (stopping)
+		{
+			break;
+		}
+		dataReady.wait(100);
+	}
+}
+
+//
+//  Scenarios
+//
+
+struct ScenarioResult
+{
+	std::vector<double> LatencyMs;
+	std::vector<double> EngineLatencyMs;
+	UINT64 MarkersRendered = 0;
+	UINT64 MarkersFound = 0;
+	UINT64 Glitches = 0;
+	UINT64 Bytes = 0;
+	double Seconds = 0.0;
+	double CpuPercentPerStream = 0.0;
+	UINT32 StreamsStarted = 0;
+};
+
+static double Percentile(std::vector<double> values, double percentile)
+{
+	if (values.empty())
+	{
+		return NAN;
+	}
+	std::sort(values.begin(), values.end());
+	return values[static_cast<size_t>(percentile * (values.size() - 1) + 0.5)];
+}
+
+//
+//  MatchMarkers()
+//
+//  Pairs every onset with the burst whose render time is nearest its engine timestamp, within half
+//  an interval, and counts the bursts rendered while the window was open.
+//
+static void MatchMarkers(const std::vector<UINT64>& markers, const std::vector<CStreamMeter::Onset>& onsets, UINT64 windowStart,
+	UINT64 windowEnd, ScenarioResult& result)
+{
+	const UINT64 tolerance = static_cast<UINT64>(BENCH_MARKER_INTERVAL_MS) * 10000 / 2;
+	for (UINT64 marker : markers)
+	{
+		if (marker >= windowStart && marker < windowEnd)
+		{
+			result.MarkersRendered++;
+		}
+	}
+
+	for (const auto& onset : onsets)
+	{
+		auto nearest = std::min_element(markers.begin(), markers.end(), [&onset](UINT64 a, UINT64 b)
+			{
+				return std::llabs(static_cast<INT64>(a - onset.EngineQpc)) < std::llabs(static_cast<INT64>(b - onset.EngineQpc));
+			});
+		if (nearest == markers.end() || std::llabs(static_cast<INT64>(*nearest - onset.EngineQpc)) > static_cast<INT64>(tolerance) ||
+			*nearest < windowStart || *nearest >= windowEnd)
+		{
+			continue;
+		}
+
+		result.MarkersFound++;
+		result.LatencyMs.push_back(static_cast<INT64>(onset.DeliveredQpc - *nearest) / 10000.0);
+		result.EngineLatencyMs.push_back(static_cast<INT64>(onset.EngineQpc - *nearest) / 10000.0);
+	}
+}
+
+static HRESULT RunScenario(const BenchmarkOptions& options, const std::wstring& output, UINT32 sessions, ScenarioResult& result)
+{
+	wchar_t selfPath[MAX_PATH];
+	GetModuleFileNameW(nullptr, selfPath, ARRAYSIZE(selfPath));
+
+	// One render helper per session, each reporting its bursts on a reader thread
+	const UINT32 renderMs = BENCH_SETTLE_MS + options.DurationMs + BENCH_SETTLE_MS;
+	std::vector<ChildProcess> helpers(sessions);
+	std::vector<std::vector<UINT64>> markers(sessions);
+	std::vector<std::thread> helperReaders;
+	auto joinHelpers = wil::scope_exit([&]()
+		{
+			for (auto& helper : helpers)
+			{
+				if (helper.Process.hProcess && WaitForSingleObject(helper.Process.hProcess, renderMs + BENCH_EXIT_TIMEOUT_MS) != WAIT_OBJECT_0)
+				{
+					TerminateProcess(helper.Process.hProcess, 1);
+				}
+			}
+			for (auto& reader : helperReaders)
+			{
+				reader.join();
+			}
+		});
+	for (UINT32 i = 0; i < sessions; i++)
+	{
+		RETURN_IF_FAILED(LaunchChild(L"\"" + std::wstring(selfPath) + L"\" --render " + std::to_wstring(renderMs), false, false, helpers[i]));
+		helperReaders.emplace_back([&, i]()
+			{
+				ReadLines(helpers[i].Stdout.get(), [&](const std::string& line)
+					{
+						long long index = 0;
+						unsigned long long qpc = 0;
+						if (sscanf_s(line.c_str(), "marker %lld %llu", &index, &qpc) == 2)
+						{
+							markers[i].push_back(qpc);
+						}
+					});
+			});
+	}
+
+	// The capture process under test
+	const std::wstring sharedMemoryName = L"Local\\LoopbackBenchmark." + std::to_wstring(GetCurrentProcessId());
+	std::wstring commandLine = L"\"" + options.CapturePath + L"\" --multi --output " + output;
+	if (output == L"shm")
+	{
+		commandLine += L" --shm-name " + sharedMemoryName;
+	}
+	if (!options.CaptureArguments.empty())
+	{
+		commandLine += L" " + options.CaptureArguments;
+	}
+
+	ChildProcess capture;
+	RETURN_IF_FAILED(LaunchChild(commandLine, true, true, capture));
+
+	std::vector<std::unique_ptr<CStreamMeter>> meters;
+	for (UINT32 i = 0; i < sessions; i++)
+	{
+		meters.push_back(std::make_unique<CStreamMeter>());
+	}
+
+	// Control replies; anything else the capture prints is passed through with --verbose
+	std::atomic<UINT32> replies{ 0 };
+	std::atomic<UINT32> started{ 0 };
+	wil::unique_event_nothrow allReplied;
+	RETURN_IF_FAILED(allReplied.create(wil::EventOptions::ManualReset));
+	std::thread stderrReader([&]()
+		{
+			ReadLines(capture.Stderr.get(), [&](const std::string& line)
+				{
+					const bool isStarted = (line.compare(0, 8, "started ") == 0);
+					if (isStarted || line.compare(0, 6, "error ") == 0)
+					{
+						started += isStarted ? 1 : 0;
+						if (++replies == sessions)
+						{
+							allReplied.SetEvent();
+						}
+					}
+					if (!isStarted && (options.Verbose || line.compare(0, 6, "error ") == 0))
+					{
+						std::cerr << "  capture: " << line << "\n";
+					}
+				});
+		});
+
+	std::atomic<bool> stopReaders{ false };
+	std::vector<std::thread> dataReaders;
+	if (output == L"shm")
+	{
+		for (UINT32 i = 0; i < sessions; i++)
+		{
+			dataReaders.emplace_back([&, i]() { ReadSharedRing(sharedMemoryName + L"." + std::to_wstring(i), *meters[i], stopReaders); });
+		}
+	}
+	else
+	{
+		dataReaders.emplace_back([&]() { ReadFramedPipe(capture.Stdout.get(), meters); });
+	}
+
+	for (UINT32 i = 0; i < sessions; i++)
+	{
+		WriteLine(capture.Stdin.get(), "start " + std::to_string(i) + " " + std::to_string(helpers[i].Process.dwProcessId) + " include\n");
+	}
+	allReplied.wait(BENCH_START_TIMEOUT_MS);
+	result.StreamsStarted = started.load();
+
+	// Measure once activation and the first buffers are out of the way
+	Sleep(BENCH_SETTLE_MS);
+	for (auto& meter : meters)
+	{
+		meter->SetMeasuring(true);
+	}
+	const UINT64 windowStart = GetQpcPosition();
+	const UINT64 cpuStart = GetProcessCpuTime(capture.Process.hProcess);
+
+	Sleep(options.DurationMs);
+
+	const UINT64 cpuEnd = GetProcessCpuTime(capture.Process.hProcess);
+	const UINT64 windowEnd = GetQpcPosition();
+	for (auto& meter : meters)
+	{
+		meter->SetMeasuring(false);
+	}
+
+	WriteLine(capture.Stdin.get(), "quit\n");
+	capture.Stdin.reset();
+	if (WaitForSingleObject(capture.Process.hProcess, BENCH_EXIT_TIMEOUT_MS) != WAIT_OBJECT_0)
+	{
+		std::wcerr << L"  capture didn't exit, terminating it\n";
+		TerminateProcess(capture.Process.hProcess, 1);
+	}
+	stopReaders.store(true, std::memory_order_release);
+	for (auto& reader : dataReaders)
+	{
+		reader.join();
+	}
+	stderrReader.join();
+	joinHelpers.reset();
+
+	result.Seconds = static_cast<double>(windowEnd - windowStart) / QPC_HNS_PER_SEC;
+	result.CpuPercentPerStream = (sessions > 0 && windowEnd > windowStart) ?
+		100.0 * static_cast<double>(cpuEnd - cpuStart) / static_cast<double>(windowEnd - windowStart) / sessions : 0.0;
+	for (UINT32 i = 0; i < sessions; i++)
+	{
+		MatchMarkers(markers[i], meters[i]->GetOnsets(), windowStart, windowEnd, result);
+		result.Glitches += meters[i]->GetGlitches();
+		result.Bytes += meters[i]->GetBytes();
+	}
+	return S_OK;
+}
+
+static void PrintResult(const std::wstring& output, UINT32 sessions, const ScenarioResult& result)
+{
+	const double minutes = result.Seconds / 60.0;
+	printf("%-7ls %8u %8u %9.2f %9.2f %9.2f %10.2f %7llu/%-7llu %10.2f %9.3f %9.2f\n",
+		output.c_str(), sessions, result.StreamsStarted,
+		Percentile(result.LatencyMs, 0.5), Percentile(result.LatencyMs, 0.95), Percentile(result.LatencyMs, 1.0),
+		Percentile(result.EngineLatencyMs, 0.5),
+		result.MarkersFound, result.MarkersRendered,
+		(minutes > 0.0 && sessions > 0) ? result.Glitches / minutes / sessions : 0.0,
+		result.Seconds > 0.0 ? result.Bytes / result.Seconds / (1024.0 * 1024.0) : 0.0,
+		result.CpuPercentPerStream);
+	fflush(stdout);
+}
+
+static void PrintUsage()
+{
+	std::wcout << L"Usage: LoopbackBenchmark.exe [options] [-- <ApplicationLoopback.exe options>]\n"
+		L"  --exe <path>              ApplicationLoopback.exe to test (default: next to this executable)\n"
+		L"  --duration-ms <ms>        Measurement time per scenario (default 10000); make it long to soak\n"
+		L"  --sessions <n,n,...>      Concurrent captures per scenario (default 1,4,16)\n"
+		L"  --output <mode,mode,...>  Output modes to test: stdout, pipe, shm (default all three)\n"
+		L"  --verbose                 Pass the capture's diagnostics through to stderr\n"
+		L"  --render <ms>             Internal: play the test signal and report its bursts\n";
+}
+
+template <typename T, typename Parse>
+static std::vector<T> SplitList(PCWSTR value, Parse parse)
+{
+	std::vector<T> items;
+	std::wstring list(value);
+	size_t start = 0;
+	while (start <= list.size())
+	{
+		const size_t end = (std::min)(list.find(L',', start), list.size());
+		if (end > start)
+		{
+			items.push_back(parse(list.substr(start, end - start)));
+		}
+		start = end + 1;
+	}
+	return items;
+}
+
+static bool ParseBenchmarkOptions(int argc, wchar_t* argv[], BenchmarkOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		PCWSTR option = argv[i];
+		PCWSTR value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+		if (wcscmp(option, L"--") == 0)
+		{
+			for (i++; i < argc; i++)
+			{
+				options.CaptureArguments += (options.CaptureArguments.empty() ? L"" : L" ") + std::wstring(argv[i]);
+			}
+		}
+		else if (wcscmp(option, L"--exe") == 0 && value != nullptr)
+		{
+			options.CapturePath = value;
+			i++;
+		}
+		else if (wcscmp(option, L"--duration-ms") == 0 && value != nullptr)
+		{
+			options.DurationMs = wcstoul(value, nullptr, 10);
+			if (options.DurationMs == 0)
+			{
+				std::wcerr << L"Invalid duration " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--sessions") == 0 && value != nullptr)
+		{
+			options.Sessions = SplitList<UINT32>(value, [](const std::wstring& item) { return wcstoul(item.c_str(), nullptr, 10); });
+			if (options.Sessions.empty() || std::find(options.Sessions.begin(), options.Sessions.end(), 0u) != options.Sessions.end())
+			{
+				std::wcerr << L"Invalid session counts " << value << L".\n";
+				return false;
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--output") == 0 && value != nullptr)
+		{
+			options.Outputs = SplitList<std::wstring>(value, [](const std::wstring& item) { return item; });
+			for (const auto& output : options.Outputs)
+			{
+				if (output != L"stdout" && output != L"pipe" && output != L"shm")
+				{
+					std::wcerr << L"Unknown output mode " << output << L".\n";
+					return false;
+				}
+			}
+			i++;
+		}
+		else if (wcscmp(option, L"--verbose") == 0)
+		{
+			options.Verbose = true;
+		}
+		else
+		{
+			PrintUsage();
+			return false;
+		}
+	}
+
+	if (options.CapturePath.empty())
+	{
+		wchar_t selfPath[MAX_PATH];
+		GetModuleFileNameW(nullptr, selfPath, ARRAYSIZE(selfPath));
+		options.CapturePath = selfPath;
+		options.CapturePath.erase(options.CapturePath.find_last_of(L'\\') + 1);
+		options.CapturePath += L"ApplicationLoopback.exe";
+	}
+	return true;
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+	if (argc == 3 && wcscmp(argv[1], L"--render") == 0)
+	{
+		const HRESULT hr = RunRenderer(wcstoul(argv[2], nullptr, 10));
+		if (FAILED(hr))
+		{
+			std::wcerr << L"Render helper failed: 0x" << std::hex << hr << L"\n";
+			return 1;
+		}
+		return 0;
+	}
+
+	BenchmarkOptions options;
+	if (!ParseBenchmarkOptions(argc, argv, options))
+	{
+		return 1;
+	}
+
+	printf("%-7s %8s %8s %9s %9s %9s %10s %15s %10s %9s %9s\n", "output", "sessions", "started", "p50 ms", "p95 ms", "max ms",
+		"engine ms", "markers", "glitch/min", "MB/s", "cpu%/str");
+
+	int exitCode = 0;
+	for (const auto& output : options.Outputs)
+	{
+		for (UINT32 sessions : options.Sessions)
+		{
+			ScenarioResult result;
+			const HRESULT hr = RunScenario(options, output, sessions, result);
+			if (FAILED(hr))
+			{
+				std::wcerr << output << L" x" << sessions << L" failed: 0x" << std::hex << hr << std::dec << L"\n";
+				exitCode = 1;
+				continue;
+			}
+			PrintResult(output, sessions, result);
+		}
+	}
+	return exitCode;
+}
@@ -1,17 +1,30 @@
 #include <shlobj.h>
+#include <cmath>
 #include <wchar.h>
 #include <iostream>
+#include <iomanip>
+#include <sstream>
 #include <audioclientactivationparams.h>
+#include <avrt.h>
 
 #include "LoopbackCapture.h"
+#include "Profiler.h"
+#include "Tracing.h"
 
 #define BITS_PER_BYTE 8
+#define OUTPUT_RING_MIN_BUFFERS 4
+#define REFTIMES_PER_MILLISEC 10000
+
+// Reactivation after the audio client was invalidated; attempt n waits n * CAPTURE_RECOVERY_RETRY_MS
+// first, so a default-device switch that is still settling gets a little over a second.
+#define CAPTURE_RECOVERY_ATTEMPTS 5
+#define CAPTURE_RECOVERY_RETRY_MS 100
 
 HRESULT CLoopbackCapture::SetDeviceStateErrorIfFailed(HRESULT hr)
 {
 	if (FAILED(hr))
 	{
-		m_DeviceState = DeviceState::Error;
+		SetDeviceState(DeviceState::Error);
 	}
 	return hr;
 }
@@ -21,31 +34,22 @@ HRESULT CLoopbackCapture::InitializeLoopbackCapture()
 	// Create events for sample ready or user stop
 	RETURN_IF_FAILED(m_SampleReadyEvent.create(wil::EventOptions::None));
 
-	// Initialize MF
-	RETURN_IF_FAILED(MFStartup(MF_VERSION, MFSTARTUP_LITE));
-
-	// Register MMCSS work queue
-	DWORD dwTaskID = 0;
-	RETURN_IF_FAILED(MFLockSharedWorkQueue(L"Capture", 0, &dwTaskID, &m_dwQueueID));
-
-	// Set the capture event work queue to use the MMCSS queue
-	m_xSampleReady.SetQueueID(m_dwQueueID);
-
 	// Create the completion event as auto-reset
 	RETURN_IF_FAILED(m_hActivateCompleted.create(wil::EventOptions::None));
 
 	// Create the capture-stopped event as auto-reset
 	RETURN_IF_FAILED(m_hCaptureStopped.create(wil::EventOptions::None));
 
-	return S_OK;
-}
+	// Set once OnStartCapture has run, and left set: a stop waits on it rather than finding Starting
+	RETURN_IF_FAILED(m_hStartCompleted.create(wil::EventOptions::ManualReset));
 
-CLoopbackCapture::~CLoopbackCapture()
-{
-	if (m_dwQueueID != 0)
-	{
-		MFUnlockWorkQueue(m_dwQueueID);
-	}
+	// Create the pause/resume completion event as auto-reset
+	RETURN_IF_FAILED(m_hTransitionCompleted.create(wil::EventOptions::None));
+
+	// Tells the capture thread, if there is one, to leave its loop
+	RETURN_IF_FAILED(m_StopThreadEvent.create(wil::EventOptions::ManualReset));
+
+	return S_OK;
 }
 
 HRESULT CLoopbackCapture::ActivateAudioInterface(DWORD processId, bool includeProcessTree)
@@ -73,6 +77,177 @@ HRESULT CLoopbackCapture::ActivateAudioInterface(DWORD processId, bool includePr
 		}());
 }
 
+//
+//  InitializeCaptureFormat()
+//
+//  Fills m_CaptureFormat for the requested sample format.  16-bit PCM is fixed at 48 kHz stereo.  For
+//  float32 the stream takes the engine's mix format (rate, channel count and layout) so the samples
+//  reach us exactly as the engine mixed them, with no resampling or quantization on the way.
+//
+HRESULT CLoopbackCapture::InitializeCaptureFormat()
+{
+	m_CaptureFormat = {};
+	WAVEFORMATEX& format = m_CaptureFormat.Format;
+
+	if (m_Options.Format == SampleFormat::Float32)
+	{
+		wil::unique_cotaskmem_ptr<WAVEFORMATEX> mixFormat;
+		RETURN_IF_FAILED(GetEngineMixFormat(wil::out_param(mixFormat)));
+
+		format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+		format.nChannels = mixFormat->nChannels;
+		format.nSamplesPerSec = mixFormat->nSamplesPerSec;
+		format.wBitsPerSample = 32;
+		format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+		m_CaptureFormat.Samples.wValidBitsPerSample = 32;
+		m_CaptureFormat.SubFormat = KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+
+		if (mixFormat->wFormatTag == WAVE_FORMAT_EXTENSIBLE && mixFormat->cbSize >= format.cbSize)
+		{
+			m_CaptureFormat.dwChannelMask = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(mixFormat.get())->dwChannelMask;
+		}
+		else
+		{
+			m_CaptureFormat.dwChannelMask = (format.nChannels == 2) ? KSAUDIO_SPEAKER_STEREO : 0;
+		}
+	}
+	else
+	{
+		// 16 - bit PCM format.
+		format.wFormatTag = WAVE_FORMAT_PCM;
+		format.nChannels = 2;
+		format.nSamplesPerSec = 48000;
+		format.wBitsPerSample = 16;
+	}
+
+	format.nBlockAlign = format.nChannels * format.wBitsPerSample / BITS_PER_BYTE;
+	format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
+
+	std::wcerr << L"Capture format: " << (m_Options.Format == SampleFormat::Float32 ? L"float32 " : L"pcm16 ")
+		<< format.nSamplesPerSec << L" Hz, " << format.nChannels << L" ch\n";
+
+	return S_OK;
+}
+
+//
+//  GetEngineMixFormat()
+//
+//  Process loopback clients don't implement GetMixFormat, so fall back to the default render endpoint,
+//  which is what the engine mixes the target's audio into.
+//
+HRESULT CLoopbackCapture::GetEngineMixFormat(WAVEFORMATEX** ppMixFormat)
+{
+	if (SUCCEEDED(m_AudioClient->GetMixFormat(ppMixFormat)))
+	{
+		return S_OK;
+	}
+
+	wil::com_ptr_nothrow<IMMDeviceEnumerator> enumerator;
+	RETURN_IF_FAILED(CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&enumerator)));
+
+	wil::com_ptr_nothrow<IMMDevice> device;
+	RETURN_IF_FAILED(enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device));
+
+	wil::com_ptr_nothrow<IAudioClient> endpointClient;
+	RETURN_IF_FAILED(device->Activate(__uuidof(IAudioClient), CLSCTX_INPROC_SERVER, nullptr, endpointClient.put_void()));
+
+	return endpointClient->GetMixFormat(ppMixFormat);
+}
+
+//
+//  InitializeAudioClient()
+//
+//  Initializes m_AudioClient in shared mode.  The process loopback device hands back whatever format
+//  was asked for, so no AUTOCONVERTPCM flag is involved.  When an event period was requested the
+//  stream goes through IAudioClient3::InitializeSharedAudioStream, the only way below the engine's
+//  default period in shared mode; if that isn't available we fall back to IAudioClient::Initialize
+//  with the requested buffer duration (and, as shared mode requires, a periodicity of 0).
+//
+HRESULT CLoopbackCapture::InitializeAudioClient()
+{
+	const DWORD streamFlags = AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_EVENTCALLBACK;
+
+	if (m_Options.UseMinimumPeriod || m_Options.PeriodMs > 0.0)
+	{
+		HRESULT hr = InitializeLowLatencyStream(streamFlags);
+		if (SUCCEEDED(hr))
+		{
+			return S_OK;
+		}
+		std::wcerr << L"IAudioClient3 shared stream unavailable (0x" << std::hex << hr << std::dec << L"), using IAudioClient::Initialize\n";
+	}
+
+	const REFERENCE_TIME hnsBufferDuration = static_cast<REFERENCE_TIME>(m_Options.BufferDurationMs * REFTIMES_PER_MILLISEC);
+	return m_AudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED, streamFlags, hnsBufferDuration, 0, &m_CaptureFormat.Format, nullptr);
+}
+
+//
+//  InitializeLowLatencyStream()
+//
+//  Picks the requested period (rounded to the engine's fundamental period and clamped to the range it
+//  supports), or the minimum period, and initializes the stream with it.
+//
+HRESULT CLoopbackCapture::InitializeLowLatencyStream(DWORD streamFlags)
+{
+	wil::com_ptr_nothrow<IAudioClient3> audioClient3;
+	RETURN_IF_FAILED(m_AudioClient.query_to(&audioClient3));
+
+	UINT32 defaultPeriod = 0;
+	UINT32 fundamentalPeriod = 0;
+	UINT32 minPeriod = 0;
+	UINT32 maxPeriod = 0;
+	RETURN_IF_FAILED(audioClient3->GetSharedModeEnginePeriod(&m_CaptureFormat.Format, &defaultPeriod, &fundamentalPeriod, &minPeriod, &maxPeriod));
+	RETURN_HR_IF(E_UNEXPECTED, fundamentalPeriod == 0 || minPeriod == 0);
+
+	UINT32 periodFrames = minPeriod;
+	if (!m_Options.UseMinimumPeriod)
+	{
+		const UINT32 requestedFrames = static_cast<UINT32>(m_Options.PeriodMs * m_CaptureFormat.Format.nSamplesPerSec / 1000.0);
+		periodFrames = ((requestedFrames + fundamentalPeriod / 2) / fundamentalPeriod) * fundamentalPeriod;
+		periodFrames = min(max(periodFrames, minPeriod), maxPeriod);
+	}
+
+	return audioClient3->InitializeSharedAudioStream(streamFlags, periodFrames, &m_CaptureFormat.Format, nullptr);
+}
+
+//
+//  ReportNegotiatedLatency()
+//
+//  Prints the event period, buffer size and stream latency the engine actually granted, so the
+//  latency can be compared across machines.
+//
+void CLoopbackCapture::ReportNegotiatedLatency()
+{
+	const double framesPerMs = m_CaptureFormat.Format.nSamplesPerSec / 1000.0;
+	double periodMs = 0.0;
+
+	UINT32 periodFrames = 0;
+	wil::unique_cotaskmem_ptr<WAVEFORMATEX> currentFormat;
+	wil::com_ptr_nothrow<IAudioClient3> audioClient3;
+	if (SUCCEEDED(m_AudioClient.query_to(&audioClient3)) &&
+		SUCCEEDED(audioClient3->GetCurrentSharedModeEnginePeriod(wil::out_param(currentFormat), &periodFrames)) && periodFrames > 0)
+	{
+		periodMs = periodFrames / framesPerMs;
+	}
+	else
+	{
+		REFERENCE_TIME hnsDefaultPeriod = 0;
+		if (SUCCEEDED(m_AudioClient->GetDevicePeriod(&hnsDefaultPeriod, nullptr)))
+		{
+			periodMs = static_cast<double>(hnsDefaultPeriod) / REFTIMES_PER_MILLISEC;
+		}
+	}
+
+	REFERENCE_TIME hnsStreamLatency = 0;
+	m_AudioClient->GetStreamLatency(&hnsStreamLatency);
+
+	std::wcerr << std::fixed << std::setprecision(2)
+		<< L"Capture latency: period " << periodMs << L" ms, buffer " << m_BufferFrames << L" frames ("
+		<< (m_BufferFrames / framesPerMs) << L" ms), stream latency "
+		<< (static_cast<double>(hnsStreamLatency) / REFTIMES_PER_MILLISEC) << L" ms\n"
+		<< std::defaultfloat;
+}
+
 //
 //  ActivateCompleted()
 //
@@ -92,25 +267,43 @@ HRESULT CLoopbackCapture::ActivateCompleted(IActivateAudioInterfaceAsyncOperatio
 			// Get the pointer for the Audio Client
 			RETURN_IF_FAILED(punkAudioInterface.copy_to(&m_AudioClient));
 
-			// The app can also call m_AudioClient->GetMixFormat instead to get the capture format.
-			// 16 - bit PCM format.
-			m_CaptureFormat.wFormatTag = WAVE_FORMAT_PCM;
-			m_CaptureFormat.nChannels = 2;
-			m_CaptureFormat.nSamplesPerSec = 48000;
-			m_CaptureFormat.wBitsPerSample = 16;
-			m_CaptureFormat.nBlockAlign = m_CaptureFormat.nChannels * m_CaptureFormat.wBitsPerSample / BITS_PER_BYTE;
-			m_CaptureFormat.nAvgBytesPerSec = m_CaptureFormat.nSamplesPerSec * m_CaptureFormat.nBlockAlign;
-
-			// Initialize the AudioClient in Shared Mode with the user specified buffer
-			RETURN_IF_FAILED(m_AudioClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
-				AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
-				200000,
-				AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM,
-				&m_CaptureFormat,
-				nullptr));
+			RETURN_IF_FAILED(InitializeCaptureFormat());
+
+			// Initialize the AudioClient in Shared Mode with the user specified buffer and period
+			RETURN_IF_FAILED(InitializeAudioClient());
+
+			// Precompute the silence gate's thresholds and kernels for this format
+			RETURN_IF_FAILED(m_SilenceGate.Initialize(&m_CaptureFormat.Format, m_Options.SilenceThresholdDb, m_Options.SilenceHysteresisDb,
+				m_Options.SilenceDetect, m_Options.SilenceAttackMs, m_Options.SilenceHangoverMs));
+			// A retarget or recovery starts the gate closed again, with no close to count
+			m_Stats->RecordGateState(m_SilenceGate.IsOpen());
+			if (m_Options.MeterIntervalMs != 0)
+			{
+				RETURN_IF_FAILED(m_Meter.Initialize(&m_CaptureFormat.Format, m_Options.MeterIntervalMs, m_Options.MeterLoudness));
+			}
 
 			// Get the maximum size of the AudioClient Buffer
 			RETURN_IF_FAILED(m_AudioClient->GetBufferSize(&m_BufferFrames));
+			ReportNegotiatedLatency();
+
+			// Open the sink with its ring preallocated: at least a second of audio and never less than a few
+			// full engine buffers, so a reader that stalls briefly costs nothing on the capture thread.  No
+			// packet is ever larger than one full engine buffer.
+			// A retargeted capture keeps the sink it has, so the new client must produce what it was sized for.
+			const UINT32 cbMaxPacket = m_BufferFrames * m_CaptureFormat.Format.nBlockAlign;
+			if (m_Sink)
+			{
+				RETURN_HR_IF(AUDCLNT_E_UNSUPPORTED_FORMAT, memcmp(&m_CaptureFormat, &m_SinkFormat, sizeof(m_CaptureFormat)) != 0 ||
+					cbMaxPacket > m_cbSinkMaxPacket);
+			}
+			else
+			{
+				RETURN_IF_FAILED(m_pSinkProvider->OpenSink(m_StreamId, m_CaptureFormat.Format,
+					max(m_CaptureFormat.Format.nAvgBytesPerSec, OUTPUT_RING_MIN_BUFFERS * cbMaxPacket), cbMaxPacket,
+					m_Options.WriteStreamHeader, m_Sink));
+				m_SinkFormat = m_CaptureFormat;
+				m_cbSinkMaxPacket = cbMaxPacket;
+			}
 
 			// Get the capture client
 			RETURN_IF_FAILED(m_AudioClient->GetService(IID_PPV_ARGS(&m_AudioCaptureClient)));
@@ -122,68 +315,162 @@ HRESULT CLoopbackCapture::ActivateCompleted(IActivateAudioInterfaceAsyncOperatio
 			RETURN_IF_FAILED(m_AudioClient->SetEventHandle(m_SampleReadyEvent.get()));
 
 			// Everything is ready.
-			m_DeviceState = DeviceState::Initialized;
+			SetDeviceState(DeviceState::Initialized);
 
 			return S_OK;
 		}());
 
+	TraceLoggingWrite(g_hLoopbackTraceProvider, "ActivateCompleted",
+		TraceLoggingLevel(WINEVENT_LEVEL_INFO), TraceLoggingKeyword(TRACE_KEYWORD_CAPTURE),
+		TraceLoggingUInt32(m_StreamId, "StreamId"),
+		TraceLoggingUInt32(m_Options.ProcessId, "ProcessId"),
+		TraceLoggingHResult(m_activateResult, "HResult"),
+		TraceLoggingUInt32(m_CaptureFormat.Format.nSamplesPerSec, "SamplesPerSec"),
+		TraceLoggingUInt32(m_CaptureFormat.Format.nChannels, "Channels"),
+		TraceLoggingUInt32(m_BufferFrames, "BufferFrames"));
+
 	// Let ActivateAudioInterface know that m_activateResult has the result of the activation attempt.
 	m_hActivateCompleted.SetEvent();
 	return S_OK;
 }
 
-HRESULT CLoopbackCapture::StartCaptureAsync(DWORD processId, bool includeProcessTree)
+HRESULT CLoopbackCapture::StartCaptureAsync(const CaptureOptions& options, UINT32 streamId, DWORD dwQueueID, CCaptureSinkProvider* pSinkProvider,
+	CAudioSessionMonitor* pSessionMonitor)
 {
+	m_Options = options;
+	m_StreamId = streamId;
+	m_pSinkProvider = pSinkProvider;
+	m_pSessionMonitor = (options.IdleAfterMs != 0) ? pSessionMonitor : nullptr;
+	m_Stats = std::make_shared<CCaptureStats>();
+
+	// Sample-ready callbacks of every capture in the process run on the host's MMCSS work queue
+	m_xSampleReady.SetQueueID(dwQueueID);
+
 	RETURN_IF_FAILED(InitializeLoopbackCapture());
-	RETURN_IF_FAILED(ActivateAudioInterface(processId, includeProcessTree));
+
+	HRESULT hr = ActivateAudioInterface(m_Options.ProcessId, m_Options.IncludeProcessTree);
+	if (FAILED(hr))
+	{
+		// Activation may have failed after the sink was opened; don't leave it dangling
+		m_pSinkProvider->CloseSink(m_Sink);
+		m_Sink.reset();
+		return hr;
+	}
 
 	// We should be in the initialzied state if this is the first time through getting ready to capture.
-	if (m_DeviceState == DeviceState::Initialized)
+	if (GetDeviceState() == DeviceState::Initialized)
 	{
-		m_DeviceState = DeviceState::Starting;
-		return MFPutWorkItem2(MFASYNC_CALLBACK_QUEUE_MULTITHREADED, 0, &m_xStartCapture, nullptr);
+		SetDeviceState(DeviceState::Starting);
+		hr = MFPutWorkItem2(MFASYNC_CALLBACK_QUEUE_MULTITHREADED, 0, &m_xStartCapture, nullptr);
+		if (FAILED(hr))
+		{
+			// Nothing will ever start or stop this capture, so don't leave its sink open either
+			SetDeviceState(DeviceState::Error);
+			m_pSinkProvider->CloseSink(m_Sink);
+			m_Sink.reset();
+			return hr;
+		}
 	}
 
+	WatchTargetProcess(m_Options.ProcessId);
 	return S_OK;
 }
 
 //
 //  OnStartCapture()
 //
-//  Callback method to start capture
+//  Callback method to start capture.  An idle capture starts out idle: the audio client is only
+//  started once the session monitor hears the target.
 //
 HRESULT CLoopbackCapture::OnStartCapture(IMFAsyncResult* pResult)
 {
-	return SetDeviceStateErrorIfFailed([&]()->HRESULT
+	auto lock = m_TransitionLock.lock();
+	const HRESULT hr = SetDeviceStateErrorIfFailed([&]()->HRESULT
 		{
+			// The thread waits on the buffer event whether or not the client is running
+			if (m_Options.Engine == CaptureEngine::Thread)
+			{
+				m_CaptureThread.reset(CreateThread(nullptr, 0, CLoopbackCapture::CaptureThreadProc, this, 0, nullptr));
+				RETURN_LAST_ERROR_IF(!m_CaptureThread);
+			}
+
+			if (m_pSessionMonitor != nullptr)
+			{
+				SetDeviceState(DeviceState::Idle);
+				m_IdleEntered = true;
+				m_pSessionMonitor->Watch(this, m_Options.ProcessId, m_Options.IncludeProcessTree,
+					static_cast<float>(pow(10.0, m_Options.SilenceThresholdDb / 20.0)));
+				ReportStatus(L"idle", m_Options.ProcessId, S_OK);
+				return S_OK;
+			}
+
 			// Start the capture
 			RETURN_IF_FAILED(m_AudioClient->Start());
 
-			m_DeviceState = DeviceState::Capturing;
-			MFPutWaitingWorkItem(m_SampleReadyEvent.get(), 0, m_SampleReadyAsyncResult.get(), &m_SampleReadyKey);
+			m_LastAudibleQpc = GetQpcPosition();
+			SetDeviceState(DeviceState::Capturing);
+			if (m_Options.Engine != CaptureEngine::Thread)
+			{
+				MFPutWaitingWorkItem(m_SampleReadyEvent.get(), 0, m_SampleReadyAsyncResult.get(), &m_SampleReadyKey);
+			}
 
 			return S_OK;
 		}());
+
+	TraceLoggingWrite(g_hLoopbackTraceProvider, "OnStartCapture",
+		TraceLoggingLevel(WINEVENT_LEVEL_INFO), TraceLoggingKeyword(TRACE_KEYWORD_CAPTURE),
+		TraceLoggingUInt32(m_StreamId, "StreamId"),
+		TraceLoggingUInt32(m_Options.ProcessId, "ProcessId"),
+		TraceLoggingHResult(hr, "HResult"),
+		TraceLoggingBool(GetDeviceState() == DeviceState::Idle, "Idle"),
+		TraceLoggingWideString(m_Options.Engine == CaptureEngine::Thread ? L"thread" : L"workqueue", "Engine"));
+
+	m_hStartCompleted.SetEvent();
+	return hr;
 }
 
 
 //
 //  StopCaptureAsync()
 //
-//  Stop capture asynchronously via MF Work Item
+//  Stop capture asynchronously via MF Work Item.  A stop that comes in while OnStartCapture is still
+//  queued waits for it first, outside the lock it takes; otherwise the capture would start running
+//  after its host had already let go of it.
 //
 HRESULT CLoopbackCapture::StopCaptureAsync()
 {
-	RETURN_HR_IF(E_NOT_VALID_STATE, (m_DeviceState != DeviceState::Capturing) &&
-		(m_DeviceState != DeviceState::Error));
+	if (GetDeviceState() == DeviceState::Starting)
+	{
+		m_hStartCompleted.wait();
+	}
+
+	auto lock = m_TransitionLock.lock();
+
+	// A recovery or idle transition still queued finds the capture stopped and leaves it alone
+	const DeviceState state = GetDeviceState();
+	RETURN_HR_IF(E_NOT_VALID_STATE, (state != DeviceState::Capturing) && (state != DeviceState::Paused) &&
+		(state != DeviceState::Recovering) && (state != DeviceState::Idle) && (state != DeviceState::Error));
+
+	StopWatchingTargetProcess();
+	if (m_pSessionMonitor != nullptr)
+	{
+		m_pSessionMonitor->Unwatch(this);
+		m_IdleEntered = false;
+	}
 
-	m_DeviceState = DeviceState::Stopping;
+	// Sequentially consistent, pairing with EnterCallback: from here on every callback either sees
+	// Stopping and backs out, or OnStopCapture sees it running and waits for it.
+	m_DeviceState.store(DeviceState::Stopping, std::memory_order_seq_cst);
 
 	RETURN_IF_FAILED(MFPutWorkItem2(MFASYNC_CALLBACK_QUEUE_MULTITHREADED, 0, &m_xStopCapture, nullptr));
 
 	// Wait for capture to stop
 	m_hCaptureStopped.wait();
 
+	// Let the sink drain whatever is still buffered and then drop it
+	m_pSinkProvider->CloseSink(m_Sink);
+	m_Sink.reset();
+
 	return S_OK;
 }
 
@@ -194,6 +481,9 @@ HRESULT CLoopbackCapture::StopCaptureAsync()
 //
 HRESULT CLoopbackCapture::OnStopCapture(IMFAsyncResult* pResult)
 {
+	// Once the callback in flight (if any) has left, none will re-queue itself or touch the sink
+	WaitForCallbackToLeave();
+
 	// Stop capture by cancelling Work Item
 	// Cancel the queued work item (if any)
 	if (0 != m_SampleReadyKey)
@@ -202,12 +492,447 @@ HRESULT CLoopbackCapture::OnStopCapture(IMFAsyncResult* pResult)
 		m_SampleReadyKey = 0;
 	}
 
-	m_AudioClient->Stop();
+	// Or tell the capture thread to leave its loop
+	if (m_CaptureThread)
+	{
+		m_StopThreadEvent.SetEvent();
+		WaitForSingleObject(m_CaptureThread.get(), INFINITE);
+		m_CaptureThread.reset();
+	}
+
+	// A failed retarget or recovery can leave no client behind
+	if (m_AudioClient)
+	{
+		m_AudioClient->Stop();
+	}
 	m_SampleReadyAsyncResult.reset();
 
 	return FinishCaptureAsync();
 }
 
+//
+//  RunTransition()
+//
+//  Runs a pause or resume work item and waits for its result.  Like stopping, the audio client is
+//  only driven from MF threads, so an STA caller (the addon in Electron) is never the one touching it.
+//
+HRESULT CLoopbackCapture::RunTransition(IMFAsyncCallback* pCallback)
+{
+	RETURN_IF_FAILED(MFPutWorkItem2(MFASYNC_CALLBACK_QUEUE_MULTITHREADED, 0, pCallback, nullptr));
+	m_hTransitionCompleted.wait();
+	return m_transitionResult;
+}
+
+//
+//  PauseCaptureAsync()
+//
+//  Stops the audio client, leaving the sink, the events and the capture thread in place.  An idle
+//  capture's client is stopped already; it just stops waiting for the target.
+//
+HRESULT CLoopbackCapture::PauseCaptureAsync()
+{
+	auto lock = m_TransitionLock.lock();
+	RETURN_IF_FAILED(CompletePendingTransitions());
+
+	if (GetDeviceState() == DeviceState::Idle)
+	{
+		m_pSessionMonitor->Unwatch(this);
+		m_IdleEntered = false;
+		SetDeviceState(DeviceState::Paused);
+		return S_OK;
+	}
+	RETURN_HR_IF(E_NOT_VALID_STATE, GetDeviceState() != DeviceState::Capturing);
+
+	// As in StopCaptureAsync: from here on callbacks back out without re-queuing themselves
+	m_DeviceState.store(DeviceState::Paused, std::memory_order_seq_cst);
+
+	return RunTransition(&m_xPauseCapture);
+}
+
+//
+//  OnPauseCapture()
+//
+//  Callback method to pause capture.  Whatever the engine buffered is thrown away, so a resume starts
+//  with current audio rather than the moment the capture was paused.
+//
+HRESULT CLoopbackCapture::OnPauseCapture(IMFAsyncResult* pResult)
+{
+	WaitForCallbackToLeave();
+
+	if (0 != m_SampleReadyKey)
+	{
+		MFCancelWorkItem(m_SampleReadyKey);
+		m_SampleReadyKey = 0;
+	}
+
+	m_transitionResult = SetDeviceStateErrorIfFailed([&]()->HRESULT
+		{
+			RETURN_IF_FAILED(m_AudioClient->Stop());
+			RETURN_IF_FAILED(m_AudioClient->Reset());
+			return S_OK;
+		}());
+
+	m_hTransitionCompleted.SetEvent();
+	return S_OK;
+}
+
+//
+//  ResumeCaptureAsync()
+//
+//  Starts a paused capture again.
+//
+HRESULT CLoopbackCapture::ResumeCaptureAsync()
+{
+	auto lock = m_TransitionLock.lock();
+	RETURN_HR_IF(E_NOT_VALID_STATE, GetDeviceState() != DeviceState::Paused);
+
+	m_DiscontinuityPending.store(true, std::memory_order_release);
+	return RunTransition(&m_xResumeCapture);
+}
+
+//
+//  OnResumeCapture()
+//
+//  Callback method to resume capture.  The capture thread, if there is one, never stopped waiting.
+//
+HRESULT CLoopbackCapture::OnResumeCapture(IMFAsyncResult* pResult)
+{
+	m_transitionResult = SetDeviceStateErrorIfFailed([&]()->HRESULT
+		{
+			RETURN_IF_FAILED(m_AudioClient->Start());
+
+			// The idle time counts from here
+			m_LastAudibleQpc = GetQpcPosition();
+			SetDeviceState(DeviceState::Capturing);
+			if (m_Options.Engine != CaptureEngine::Thread)
+			{
+				MFPutWaitingWorkItem(m_SampleReadyEvent.get(), 0, m_SampleReadyAsyncResult.get(), &m_SampleReadyKey);
+			}
+			return S_OK;
+		}());
+
+	m_hTransitionCompleted.SetEvent();
+	return S_OK;
+}
+
+//
+//  RetargetCaptureAsync()
+//
+//  Pauses the capture, activates a process loopback client for the new target on the events and
+//  work queue set up by InitializeLoopbackCapture, and resumes if the capture was running.  Costs
+//  one activation instead of a new process.
+//
+HRESULT CLoopbackCapture::RetargetCaptureAsync(DWORD processId, bool includeProcessTree)
+{
+	auto lock = m_TransitionLock.lock();
+	RETURN_IF_FAILED(CompletePendingTransitions());
+
+	const DeviceState state = GetDeviceState();
+	RETURN_HR_IF(E_NOT_VALID_STATE, (state != DeviceState::Capturing) && (state != DeviceState::Paused) && (state != DeviceState::Idle));
+
+	// An idle capture comes back running and goes idle again once the new target has been quiet
+	const bool wasCapturing = (state == DeviceState::Capturing) || (state == DeviceState::Idle);
+	if (wasCapturing)
+	{
+		RETURN_IF_FAILED(PauseCaptureAsync());
+	}
+
+	RETURN_IF_FAILED(Reactivate(processId, includeProcessTree));
+	WatchTargetProcess(processId);
+
+	if (wasCapturing)
+	{
+		return ResumeCaptureAsync();
+	}
+
+	// Resuming later flags the gap
+	return S_OK;
+}
+
+//
+//  Reactivate()
+//
+//  Activates a new process loopback client on the existing events, work queue and sink, leaving the
+//  capture paused.  The old client must already be stopped.
+//
+HRESULT CLoopbackCapture::Reactivate(DWORD processId, bool includeProcessTree)
+{
+	// ActivateCompleted sets these up again for the new client
+	m_AudioCaptureClient.reset();
+	m_AudioClient.reset();
+
+	m_Options.ProcessId = processId;
+	m_Options.IncludeProcessTree = includeProcessTree;
+	RETURN_IF_FAILED(ActivateAudioInterface(processId, includeProcessTree));
+	SetDeviceState(DeviceState::Paused);
+	return S_OK;
+}
+
+// Failures after which a freshly activated client is expected to work again.
+static bool IsRecoverableError(HRESULT hr)
+{
+	return hr == AUDCLNT_E_DEVICE_INVALIDATED || hr == AUDCLNT_E_SERVICE_NOT_RUNNING || hr == AUDCLNT_E_RESOURCES_INVALIDATED;
+}
+
+//
+//  HandleCaptureFailure()
+//
+//  Called by the capture callback or thread, still inside EnterCallback, when reading the engine
+//  failed.  A client that was invalidated is handed to OnRecoverCapture; anything else leaves the
+//  capture in error.  Returns true if recovery was queued.  If a stop or pause got in first, the
+//  failure is theirs to deal with and the state is left alone.
+//
+bool CLoopbackCapture::HandleCaptureFailure(HRESULT hr)
+{
+	const bool recoverable = IsRecoverableError(hr);
+	DeviceState expected = DeviceState::Capturing;
+	if (!m_DeviceState.compare_exchange_strong(expected, recoverable ? DeviceState::Recovering : DeviceState::Error, std::memory_order_seq_cst))
+	{
+		return false;
+	}
+
+	if (recoverable)
+	{
+		ReportStatus(L"recovering", m_Options.ProcessId, hr);
+		if (SUCCEEDED(MFPutWorkItem2(MFASYNC_CALLBACK_QUEUE_MULTITHREADED, 0, &m_xRecoverCapture, nullptr)))
+		{
+			return true;
+		}
+		SetDeviceState(DeviceState::Error);
+	}
+
+	ReportStatus(L"failed", m_Options.ProcessId, hr);
+	return false;
+}
+
+//
+//  OnRecoverCapture()
+//
+//  Callback method to recover an invalidated capture, unless a transition on the host's thread has
+//  already done it or stopped the capture.
+//
+HRESULT CLoopbackCapture::OnRecoverCapture(IMFAsyncResult* pResult)
+{
+	auto lock = m_TransitionLock.lock();
+	CompletePendingTransitions();
+	return S_OK;
+}
+
+//
+//  CompletePendingTransitions()
+//
+//  Finishes a recovery or an idle transition the capture callback has started but whose work item
+//  hasn't run yet, so the caller finds the capture in a settled state.  Called with
+//  m_TransitionLock held; the queued work item then finds nothing left to do.
+//
+HRESULT CLoopbackCapture::CompletePendingTransitions()
+{
+	const DeviceState state = GetDeviceState();
+	if (state == DeviceState::Recovering)
+	{
+		return Recover();
+	}
+	if (state == DeviceState::Idle && !m_IdleEntered)
+	{
+		return EnterIdle();
+	}
+	return S_OK;
+}
+
+//
+//  Recover()
+//
+//  Activates the same target again in place and resumes, so the consumer sees one stream with a
+//  discontinuity instead of an error and a new process.  Activation can fail while the new default
+//  device is still coming up, so it is retried a few times.  A client whose format no longer fits
+//  the sink (a float capture on a device with another mix format) can't be recovered in place.
+//  Called with m_TransitionLock held.
+//
+HRESULT CLoopbackCapture::Recover()
+{
+	// Callbacks back out while Recovering; the failed one didn't re-queue itself
+	WaitForCallbackToLeave();
+	if (0 != m_SampleReadyKey)
+	{
+		MFCancelWorkItem(m_SampleReadyKey);
+		m_SampleReadyKey = 0;
+	}
+	if (m_AudioClient)
+	{
+		m_AudioClient->Stop();
+	}
+
+	HRESULT hr = E_UNEXPECTED;
+	for (UINT32 attempt = 1; attempt <= CAPTURE_RECOVERY_ATTEMPTS; attempt++)
+	{
+		Sleep(attempt * CAPTURE_RECOVERY_RETRY_MS);
+
+		hr = Reactivate(m_Options.ProcessId, m_Options.IncludeProcessTree);
+		if (SUCCEEDED(hr))
+		{
+			m_DiscontinuityPending.store(true, std::memory_order_release);
+			hr = RunTransition(&m_xResumeCapture);
+		}
+		if (SUCCEEDED(hr) || hr == AUDCLNT_E_UNSUPPORTED_FORMAT)
+		{
+			break;
+		}
+	}
+
+	if (FAILED(hr))
+	{
+		SetDeviceState(DeviceState::Error);
+	}
+	ReportStatus(SUCCEEDED(hr) ? L"recovered" : L"recoveryFailed", m_Options.ProcessId, hr);
+	return hr;
+}
+
+//
+//  RequestIdle()
+//
+//  Called by the capture callback, inside EnterCallback, once nothing audible has come through for
+//  the idle time.  From Idle on the callbacks back out and OnGoIdle stops the client.
+//
+void CLoopbackCapture::RequestIdle()
+{
+	DeviceState expected = DeviceState::Capturing;
+	if (m_DeviceState.compare_exchange_strong(expected, DeviceState::Idle, std::memory_order_seq_cst) &&
+		FAILED(MFPutWorkItem2(MFASYNC_CALLBACK_QUEUE_MULTITHREADED, 0, &m_xGoIdle, nullptr)))
+	{
+		// Carry on capturing and try again on the next callback
+		SetDeviceState(DeviceState::Capturing);
+	}
+}
+
+HRESULT CLoopbackCapture::OnGoIdle(IMFAsyncResult* pResult)
+{
+	auto lock = m_TransitionLock.lock();
+	CompletePendingTransitions();
+	return S_OK;
+}
+
+//
+//  EnterIdle()
+//
+//  Stops the audio client the way a pause does and has the session monitor watch the target.
+//  Called with m_TransitionLock held and the state already Idle.
+//
+HRESULT CLoopbackCapture::EnterIdle()
+{
+	RETURN_IF_FAILED(RunTransition(&m_xPauseCapture));
+
+	m_IdleEntered = true;
+	m_pSessionMonitor->Watch(this, m_Options.ProcessId, m_Options.IncludeProcessTree,
+		static_cast<float>(pow(10.0, m_Options.SilenceThresholdDb / 20.0)));
+	ReportStatus(L"idle", m_Options.ProcessId, S_OK);
+	return S_OK;
+}
+
+// CAudioActivityListener: on the monitor's thread, with its lock held, so only queue the wake-up.
+void CLoopbackCapture::OnAudioActivity()
+{
+	MFPutWorkItem2(MFASYNC_CALLBACK_QUEUE_MULTITHREADED, 0, &m_xWakeCapture, nullptr);
+}
+
+HRESULT CLoopbackCapture::OnWakeCapture(IMFAsyncResult* pResult)
+{
+	auto lock = m_TransitionLock.lock();
+	if (GetDeviceState() == DeviceState::Idle && m_IdleEntered)
+	{
+		LeaveIdle();
+	}
+	return S_OK;
+}
+
+//
+//  LeaveIdle()
+//
+//  Starts the audio client again for a target that has started playing.  The engine only buffers
+//  while the client runs, so the first packet is flagged as a discontinuity, like after a resume.
+//
+HRESULT CLoopbackCapture::LeaveIdle()
+{
+	m_pSessionMonitor->Unwatch(this);
+	m_IdleEntered = false;
+
+	m_DiscontinuityPending.store(true, std::memory_order_release);
+	const HRESULT hr = RunTransition(&m_xResumeCapture);
+	ReportStatus(SUCCEEDED(hr) ? L"active" : L"failed", m_Options.ProcessId, hr);
+	return hr;
+}
+
+//
+//  WatchTargetProcess()
+//
+//  Queues OnTargetExited to run when the target process exits.  Processes that can't be opened
+//  (protected ones, or one that is already gone) are simply not watched.
+//
+void CLoopbackCapture::WatchTargetProcess(DWORD processId)
+{
+	StopWatchingTargetProcess();
+
+	m_TargetProcess.reset(OpenProcess(SYNCHRONIZE, FALSE, processId));
+	if (!m_TargetProcess)
+	{
+		return;
+	}
+
+	m_WatchedProcessId.store(processId, std::memory_order_relaxed);
+	if (FAILED(MFCreateAsyncResult(nullptr, &m_xTargetExited, nullptr, &m_TargetExitedAsyncResult)) ||
+		FAILED(MFPutWaitingWorkItem(m_TargetProcess.get(), 0, m_TargetExitedAsyncResult.get(), &m_TargetExitedKey)))
+	{
+		StopWatchingTargetProcess();
+	}
+}
+
+// Also breaks the reference the waiting async result holds on this object.
+void CLoopbackCapture::StopWatchingTargetProcess()
+{
+	if (0 != m_TargetExitedKey)
+	{
+		MFCancelWorkItem(m_TargetExitedKey);
+		m_TargetExitedKey = 0;
+	}
+	m_TargetExitedAsyncResult.reset();
+	m_TargetProcess.reset();
+}
+
+//
+//  OnTargetExited()
+//
+//  Callback method for the target process exiting.  The capture carries on (it now only hears
+//  silence, or everything, when excluding), so the client can retarget it instead of starting over.
+//
+HRESULT CLoopbackCapture::OnTargetExited(IMFAsyncResult* pResult)
+{
+	ReportStatus(L"targetExited", m_WatchedProcessId.load(std::memory_order_relaxed), S_OK);
+	return S_OK;
+}
+
+//
+//  ReportStatus()
+//
+//  Prints one status line, built first and written in one go like the stats lines.
+//
+void CLoopbackCapture::ReportStatus(PCWSTR status, DWORD processId, HRESULT hr) const
+{
+	std::wostringstream line;
+	line << L"{\"event\":\"status\",\"stream\":" << m_StreamId << L",\"pid\":" << processId << L",\"status\":\"" << status << L"\"";
+	if (FAILED(hr))
+	{
+		line << L",\"hr\":\"0x" << std::hex << std::setw(8) << std::setfill(L'0') << static_cast<UINT32>(hr) << L"\"";
+	}
+	line << L"}\n";
+	std::wcerr << line.str() << std::flush;
+
+	TraceLoggingWrite(g_hLoopbackTraceProvider, "CaptureStatus",
+		TraceLoggingLevel(WINEVENT_LEVEL_INFO), TraceLoggingKeyword(TRACE_KEYWORD_CAPTURE),
+		TraceLoggingUInt32(m_StreamId, "StreamId"),
+		TraceLoggingUInt32(processId, "ProcessId"),
+		TraceLoggingWideString(status, "Status"),
+		TraceLoggingHResult(hr, "HResult"));
+}
+
 //
 //  FinishCaptureAsync()
 //
@@ -226,7 +951,12 @@ HRESULT CLoopbackCapture::FinishCaptureAsync()
 //
 HRESULT CLoopbackCapture::OnFinishCapture(IMFAsyncResult* pResult)
 {
-	m_DeviceState = DeviceState::Stopped;
+	SetDeviceState(DeviceState::Stopped);
+
+	TraceLoggingWrite(g_hLoopbackTraceProvider, "CaptureStopped",
+		TraceLoggingLevel(WINEVENT_LEVEL_INFO), TraceLoggingKeyword(TRACE_KEYWORD_CAPTURE),
+		TraceLoggingUInt32(m_StreamId, "StreamId"),
+		TraceLoggingUInt32(m_Options.ProcessId, "ProcessId"));
 
 	m_hCaptureStopped.SetEvent();
 
@@ -240,41 +970,130 @@ HRESULT CLoopbackCapture::OnFinishCapture(IMFAsyncResult* pResult)
 //
 HRESULT CLoopbackCapture::OnSampleReady(IMFAsyncResult* pResult)
 {
-	if (SUCCEEDED(OnAudioSampleRequested()))
+	if (!EnterCallback())
+	{
+		return S_OK;
+	}
+
+	const HRESULT hr = OnAudioSampleRequested();
+	if (SUCCEEDED(hr))
 	{
 		// Re-queue work item for next sample
-		if (m_DeviceState == DeviceState::Capturing)
+		if (GetDeviceState() == DeviceState::Capturing)
 		{
 			// Re-queue work item for next sample
-			return MFPutWaitingWorkItem(m_SampleReadyEvent.get(), 0, m_SampleReadyAsyncResult.get(), &m_SampleReadyKey);
+			MFPutWaitingWorkItem(m_SampleReadyEvent.get(), 0, m_SampleReadyAsyncResult.get(), &m_SampleReadyKey);
 		}
 	}
 	else
 	{
-		m_DeviceState = DeviceState::Error;
+		// Recovery re-queues once the client has been activated again
+		HandleCaptureFailure(hr);
 	}
 
+	LeaveCallback();
 	return S_OK;
 }
 
-bool IsBufferSilent(const BYTE* pData, UINT32 numFrames, WAVEFORMATEX* format, double silenceThresholdDb = -50.0) {
-	if (format->wBitsPerSample != 16) {
-		// You can add support for 24-bit, float, etc., but let's keep it simple.
-		throw std::runtime_error("Only 16-bit PCM supported in this example");
+//
+//  EnterCallback()
+//
+//  Called at the top of every capture callback instead of taking a lock.  Returns false, having left
+//  again, unless the capture is running.  Never blocks: it is the stopping side that waits.
+//
+bool CLoopbackCapture::EnterCallback()
+{
+	m_ActiveCallbacks.fetch_add(1, std::memory_order_seq_cst);
+	if (m_DeviceState.load(std::memory_order_seq_cst) != DeviceState::Capturing)
+	{
+		LeaveCallback();
+		return false;
+	}
+	return true;
+}
+
+void CLoopbackCapture::LeaveCallback()
+{
+	m_ActiveCallbacks.fetch_sub(1, std::memory_order_release);
+}
+
+// Stop side: yields until every callback that got past EnterCallback before Stopping was set has
+// returned.  A count rather than a flag: the shared work queue can start the re-queued callback
+// before the one that queued it has left.
+void CLoopbackCapture::WaitForCallbackToLeave()
+{
+	while (m_ActiveCallbacks.load(std::memory_order_acquire) != 0)
+	{
+		SwitchToThread();
 	}
+}
 
-	const int16_t* samples = reinterpret_cast<const int16_t*>(pData);
-	int numSamples = numFrames * format->nChannels;
+// LOOPBACK_FRAME_FLAG_* for the AUDCLNT_BUFFERFLAGS_* GetBuffer returned.
+static UINT32 GetFrameFlags(DWORD captureFlags)
+{
+	UINT32 flags = 0;
+	if (captureFlags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY)
+	{
+		flags |= LOOPBACK_FRAME_FLAG_DISCONTINUITY;
+	}
+	if (captureFlags & AUDCLNT_BUFFERFLAGS_SILENT)
+	{
+		flags |= LOOPBACK_FRAME_FLAG_ENGINE_SILENT;
+	}
+	if (captureFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR)
+	{
+		flags |= LOOPBACK_FRAME_FLAG_TIMESTAMP_ERROR;
+	}
+	return flags;
+}
+
+DWORD WINAPI CLoopbackCapture::CaptureThreadProc(LPVOID lpParameter)
+{
+	static_cast<CLoopbackCapture*>(lpParameter)->CaptureThread();
+	return 0;
+}
+
+//
+//  CaptureThread()
+//
+//  Pull-model alternative to OnSampleReady: the thread registers itself with MMCSS as "Pro Audio"
+//  and blocks on the engine's buffer event directly, so each period costs one wait instead of a
+//  work-queue dispatch and a re-queue.  The thread runs until OnStopCapture signals
+//  m_StopThreadEvent, or until a callback fails in a way recovery can't help with.
+//
+void CLoopbackCapture::CaptureThread()
+{
+	DWORD taskIndex = 0;
+	HANDLE hMmcss = AvSetMmThreadCharacteristicsW(L"Pro Audio", &taskIndex);
+	if (hMmcss == nullptr)
+	{
+		// Still works, just without the MMCSS scheduling boost
+		std::wcerr << L"AvSetMmThreadCharacteristics failed: " << GetLastError() << L"\n";
+	}
+
+	HANDLE waitHandles[] = { m_StopThreadEvent.get(), m_SampleReadyEvent.get() };
+	while (WaitForMultipleObjects(ARRAYSIZE(waitHandles), waitHandles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+	{
+		if (!EnterCallback())
+		{
+			continue;
+		}
 
-	double threshold = pow(10.0, silenceThresholdDb / 20.0) * 32768.0;
+		// While recovering, the thread keeps waiting: the new client signals the same event
+		const HRESULT hr = OnAudioSampleRequested();
+		const bool recovering = FAILED(hr) && HandleCaptureFailure(hr);
+		LeaveCallback();
 
-	for (int i = 0; i < numSamples; ++i) {
-		if (std::abs(samples[i]) > threshold) {
-			return false;  // Not silent
+		if (FAILED(hr) && !recovering)
+		{
+			break;
 		}
 	}
 
-	return true;  // All samples below threshold
+	if (hMmcss != nullptr)
+	{
+		AvRevertMmThreadCharacteristics(hMmcss);
+	}
 }
 
 //
@@ -290,15 +1109,14 @@ HRESULT CLoopbackCapture::OnAudioSampleRequested()
 	UINT64 u64DevicePosition = 0;
 	UINT64 u64QPCPosition = 0;
 	DWORD cbBytesToCapture = 0;
+	UINT32 packets = 0;
+	UINT64 frames = 0;
+	HRESULT hr = S_OK;
 
-	auto lock = m_CritSec.lock();
-
-	// If this flag is set, we have already queued up the async call to finialize the WAV header
-	// So we don't want to grab or write any more data that would possibly give us an invalid size
-	if (m_DeviceState == DeviceState::Stopping)
-	{
-		return S_OK;
-	}
+	// No lock: the caller has been through EnterCallback, so the capture is running and stays
+	// set up until this returns.
+	const UINT64 callbackStart = GetQpcPosition();
+	CThreadProfile::TagCurrentThread(ProfileThread::Capture);
 
 	// A word on why we have a loop here;
 	// Suppose it has been 10 milliseconds or so since the last time
@@ -320,27 +1138,120 @@ HRESULT CLoopbackCapture::OnAudioSampleRequested()
 	//
 	// We do this by calling IAudioCaptureClient::GetNextPacketSize
 	// over and over again until it indicates there are no more packets remaining.
-	while (SUCCEEDED(m_AudioCaptureClient->GetNextPacketSize(&FramesAvailable)) && FramesAvailable > 0)
+	while (SUCCEEDED(hr = m_AudioCaptureClient->GetNextPacketSize(&FramesAvailable)) && FramesAvailable > 0)
 	{
-		cbBytesToCapture = FramesAvailable * m_CaptureFormat.nBlockAlign;
+		cbBytesToCapture = FramesAvailable * m_CaptureFormat.Format.nBlockAlign;
 
 		// Get sample buffer
 		RETURN_IF_FAILED(m_AudioCaptureClient->GetBuffer(&Data, &FramesAvailable, &dwCaptureFlags, &u64DevicePosition, &u64QPCPosition));
+		const UINT64 packetStart = GetQpcPosition();
 
+		m_Stats->RecordPacket(FramesAvailable, cbBytesToCapture, dwCaptureFlags, u64DevicePosition);
 
-		// Write to stdout
-		if (m_DeviceState != DeviceState::Stopping && !IsBufferSilent(Data, FramesAvailable, &m_CaptureFormat,-70))
+		CapturePacketInfo info;
+		info.Frames = FramesAvailable;
+		info.Flags = GetFrameFlags(dwCaptureFlags);
+		info.DevicePosition = u64DevicePosition;
+		info.QpcPosition = u64QPCPosition;
+		if (m_DiscontinuityPending.load(std::memory_order_relaxed) && m_DiscontinuityPending.exchange(false, std::memory_order_acquire))
 		{
-			size_t byteCount = FramesAvailable * m_CaptureFormat.nBlockAlign;
-			fwrite(Data, 1, byteCount, stdout);
+			info.Flags |= LOOPBACK_FRAME_FLAG_DISCONTINUITY;
+		}
+
+		// Hand the packet to the writer thread.  This is only a copy into the preallocated ring; if the
+		// reader has fallen behind so far that the ring is full, the packet is dropped and counted rather
+		// than blocking the real-time thread on the pipe.
+		// Packets the engine already flagged as silent aren't scanned at all, and packets the silence
+		// gate holds back only tell the sink how many frames they stood for.  With --meter-only neither
+		// is written; the meter below still sees every packet.
+		bool gateOpened = false;
+		bool gateClosed = false;
+		const bool isSilent = m_SilenceGate.Process(Data, FramesAvailable, (dwCaptureFlags & AUDCLNT_BUFFERFLAGS_SILENT) != 0,
+			gateOpened, gateClosed);
+		if (gateOpened || gateClosed)
+		{
+			m_Stats->RecordGateTransition(gateOpened);
+		}
+		if (gateOpened)
+		{
+			info.Flags |= LOOPBACK_FRAME_FLAG_GATE_OPENED;
+		}
+		bool written = true;
+		if (isSilent)
+		{
+			m_Stats->RecordSilentSkip();
+			if (!m_Options.MeterOnly)
+			{
+				written = m_Sink->WriteSilence(info);
+				m_Stats->RecordWrite(written, 0);
+			}
+		}
+		else
+		{
+			if (!m_Options.MeterOnly)
+			{
+				written = m_Sink->WritePacket(Data, cbBytesToCapture, info);
+				m_Stats->RecordWrite(written, cbBytesToCapture);
+			}
+
+			// Engine capture time to hand-off time, when the engine vouches for the timestamp
+			const UINT64 now = GetQpcPosition();
+			m_LastAudibleQpc = now;
+			if (!(dwCaptureFlags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR) && now >= u64QPCPosition)
+			{
+				m_Stats->RecordLatency(now - u64QPCPosition);
+			}
+		}
+
+		// Levels go out after the audio they cover
+		if (m_Options.MeterIntervalMs != 0)
+		{
+			LOOPBACK_METER_PAYLOAD meter;
+			CapturePacketInfo meterInfo;
+			if (m_Meter.Process(Data, FramesAvailable, (dwCaptureFlags & AUDCLNT_BUFFERFLAGS_SILENT) != 0, info, meter, meterInfo))
+			{
+				m_Sink->WriteMeter(meter, meterInfo);
+			}
 		}
 
 		// Release buffer back
 		m_AudioCaptureClient->ReleaseBuffer(FramesAvailable);
+		const UINT64 packetTime = GetQpcPosition() - packetStart;
+		m_Stats->RecordPacketTime(packetTime);
+		packets++;
+		frames += FramesAvailable;
+
+		// Only evaluated while a session has the packet events on
+		TraceLoggingWrite(g_hLoopbackTraceProvider, "CapturePacket",
+			TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(TRACE_KEYWORD_PACKETS),
+			TraceLoggingUInt32(m_StreamId, "StreamId"),
+			TraceLoggingUInt32(FramesAvailable, "Frames"),
+			TraceLoggingHexUInt32(dwCaptureFlags, "BufferFlags"),
+			TraceLoggingUInt64(u64DevicePosition, "DevicePosition"),
+			TraceLoggingUInt64(u64QPCPosition, "QpcPosition"),
+			TraceLoggingUInt64(packetTime, "PacketTime"),
+			TraceLoggingBool(isSilent, "Silent"),
+			TraceLoggingBool(written, "Written"));
+	}
 
-		// Increase the size of our 'data' chunk.  m_cbDataSize needs to be accurate
-		m_cbDataSize += cbBytesToCapture;
+	// An invalidated client usually shows up here first
+	RETURN_IF_FAILED(hr);
+
+	if (m_pSessionMonitor != nullptr && GetQpcPosition() - m_LastAudibleQpc >= static_cast<UINT64>(m_Options.IdleAfterMs) * REFTIMES_PER_MILLISEC)
+	{
+		RequestIdle();
 	}
 
+	m_Sink->NotifyDataReady();
+
+	const UINT64 callbackTime = GetQpcPosition() - callbackStart;
+	m_Stats->RecordCallback(callbackTime);
+	TraceLoggingWrite(g_hLoopbackTraceProvider, "OnAudioSampleRequested",
+		TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(TRACE_KEYWORD_PACKETS),
+		TraceLoggingUInt32(m_StreamId, "StreamId"),
+		TraceLoggingUInt32(packets, "Packets"),
+		TraceLoggingUInt64(frames, "Frames"),
+		TraceLoggingUInt64(callbackStart, "QpcPosition"),
+		TraceLoggingUInt64(callbackTime, "Duration"));
 	return S_OK;
 }
\ No newline at end of file
@@ -5,29 +5,65 @@
 #include <initguid.h>
 #include <guiddef.h>
 #include <mfapi.h>
+#include <atomic>
 
 #include <wrl\implements.h>
 #include <wil\com.h>
+#include <wil\resource.h>
 #include <wil\result.h>
 
+#include "AudioSessionMonitor.h"
+#include "CaptureOptions.h"
+#include "CaptureStats.h"
+#include "CaptureSink.h"
 #include "Common.h"
+#include "LevelMeter.h"
+#include "QpcClock.h"
+#include "SilenceDetector.h"
+#include "StreamProtocol.h"
 
 using namespace Microsoft::WRL;
 
 class CLoopbackCapture :
-    public RuntimeClass< RuntimeClassFlags< ClassicCom >, FtmBase, IActivateAudioInterfaceCompletionHandler >
+    public RuntimeClass< RuntimeClassFlags< ClassicCom >, FtmBase, IActivateAudioInterfaceCompletionHandler >,
+    public CAudioActivityListener
 {
 public:
     CLoopbackCapture() = default;
-    ~CLoopbackCapture();
 
-    HRESULT StartCaptureAsync(DWORD processId, bool includeProcessTree);
+    // Captures options.ProcessId into a sink for streamId, on the host's shared MMCSS work queue.  With
+    // options.IdleAfterMs, pSessionMonitor tells an idle capture when to start its audio client.
+    HRESULT StartCaptureAsync(const CaptureOptions& options, UINT32 streamId, DWORD dwQueueID, CCaptureSinkProvider* pSinkProvider,
+        CAudioSessionMonitor* pSessionMonitor = nullptr);
     HRESULT StopCaptureAsync();
 
+    // Stop the audio client without tearing the capture down, and start it again.  The stream stays
+    // open; the first packet after a resume is flagged LOOPBACK_FRAME_FLAG_DISCONTINUITY.
+    HRESULT PauseCaptureAsync();
+    HRESULT ResumeCaptureAsync();
+
+    // Points a running or paused capture at another process.  Only the audio client is activated
+    // again; the events, the work queue, the capture thread and the sink are kept, so the consumer
+    // sees one continuous stream.  Fails, leaving the capture in error, if the new client's format or
+    // packet size doesn't fit the open sink.
+    HRESULT RetargetCaptureAsync(DWORD processId, bool includeProcessTree);
+
+    // Real-time counters of this capture; valid once StartCaptureAsync has been called.
+    std::shared_ptr<CCaptureStats> GetStats() const { return m_Stats; }
+
     METHODASYNCCALLBACK(CLoopbackCapture, StartCapture, OnStartCapture);
     METHODASYNCCALLBACK(CLoopbackCapture, StopCapture, OnStopCapture);
+    METHODASYNCCALLBACK(CLoopbackCapture, PauseCapture, OnPauseCapture);
+    METHODASYNCCALLBACK(CLoopbackCapture, ResumeCapture, OnResumeCapture);
     METHODASYNCCALLBACK(CLoopbackCapture, SampleReady, OnSampleReady);
     METHODASYNCCALLBACK(CLoopbackCapture, FinishCapture, OnFinishCapture);
+    METHODASYNCCALLBACK(CLoopbackCapture, RecoverCapture, OnRecoverCapture);
+    METHODASYNCCALLBACK(CLoopbackCapture, TargetExited, OnTargetExited);
+    METHODASYNCCALLBACK(CLoopbackCapture, GoIdle, OnGoIdle);
+    METHODASYNCCALLBACK(CLoopbackCapture, WakeCapture, OnWakeCapture);
+
+    // CAudioActivityListener
+    void OnAudioActivity() override;
 
     // IActivateAudioInterfaceCompletionHandler
     STDMETHOD(ActivateCompleted)(IActivateAudioInterfaceAsyncOperation* operation);
@@ -42,41 +78,127 @@ private:
         Initialized,
         Starting,
         Capturing,
+        Paused,
+        Recovering,
+        Idle,
         Stopping,
         Stopped,
     };
 
     HRESULT OnStartCapture(IMFAsyncResult* pResult);
     HRESULT OnStopCapture(IMFAsyncResult* pResult);
+    HRESULT OnPauseCapture(IMFAsyncResult* pResult);
+    HRESULT OnResumeCapture(IMFAsyncResult* pResult);
     HRESULT OnFinishCapture(IMFAsyncResult* pResult);
     HRESULT OnSampleReady(IMFAsyncResult* pResult);
+    HRESULT OnRecoverCapture(IMFAsyncResult* pResult);
+    HRESULT OnTargetExited(IMFAsyncResult* pResult);
+    HRESULT OnGoIdle(IMFAsyncResult* pResult);
+    HRESULT OnWakeCapture(IMFAsyncResult* pResult);
 
     HRESULT InitializeLoopbackCapture();
     HRESULT OnAudioSampleRequested();
 
+    bool EnterCallback();
+    void LeaveCallback();
+    void WaitForCallbackToLeave();
+    DeviceState GetDeviceState() const { return m_DeviceState.load(std::memory_order_acquire); }
+    void SetDeviceState(DeviceState state) { m_DeviceState.store(state, std::memory_order_release); }
+
+    // CaptureEngine::Thread
+    static DWORD WINAPI CaptureThreadProc(LPVOID lpParameter);
+    void CaptureThread();
+
     HRESULT ActivateAudioInterface(DWORD processId, bool includeProcessTree);
+    HRESULT InitializeCaptureFormat();
+    HRESULT GetEngineMixFormat(WAVEFORMATEX** ppMixFormat);
+    HRESULT InitializeAudioClient();
+    HRESULT InitializeLowLatencyStream(DWORD streamFlags);
+    void ReportNegotiatedLatency();
     HRESULT FinishCaptureAsync();
+    HRESULT RunTransition(IMFAsyncCallback* pCallback);
+    HRESULT Reactivate(DWORD processId, bool includeProcessTree);
+
+    bool HandleCaptureFailure(HRESULT hr);
+    HRESULT Recover();
+    void RequestIdle();
+    HRESULT EnterIdle();
+    HRESULT LeaveIdle();
+    HRESULT CompletePendingTransitions();
+    void WatchTargetProcess(DWORD processId);
+    void StopWatchingTargetProcess();
+
+    // Besides the control channel's replies, reports what happens to the capture on its own as one
+    // JSON line on stderr:
+    //
+    //      {"event":"status","stream":0,"pid":1234,"status":"recovering","hr":"0x88890004"}
+    //
+    // "recovering" when the audio client was invalidated (default device change, audio service
+    // restart) and is being activated again in place, then "recovered" or "recoveryFailed";
+    // "targetExited" when the target process exits, the stream staying open for a retarget or stop;
+    // "idle" when an idle capture (--idle-after-ms) has stopped its audio client, "active" when it
+    // has started it again; "failed" when capturing failed for good.  "hr" is only present for
+    // failures.
+    void ReportStatus(PCWSTR status, DWORD processId, HRESULT hr) const;
 
     HRESULT SetDeviceStateErrorIfFailed(HRESULT hr);
 
+    CaptureOptions m_Options;
     wil::com_ptr_nothrow<IAudioClient> m_AudioClient;
-    WAVEFORMATEX m_CaptureFormat{};
+    WAVEFORMATEXTENSIBLE m_CaptureFormat{};
     UINT32 m_BufferFrames = 0;
     wil::com_ptr_nothrow<IAudioCaptureClient> m_AudioCaptureClient;
     wil::com_ptr_nothrow<IMFAsyncResult> m_SampleReadyAsyncResult;
+    UINT32 m_StreamId = 0;
+    CCaptureSinkProvider* m_pSinkProvider = nullptr;
+    std::shared_ptr<CCaptureSink> m_Sink;
+    // What m_Sink was opened for; a retargeted client has to match it
+    WAVEFORMATEXTENSIBLE m_SinkFormat{};
+    UINT32 m_cbSinkMaxPacket = 0;
+    CSilenceGate m_SilenceGate;
+    // Only initialized with --meter
+    CLevelMeter m_Meter;
+    std::shared_ptr<CCaptureStats> m_Stats;
 
     wil::unique_event_nothrow m_SampleReadyEvent;
     MFWORKITEM_KEY m_SampleReadyKey = 0;
-    wil::critical_section m_CritSec;
-    DWORD m_dwQueueID = 0;
-    DWORD m_cbHeaderSize = 0;
-    DWORD m_cbDataSize = 0;
+    wil::unique_handle m_CaptureThread;
+    wil::unique_event_nothrow m_StopThreadEvent;
 
     // These two members are used to communicate between the main thread
     // and the ActivateCompleted callback.
     HRESULT m_activateResult = E_UNEXPECTED;
 
-    DeviceState m_DeviceState{ DeviceState::Uninitialized };
+    // Written by the MF threads that start and stop the capture, read by the capture callback.  The
+    // callback takes no lock: EnterCallback/WaitForCallbackToLeave keep stopping from yanking the
+    // audio client or the sink out from under it.
+    std::atomic<DeviceState> m_DeviceState{ DeviceState::Uninitialized };
+    // Callbacks between EnterCallback and LeaveCallback
+    std::atomic<LONG> m_ActiveCallbacks{ 0 };
+    // Set by resume and retarget, cleared by the first packet after them
+    std::atomic<bool> m_DiscontinuityPending{ false };
     wil::unique_event_nothrow m_hActivateCompleted;
+    wil::unique_event_nothrow m_hStartCompleted;
     wil::unique_event_nothrow m_hCaptureStopped;
+
+    // Pause and resume: completion and result of the work item, waited for by the caller
+    wil::unique_event_nothrow m_hTransitionCompleted;
+    HRESULT m_transitionResult = E_UNEXPECTED;
+
+    // Held by the public transitions (on the host's thread) and by recovery (on an MF thread), so a
+    // stop or retarget never runs against a half-reactivated client.
+    wil::critical_section m_TransitionLock;
+
+    // Exit notification for the target process, where it can be opened for SYNCHRONIZE
+    wil::unique_handle m_TargetProcess;
+    wil::com_ptr_nothrow<IMFAsyncResult> m_TargetExitedAsyncResult;
+    MFWORKITEM_KEY m_TargetExitedKey = 0;
+    std::atomic<DWORD> m_WatchedProcessId{ 0 };
+
+    // --idle-after-ms.  The capture callback moves Capturing to Idle once nothing audible has come
+    // through for the idle time; m_IdleEntered (under m_TransitionLock) says the audio client has
+    // actually been stopped and the session monitor is watching for the target to play.
+    CAudioSessionMonitor* m_pSessionMonitor = nullptr;
+    bool m_IdleEntered = false;
+    UINT64 m_LastAudibleQpc = 0;
 };
\ No newline at end of file
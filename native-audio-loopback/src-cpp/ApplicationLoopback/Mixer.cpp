@@ -0,0 +1,503 @@
+#include <AudioClient.h>
+#include <immintrin.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cstring>
+
+#include <wil\result.h>
+
+#include "CpuFeatures.h"
+#include "Mixer.h"
+#include "Profiler.h"
+#include "QpcClock.h"
+#include "StreamProtocol.h"
+
+// How often the mixer thread wakes up, and the most it mixes in one block.
+#define MIXER_PERIOD_MS 5
+#define MIXER_BLOCK_MS 10
+
+// Packets that start this close to where the previous one ended are treated as contiguous.
+#define MIXER_RESYNC_MS 2
+
+#define HNS_PER_SEC 10000000LL
+#define INT16_FULL_SCALE 32768.0f
+
+//
+//  Kernels
+//
+//  Input conversion (capture thread), accumulation and output conversion (mixer thread), in SSE2 and
+//  AVX2 flavors picked once when the mix format is fixed.
+//
+
+static void Int16ToFloatSse2(const BYTE* pData, float* pOut, size_t samples)
+{
+	const INT16* p = reinterpret_cast<const INT16*>(pData);
+	const __m128 scale = _mm_set1_ps(1.0f / INT16_FULL_SCALE);
+
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+		// Sign-extend by placing each sample in the top half of a 32-bit lane and shifting it back down.
+		const __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		const __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_ps(pOut + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+		_mm_storeu_ps(pOut + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+	}
+
+	for (; i < samples; i++)
+	{
+		pOut[i] = p[i] * (1.0f / INT16_FULL_SCALE);
+	}
+}
+
+static void Int16ToFloatAvx2(const BYTE* pData, float* pOut, size_t samples)
+{
+	const INT16* p = reinterpret_cast<const INT16*>(pData);
+	const __m256 scale = _mm256_set1_ps(1.0f / INT16_FULL_SCALE);
+
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+	{
+		const __m256i low = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+		const __m256i high = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 8)));
+		_mm256_storeu_ps(pOut + i, _mm256_mul_ps(_mm256_cvtepi32_ps(low), scale));
+		_mm256_storeu_ps(pOut + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(high), scale));
+	}
+	_mm256_zeroupper();
+
+	Int16ToFloatSse2(reinterpret_cast<const BYTE*>(p + i), pOut + i, samples - i);
+}
+
+static void Float32ToFloat(const BYTE* pData, float* pOut, size_t samples)
+{
+	memcpy(pOut, pData, samples * sizeof(float));
+}
+
+static void AccumulateSse2(float* pAccumulator, const float* pSource, size_t samples, float gain)
+{
+	const __m128 g = _mm_set1_ps(gain);
+
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		const __m128 a = _mm_add_ps(_mm_loadu_ps(pAccumulator + i), _mm_mul_ps(_mm_loadu_ps(pSource + i), g));
+		const __m128 b = _mm_add_ps(_mm_loadu_ps(pAccumulator + i + 4), _mm_mul_ps(_mm_loadu_ps(pSource + i + 4), g));
+		_mm_storeu_ps(pAccumulator + i, a);
+		_mm_storeu_ps(pAccumulator + i + 4, b);
+	}
+
+	for (; i < samples; i++)
+	{
+		pAccumulator[i] += pSource[i] * gain;
+	}
+}
+
+static void AccumulateAvx2(float* pAccumulator, const float* pSource, size_t samples, float gain)
+{
+	const __m256 g = _mm256_set1_ps(gain);
+
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+	{
+		const __m256 a = _mm256_add_ps(_mm256_loadu_ps(pAccumulator + i), _mm256_mul_ps(_mm256_loadu_ps(pSource + i), g));
+		const __m256 b = _mm256_add_ps(_mm256_loadu_ps(pAccumulator + i + 8), _mm256_mul_ps(_mm256_loadu_ps(pSource + i + 8), g));
+		_mm256_storeu_ps(pAccumulator + i, a);
+		_mm256_storeu_ps(pAccumulator + i + 8, b);
+	}
+	_mm256_zeroupper();
+
+	AccumulateSse2(pAccumulator + i, pSource + i, samples - i, gain);
+}
+
+// Clamps before converting: _mm_cvtps_epi32 turns anything out of range into INT32_MIN.
+static void FloatToInt16Sse2(const float* pAccumulator, BYTE* pOut, size_t samples)
+{
+	INT16* p = reinterpret_cast<INT16*>(pOut);
+	const __m128 scale = _mm_set1_ps(INT16_FULL_SCALE);
+	const __m128 high = _mm_set1_ps(32767.0f);
+	const __m128 low = _mm_set1_ps(-32768.0f);
+
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		const __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(pAccumulator + i), scale), low), high);
+		const __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(pAccumulator + i + 4), scale), low), high);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(p + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+	}
+
+	for (; i < samples; i++)
+	{
+		const float sample = (std::min)((std::max)(pAccumulator[i] * INT16_FULL_SCALE, -32768.0f), 32767.0f);
+		p[i] = static_cast<INT16>(_mm_cvtss_si32(_mm_set_ss(sample)));
+	}
+}
+
+static void FloatToInt16Avx2(const float* pAccumulator, BYTE* pOut, size_t samples)
+{
+	INT16* p = reinterpret_cast<INT16*>(pOut);
+	const __m256 scale = _mm256_set1_ps(INT16_FULL_SCALE);
+	const __m256 high = _mm256_set1_ps(32767.0f);
+	const __m256 low = _mm256_set1_ps(-32768.0f);
+
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+	{
+		const __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(pAccumulator + i), scale), low), high);
+		const __m256 b = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(pAccumulator + i + 8), scale), low), high);
+		// packs works within 128-bit lanes, so put the quadwords back in order afterwards.
+		const __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+	_mm256_zeroupper();
+
+	FloatToInt16Sse2(pAccumulator + i, reinterpret_cast<BYTE*>(p + i), samples - i);
+}
+
+// Float output keeps the accumulator's headroom; clipping is left to whoever consumes it.
+static void FloatToFloat32(const float* pAccumulator, BYTE* pOut, size_t samples)
+{
+	memcpy(pOut, pAccumulator, samples * sizeof(float));
+}
+
+//
+//  CMixerSource
+//
+
+//
+//  WritePacket()
+//
+//  Places the packet on the mixer timeline.  Frames the mixer has already played past, or that overlap
+//  the previous packet, are dropped; a gap since the previous packet is filled with silence.
+//
+bool CMixerSource::WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info)
+{
+	const UINT32 frames = info.Frames;
+	const INT64 readPosition = m_ReadPosition.load(std::memory_order_acquire);
+
+	INT64 position = static_cast<INT64>(info.QpcPosition - m_BaseQpc) * m_SamplesPerSec / HNS_PER_SEC;
+	if (llabs(position - m_NextPosition) <= m_ResyncFrames)
+	{
+		position = m_NextPosition;
+	}
+
+	const INT64 end = position + frames;
+	const INT64 floor = (std::max)(m_NextPosition, readPosition);
+	if (end <= floor || end - readPosition > m_CapacityFrames)
+	{
+		// Too late to be heard, or the mixer has stalled and there is no room left.
+		m_DroppedFrames.fetch_add(frames, std::memory_order_relaxed);
+		return false;
+	}
+
+	if (position > floor)
+	{
+		ZeroFrames(floor, static_cast<UINT32>(position - floor));
+	}
+
+	const INT64 first = (std::max)(position, floor);
+	WriteFrames(pData + (first - position) * m_BlockAlign, first, static_cast<UINT32>(end - first));
+	if (first > position)
+	{
+		m_DroppedFrames.fetch_add(first - position, std::memory_order_relaxed);
+	}
+
+	m_NextPosition = end;
+	m_WritePosition.store(end, std::memory_order_release);
+	return true;
+}
+
+void CMixerSource::WriteFrames(const BYTE* pData, INT64 position, UINT32 frames)
+{
+	const UINT32 slot = static_cast<UINT32>(position & (m_CapacityFrames - 1));
+	const UINT32 firstFrames = (std::min)(frames, m_CapacityFrames - slot);
+
+	m_pfnToFloat(pData, m_Storage.get() + static_cast<size_t>(slot) * m_Channels, static_cast<size_t>(firstFrames) * m_Channels);
+	m_pfnToFloat(pData + static_cast<size_t>(firstFrames) * m_BlockAlign, m_Storage.get(), static_cast<size_t>(frames - firstFrames) * m_Channels);
+}
+
+void CMixerSource::ZeroFrames(INT64 position, UINT32 frames)
+{
+	const UINT32 slot = static_cast<UINT32>(position & (m_CapacityFrames - 1));
+	const UINT32 firstFrames = (std::min)(frames, m_CapacityFrames - slot);
+
+	std::fill_n(m_Storage.get() + static_cast<size_t>(slot) * m_Channels, static_cast<size_t>(firstFrames) * m_Channels, 0.0f);
+	std::fill_n(m_Storage.get(), static_cast<size_t>(frames - firstFrames) * m_Channels, 0.0f);
+}
+
+//
+//  CMixer
+//
+
+CMixer::~CMixer()
+{
+	Shutdown();
+}
+
+HRESULT CMixer::Initialize(CCaptureSinkProvider* pOutput, double latencyMs, UINT32 outputStreamId)
+{
+	m_pOutput = pOutput;
+	m_LatencyMs = latencyMs;
+	m_OutputStreamId = outputStreamId;
+
+	RETURN_IF_FAILED(m_StopEvent.create(wil::EventOptions::ManualReset));
+	return S_OK;
+}
+
+//
+//  Shutdown()
+//
+//  Mixes out whatever the sources still hold, stops the mixer thread and closes the mixed stream.
+//
+void CMixer::Shutdown()
+{
+	if (m_MixerThread)
+	{
+		m_StopEvent.SetEvent();
+		WaitForSingleObject(m_MixerThread.get(), INFINITE);
+		m_MixerThread.reset();
+	}
+
+	if (m_OutputSink)
+	{
+		m_pOutput->CloseSink(m_OutputSink);
+		m_OutputSink.reset();
+	}
+
+	auto lock = m_SourcesLock.lock_exclusive();
+	m_Sources.clear();
+}
+
+void CMixer::SetGain(UINT32 streamId, float gain)
+{
+	auto lock = m_SourcesLock.lock_exclusive();
+	m_Gains[streamId] = gain;
+	for (auto& source : m_Sources)
+	{
+		if (source->m_StreamId == streamId)
+		{
+			source->m_Gain.store(gain, std::memory_order_relaxed);
+		}
+	}
+}
+
+//
+//  OpenSink()
+//
+//  Adds a source starting at the mixer's current position.  Every source must be in the mix format;
+//  since all captures of a process share their options, that only fails if the default device's mix
+//  format changed in between.
+//
+HRESULT CMixer::OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 /*cbMaxPacket*/, bool writeHeader,
+	std::shared_ptr<CCaptureSink>& sink)
+{
+	auto lock = m_SourcesLock.lock_exclusive();
+
+	if (!m_OutputSink)
+	{
+		RETURN_IF_FAILED(OpenOutput(format, cbMinCapacity, writeHeader));
+	}
+	RETURN_HR_IF(AUDCLNT_E_UNSUPPORTED_FORMAT, GetSampleFormat(&format) != GetSampleFormat(&m_Format.Format) ||
+		format.nChannels != m_Channels || format.nSamplesPerSec != m_Format.Format.nSamplesPerSec);
+
+	auto source = std::make_shared<CMixerSource>();
+	source->m_Storage.reset(new (std::nothrow) float[static_cast<size_t>(m_CapacityFrames) * m_Channels]);
+	RETURN_IF_NULL_ALLOC(source->m_Storage);
+
+	source->m_StreamId = streamId;
+	source->m_CapacityFrames = m_CapacityFrames;
+	source->m_Channels = m_Channels;
+	source->m_BlockAlign = format.nBlockAlign;
+	source->m_SamplesPerSec = format.nSamplesPerSec;
+	source->m_BaseQpc = m_BaseQpc;
+	source->m_ResyncFrames = static_cast<INT64>(format.nSamplesPerSec) * MIXER_RESYNC_MS / 1000;
+	source->m_pfnToFloat = m_pfnToFloat;
+
+	auto gain = m_Gains.find(streamId);
+	source->m_Gain.store(gain != m_Gains.end() ? gain->second : 1.0f, std::memory_order_relaxed);
+
+	// Nothing before the mixer's current position will be heard anyway.
+	const INT64 position = m_MixPosition.load(std::memory_order_acquire);
+	source->m_NextPosition = position;
+	source->m_WritePosition.store(position, std::memory_order_relaxed);
+	source->m_ReadPosition.store(position, std::memory_order_relaxed);
+
+	m_Sources.push_back(source);
+	sink = std::move(source);
+	return S_OK;
+}
+
+void CMixer::CloseSink(const std::shared_ptr<CCaptureSink>& sink)
+{
+	if (sink)
+	{
+		// The mixer thread drops the source once it has mixed what is left.
+		static_cast<CMixerSource*>(sink.get())->m_Closed.store(true, std::memory_order_release);
+	}
+}
+
+//
+//  OpenOutput()
+//
+//  Fixes the mix format, picks the kernels for it, opens the sink for the mixed stream and starts the
+//  mixer thread with the timeline's origin at the current performance counter.
+//
+HRESULT CMixer::OpenOutput(const WAVEFORMATEX& format, UINT32 cbMinCapacity, bool writeHeader)
+{
+	const SampleFormat sampleFormat = GetSampleFormat(&format);
+	RETURN_HR_IF(AUDCLNT_E_UNSUPPORTED_FORMAT, sampleFormat != SampleFormat::Int16 && sampleFormat != SampleFormat::Float32);
+
+	const size_t cbFormat = sizeof(WAVEFORMATEX) + format.cbSize;
+	memcpy(&m_Format, &format, (std::min)(cbFormat, sizeof(m_Format)));
+	m_Channels = format.nChannels;
+
+	const bool avx2 = IsAvx2Supported();
+	if (sampleFormat == SampleFormat::Int16)
+	{
+		m_pfnToFloat = avx2 ? Int16ToFloatAvx2 : Int16ToFloatSse2;
+		m_pfnFromFloat = avx2 ? FloatToInt16Avx2 : FloatToInt16Sse2;
+	}
+	else
+	{
+		m_pfnToFloat = Float32ToFloat;
+		m_pfnFromFloat = FloatToFloat32;
+	}
+	m_pfnAccumulate = avx2 ? AccumulateAvx2 : AccumulateSse2;
+
+	// Source rings hold as much audio as the output ring the capture asked for.
+	m_CapacityFrames = CPacketRing::RoundUpCapacity(cbMinCapacity / format.nBlockAlign);
+	RETURN_HR_IF(E_INVALIDARG, m_CapacityFrames == 0);
+	m_LatencyFrames = static_cast<INT64>(m_LatencyMs * format.nSamplesPerSec / 1000.0);
+
+	const size_t blockFrames = static_cast<size_t>(format.nSamplesPerSec) * MIXER_BLOCK_MS / 1000;
+	m_Accumulator.resize(blockFrames * m_Channels);
+	m_OutputBuffer.resize(blockFrames * format.nBlockAlign);
+
+	RETURN_IF_FAILED(m_pOutput->OpenSink(m_OutputStreamId, format, cbMinCapacity, static_cast<UINT32>(m_OutputBuffer.size()), writeHeader, m_OutputSink));
+
+	m_BaseQpc = GetQpcPosition();
+	m_MixPosition.store(0, std::memory_order_relaxed);
+
+	m_MixerThread.reset(CreateThread(nullptr, 0, CMixer::MixerThreadProc, this, 0, nullptr));
+	RETURN_LAST_ERROR_IF(!m_MixerThread);
+
+	return S_OK;
+}
+
+DWORD WINAPI CMixer::MixerThreadProc(LPVOID lpParameter)
+{
+	static_cast<CMixer*>(lpParameter)->MixerThread();
+	return 0;
+}
+
+void CMixer::MixerThread()
+{
+	CThreadProfile::TagCurrentThread(ProfileThread::Mixer);
+	while (WaitForSingleObject(m_StopEvent.get(), MIXER_PERIOD_MS) == WAIT_TIMEOUT)
+	{
+		Mix(GetTimelinePosition() - m_LatencyFrames);
+	}
+
+	// The captures have all stopped by now; mix out their tails without waiting for the latency.
+	Mix(GetTimelinePosition());
+}
+
+//
+//  Mix()
+//
+//  Mixes and writes every block up to targetPosition, then drops the sources that were closed and
+//  have nothing left to mix.
+//
+void CMixer::Mix(INT64 targetPosition)
+{
+	// Copied into a member so the vector's storage is reused rather than allocated on every wake
+	std::vector<std::shared_ptr<CMixerSource>>& sources = m_SourcesSnapshot;
+	{
+		auto lock = m_SourcesLock.lock_shared();
+		sources = m_Sources;
+	}
+
+	INT64 position = m_MixPosition.load(std::memory_order_relaxed);
+
+	// After a long stall (debugger, suspended machine) don't render the whole gap; the sources have
+	// dropped that audio anyway.
+	if (targetPosition - position > m_CapacityFrames)
+	{
+		position = targetPosition - m_CapacityFrames;
+	}
+
+	const UINT32 blockFrames = static_cast<UINT32>(m_Accumulator.size() / m_Channels);
+	bool wroteAny = false;
+	while (position < targetPosition)
+	{
+		const UINT32 frames = static_cast<UINT32>((std::min)(targetPosition - position, static_cast<INT64>(blockFrames)));
+		MixBlock(sources, position, frames);
+		position += frames;
+		wroteAny = true;
+
+		for (auto& source : sources)
+		{
+			source->m_ReadPosition.store(position, std::memory_order_release);
+		}
+		m_MixPosition.store(position, std::memory_order_release);
+	}
+
+	if (wroteAny)
+	{
+		m_OutputSink->NotifyDataReady();
+	}
+
+	const bool anyClosed = std::any_of(sources.begin(), sources.end(), [](const std::shared_ptr<CMixerSource>& source)
+		{
+			return source->m_Closed.load(std::memory_order_acquire);
+		});
+	if (anyClosed)
+	{
+		auto lock = m_SourcesLock.lock_exclusive();
+		m_Sources.erase(std::remove_if(m_Sources.begin(), m_Sources.end(), [position](const std::shared_ptr<CMixerSource>& source)
+			{
+				return source->m_Closed.load(std::memory_order_acquire) && source->m_WritePosition.load(std::memory_order_acquire) <= position;
+			}), m_Sources.end());
+	}
+
+	sources.clear();
+}
+
+void CMixer::MixBlock(const std::vector<std::shared_ptr<CMixerSource>>& sources, INT64 position, UINT32 frames)
+{
+	float* pAccumulator = m_Accumulator.data();
+	std::fill_n(pAccumulator, static_cast<size_t>(frames) * m_Channels, 0.0f);
+
+	for (auto& source : sources)
+	{
+		const INT64 written = source->m_WritePosition.load(std::memory_order_acquire);
+		const float gain = source->m_Gain.load(std::memory_order_relaxed);
+		if (written <= position || gain == 0.0f)
+		{
+			continue;
+		}
+
+		const UINT32 available = static_cast<UINT32>((std::min)(written - position, static_cast<INT64>(frames)));
+		const UINT32 slot = static_cast<UINT32>(position & (m_CapacityFrames - 1));
+		const UINT32 firstFrames = (std::min)(available, m_CapacityFrames - slot);
+
+		m_pfnAccumulate(pAccumulator, source->m_Storage.get() + static_cast<size_t>(slot) * m_Channels,
+			static_cast<size_t>(firstFrames) * m_Channels, gain);
+		m_pfnAccumulate(pAccumulator + static_cast<size_t>(firstFrames) * m_Channels, source->m_Storage.get(),
+			static_cast<size_t>(available - firstFrames) * m_Channels, gain);
+	}
+
+	m_pfnFromFloat(pAccumulator, m_OutputBuffer.data(), static_cast<size_t>(frames) * m_Channels);
+
+	CapturePacketInfo info;
+	info.Frames = frames;
+	info.DevicePosition = static_cast<UINT64>(position);
+	info.QpcPosition = m_BaseQpc + static_cast<UINT64>(position) * HNS_PER_SEC / m_Format.Format.nSamplesPerSec;
+	m_OutputSink->WritePacket(m_OutputBuffer.data(), frames * m_Format.Format.nBlockAlign, info);
+}
+
+// Frames elapsed on the mixer timeline, which starts at m_BaseQpc.
+INT64 CMixer::GetTimelinePosition() const
+{
+	return static_cast<INT64>(GetQpcPosition() - m_BaseQpc) * m_Format.Format.nSamplesPerSec / HNS_PER_SEC;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <Windows.h>
+#include <mmreg.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <wil\resource.h>
+
+#include "CaptureSink.h"
+#include "RingBuffer.h"
+#include "SampleFormat.h"
+
+typedef void (*PFN_MIXER_TO_FLOAT)(const BYTE* pData, float* pOut, size_t samples);
+typedef void (*PFN_MIXER_ACCUMULATE)(float* pAccumulator, const float* pSource, size_t samples, float gain);
+typedef void (*PFN_MIXER_FROM_FLOAT)(const float* pAccumulator, BYTE* pOut, size_t samples);
+
+//
+//  CMixerSource
+//
+//  One capture's input to the mixer: a float32 ring indexed by absolute frame position on the mixer's
+//  timeline.  The capture thread converts each packet and stores it at the position its QPC timestamp
+//  maps to, filling gaps (e.g. skipped silent packets) with zeros, then publishes m_WritePosition.  The
+//  mixer thread reads frames below m_WritePosition and publishes how far it got in m_ReadPosition.
+//  Positions only ever grow, so as with CPacketRing neither side locks.
+//
+class CMixerSource : public CCaptureSink
+{
+public:
+    CMixerSource() = default;
+    CMixerSource(const CMixerSource&) = delete;
+    CMixerSource& operator=(const CMixerSource&) = delete;
+
+    // CCaptureSink; capture thread only.
+    bool WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info) override;
+    // Skipped silence is just a gap; the next packet zero-fills it.
+    bool WriteSilence(const CapturePacketInfo&) override { return true; }
+    // A source's levels say nothing about the mix.
+    bool WriteMeter(const LOOPBACK_METER_PAYLOAD&, const CapturePacketInfo&) override { return true; }
+    void NotifyDataReady() override {}
+
+    UINT64 GetDroppedFrames() const { return m_DroppedFrames.load(std::memory_order_relaxed); }
+
+private:
+    friend class CMixer;
+
+    void WriteFrames(const BYTE* pData, INT64 position, UINT32 frames);
+    void ZeroFrames(INT64 position, UINT32 frames);
+
+    UINT32 m_StreamId = 0;
+    std::unique_ptr<float[]> m_Storage;
+    UINT32 m_CapacityFrames = 0;
+    UINT32 m_Channels = 0;
+    UINT32 m_BlockAlign = 0;
+    UINT32 m_SamplesPerSec = 0;
+    UINT64 m_BaseQpc = 0;
+    INT64 m_ResyncFrames = 0;
+    PFN_MIXER_TO_FLOAT m_pfnToFloat = nullptr;
+
+    // Capture thread only: where the previous packet ended.
+    INT64 m_NextPosition = 0;
+
+    std::atomic<float> m_Gain{ 1.0f };
+    std::atomic<bool> m_Closed{ false };
+    std::atomic<UINT64> m_DroppedFrames{ 0 };
+
+    alignas(64) std::atomic<INT64> m_WritePosition{ 0 };
+    alignas(64) std::atomic<INT64> m_ReadPosition{ 0 };
+};
+
+//
+//  CMixer
+//
+//  Sums every capture into a single output stream: all of them with --mix, or the per-target captures
+//  of one stream that merges several process trees.  Sources are aligned by the QPC position of their
+//  packets rather than by arrival order: the mixer thread runs a fixed latency behind the performance
+//  counter and, every period, mixes the frames whose time has come from all sources with per-source
+//  gain into a float accumulator, then writes the block in the capture format (int16 saturates).  A
+//  source that has not delivered a frame by then contributes silence for it.
+//
+class CMixer : public CCaptureSinkProvider
+{
+public:
+    CMixer() = default;
+    ~CMixer();
+
+    // The mixed stream goes to a sink of pOutput with stream id outputStreamId.
+    HRESULT Initialize(CCaptureSinkProvider* pOutput, double latencyMs, UINT32 outputStreamId = 0);
+    void Shutdown();
+
+    // Linear gain for a stream, applied from the next block on.  May be set before the stream starts.
+    void SetGain(UINT32 streamId, float gain);
+
+    // CCaptureSinkProvider.  The first sink fixes the mix format and opens the mixed output stream.
+    HRESULT OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 cbMaxPacket, bool writeHeader,
+        std::shared_ptr<CCaptureSink>& sink) override;
+    void CloseSink(const std::shared_ptr<CCaptureSink>& sink) override;
+
+private:
+    HRESULT OpenOutput(const WAVEFORMATEX& format, UINT32 cbMinCapacity, bool writeHeader);
+    static DWORD WINAPI MixerThreadProc(LPVOID lpParameter);
+    void MixerThread();
+    void Mix(INT64 targetPosition);
+    void MixBlock(const std::vector<std::shared_ptr<CMixerSource>>& sources, INT64 position, UINT32 frames);
+    INT64 GetTimelinePosition() const;
+
+    CCaptureSinkProvider* m_pOutput = nullptr;
+    double m_LatencyMs = 0.0;
+    UINT32 m_OutputStreamId = 0;
+
+    // Fixed by the first sink
+    WAVEFORMATEXTENSIBLE m_Format{};
+    UINT32 m_Channels = 0;
+    UINT32 m_CapacityFrames = 0;
+    UINT64 m_BaseQpc = 0;
+    INT64 m_LatencyFrames = 0;
+    std::shared_ptr<CCaptureSink> m_OutputSink;
+    PFN_MIXER_TO_FLOAT m_pfnToFloat = nullptr;
+    PFN_MIXER_ACCUMULATE m_pfnAccumulate = nullptr;
+    PFN_MIXER_FROM_FLOAT m_pfnFromFloat = nullptr;
+
+    // Mixer thread only, preallocated for one block.  m_MixPosition is read when a source is added.
+    std::vector<float> m_Accumulator;
+    std::vector<BYTE> m_OutputBuffer;
+    std::vector<std::shared_ptr<CMixerSource>> m_SourcesSnapshot;
+    std::atomic<INT64> m_MixPosition{ 0 };
+
+    wil::unique_event_nothrow m_StopEvent;
+    wil::unique_handle m_MixerThread;
+
+    // Guards the source list and the gain table; the capture threads never take it.
+    wil::srwlock m_SourcesLock;
+    std::vector<std::shared_ptr<CMixerSource>> m_Sources;
+    std::map<UINT32, float> m_Gains;
+};
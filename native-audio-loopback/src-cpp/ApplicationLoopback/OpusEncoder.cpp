@@ -0,0 +1,449 @@
+#include <AudioClient.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+#include <wil\result.h>
+
+#include "OpusEncoder.h"
+#include "Profiler.h"
+#include "StreamProtocol.h"
+
+#ifdef LOOPBACK_HAS_OPUS
+#include <opus.h>
+#endif
+
+// How often the encoder wakes up without new data to report problems.
+#define ENCODER_REPORT_INTERVAL_MS 1000
+
+// Largest packet libopus recommends budgeting for.
+#define OPUS_MAX_PACKET_BYTES 4000
+
+#define HNS_PER_SEC 10000000ULL
+
+//
+//  Thin wrappers over libopus so that the rest of the stage doesn't care whether it was built in.
+//
+
+static HRESULT CreateOpusEncoder(UINT32 samplesPerSec, UINT32 channels, UINT32 bitrate, OpusEncoder** ppEncoder)
+{
+#ifdef LOOPBACK_HAS_OPUS
+	int error = OPUS_OK;
+	OpusEncoder* encoder = opus_encoder_create(static_cast<opus_int32>(samplesPerSec), static_cast<int>(channels), OPUS_APPLICATION_AUDIO, &error);
+	if (error != OPUS_OK)
+	{
+		std::wcerr << L"opus_encoder_create failed: " << opus_strerror(error) << L"\n";
+		return E_INVALIDARG;
+	}
+
+	opus_encoder_ctl(encoder, OPUS_SET_BITRATE(static_cast<opus_int32>(bitrate)));
+	*ppEncoder = encoder;
+	return S_OK;
+#else
+	UNREFERENCED_PARAMETER(samplesPerSec);
+	UNREFERENCED_PARAMETER(channels);
+	UNREFERENCED_PARAMETER(bitrate);
+	*ppEncoder = nullptr;
+	return E_NOTIMPL;
+#endif
+}
+
+static void DestroyOpusEncoder(OpusEncoder* encoder)
+{
+#ifdef LOOPBACK_HAS_OPUS
+	opus_encoder_destroy(encoder);
+#else
+	UNREFERENCED_PARAMETER(encoder);
+#endif
+}
+
+// Size of the encoded packet, or a negative libopus error code.
+static int EncodeOpusFrame(OpusEncoder* encoder, SampleFormat sampleFormat, const BYTE* pPcm, UINT32 frames, BYTE* pPacket, UINT32 cbPacket)
+{
+#ifdef LOOPBACK_HAS_OPUS
+	if (sampleFormat == SampleFormat::Float32)
+	{
+		return opus_encode_float(encoder, reinterpret_cast<const float*>(pPcm), static_cast<int>(frames), pPacket, static_cast<opus_int32>(cbPacket));
+	}
+	return opus_encode(encoder, reinterpret_cast<const opus_int16*>(pPcm), static_cast<int>(frames), pPacket, static_cast<opus_int32>(cbPacket));
+#else
+	UNREFERENCED_PARAMETER(encoder);
+	UNREFERENCED_PARAMETER(sampleFormat);
+	UNREFERENCED_PARAMETER(pPcm);
+	UNREFERENCED_PARAMETER(frames);
+	UNREFERENCED_PARAMETER(pPacket);
+	UNREFERENCED_PARAMETER(cbPacket);
+	return -1;
+#endif
+}
+
+//
+//  COpusEncoderStream
+//
+
+COpusEncoderStream::~COpusEncoderStream()
+{
+	if (m_Encoder != nullptr)
+	{
+		DestroyOpusEncoder(m_Encoder);
+	}
+}
+
+bool COpusEncoderStream::WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info)
+{
+	return WriteInputRecord(pData, cbData, info, InputRecordKind::Audio);
+}
+
+bool COpusEncoderStream::WriteSilence(const CapturePacketInfo& info)
+{
+	return WriteInputRecord(nullptr, 0, info, InputRecordKind::Silence);
+}
+
+bool COpusEncoderStream::WriteMeter(const LOOPBACK_METER_PAYLOAD& meter, const CapturePacketInfo& info)
+{
+	return WriteInputRecord(&meter, sizeof(meter), info, InputRecordKind::Meter);
+}
+
+bool COpusEncoderStream::WriteInputRecord(const void* pData, UINT32 cbData, const CapturePacketInfo& info, InputRecordKind kind)
+{
+	if (m_Finished.load(std::memory_order_acquire))
+	{
+		return false;
+	}
+
+	InputRecordHeader header{};
+	header.Frames = info.Frames;
+	header.Flags = info.Flags;
+	header.Kind = kind;
+	header.DevicePosition = info.DevicePosition;
+	header.QpcPosition = info.QpcPosition;
+
+	if (!m_Input.Reserve(static_cast<UINT32>(sizeof(header)) + cbData))
+	{
+		m_OverrunCount.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	m_Input.Append(&header, sizeof(header));
+	if (cbData > 0)
+	{
+		m_Input.Append(pData, cbData);
+	}
+	m_Input.Commit();
+	return true;
+}
+
+void COpusEncoderStream::NotifyDataReady()
+{
+	SetEvent(m_hDataReady);
+}
+
+//
+//  COpusEncoder
+//
+
+COpusEncoder::~COpusEncoder()
+{
+	Shutdown();
+}
+
+HRESULT COpusEncoder::Initialize(CCaptureSinkProvider* pOutput, bool framed, UINT32 frameMs, UINT32 bitrate)
+{
+#ifndef LOOPBACK_HAS_OPUS
+	std::wcerr << L"This build has no Opus support; rebuild with /p:OpusRoot=<libopus install dir>.\n";
+	return E_NOTIMPL;
+#else
+	m_pOutput = pOutput;
+	m_Framed = framed;
+	m_FrameMs = frameMs;
+	m_Bitrate = bitrate;
+
+	// Auto-reset: capture threads signal once per callback, the encoder drains everything it finds.
+	RETURN_IF_FAILED(m_DataReadyEvent.create(wil::EventOptions::None));
+	RETURN_IF_FAILED(m_StopEvent.create(wil::EventOptions::ManualReset));
+
+	m_EncoderThread.reset(CreateThread(nullptr, 0, COpusEncoder::EncoderThreadProc, this, 0, nullptr));
+	RETURN_LAST_ERROR_IF(!m_EncoderThread);
+
+	return S_OK;
+#endif
+}
+
+//
+//  Shutdown()
+//
+//  Encodes what is left of every stream, closes their downstream sinks and stops the encoder thread.
+//
+void COpusEncoder::Shutdown()
+{
+	if (m_EncoderThread)
+	{
+		m_StopEvent.SetEvent();
+		WaitForSingleObject(m_EncoderThread.get(), INFINITE);
+		m_EncoderThread.reset();
+	}
+}
+
+//
+//  OpenSink()
+//
+//  Creates the libopus encoder for the stream and opens its downstream sink.  The stream header
+//  downstream describes the Opus stream, not the PCM that goes in.
+//
+HRESULT COpusEncoder::OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 /*cbMaxPacket*/, bool writeHeader,
+	std::shared_ptr<CCaptureSink>& sink)
+{
+	const SampleFormat sampleFormat = GetSampleFormat(&format);
+	const UINT32 rate = format.nSamplesPerSec;
+	const bool supportedRate = (rate == 8000 || rate == 12000 || rate == 16000 || rate == 24000 || rate == 48000);
+	if ((sampleFormat != SampleFormat::Int16 && sampleFormat != SampleFormat::Float32) || !supportedRate ||
+		format.nChannels < 1 || format.nChannels > 2)
+	{
+		std::wcerr << L"Opus can't encode " << rate << L" Hz, " << format.nChannels << L" ch; use --format pcm16\n";
+		return AUDCLNT_E_UNSUPPORTED_FORMAT;
+	}
+
+	auto stream = std::make_shared<COpusEncoderStream>();
+	RETURN_IF_FAILED(stream->m_Input.Initialize(cbMinCapacity));
+	RETURN_IF_FAILED(CreateOpusEncoder(rate, format.nChannels, m_Bitrate, &stream->m_Encoder));
+
+	stream->m_hDataReady = m_DataReadyEvent.get();
+	stream->m_SampleFormat = sampleFormat;
+	stream->m_BlockAlign = format.nBlockAlign;
+	stream->m_SamplesPerSec = rate;
+	stream->m_FrameSize = rate * m_FrameMs / 1000;
+	stream->m_Pcm.resize(static_cast<size_t>(stream->m_FrameSize) * format.nBlockAlign);
+	stream->m_Packet.resize(sizeof(LOOPBACK_PACKET_HEADER) + OPUS_MAX_PACKET_BYTES);
+
+	WAVEFORMATEX opusFormat{};
+	opusFormat.wFormatTag = WAVE_FORMAT_OPUS;
+	opusFormat.nChannels = format.nChannels;
+	opusFormat.nSamplesPerSec = rate;
+	opusFormat.nAvgBytesPerSec = m_Bitrate / 8;
+
+	// Two seconds of packets at the target bitrate, with room for the per-packet headers.
+	const UINT32 cbOutputCapacity = (std::max)(m_Bitrate / 4, 64u * 1024u);
+	RETURN_IF_FAILED(m_pOutput->OpenSink(streamId, opusFormat, cbOutputCapacity, static_cast<UINT32>(stream->m_Packet.size()), writeHeader,
+		stream->m_Output));
+
+	{
+		auto lock = m_StreamsLock.lock_exclusive();
+		m_Streams.push_back(stream);
+	}
+
+	sink = std::move(stream);
+	return S_OK;
+}
+
+void COpusEncoder::CloseSink(const std::shared_ptr<CCaptureSink>& sink)
+{
+	if (sink)
+	{
+		// The encoder thread flushes the stream and closes its downstream sink.
+		static_cast<COpusEncoderStream*>(sink.get())->m_Closed.store(true, std::memory_order_release);
+		m_DataReadyEvent.SetEvent();
+	}
+}
+
+DWORD WINAPI COpusEncoder::EncoderThreadProc(LPVOID lpParameter)
+{
+	static_cast<COpusEncoder*>(lpParameter)->EncoderThread();
+	return 0;
+}
+
+void COpusEncoder::EncoderThread()
+{
+	CThreadProfile::TagCurrentThread(ProfileThread::Encoder);
+	HANDLE waitHandles[] = { m_StopEvent.get(), m_DataReadyEvent.get() };
+
+	for (;;)
+	{
+		DWORD waitResult = WaitForMultipleObjects(ARRAYSIZE(waitHandles), waitHandles, FALSE, ENCODER_REPORT_INTERVAL_MS);
+
+		const bool stopping = (waitResult == WAIT_OBJECT_0 || waitResult == WAIT_FAILED);
+		DrainStreams(stopping);
+
+		if (stopping)
+		{
+			break;
+		}
+	}
+}
+
+//
+//  DrainStreams()
+//
+//  Encodes every stream's pending input.  Streams that were closed (or all of them, when stopping)
+//  get their last partial frame padded with silence and encoded, and their downstream sink closed.
+//  A finished stream refuses writes from before its last drain on, so a capture that is still running
+//  sees them fail rather than filling a ring nobody reads.
+//
+void COpusEncoder::DrainStreams(bool stopping)
+{
+	std::vector<std::shared_ptr<COpusEncoderStream>>& streams = m_StreamsSnapshot;
+	{
+		auto lock = m_StreamsLock.lock_shared();
+		streams = m_Streams;
+	}
+
+	bool anyFinished = false;
+	for (auto& stream : streams)
+	{
+		// Read the flag before draining so nothing written just before closing is left behind.
+		const bool finished = stopping || stream->m_Closed.load(std::memory_order_acquire);
+		if (finished)
+		{
+			stream->m_Finished.store(true, std::memory_order_release);
+		}
+		DrainInput(*stream);
+		ReportErrors(*stream);
+
+		if (finished && stream->m_Output)
+		{
+			FlushPartialFrame(*stream);
+			stream->m_Output->NotifyDataReady();
+			m_pOutput->CloseSink(stream->m_Output);
+			stream->m_Output.reset();
+			anyFinished = true;
+		}
+		else if (stream->m_Output)
+		{
+			stream->m_Output->NotifyDataReady();
+		}
+	}
+
+	if (anyFinished)
+	{
+		auto lock = m_StreamsLock.lock_exclusive();
+		m_Streams.erase(std::remove_if(m_Streams.begin(), m_Streams.end(), [](const std::shared_ptr<COpusEncoderStream>& stream)
+			{
+				return !stream->m_Output;
+			}), m_Streams.end());
+	}
+
+	streams.clear();
+}
+
+//
+//  DrainInput()
+//
+//  Moves queued PCM into the frame buffer and encodes each frame as it fills.  A frame's positions
+//  are those of its first sample, interpolated within the packet it came from, and its flags are
+//  those of every packet that contributed to it.  A silence record ends the current frame early
+//  (padded with zeros) so the silence it stands for lands after it downstream.  Meter records go
+//  straight through, ahead of the frame still filling.
+//
+void COpusEncoder::DrainInput(COpusEncoderStream& stream)
+{
+	COpusEncoderStream::InputRecordHeader header;
+	while (stream.m_Input.GetReadAvailable() >= sizeof(header))
+	{
+		// Records are committed whole, so the payload is always there once the header is.
+		stream.m_Input.Read(&header, sizeof(header));
+
+		if (header.Kind != COpusEncoderStream::InputRecordKind::Audio)
+		{
+			CapturePacketInfo info;
+			info.Frames = header.Frames;
+			info.Flags = header.Flags;
+			info.DevicePosition = header.DevicePosition;
+			info.QpcPosition = header.QpcPosition;
+
+			if (header.Kind == COpusEncoderStream::InputRecordKind::Meter)
+			{
+				LOOPBACK_METER_PAYLOAD meter;
+				stream.m_Input.Read(&meter, sizeof(meter));
+				stream.m_Output->WriteMeter(meter, info);
+			}
+			else
+			{
+				FlushPartialFrame(stream);
+				stream.m_Output->WriteSilence(info);
+			}
+			continue;
+		}
+
+		UINT32 offset = 0;
+		while (offset < header.Frames)
+		{
+			if (stream.m_PcmFrames == 0)
+			{
+				stream.m_PcmDevicePosition = header.DevicePosition + offset;
+				stream.m_PcmQpcPosition = header.QpcPosition + offset * HNS_PER_SEC / stream.m_SamplesPerSec;
+			}
+			stream.m_PcmFlags |= header.Flags;
+
+			const UINT32 frames = (std::min)(header.Frames - offset, stream.m_FrameSize - stream.m_PcmFrames);
+			stream.m_Input.Read(stream.m_Pcm.data() + static_cast<size_t>(stream.m_PcmFrames) * stream.m_BlockAlign,
+				frames * stream.m_BlockAlign);
+			stream.m_PcmFrames += frames;
+			offset += frames;
+
+			if (stream.m_PcmFrames == stream.m_FrameSize)
+			{
+				EncodeFrame(stream);
+			}
+		}
+	}
+}
+
+// Pads a partly filled frame with silence and encodes it; Opus only takes whole frames.
+void COpusEncoder::FlushPartialFrame(COpusEncoderStream& stream)
+{
+	if (stream.m_PcmFrames > 0)
+	{
+		memset(stream.m_Pcm.data() + static_cast<size_t>(stream.m_PcmFrames) * stream.m_BlockAlign, 0,
+			static_cast<size_t>(stream.m_FrameSize - stream.m_PcmFrames) * stream.m_BlockAlign);
+		stream.m_PcmFrames = stream.m_FrameSize;
+		EncodeFrame(stream);
+	}
+}
+
+void COpusEncoder::EncodeFrame(COpusEncoderStream& stream)
+{
+	const UINT32 cbHeader = m_Framed ? 0 : static_cast<UINT32>(sizeof(LOOPBACK_PACKET_HEADER));
+	BYTE* pPacket = stream.m_Packet.data();
+
+	const int cbEncoded = EncodeOpusFrame(stream.m_Encoder, stream.m_SampleFormat, stream.m_Pcm.data(), stream.m_FrameSize,
+		pPacket + cbHeader, OPUS_MAX_PACKET_BYTES);
+	const UINT32 flags = stream.m_PcmFlags;
+	stream.m_PcmFrames = 0;
+	stream.m_PcmFlags = 0;
+
+	if (cbEncoded < 0)
+	{
+		stream.m_EncodeErrors++;
+		return;
+	}
+
+	if (!m_Framed)
+	{
+		LOOPBACK_PACKET_HEADER header{};
+		header.PayloadSize = static_cast<UINT32>(cbEncoded);
+		header.FrameCount = stream.m_FrameSize;
+		header.QpcPosition = stream.m_PcmQpcPosition;
+		memcpy(pPacket, &header, sizeof(header));
+	}
+
+	CapturePacketInfo info;
+	info.Frames = stream.m_FrameSize;
+	info.Flags = flags;
+	info.DevicePosition = stream.m_PcmDevicePosition;
+	info.QpcPosition = stream.m_PcmQpcPosition;
+	stream.m_Output->WritePacket(pPacket, cbHeader + static_cast<UINT32>(cbEncoded), info);
+}
+
+void COpusEncoder::ReportErrors(COpusEncoderStream& stream)
+{
+	const UINT64 overrunCount = stream.m_OverrunCount.load(std::memory_order_relaxed);
+	if (overrunCount != stream.m_ReportedOverrunCount || stream.m_EncodeErrors != 0)
+	{
+		// One write, so it doesn't interleave with other threads' stderr lines
+		std::wostringstream line;
+		line << L"Encoder: " << (overrunCount - stream.m_ReportedOverrunCount) << L" packet(s) dropped, "
+			<< stream.m_EncodeErrors << L" frame(s) failed to encode\n";
+		std::wcerr << line.str() << std::flush;
+		stream.m_ReportedOverrunCount = overrunCount;
+		stream.m_EncodeErrors = 0;
+	}
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <Windows.h>
+#include <mmreg.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <wil\resource.h>
+
+#include "CaptureSink.h"
+#include "RingBuffer.h"
+#include "SampleFormat.h"
+
+// libopus' encoder state; only OpusEncoder.cpp sees its definition.
+struct OpusEncoder;
+
+//
+//  COpusEncoderStream
+//
+//  One stream's path into the encoder.  The capture thread only copies each packet, with its frame
+//  count, flags and positions, into a preallocated PCM ring.  The encoder thread cuts the PCM into Opus
+//  frames, encodes them and is the only producer of the stream's downstream sink.
+//
+class COpusEncoderStream : public CCaptureSink
+{
+public:
+    COpusEncoderStream() = default;
+    ~COpusEncoderStream();
+    COpusEncoderStream(const COpusEncoderStream&) = delete;
+    COpusEncoderStream& operator=(const COpusEncoderStream&) = delete;
+
+    // CCaptureSink; capture thread only.
+    bool WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info) override;
+    bool WriteSilence(const CapturePacketInfo& info) override;
+    bool WriteMeter(const LOOPBACK_METER_PAYLOAD& meter, const CapturePacketInfo& info) override;
+    void NotifyDataReady() override;
+
+private:
+    friend class COpusEncoder;
+
+    // Silence records carry no samples; the encoder flushes what it has and passes them on.  Meter
+    // records carry a LOOPBACK_METER_PAYLOAD and are passed on as they come.
+    enum class InputRecordKind : UINT32
+    {
+        Audio,
+        Silence,
+        Meter,
+    };
+
+    struct InputRecordHeader
+    {
+        UINT32 Frames;
+        UINT32 Flags;
+        InputRecordKind Kind;
+        UINT32 Reserved;
+        UINT64 DevicePosition;
+        UINT64 QpcPosition;
+    };
+
+    bool WriteInputRecord(const void* pData, UINT32 cbData, const CapturePacketInfo& info, InputRecordKind kind);
+
+    CPacketRing m_Input;
+    HANDLE m_hDataReady = nullptr;
+    std::atomic<bool> m_Closed{ false };
+    // Set by the encoder thread once it has flushed the stream and dropped it; later writes fail.
+    std::atomic<bool> m_Finished{ false };
+    std::atomic<UINT64> m_OverrunCount{ 0 };
+
+    // Encoder thread only
+    std::shared_ptr<CCaptureSink> m_Output;
+    OpusEncoder* m_Encoder = nullptr;
+    SampleFormat m_SampleFormat = SampleFormat::Unknown;
+    UINT32 m_BlockAlign = 0;
+    UINT32 m_SamplesPerSec = 0;
+    UINT32 m_FrameSize = 0;
+    std::vector<BYTE> m_Pcm;
+    UINT32 m_PcmFrames = 0;
+    UINT32 m_PcmFlags = 0;
+    UINT64 m_PcmDevicePosition = 0;
+    UINT64 m_PcmQpcPosition = 0;
+    std::vector<BYTE> m_Packet;
+    UINT64 m_EncodeErrors = 0;
+    UINT64 m_ReportedOverrunCount = 0;
+};
+
+//
+//  COpusEncoder
+//
+//  Encoder stage between the captures (or the mixer) and the output.  Every sink it hands out is
+//  encoded to Opus on one shared encoder thread, so neither the real-time capture callback nor the
+//  Electron renderer pays for encoding, and the pipe carries ~20x less data than 16-bit PCM.  Packets
+//  go downstream as framed records, or behind a LOOPBACK_PACKET_HEADER on an unframed channel.
+//
+//  Needs libopus: build with /p:OpusRoot=<install dir> to define LOOPBACK_HAS_OPUS.  Without it
+//  Initialize fails with E_NOTIMPL.
+//
+class COpusEncoder : public CCaptureSinkProvider
+{
+public:
+    COpusEncoder() = default;
+    ~COpusEncoder();
+
+    HRESULT Initialize(CCaptureSinkProvider* pOutput, bool framed, UINT32 frameMs, UINT32 bitrate);
+    // Flushes and closes every stream, open or not.  The captures writing into it are expected to
+    // have stopped already (CCaptureHost::Shutdown stops them first).  Otherwise their later writes
+    // fail, and only one racing the shutdown itself can be accepted and lost.
+    void Shutdown();
+
+    // CCaptureSinkProvider.  The input must be 16-bit or float at a rate Opus supports, mono or stereo.
+    HRESULT OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 cbMaxPacket, bool writeHeader,
+        std::shared_ptr<CCaptureSink>& sink) override;
+    void CloseSink(const std::shared_ptr<CCaptureSink>& sink) override;
+
+private:
+    static DWORD WINAPI EncoderThreadProc(LPVOID lpParameter);
+    void EncoderThread();
+    void DrainStreams(bool stopping);
+    void DrainInput(COpusEncoderStream& stream);
+    void FlushPartialFrame(COpusEncoderStream& stream);
+    void EncodeFrame(COpusEncoderStream& stream);
+    void ReportErrors(COpusEncoderStream& stream);
+
+    CCaptureSinkProvider* m_pOutput = nullptr;
+    bool m_Framed = false;
+    UINT32 m_FrameMs = 0;
+    UINT32 m_Bitrate = 0;
+
+    wil::unique_event_nothrow m_DataReadyEvent;
+    wil::unique_event_nothrow m_StopEvent;
+    wil::unique_handle m_EncoderThread;
+
+    // Guarded by m_StreamsLock, which the capture threads never take.
+    wil::srwlock m_StreamsLock;
+    std::vector<std::shared_ptr<COpusEncoderStream>> m_Streams;
+
+    // Encoder thread only: DrainStreams' copy of m_Streams, kept so its storage is reused.
+    std::vector<std::shared_ptr<COpusEncoderStream>> m_StreamsSnapshot;
+};
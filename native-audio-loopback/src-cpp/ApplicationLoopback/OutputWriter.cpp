@@ -0,0 +1,543 @@
+#include <stdio.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "OutputWriter.h"
+#include "Profiler.h"
+#include "QpcClock.h"
+#include "StreamProtocol.h"
+#include "Tracing.h"
+
+// How often the writer wakes up without new data to report overruns.
+#define OUTPUT_REPORT_INTERVAL_MS 1000
+
+// How long CloseStream waits for room for a stream's end record.
+#define OUTPUT_CLOSE_RETRIES 100
+#define OUTPUT_CLOSE_RETRY_MS 10
+
+bool COutputStream::WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info)
+{
+	const bool written = m_Framed ?
+		WriteRecord(LOOPBACK_FRAME_AUDIO, pData, cbData, info) :
+		m_Ring.TryWrite(pData, cbData);
+
+	if (!written)
+	{
+		m_pOverrunCount->fetch_add(1, std::memory_order_relaxed);
+		m_pOverrunBytes->fetch_add(cbData, std::memory_order_relaxed);
+	}
+
+	return written;
+}
+
+bool COutputStream::WriteSilence(const CapturePacketInfo& info)
+{
+	if (!m_Framed)
+	{
+		return true;
+	}
+
+	const bool written = WriteRecord(LOOPBACK_FRAME_SILENCE, nullptr, 0, info);
+	if (!written)
+	{
+		m_pOverrunCount->fetch_add(1, std::memory_order_relaxed);
+	}
+
+	return written;
+}
+
+bool COutputStream::WriteMeter(const LOOPBACK_METER_PAYLOAD& meter, const CapturePacketInfo& info)
+{
+	if (!m_Framed)
+	{
+		return true;
+	}
+
+	const bool written = WriteRecord(LOOPBACK_FRAME_METER, &meter, sizeof(meter), info);
+	if (!written)
+	{
+		m_pOverrunCount->fetch_add(1, std::memory_order_relaxed);
+		m_pOverrunBytes->fetch_add(sizeof(meter), std::memory_order_relaxed);
+	}
+
+	return written;
+}
+
+void COutputStream::NotifyDataReady()
+{
+	SetEvent(m_hDataReady);
+}
+
+//
+//  WriteRecord()
+//
+//  Publishes a LOOPBACK_FRAME_HEADER and its payload as one unit, or nothing if they don't both fit.
+//
+bool COutputStream::WriteRecord(UINT16 type, const void* pPayload, UINT32 cbPayload, const CapturePacketInfo& info)
+{
+	LOOPBACK_FRAME_HEADER header{};
+	header.Magic = LOOPBACK_FRAME_MAGIC;
+	header.Type = type;
+	header.StreamId = static_cast<UINT16>(m_StreamId);
+	header.PayloadSize = cbPayload;
+	header.FrameCount = info.Frames;
+	header.Flags = info.Flags;
+	header.DevicePosition = info.DevicePosition;
+	header.QpcPosition = info.QpcPosition;
+
+	if (!m_Ring.Reserve(static_cast<UINT32>(sizeof(header)) + cbPayload))
+	{
+		return false;
+	}
+
+	m_Ring.Append(&header, sizeof(header));
+	if (cbPayload > 0)
+	{
+		m_Ring.Append(pPayload, cbPayload);
+	}
+	m_Ring.Commit();
+
+	return true;
+}
+
+//
+//  InitializeSharedMemory()
+//
+//  Creates "<name>" as a pagefile-backed section holding LOOPBACK_SHARED_RING_HEADER followed by the
+//  ring data, and "<name>.DataReady" as the wake-up event for the reader.
+//
+HRESULT COutputStream::InitializeSharedMemory(PCWSTR sharedMemoryName, const WAVEFORMATEX& format, UINT32 cbMinCapacity)
+{
+	RETURN_HR_IF(E_INVALIDARG, sharedMemoryName == nullptr || *sharedMemoryName == L'\0');
+
+	const UINT32 cbCapacity = CPacketRing::RoundUpCapacity(cbMinCapacity);
+	RETURN_HR_IF(E_INVALIDARG, cbCapacity == 0);
+
+	// Keep the ring data cache-line aligned behind the header.
+	const UINT32 cbHeader = (sizeof(LOOPBACK_SHARED_RING_HEADER) + 63) & ~63u;
+	const UINT64 cbMapping = static_cast<UINT64>(cbHeader) + cbCapacity;
+
+	m_hMapping.reset(CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+		static_cast<DWORD>(cbMapping >> 32), static_cast<DWORD>(cbMapping), sharedMemoryName));
+	RETURN_LAST_ERROR_IF(!m_hMapping);
+
+	// Someone else's section under the same name would have the wrong size and stale cursors.
+	RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), GetLastError() == ERROR_ALREADY_EXISTS);
+
+	m_SharedHeader.reset(static_cast<LOOPBACK_SHARED_RING_HEADER*>(MapViewOfFile(m_hMapping.get(), FILE_MAP_ALL_ACCESS, 0, 0, 0)));
+	RETURN_LAST_ERROR_IF(!m_SharedHeader);
+
+	// A fresh section is zero-filled, so the cursors and counters already start at 0.
+	LOOPBACK_SHARED_RING_HEADER* header = m_SharedHeader.get();
+	header->Version = LOOPBACK_SHARED_RING_VERSION;
+	header->HeaderSize = cbHeader;
+	header->Capacity = cbCapacity;
+	header->FormatTag = GetWireFormatTag(&format);
+	header->Channels = format.nChannels;
+	header->SamplesPerSec = format.nSamplesPerSec;
+	header->BitsPerSample = format.wBitsPerSample;
+	header->BlockAlign = format.nBlockAlign;
+
+	m_Ring.Attach(reinterpret_cast<BYTE*>(header) + cbHeader, cbCapacity, &header->WritePosition, &header->ReadPosition);
+	m_pOverrunCount = &header->OverrunCount;
+	m_pOverrunBytes = &header->OverrunBytes;
+
+	std::wstring eventName(sharedMemoryName);
+	eventName += LOOPBACK_SHARED_RING_EVENT_SUFFIX;
+	// Auto-reset: signaled once per capture callback that committed data.
+	RETURN_IF_FAILED(m_SharedDataReadyEvent.create(wil::EventOptions::None, eventName.c_str()));
+	m_hDataReady = m_SharedDataReadyEvent.get();
+
+	// Publish the magic last so a reader polling for the section never sees a half-filled header.
+	std::atomic_thread_fence(std::memory_order_release);
+	header->Magic = LOOPBACK_SHARED_RING_MAGIC;
+
+	return S_OK;
+}
+
+COutputWriter::~COutputWriter()
+{
+	Shutdown();
+}
+
+//
+//  Initialize()
+//
+//  Sets up the output channel and starts the writer thread for the pipe-based modes.  Streams are
+//  opened separately, once each capture knows its format.
+//
+HRESULT COutputWriter::Initialize(OutputMode mode, PCWSTR sharedMemoryName, bool framed, UINT32 chunkMs, UINT32 chunkLatencyMs)
+{
+	m_Mode = mode;
+	m_Framed = framed;
+	m_ChunkMs = chunkMs;
+	m_ChunkLatencyHns = static_cast<UINT64>(chunkLatencyMs) * (QPC_HNS_PER_SEC / 1000);
+
+	if (m_Mode == OutputMode::SharedMemory)
+	{
+		RETURN_HR_IF(E_INVALIDARG, sharedMemoryName == nullptr || *sharedMemoryName == L'\0');
+		m_SharedMemoryName = sharedMemoryName;
+		return S_OK;
+	}
+
+	// Auto-reset: capture threads signal once per callback, the writer drains everything it finds.
+	RETURN_IF_FAILED(m_DataReadyEvent.create(wil::EventOptions::None));
+	RETURN_IF_FAILED(m_StopEvent.create(wil::EventOptions::ManualReset));
+
+	if (m_Mode == OutputMode::Pipe)
+	{
+		m_hPipe = GetStdHandle(STD_OUTPUT_HANDLE);
+		RETURN_LAST_ERROR_IF(m_hPipe == INVALID_HANDLE_VALUE);
+		// No stdout attached: GetStdHandle doesn't set a last error for that
+		RETURN_HR_IF(E_HANDLE, m_hPipe == nullptr);
+		RETURN_IF_FAILED(m_WriteCompletedEvent.create(wil::EventOptions::ManualReset));
+
+		// A file writes at the OVERLAPPED's offset even on a synchronous handle, so carry on from
+		// wherever the file pointer is (the end, with >>)
+		if (GetFileType(m_hPipe) == FILE_TYPE_DISK)
+		{
+			LARGE_INTEGER position{};
+			RETURN_IF_WIN32_BOOL_FALSE(SetFilePointerEx(m_hPipe, LARGE_INTEGER{}, &position, FILE_CURRENT));
+			m_WritePosition = static_cast<UINT64>(position.QuadPart);
+		}
+	}
+
+	m_WriterThread.reset(CreateThread(nullptr, 0, COutputWriter::WriterThreadProc, this, 0, nullptr));
+	RETURN_LAST_ERROR_IF(!m_WriterThread);
+
+	return S_OK;
+}
+
+//
+//  Shutdown()
+//
+//  Asks the writer thread to drain what is left in every ring and waits for it to exit.
+//
+HRESULT COutputWriter::Shutdown()
+{
+	if (m_WriterThread)
+	{
+		m_StopEvent.SetEvent();
+		WaitForSingleObject(m_WriterThread.get(), INFINITE);
+		m_WriterThread.reset();
+	}
+
+	// Shared-memory streams have no writer thread; report whatever the reader made us drop.
+	auto lock = m_StreamsLock.lock_exclusive();
+	for (auto& stream : m_Streams)
+	{
+		ReportOverruns(*stream);
+	}
+	m_Streams.clear();
+
+	return S_OK;
+}
+
+//
+//  OpenStream()
+//
+//  Preallocates the stream's ring, locally or in its own shared-memory section, and queues its header.
+//  Framed streams in shared-memory mode each get a section named "<name>.<streamId>".
+//
+HRESULT COutputWriter::OpenStream(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, bool writeHeader,
+	std::shared_ptr<COutputStream>& stream)
+{
+	auto newStream = std::make_shared<COutputStream>();
+	newStream->m_StreamId = streamId;
+	newStream->m_Framed = m_Framed;
+
+	if (m_Mode == OutputMode::SharedMemory)
+	{
+		std::wstring name = m_SharedMemoryName;
+		if (m_Framed)
+		{
+			name += L"." + std::to_wstring(streamId);
+		}
+		RETURN_IF_FAILED(newStream->InitializeSharedMemory(name.c_str(), format, cbMinCapacity));
+	}
+	else
+	{
+		RETURN_IF_FAILED(newStream->m_Ring.Initialize(cbMinCapacity));
+		newStream->m_hDataReady = m_DataReadyEvent.get();
+
+		// Framed records count their headers too, so a framed chunk holds slightly less audio.  A
+		// chunk never needs more than half the ring, or the capture would overrun waiting for it.
+		const UINT64 cbChunk = static_cast<UINT64>(format.nAvgBytesPerSec) * m_ChunkMs / 1000;
+		newStream->m_cbChunk = static_cast<UINT32>((std::min)(cbChunk, static_cast<UINT64>(newStream->m_Ring.GetCapacity() / 2)));
+	}
+
+	LOOPBACK_STREAM_HEADER streamHeader;
+	FillStreamHeader(&format, streamHeader);
+	if (m_Framed)
+	{
+		RETURN_HR_IF(E_OUTOFMEMORY, !newStream->WriteRecord(LOOPBACK_FRAME_FORMAT, &streamHeader, sizeof(streamHeader), CapturePacketInfo{}));
+	}
+	else if (writeHeader && m_Mode != OutputMode::SharedMemory)
+	{
+		// The shared-memory ring describes its format in the section header instead.
+		RETURN_HR_IF(E_OUTOFMEMORY, !newStream->m_Ring.TryWrite(reinterpret_cast<const BYTE*>(&streamHeader), sizeof(streamHeader)));
+	}
+
+	{
+		auto lock = m_StreamsLock.lock_exclusive();
+		m_Streams.push_back(newStream);
+	}
+
+	newStream->NotifyDataReady();
+	stream = std::move(newStream);
+
+	return S_OK;
+}
+
+//
+//  CloseStream()
+//
+//  Called once the stream's capture has stopped.  The writer thread drains the rest of the ring and
+//  drops the stream; shared-memory streams go right away since the reader drains those.
+//
+void COutputWriter::CloseStream(const std::shared_ptr<COutputStream>& stream)
+{
+	if (!stream)
+	{
+		return;
+	}
+
+	if (m_Framed)
+	{
+		// The capture has stopped, so this thread is now the stream's only producer and can afford to
+		// wait for room rather than lose the end record.
+		for (UINT32 attempt = 0; !stream->WriteRecord(LOOPBACK_FRAME_END, nullptr, 0, CapturePacketInfo{}) && attempt < OUTPUT_CLOSE_RETRIES; attempt++)
+		{
+			Sleep(OUTPUT_CLOSE_RETRY_MS);
+		}
+		stream->NotifyDataReady();
+	}
+
+	stream->m_Closed.store(true, std::memory_order_release);
+
+	if (m_Mode == OutputMode::SharedMemory)
+	{
+		auto lock = m_StreamsLock.lock_exclusive();
+		ReportOverruns(*stream);
+		m_Streams.erase(std::remove(m_Streams.begin(), m_Streams.end(), stream), m_Streams.end());
+	}
+	else
+	{
+		m_DataReadyEvent.SetEvent();
+	}
+}
+
+HRESULT COutputWriter::OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 /*cbMaxPacket*/, bool writeHeader,
+	std::shared_ptr<CCaptureSink>& sink)
+{
+	std::shared_ptr<COutputStream> stream;
+	RETURN_IF_FAILED(OpenStream(streamId, format, cbMinCapacity, writeHeader, stream));
+	sink = std::move(stream);
+	return S_OK;
+}
+
+void COutputWriter::CloseSink(const std::shared_ptr<CCaptureSink>& sink)
+{
+	CloseStream(std::static_pointer_cast<COutputStream>(sink));
+}
+
+DWORD WINAPI COutputWriter::WriterThreadProc(LPVOID lpParameter)
+{
+	static_cast<COutputWriter*>(lpParameter)->WriterThread();
+	return 0;
+}
+
+void COutputWriter::WriterThread()
+{
+	CThreadProfile::TagCurrentThread(ProfileThread::Writer);
+	HANDLE waitHandles[] = { m_StopEvent.get(), m_DataReadyEvent.get() };
+
+	DWORD timeout = OUTPUT_REPORT_INTERVAL_MS;
+	for (;;)
+	{
+		DWORD waitResult = WaitForMultipleObjects(ARRAYSIZE(waitHandles), waitHandles, FALSE, timeout);
+		const bool stopping = (waitResult == WAIT_OBJECT_0 || waitResult == WAIT_FAILED);
+
+		timeout = DrainStreams(stopping);
+
+		if (stopping)
+		{
+			break;
+		}
+	}
+}
+
+//
+//  DrainStreams()
+//
+//  Drains every open stream and drops the closed ones once they are empty.  Works on a snapshot of
+//  the list so m_StreamsLock is never held while the pipe blocks.  With chunking, a stream short of
+//  a chunk is left alone until its partial chunk is due, unless flush is set or the stream has been
+//  closed.  Returns how long the writer may wait before a partial chunk falls due.
+//
+DWORD COutputWriter::DrainStreams(bool flush)
+{
+	std::vector<std::shared_ptr<COutputStream>>& streams = m_StreamsSnapshot;
+	{
+		auto lock = m_StreamsLock.lock_shared();
+		streams = m_Streams;
+	}
+
+	const UINT64 now = GetQpcPosition();
+	DWORD timeout = OUTPUT_REPORT_INTERVAL_MS;
+	bool anyClosed = false;
+	bool wroteAny = false;
+	for (auto& stream : streams)
+	{
+		// Read the flag before draining so the end record queued just before closing is drained too.
+		const bool closed = stream->m_Closed.load(std::memory_order_acquire);
+
+		const UINT32 cbAvailable = stream->m_Ring.GetReadAvailable();
+		if (stream->m_cbChunk != 0 && cbAvailable > 0 && !closed && !flush)
+		{
+			if (stream->m_PendingSinceQpc == 0)
+			{
+				stream->m_PendingSinceQpc = now;
+			}
+
+			const UINT64 waited = now - stream->m_PendingSinceQpc;
+			if (cbAvailable < stream->m_cbChunk && waited < m_ChunkLatencyHns)
+			{
+				// Round up so the next wake-up finds the chunk due rather than a tick early
+				const UINT64 msLeft = (m_ChunkLatencyHns - waited + (QPC_HNS_PER_SEC / 1000) - 1) / (QPC_HNS_PER_SEC / 1000);
+				timeout = (std::min)(timeout, static_cast<DWORD>(msLeft));
+				ReportOverruns(*stream);
+				continue;
+			}
+		}
+
+		wroteAny |= DrainRing(stream->m_Ring, stream->m_StreamId);
+		stream->m_PendingSinceQpc = 0;
+		ReportOverruns(*stream);
+		anyClosed |= closed;
+	}
+
+	if (wroteAny && m_Mode == OutputMode::Stdout)
+	{
+		fflush(stdout);
+	}
+
+	if (anyClosed)
+	{
+		auto lock = m_StreamsLock.lock_exclusive();
+		m_Streams.erase(std::remove_if(m_Streams.begin(), m_Streams.end(), [](const std::shared_ptr<COutputStream>& stream)
+			{
+				return stream->m_Closed.load(std::memory_order_acquire) && stream->m_Ring.IsEmpty();
+			}), m_Streams.end());
+	}
+
+	streams.clear();
+	return timeout;
+}
+
+//
+//  DrainRing()
+//
+//  Writes every committed byte of one ring to the output.  This is the only place that can block on
+//  the pipe.  Committed data always ends on a record boundary, so records of different streams never
+//  interleave mid-record.  While output events are traced, writes that block for longer than
+//  TRACE_OUTPUT_STALL_MS are logged as stalls.
+//
+bool COutputWriter::DrainRing(CPacketRing& ring, UINT32 streamId)
+{
+	const BYTE* pData = nullptr;
+	UINT32 cbData = 0;
+	bool wroteAny = false;
+	const bool traceStalls = CCaptureTrace::IsEnabled(WINEVENT_LEVEL_INFO, TRACE_KEYWORD_OUTPUT);
+
+	while ((cbData = ring.GetReadRegion(&pData)) > 0)
+	{
+		const UINT64 writeStart = traceStalls ? GetQpcPosition() : 0;
+
+		// A short or failed write means the reader went away; consume anyway so the ring keeps moving.
+		if (m_Mode == OutputMode::Pipe)
+		{
+			WritePipe(pData, cbData);
+		}
+		else
+		{
+			fwrite(pData, 1, cbData, stdout);
+		}
+		ring.Consume(cbData);
+		wroteAny = true;
+
+		if (traceStalls)
+		{
+			const UINT64 writeTime = GetQpcPosition() - writeStart;
+			if (writeTime >= TRACE_OUTPUT_STALL_MS * QPC_HNS_PER_SEC / 1000)
+			{
+				TraceLoggingWrite(g_hLoopbackTraceProvider, "OutputStall",
+					TraceLoggingLevel(WINEVENT_LEVEL_INFO), TraceLoggingKeyword(TRACE_KEYWORD_OUTPUT),
+					TraceLoggingUInt32(streamId, "StreamId"),
+					TraceLoggingUInt32(cbData, "Bytes"),
+					TraceLoggingUInt64(writeStart, "QpcPosition"),
+					TraceLoggingUInt64(writeTime, "Duration"));
+			}
+		}
+	}
+
+	return wroteAny;
+}
+
+//
+//  WritePipe()
+//
+//  Writes straight out of ring memory with WriteFile.  If the handle was opened for overlapped I/O the
+//  write is issued asynchronously and awaited here; otherwise WriteFile completes in place.  Either
+//  way an OVERLAPPED is passed, and for a file its offset is where the data goes, so every write
+//  carries m_WritePosition; pipes and consoles ignore it.  The ring region stays valid until the
+//  write finishes because it is consumed afterwards.
+//
+HRESULT COutputWriter::WritePipe(const BYTE* pData, UINT32 cbData)
+{
+	while (cbData > 0)
+	{
+		OVERLAPPED overlapped{};
+		overlapped.Offset = static_cast<DWORD>(m_WritePosition);
+		overlapped.OffsetHigh = static_cast<DWORD>(m_WritePosition >> 32);
+		overlapped.hEvent = m_WriteCompletedEvent.get();
+		m_WriteCompletedEvent.ResetEvent();
+
+		DWORD cbWritten = 0;
+		if (!WriteFile(m_hPipe, pData, cbData, nullptr, &overlapped))
+		{
+			RETURN_LAST_ERROR_IF(GetLastError() != ERROR_IO_PENDING);
+		}
+		RETURN_IF_WIN32_BOOL_FALSE(GetOverlappedResult(m_hPipe, &overlapped, &cbWritten, TRUE));
+		RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_BROKEN_PIPE), cbWritten == 0);
+
+		pData += cbWritten;
+		cbData -= cbWritten;
+		m_WritePosition += cbWritten;
+	}
+
+	return S_OK;
+}
+
+void COutputWriter::ReportOverruns(COutputStream& stream)
+{
+	UINT64 overrunCount = stream.GetOverrunCount();
+	if (overrunCount != stream.m_ReportedOverrunCount)
+	{
+		// One write, so it doesn't interleave with other threads' stderr lines
+		std::wostringstream line;
+		line << L"Output overrun on stream " << stream.m_StreamId << L": "
+			<< (overrunCount - stream.m_ReportedOverrunCount) << L" packet(s) dropped ("
+			<< overrunCount << L" packets, " << stream.GetOverrunBytes() << L" bytes total)\n";
+		std::wcerr << line.str() << std::flush;
+		TraceLoggingWrite(g_hLoopbackTraceProvider, "OutputOverrun",
+			TraceLoggingLevel(WINEVENT_LEVEL_WARNING), TraceLoggingKeyword(TRACE_KEYWORD_OUTPUT),
+			TraceLoggingUInt32(stream.m_StreamId, "StreamId"),
+			TraceLoggingUInt64(overrunCount - stream.m_ReportedOverrunCount, "DroppedPackets"),
+			TraceLoggingUInt64(overrunCount, "TotalDroppedPackets"),
+			TraceLoggingUInt64(stream.GetOverrunBytes(), "TotalDroppedBytes"));
+		stream.m_ReportedOverrunCount = overrunCount;
+	}
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <Windows.h>
+#include <mmreg.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <wil\resource.h>
+#include <wil\result.h>
+
+#include "CaptureSink.h"
+#include "RingBuffer.h"
+#include "SharedRing.h"
+
+enum class OutputMode
+{
+    // CRT fwrite on stdout from the writer thread.
+    Stdout,
+    // WriteFile on the raw stdout handle straight out of ring memory, bypassing the CRT buffer and lock.
+    Pipe,
+    // Named file mapping + event; the capture thread writes directly into memory the reader maps.
+    SharedMemory,
+};
+
+//
+//  COutputStream
+//
+//  One capture stream's path to the output.  Owned jointly by the capture that produces into it and by
+//  the COutputWriter that drains it.  The capture thread only copies packets into the stream's
+//  preallocated ring (WritePacket) and wakes the consumer (NotifyDataReady); when the ring is full the
+//  packet is dropped and counted instead of blocking.  In framed mode every packet is published
+//  together with its LOOPBACK_FRAME_HEADER, so the consumer only ever sees whole records, and
+//  suppressed silence becomes a LOOPBACK_FRAME_SILENCE record and levels a LOOPBACK_FRAME_METER
+//  record; unframed, both are simply left out.
+//
+class COutputStream : public CCaptureSink
+{
+public:
+    COutputStream() = default;
+    COutputStream(const COutputStream&) = delete;
+    COutputStream& operator=(const COutputStream&) = delete;
+
+    // CCaptureSink; capture thread only.
+    bool WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info) override;
+    bool WriteSilence(const CapturePacketInfo& info) override;
+    bool WriteMeter(const LOOPBACK_METER_PAYLOAD& meter, const CapturePacketInfo& info) override;
+    void NotifyDataReady() override;
+
+    UINT32 GetStreamId() const { return m_StreamId; }
+    UINT64 GetOverrunCount() const { return m_pOverrunCount->load(std::memory_order_relaxed); }
+    UINT64 GetOverrunBytes() const { return m_pOverrunBytes->load(std::memory_order_relaxed); }
+
+private:
+    friend class COutputWriter;
+
+    HRESULT InitializeSharedMemory(PCWSTR sharedMemoryName, const WAVEFORMATEX& format, UINT32 cbMinCapacity);
+    bool WriteRecord(UINT16 type, const void* pPayload, UINT32 cbPayload, const CapturePacketInfo& info);
+
+    UINT32 m_StreamId = 0;
+    bool m_Framed = false;
+    CPacketRing m_Ring;
+
+    // Set once the capture has stopped; the writer drops the stream after draining it.
+    std::atomic<bool> m_Closed{ false };
+
+    // Event that wakes the consumer: the writer thread's, or the stream's own named event for shm.
+    HANDLE m_hDataReady = nullptr;
+
+    // SharedMemory mode
+    wil::unique_handle m_hMapping;
+    wil::unique_mapview_ptr<LOOPBACK_SHARED_RING_HEADER> m_SharedHeader;
+    wil::unique_event_nothrow m_SharedDataReadyEvent;
+
+    // Point at the local counters, or at the shared header so the reader can see them too.
+    std::atomic<UINT64> m_OverrunCount{ 0 };
+    std::atomic<UINT64> m_OverrunBytes{ 0 };
+    std::atomic<UINT64>* m_pOverrunCount = &m_OverrunCount;
+    std::atomic<UINT64>* m_pOverrunBytes = &m_OverrunBytes;
+
+    // Writer thread only: last total printed to stderr.
+    UINT64 m_ReportedOverrunCount = 0;
+
+    // Writer thread only, with chunking: bytes that make a chunk, and when the writer first found the
+    // data it is still holding back (0 while nothing is).
+    UINT32 m_cbChunk = 0;
+    UINT64 m_PendingSinceQpc = 0;
+};
+
+//
+//  COutputWriter
+//
+//  Owns the process's output channel.  In the Stdout and Pipe modes a dedicated writer thread drains
+//  every open stream's ring in turn, so a slow reader on the other end of the pipe can never stall
+//  WASAPI and several captures can share one pipe.  With chunking, a stream's data is held back until
+//  a chunk's worth has built up or the oldest of it has waited the chunk latency, so the reader gets
+//  a few large writes instead of one per packet.  In SharedMemory mode each stream's ring lives in
+//  its own mapping and the reader process is the consumer.
+//
+class COutputWriter : public CCaptureSinkProvider
+{
+public:
+    COutputWriter() = default;
+    ~COutputWriter();
+
+    // chunkMs of 0 writes each capture callback's packets as they come.
+    HRESULT Initialize(OutputMode mode, PCWSTR sharedMemoryName, bool framed, UINT32 chunkMs = 0, UINT32 chunkLatencyMs = 0);
+    HRESULT Shutdown();
+
+    // Creates the stream's ring and queues its stream header (framed, or raw when writeHeader is set).
+    HRESULT OpenStream(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, bool writeHeader,
+        std::shared_ptr<COutputStream>& stream);
+
+    // Queues the stream's end record.  The writer drains what is left and then lets the stream go.
+    void CloseStream(const std::shared_ptr<COutputStream>& stream);
+
+    // CCaptureSinkProvider: every capture gets its own stream.
+    HRESULT OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 cbMaxPacket, bool writeHeader,
+        std::shared_ptr<CCaptureSink>& sink) override;
+    void CloseSink(const std::shared_ptr<CCaptureSink>& sink) override;
+
+private:
+    static DWORD WINAPI WriterThreadProc(LPVOID lpParameter);
+    void WriterThread();
+    DWORD DrainStreams(bool flush);
+    bool DrainRing(CPacketRing& ring, UINT32 streamId);
+    HRESULT WritePipe(const BYTE* pData, UINT32 cbData);
+    void ReportOverruns(COutputStream& stream);
+
+    OutputMode m_Mode = OutputMode::Stdout;
+    bool m_Framed = false;
+    std::wstring m_SharedMemoryName;
+    UINT32 m_ChunkMs = 0;
+    UINT64 m_ChunkLatencyHns = 0;
+
+    wil::unique_event_nothrow m_DataReadyEvent;
+    wil::unique_event_nothrow m_StopEvent;
+    wil::unique_handle m_WriterThread;
+
+    // Streams being drained.  Guarded by m_StreamsLock, which the capture threads never take.
+    wil::srwlock m_StreamsLock;
+    std::vector<std::shared_ptr<COutputStream>> m_Streams;
+
+    // Writer thread only: DrainStreams' copy of m_Streams, kept so its storage is reused.
+    std::vector<std::shared_ptr<COutputStream>> m_StreamsSnapshot;
+
+    // Pipe mode
+    HANDLE m_hPipe = INVALID_HANDLE_VALUE;
+    wil::unique_event_nothrow m_WriteCompletedEvent;
+    // Where the next write goes when stdout is redirected to a file; pipes ignore it
+    UINT64 m_WritePosition = 0;
+};
@@ -0,0 +1,215 @@
+#include <psapi.h>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "Profiler.h"
+
+#define HNS_PER_MS 10000
+
+//
+//  CThreadProfile
+//
+
+namespace
+{
+	struct TaggedThread
+	{
+		ProfileThread Role;
+		wil::unique_handle Thread;
+	};
+
+	// Constructed on first use, so tagging works from any thread however early.
+	struct ThreadRegistry
+	{
+		wil::srwlock Lock;
+		std::vector<TaggedThread> Threads;
+	};
+
+	ThreadRegistry& GetThreadRegistry()
+	{
+		static ThreadRegistry registry;
+		return registry;
+	}
+
+	UINT64 FileTimeToHns(const FILETIME& time)
+	{
+		return (static_cast<UINT64>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+	}
+}
+
+void CThreadProfile::AddCurrentThread(ProfileThread role)
+{
+	wil::unique_handle thread(OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, GetCurrentThreadId()));
+	if (!thread)
+	{
+		return;
+	}
+
+	ThreadRegistry& registry = GetThreadRegistry();
+	auto lock = registry.Lock.lock_exclusive();
+	registry.Threads.push_back({ role, std::move(thread) });
+}
+
+void CThreadProfile::GetCpuTimes(UINT64 (&cpuTimes)[static_cast<size_t>(ProfileThread::Count)])
+{
+	std::fill(std::begin(cpuTimes), std::end(cpuTimes), 0ULL);
+
+	ThreadRegistry& registry = GetThreadRegistry();
+	auto lock = registry.Lock.lock_shared();
+	for (const auto& tagged : registry.Threads)
+	{
+		FILETIME creation, exit, kernel, user;
+		if (GetThreadTimes(tagged.Thread.get(), &creation, &exit, &kernel, &user))
+		{
+			cpuTimes[static_cast<size_t>(tagged.Role)] += FileTimeToHns(kernel) + FileTimeToHns(user);
+		}
+	}
+}
+
+//
+//  CProfileReporter
+//
+
+CProfileReporter::~CProfileReporter()
+{
+	Shutdown();
+}
+
+HRESULT CProfileReporter::Initialize(UINT32 intervalMs)
+{
+	m_IntervalMs = intervalMs;
+	m_StartTick = m_LastTick = GetTickCount64();
+	RETURN_IF_FAILED(m_StopEvent.create(wil::EventOptions::ManualReset));
+
+	m_ReporterThread.reset(CreateThread(nullptr, 0, CProfileReporter::ReporterThreadProc, this, 0, nullptr));
+	RETURN_LAST_ERROR_IF(!m_ReporterThread);
+
+	return S_OK;
+}
+
+void CProfileReporter::Shutdown()
+{
+	if (!m_ReporterThread)
+	{
+		return;
+	}
+
+	m_StopEvent.SetEvent();
+	WaitForSingleObject(m_ReporterThread.get(), INFINITE);
+	m_ReporterThread.reset();
+
+	auto lock = m_StatsLock.lock_exclusive();
+	Report(true);
+	m_Stats.clear();
+}
+
+void CProfileReporter::Add(UINT32 streamId, const std::shared_ptr<CCaptureStats>& stats)
+{
+	if (!m_ReporterThread)
+	{
+		return;
+	}
+
+	auto lock = m_StatsLock.lock_exclusive();
+	m_Stats.emplace_back(streamId, stats);
+}
+
+void CProfileReporter::Remove(UINT32 streamId)
+{
+	auto lock = m_StatsLock.lock_exclusive();
+	auto retired = std::partition(m_Stats.begin(), m_Stats.end(),
+		[streamId](const auto& entry) { return entry.first != streamId; });
+	for (auto it = retired; it != m_Stats.end(); ++it)
+	{
+		it->second->AddPacketTimeHistogram(m_RetiredHistogram);
+	}
+	m_Stats.erase(retired, m_Stats.end());
+}
+
+DWORD WINAPI CProfileReporter::ReporterThreadProc(LPVOID lpParameter)
+{
+	static_cast<CProfileReporter*>(lpParameter)->ReporterThread();
+	return 0;
+}
+
+void CProfileReporter::ReporterThread()
+{
+	while (WaitForSingleObject(m_StopEvent.get(), m_IntervalMs) == WAIT_TIMEOUT)
+	{
+		auto lock = m_StatsLock.lock_exclusive();
+		Report(false);
+	}
+}
+
+//
+//  Report()
+//
+//  Prints one profile line, built first and written in one go like the stats lines.  Called with
+//  m_StatsLock held.
+//
+void CProfileReporter::Report(bool final)
+{
+	FILETIME creation, exit, kernel, user;
+	UINT64 cpuTime = 0;
+	if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+	{
+		cpuTime = FileTimeToHns(kernel) + FileTimeToHns(user);
+	}
+
+	UINT64 threadTimes[static_cast<size_t>(ProfileThread::Count)];
+	CThreadProfile::GetCpuTimes(threadTimes);
+	UINT64 taggedTime = 0;
+	for (UINT64 time : threadTimes)
+	{
+		taggedTime += time;
+	}
+
+	PROCESS_MEMORY_COUNTERS_EX memory{};
+	GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&memory), sizeof(memory));
+
+	UINT64 histogram[CAPTURE_PACKET_TIME_BUCKETS];
+	std::copy(std::begin(m_RetiredHistogram), std::end(m_RetiredHistogram), histogram);
+	for (const auto& stats : m_Stats)
+	{
+		stats.second->AddPacketTimeHistogram(histogram);
+	}
+	UINT64 packets = 0;
+	for (UINT64 count : histogram)
+	{
+		packets += count;
+	}
+
+	// Share of one core over the time that actually passed
+	const ULONGLONG tick = GetTickCount64();
+	const UINT64 intervalMs = (std::max)(tick - m_LastTick, 1ULL);
+	const double cpuPercent = 100.0 * (cpuTime - (std::min)(m_LastCpuTime, cpuTime)) / (intervalMs * HNS_PER_MS);
+	m_LastTick = tick;
+	m_LastCpuTime = cpuTime;
+
+	std::wostringstream line;
+	line << std::fixed << std::setprecision(1)
+		<< L"{\"event\":\"profile\",\"final\":" << (final ? L"true" : L"false")
+		<< L",\"uptimeMs\":" << (tick - m_StartTick)
+		<< L",\"cpuPercent\":" << cpuPercent
+		<< L",\"cpuMs\":{\"total\":" << cpuTime / HNS_PER_MS
+		<< L",\"capture\":" << threadTimes[static_cast<size_t>(ProfileThread::Capture)] / HNS_PER_MS
+		<< L",\"writer\":" << threadTimes[static_cast<size_t>(ProfileThread::Writer)] / HNS_PER_MS
+		<< L",\"mixer\":" << threadTimes[static_cast<size_t>(ProfileThread::Mixer)] / HNS_PER_MS
+		<< L",\"encoder\":" << threadTimes[static_cast<size_t>(ProfileThread::Encoder)] / HNS_PER_MS
+		<< L",\"other\":" << (cpuTime - (std::min)(taggedTime, cpuTime)) / HNS_PER_MS
+		<< L"},\"workingSetKB\":" << memory.WorkingSetSize / 1024
+		<< L",\"peakWorkingSetKB\":" << memory.PeakWorkingSetSize / 1024
+		<< L",\"privateKB\":" << memory.PrivateUsage / 1024
+		<< L",\"pageFaults\":" << memory.PageFaultCount
+		<< L",\"packets\":" << packets
+		<< L",\"packetTimeUs\":[";
+	for (UINT32 i = 0; i < CAPTURE_PACKET_TIME_BUCKETS; i++)
+	{
+		line << (i != 0 ? L"," : L"") << histogram[i];
+	}
+	line << L"]}\n";
+	std::wcerr << line.str() << std::flush;
+}
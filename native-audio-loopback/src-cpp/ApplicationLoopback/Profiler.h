@@ -0,0 +1,101 @@
+#pragma once
+
+#include <Windows.h>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <wil\resource.h>
+#include <wil\result.h>
+
+#include "CaptureStats.h"
+
+// What a thread of the process spends its time on, for splitting the process's CPU time.
+enum class ProfileThread
+{
+    // The shared "Capture" work queue's threads, or the per-capture threads of --engine thread.
+    Capture,
+    Writer,
+    Mixer,
+    Encoder,
+    Count,
+};
+
+//
+//  CThreadProfile
+//
+//  Process-wide list of tagged threads.  Each pipeline thread tags itself when it starts, and the
+//  capture callbacks tag whichever work-queue thread they run on; after a thread's first tag that is
+//  a thread_local test and nothing else.  The handles are kept after the threads exit, so their CPU
+//  time still counts.
+//
+class CThreadProfile
+{
+public:
+    // Any thread.  A thread keeps the role it was first tagged with.
+    static void TagCurrentThread(ProfileThread role)
+    {
+        thread_local bool tagged = false;
+        if (!tagged)
+        {
+            tagged = true;
+            AddCurrentThread(role);
+        }
+    }
+
+    // User plus kernel time of every tagged thread, by role, in 100-ns units.
+    static void GetCpuTimes(UINT64 (&cpuTimes)[static_cast<size_t>(ProfileThread::Count)]);
+
+private:
+    static void AddCurrentThread(ProfileThread role);
+};
+
+//
+//  CProfileReporter
+//
+//  With --profile, prints what the process costs to stderr as one JSON line every interval and a
+//  last one (with "final":true) at shutdown:
+//
+//      {"event":"profile","final":false,"uptimeMs":60000,"cpuPercent":1.2,"cpuMs":{"total":710,
+//       "capture":420,"writer":150,"mixer":0,"encoder":0,"other":140},"workingSetKB":9210,
+//       "peakWorkingSetKB":9480,"privateKB":4120,"pageFaults":3012,"packets":600000,
+//       "packetTimeUs":[120000,380000,90000,9000,900,90,10,0,0,0]}
+//
+//  cpuPercent is the process's CPU time over the last interval as a share of one core; the rest are
+//  totals since startup.  packetTimeUs is a histogram over every capture, including stopped ones,
+//  of how long a packet took from GetBuffer to ReleaseBuffer; bucket i counts packets under 8 << i
+//  microseconds, and the last bucket everything slower.
+//
+class CProfileReporter
+{
+public:
+    CProfileReporter() = default;
+    ~CProfileReporter();
+
+    HRESULT Initialize(UINT32 intervalMs);
+    // Prints the final report.
+    void Shutdown();
+
+    // Main thread.  Ignored unless the reporter was initialized.  A stream merging several targets
+    // adds each target's stats under its id, and Remove retires them all.
+    void Add(UINT32 streamId, const std::shared_ptr<CCaptureStats>& stats);
+    void Remove(UINT32 streamId);
+
+private:
+    static DWORD WINAPI ReporterThreadProc(LPVOID lpParameter);
+    void ReporterThread();
+    void Report(bool final);
+
+    UINT32 m_IntervalMs = 0;
+    wil::unique_event_nothrow m_StopEvent;
+    wil::unique_handle m_ReporterThread;
+
+    ULONGLONG m_StartTick = 0;
+    ULONGLONG m_LastTick = 0;
+    UINT64 m_LastCpuTime = 0;
+
+    wil::srwlock m_StatsLock;
+    std::vector<std::pair<UINT32, std::shared_ptr<CCaptureStats>>> m_Stats;
+    // What the captures that have gone away had counted.
+    UINT64 m_RetiredHistogram[CAPTURE_PACKET_TIME_BUCKETS] = {};
+};
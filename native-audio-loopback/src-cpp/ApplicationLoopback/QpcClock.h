@@ -0,0 +1,20 @@
+#pragma once
+
+#include <Windows.h>
+
+#define QPC_HNS_PER_SEC 10000000LL
+
+// Performance counter in the 100-ns units GetBuffer reports its QPC position in.
+inline UINT64 GetQpcPosition()
+{
+    static const LONGLONG frequency = []()
+    {
+        LARGE_INTEGER value;
+        QueryPerformanceFrequency(&value);
+        return value.QuadPart;
+    }();
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return static_cast<UINT64>((counter.QuadPart / frequency) * QPC_HNS_PER_SEC + (counter.QuadPart % frequency) * QPC_HNS_PER_SEC / frequency);
+}
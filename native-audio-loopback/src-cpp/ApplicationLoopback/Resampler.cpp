@@ -0,0 +1,452 @@
+#include <AudioClient.h>
+#include <immintrin.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+
+#include <wil\result.h>
+
+#include "CpuFeatures.h"
+#include "Resampler.h"
+#include "StreamProtocol.h"
+
+// Rate ratios that need more filter phases than this (e.g. 44100 -> 47999) are refused.
+#define RESAMPLER_MAX_PHASES 1024
+
+#define RESAMPLER_MIN_RATE 8000
+#define RESAMPLER_MAX_RATE 192000
+
+// Downmix weight of a channel that feeds both sides, or the far side, of a stereo pair (-3 dB).
+#define RESAMPLER_MINUS_3DB 0.7071f
+
+#define PI 3.14159265358979323846
+
+//
+//  Kernels
+//
+//  One output sample is the dot product of a phase's coefficients with the newest m_Taps samples of
+//  a channel plane, in SSE2 and AVX2 flavors.  Resample() takes the flavor as a template argument,
+//  so the call inlines into the instantiation picked when the stream opens.
+//
+
+static float DotSse2(const float* pCoefficients, const float* pSamples, size_t taps)
+{
+	__m128 a = _mm_setzero_ps();
+	__m128 b = _mm_setzero_ps();
+
+	size_t i = 0;
+	for (; i + 8 <= taps; i += 8)
+	{
+		a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(pCoefficients + i), _mm_loadu_ps(pSamples + i)));
+		b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(pCoefficients + i + 4), _mm_loadu_ps(pSamples + i + 4)));
+	}
+
+	// Horizontal sum of the four lanes
+	a = _mm_add_ps(a, b);
+	a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+	a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+	float sum = _mm_cvtss_f32(a);
+
+	for (; i < taps; i++)
+	{
+		sum += pCoefficients[i] * pSamples[i];
+	}
+	return sum;
+}
+
+static float DotAvx2(const float* pCoefficients, const float* pSamples, size_t taps)
+{
+	__m256 a = _mm256_setzero_ps();
+	__m256 b = _mm256_setzero_ps();
+
+	size_t i = 0;
+	for (; i + 16 <= taps; i += 16)
+	{
+		a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(pCoefficients + i), _mm256_loadu_ps(pSamples + i)));
+		b = _mm256_add_ps(b, _mm256_mul_ps(_mm256_loadu_ps(pCoefficients + i + 8), _mm256_loadu_ps(pSamples + i + 8)));
+	}
+
+	a = _mm256_add_ps(a, b);
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+	_mm256_zeroupper();
+
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum) + DotSse2(pCoefficients + i, pSamples + i, taps - i);
+}
+
+//
+//  Filter design
+//
+
+// Zeroth-order modified Bessel function of the first kind, for the Kaiser window.
+static double BesselI0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+	for (int k = 1; k < 32; k++)
+	{
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void GetQualityParameters(ResampleQuality quality, UINT32& taps, double& rolloff, double& beta)
+{
+	switch (quality)
+	{
+	case ResampleQuality::Fast:
+		taps = 16; rolloff = 0.85; beta = 6.0;
+		break;
+	case ResampleQuality::Best:
+		taps = 64; rolloff = 0.95; beta = 10.0;
+		break;
+	default:
+		taps = 32; rolloff = 0.91; beta = 8.0;
+		break;
+	}
+}
+
+//
+//  DesignFilter()
+//
+//  Lowpass prototype at the upsampled rate (input rate * up), cut off below the lower of the two
+//  Nyquist frequencies, split into up phases of taps coefficients each.  Every phase is normalized
+//  to unity gain at DC so no phase is louder than another.
+//
+static void DesignFilter(UINT32 up, UINT32 down, UINT32 taps, double rolloff, double beta, std::vector<float>& coefficients)
+{
+	const UINT32 length = up * taps;
+	const double cutoff = rolloff * 0.5 / (std::max)(up, down);
+	const double center = (length - 1) / 2.0;
+	const double windowScale = 1.0 / BesselI0(beta);
+
+	coefficients.assign(length, 0.0f);
+	std::vector<double> row(taps);
+	for (UINT32 phase = 0; phase < up; phase++)
+	{
+		double sum = 0.0;
+		for (UINT32 k = 0; k < taps; k++)
+		{
+			const UINT32 n = phase + k * up;
+			const double t = n - center;
+			const double sinc = (t == 0.0) ? 2.0 * cutoff : sin(2.0 * PI * cutoff * t) / (PI * t);
+			const double r = (length > 1) ? (2.0 * n / (length - 1) - 1.0) : 0.0;
+			const double window = BesselI0(beta * sqrt((std::max)(0.0, 1.0 - r * r))) * windowScale;
+			row[k] = sinc * window;
+			sum += row[k];
+		}
+
+		// Tap k multiplies the sample k frames back, so the newest sample takes the last coefficient.
+		for (UINT32 k = 0; k < taps; k++)
+		{
+			coefficients[phase * taps + (taps - 1 - k)] = static_cast<float>(sum != 0.0 ? row[k] / sum : 0.0);
+		}
+	}
+}
+
+//
+//  BuildDownmixMatrix()
+//
+//  Weights of every input channel in every output channel, by speaker position when the format has
+//  a channel mask: left speakers go left, right speakers right, centers to both at -3 dB, and LFE is
+//  dropped.  Rows that add up to more than unity are scaled down so a full-scale input can't clip.
+//
+static void BuildDownmixMatrix(const WAVEFORMATEX& format, UINT32 outputChannels, std::vector<float>& matrix)
+{
+	const UINT32 inputChannels = format.nChannels;
+	matrix.assign(static_cast<size_t>(outputChannels) * inputChannels, 0.0f);
+
+	if (inputChannels == outputChannels)
+	{
+		for (UINT32 c = 0; c < inputChannels; c++)
+		{
+			matrix[c * inputChannels + c] = 1.0f;
+		}
+		return;
+	}
+
+	DWORD channelMask = 0;
+	if (format.wFormatTag == WAVE_FORMAT_EXTENSIBLE && format.cbSize >= (sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX)))
+	{
+		channelMask = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(&format)->dwChannelMask;
+	}
+
+	const DWORD leftSpeakers = SPEAKER_FRONT_LEFT | SPEAKER_FRONT_LEFT_OF_CENTER | SPEAKER_BACK_LEFT | SPEAKER_SIDE_LEFT |
+		SPEAKER_TOP_FRONT_LEFT | SPEAKER_TOP_BACK_LEFT;
+	const DWORD rightSpeakers = SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_RIGHT_OF_CENTER | SPEAKER_BACK_RIGHT | SPEAKER_SIDE_RIGHT |
+		SPEAKER_TOP_FRONT_RIGHT | SPEAKER_TOP_BACK_RIGHT;
+	const DWORD mainSpeakers = SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT;
+
+	// Channel c is the c-th set bit of the mask; channels beyond the mask have no known position.
+	DWORD remaining = channelMask;
+	for (UINT32 c = 0; c < inputChannels; c++)
+	{
+		const DWORD speaker = remaining & (~remaining + 1);
+		remaining &= ~speaker;
+
+		float left = 0.0f;
+		float right = 0.0f;
+		if (speaker == SPEAKER_LOW_FREQUENCY)
+		{
+			continue;
+		}
+		else if (speaker & leftSpeakers)
+		{
+			left = (speaker & mainSpeakers) ? 1.0f : RESAMPLER_MINUS_3DB;
+		}
+		else if (speaker & rightSpeakers)
+		{
+			right = (speaker & mainSpeakers) ? 1.0f : RESAMPLER_MINUS_3DB;
+		}
+		else if (speaker != 0)
+		{
+			left = right = RESAMPLER_MINUS_3DB;
+		}
+		else
+		{
+			// No mask: alternate left and right
+			((c % 2) == 0 ? left : right) = 1.0f;
+		}
+
+		if (inputChannels == 1)
+		{
+			// Mono to stereo is a copy, not a -3 dB pan
+			left = right = 1.0f;
+		}
+
+		if (outputChannels == 1)
+		{
+			matrix[c] = (left + right) * 0.5f;
+		}
+		else
+		{
+			matrix[0 * inputChannels + c] = left;
+			matrix[1 * inputChannels + c] = right;
+		}
+	}
+
+	for (UINT32 o = 0; o < outputChannels; o++)
+	{
+		float* row = &matrix[o * inputChannels];
+		const float sum = std::accumulate(row, row + inputChannels, 0.0f);
+		if (sum > 1.0f)
+		{
+			std::transform(row, row + inputChannels, row, [sum](float weight) { return weight / sum; });
+		}
+	}
+}
+
+bool CResamplerStream::WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info)
+{
+	const UINT32 history = m_Taps - 1;
+	const UINT32 frames = (std::min)(cbData / m_InputBlockAlign, m_PlaneFrames - history);
+
+	// Each output channel lands in its plane behind the filter history
+	m_pfnDownmix(pData, frames, m_InputChannels, m_OutputChannels, m_Matrix.data(), &m_Planes[history], m_PlaneFrames);
+
+	const UINT32 outputFrames = (this->*m_pfnResample)(frames, m_Packet.data());
+	if (outputFrames == 0)
+	{
+		return true;
+	}
+
+	CapturePacketInfo output = info;
+	output.Frames = outputFrames;
+	output.DevicePosition = ScalePosition(info.DevicePosition);
+	return m_Output->WritePacket(m_Packet.data(), outputFrames * m_OutputBlockAlign, output);
+}
+
+bool CResamplerStream::WriteSilence(const CapturePacketInfo& info)
+{
+	// Whatever the filter still holds belongs before the gap; start afresh after it.
+	ResetHistory();
+
+	const UINT64 scaled = static_cast<UINT64>(info.Frames) * m_Up + m_SilenceRemainder;
+	m_SilenceRemainder = scaled % m_Down;
+
+	CapturePacketInfo output = info;
+	output.Frames = static_cast<UINT32>(scaled / m_Down);
+	output.DevicePosition = ScalePosition(info.DevicePosition);
+	return m_Output->WriteSilence(output);
+}
+
+// Levels are the input's; only the positions move to the output rate.
+bool CResamplerStream::WriteMeter(const LOOPBACK_METER_PAYLOAD& meter, const CapturePacketInfo& info)
+{
+	CapturePacketInfo output = info;
+	output.Frames = static_cast<UINT32>(ScalePosition(info.Frames));
+	output.DevicePosition = ScalePosition(info.DevicePosition);
+	return m_Output->WriteMeter(meter, output);
+}
+
+void CResamplerStream::NotifyDataReady()
+{
+	m_Output->NotifyDataReady();
+}
+
+//
+//  Resample()
+//
+//  Produces every output frame whose newest input sample is in the planes, interleaved into pOut in
+//  the stream's encoding, then keeps the last m_Taps - 1 input frames as the next packet's history.
+//
+template <SampleFormat Format, UINT32 OutputChannels, PFN_RESAMPLER_DOT Dot>
+UINT32 CResamplerStream::Resample(UINT32 frames, BYTE* pOut)
+{
+	typedef SampleTraits<Format> Traits;
+	const UINT32 channels = (OutputChannels != SAMPLE_KERNEL_ANY_CHANNELS) ? OutputChannels : m_OutputChannels;
+	const UINT32 history = m_Taps - 1;
+	const UINT32 available = history + frames;
+	typename Traits::Type* out = reinterpret_cast<typename Traits::Type*>(pOut);
+
+	UINT32 outputFrames = 0;
+	while (m_Position < available)
+	{
+		const float* coefficients = &m_Coefficients[static_cast<size_t>(m_Phase) * m_Taps];
+		const UINT32 start = m_Position - history;
+		for (UINT32 o = 0; o < channels; o++)
+		{
+			*out++ = Traits::FromFloat(Dot(coefficients, &m_Planes[static_cast<size_t>(o) * m_PlaneFrames + start], m_Taps));
+		}
+		outputFrames++;
+
+		m_Phase += m_Down;
+		m_Position += m_Phase / m_Up;
+		m_Phase %= m_Up;
+	}
+
+	for (UINT32 o = 0; o < channels; o++)
+	{
+		float* plane = &m_Planes[static_cast<size_t>(o) * m_PlaneFrames];
+		memmove(plane, plane + frames, history * sizeof(float));
+	}
+	m_Position -= frames;
+
+	return outputFrames;
+}
+
+template <SampleFormat Format, PFN_RESAMPLER_DOT Dot>
+CResamplerStream::PFN_RESAMPLE CResamplerStream::GetResampleKernel(UINT32 outputChannels)
+{
+	switch (outputChannels)
+	{
+	case 1: return &CResamplerStream::Resample<Format, 1, Dot>;
+	case 2: return &CResamplerStream::Resample<Format, 2, Dot>;
+	default: return &CResamplerStream::Resample<Format, SAMPLE_KERNEL_ANY_CHANNELS, Dot>;
+	}
+}
+
+CResamplerStream::PFN_RESAMPLE CResamplerStream::GetResampleKernel(SampleFormat sampleFormat, UINT32 outputChannels)
+{
+	const bool avx2 = IsAvx2Supported();
+	if (sampleFormat == SampleFormat::Float32)
+	{
+		return avx2 ? GetResampleKernel<SampleFormat::Float32, DotAvx2>(outputChannels) :
+			GetResampleKernel<SampleFormat::Float32, DotSse2>(outputChannels);
+	}
+	return avx2 ? GetResampleKernel<SampleFormat::Int16, DotAvx2>(outputChannels) :
+		GetResampleKernel<SampleFormat::Int16, DotSse2>(outputChannels);
+}
+
+void CResamplerStream::ResetHistory()
+{
+	std::fill(m_Planes.begin(), m_Planes.end(), 0.0f);
+	m_Position = m_Taps - 1;
+	m_Phase = 0;
+}
+
+HRESULT CResampler::Initialize(CCaptureSinkProvider* pOutput, UINT32 outputRate, UINT32 outputChannels, ResampleQuality quality)
+{
+	RETURN_HR_IF(E_INVALIDARG, outputRate != 0 && (outputRate < RESAMPLER_MIN_RATE || outputRate > RESAMPLER_MAX_RATE));
+	RETURN_HR_IF(E_INVALIDARG, outputChannels > 2);
+
+	m_pOutput = pOutput;
+	m_OutputRate = outputRate;
+	m_OutputChannels = outputChannels;
+	m_Quality = quality;
+	return S_OK;
+}
+
+HRESULT CResampler::OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 cbMaxPacket, bool writeHeader,
+	std::shared_ptr<CCaptureSink>& sink)
+{
+	const SampleFormat sampleFormat = GetSampleFormat(&format);
+	RETURN_HR_IF(AUDCLNT_E_UNSUPPORTED_FORMAT, sampleFormat != SampleFormat::Int16 && sampleFormat != SampleFormat::Float32);
+
+	const UINT32 inputRate = format.nSamplesPerSec;
+	const UINT32 outputRate = (m_OutputRate != 0) ? m_OutputRate : inputRate;
+	const UINT32 outputChannels = (m_OutputChannels != 0) ? m_OutputChannels : format.nChannels;
+	const UINT32 divisor = std::gcd(inputRate, outputRate);
+
+	auto stream = std::make_shared<CResamplerStream>();
+	stream->m_Up = outputRate / divisor;
+	stream->m_Down = inputRate / divisor;
+	if (stream->m_Up > RESAMPLER_MAX_PHASES)
+	{
+		std::wcerr << L"Can't resample " << inputRate << L" Hz to " << outputRate << L" Hz\n";
+		return AUDCLNT_E_UNSUPPORTED_FORMAT;
+	}
+
+	stream->m_InputChannels = format.nChannels;
+	stream->m_InputBlockAlign = format.nBlockAlign;
+	stream->m_OutputChannels = outputChannels;
+	stream->m_OutputBlockAlign = outputChannels * (format.wBitsPerSample / 8);
+	BuildDownmixMatrix(format, outputChannels, stream->m_Matrix);
+
+	if (stream->m_Up == 1 && stream->m_Down == 1)
+	{
+		// Channel conversion only
+		stream->m_Taps = 1;
+		stream->m_Coefficients.assign(1, 1.0f);
+	}
+	else
+	{
+		double rolloff = 0.0;
+		double beta = 0.0;
+		GetQualityParameters(m_Quality, stream->m_Taps, rolloff, beta);
+		DesignFilter(stream->m_Up, stream->m_Down, stream->m_Taps, rolloff, beta, stream->m_Coefficients);
+	}
+	stream->m_pfnDownmix = GetDownmixKernel(sampleFormat, format.nChannels, outputChannels);
+	stream->m_pfnResample = CResamplerStream::GetResampleKernel(sampleFormat, outputChannels);
+
+	// Room for the history and the largest packet, and for every frame that packet can turn into
+	const UINT32 maxInputFrames = cbMaxPacket / format.nBlockAlign;
+	const UINT32 maxOutputFrames = static_cast<UINT32>(static_cast<UINT64>(maxInputFrames) * stream->m_Up / stream->m_Down) + 2;
+	stream->m_PlaneFrames = stream->m_Taps - 1 + maxInputFrames;
+	stream->m_Planes.resize(static_cast<size_t>(stream->m_PlaneFrames) * outputChannels);
+	stream->m_Packet.resize(static_cast<size_t>(maxOutputFrames) * stream->m_OutputBlockAlign);
+	stream->ResetHistory();
+
+	WAVEFORMATEXTENSIBLE outputFormat{};
+	memcpy(&outputFormat, &format, (std::min)(sizeof(WAVEFORMATEX) + format.cbSize, sizeof(outputFormat)));
+	outputFormat.Format.nChannels = static_cast<WORD>(outputChannels);
+	outputFormat.Format.nSamplesPerSec = outputRate;
+	outputFormat.Format.nBlockAlign = static_cast<WORD>(stream->m_OutputBlockAlign);
+	outputFormat.Format.nAvgBytesPerSec = outputRate * stream->m_OutputBlockAlign;
+	if (outputFormat.Format.wFormatTag == WAVE_FORMAT_EXTENSIBLE && outputChannels != format.nChannels)
+	{
+		outputFormat.dwChannelMask = (outputChannels == 1) ? KSAUDIO_SPEAKER_MONO : KSAUDIO_SPEAKER_STEREO;
+	}
+
+	// As much time as the capture asked for, at the new data rate
+	const UINT64 cbScaledCapacity = static_cast<UINT64>(cbMinCapacity) * outputFormat.Format.nAvgBytesPerSec / format.nAvgBytesPerSec;
+	const UINT32 cbCapacity = (std::max)(static_cast<UINT32>(cbScaledCapacity), static_cast<UINT32>(stream->m_Packet.size()) * 4);
+	RETURN_IF_FAILED(m_pOutput->OpenSink(streamId, outputFormat.Format, cbCapacity, static_cast<UINT32>(stream->m_Packet.size()), writeHeader,
+		stream->m_Output));
+
+	sink = std::move(stream);
+	return S_OK;
+}
+
+void CResampler::CloseSink(const std::shared_ptr<CCaptureSink>& sink)
+{
+	if (sink)
+	{
+		// Nothing is buffered here beyond the filter's history; the downstream stage drains the rest.
+		m_pOutput->CloseSink(static_cast<CResamplerStream*>(sink.get())->m_Output);
+	}
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <Windows.h>
+#include <mmreg.h>
+#include <memory>
+#include <vector>
+
+#include "CaptureSink.h"
+#include "SampleFormat.h"
+#include "SampleKernels.h"
+
+typedef float (*PFN_RESAMPLER_DOT)(const float* pCoefficients, const float* pSamples, size_t taps);
+
+// Filter length and stopband of the resampler; longer filters cost proportionally more per frame.
+enum class ResampleQuality
+{
+    // 16 taps per phase
+    Fast,
+    // 32 taps per phase
+    Balanced,
+    // 64 taps per phase
+    Best,
+};
+
+//
+//  CResamplerStream
+//
+//  One stream's channel conversion and sample rate conversion.  Every packet is downmixed straight
+//  into per-channel float planes behind the filter's history, run through the polyphase filter and
+//  written to the downstream sink in the input's sample encoding, all in storage preallocated for the
+//  largest packet.  Both steps are kernel instantiations for the stream's encoding and channel counts
+//  (and the CPU's dot product), picked when it opens.  It runs on the thread that produces into it
+//  (the capture callback, or the mixer thread with --mix) and neither blocks nor allocates.
+//
+class CResamplerStream : public CCaptureSink
+{
+public:
+    CResamplerStream() = default;
+    CResamplerStream(const CResamplerStream&) = delete;
+    CResamplerStream& operator=(const CResamplerStream&) = delete;
+
+    // CCaptureSink; producer thread only.
+    bool WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info) override;
+    bool WriteSilence(const CapturePacketInfo& info) override;
+    bool WriteMeter(const LOOPBACK_METER_PAYLOAD& meter, const CapturePacketInfo& info) override;
+    void NotifyDataReady() override;
+
+private:
+    friend class CResampler;
+
+    typedef UINT32 (CResamplerStream::*PFN_RESAMPLE)(UINT32 frames, BYTE* pOut);
+
+    template <SampleFormat Format, UINT32 OutputChannels, PFN_RESAMPLER_DOT Dot>
+    UINT32 Resample(UINT32 frames, BYTE* pOut);
+    template <SampleFormat Format, PFN_RESAMPLER_DOT Dot>
+    static PFN_RESAMPLE GetResampleKernel(UINT32 outputChannels);
+    static PFN_RESAMPLE GetResampleKernel(SampleFormat sampleFormat, UINT32 outputChannels);
+
+    void ResetHistory();
+    UINT64 ScalePosition(UINT64 position) const { return position * m_Up / m_Down; }
+
+    std::shared_ptr<CCaptureSink> m_Output;
+    UINT32 m_InputChannels = 0;
+    UINT32 m_InputBlockAlign = 0;
+    UINT32 m_OutputChannels = 0;
+    UINT32 m_OutputBlockAlign = 0;
+
+    // Output channel o is the sum over input channels i of m_Matrix[o * m_InputChannels + i].
+    std::vector<float> m_Matrix;
+    PFN_DOWNMIX m_pfnDownmix = nullptr;
+
+    // Rate ratio m_Up / m_Down in lowest terms; phase p's m_Taps coefficients start at p * m_Taps,
+    // reversed so they line up with ascending samples.
+    UINT32 m_Up = 1;
+    UINT32 m_Down = 1;
+    UINT32 m_Taps = 1;
+    std::vector<float> m_Coefficients;
+    PFN_RESAMPLE m_pfnResample = nullptr;
+
+    // Channel c's plane starts at c * m_PlaneFrames: m_Taps - 1 frames of history, then the packet.
+    std::vector<float> m_Planes;
+    UINT32 m_PlaneFrames = 0;
+
+    // Where the next output frame's newest input sample is in the planes, and its filter phase.
+    UINT32 m_Position = 0;
+    UINT32 m_Phase = 0;
+
+    // Fraction of an output frame left over from scaling skipped silence.
+    UINT64 m_SilenceRemainder = 0;
+
+    // The converted packet.
+    std::vector<BYTE> m_Packet;
+};
+
+//
+//  CResampler
+//
+//  Optional stage that converts every stream to a given channel count and sample rate before it is
+//  encoded or written, so the capture can stay in the engine's own mix format (--format float) and
+//  only the samples the consumer needs are shipped, e.g. 16 kHz mono for speech recognition.
+//  Conversion is a Kaiser-windowed polyphase FIR filter over the rational rate ratio, with SSE2 and
+//  AVX2 kernels picked when a stream opens; downmixing follows the input's channel mask.
+//
+class CResampler : public CCaptureSinkProvider
+{
+public:
+    CResampler() = default;
+
+    // A rate or channel count of 0 keeps the input's.  Channel counts other than 1 and 2 are only
+    // kept, never produced.
+    HRESULT Initialize(CCaptureSinkProvider* pOutput, UINT32 outputRate, UINT32 outputChannels, ResampleQuality quality);
+
+    // CCaptureSinkProvider.  The input must be 16-bit or float.
+    HRESULT OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 cbMaxPacket, bool writeHeader,
+        std::shared_ptr<CCaptureSink>& sink) override;
+    void CloseSink(const std::shared_ptr<CCaptureSink>& sink) override;
+
+private:
+    CCaptureSinkProvider* m_pOutput = nullptr;
+    UINT32 m_OutputRate = 0;
+    UINT32 m_OutputChannels = 0;
+    ResampleQuality m_Quality = ResampleQuality::Balanced;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <cstring>
+
+#include <wil\result.h>
+
+//
+//  CPacketRing
+//
+//  Single-producer/single-consumer byte ring used to hand captured packets from the real-time
+//  capture callback to the output writer thread.  Storage is allocated once up front; after that
+//  neither side allocates, locks or blocks.  The read and write cursors grow monotonically and are
+//  masked into the power-of-two storage, so "full" and "empty" never need a spare slot.
+//
+class CPacketRing
+{
+public:
+    CPacketRing() = default;
+    CPacketRing(const CPacketRing&) = delete;
+    CPacketRing& operator=(const CPacketRing&) = delete;
+
+    // Allocates at least cbMinCapacity bytes, rounded up to the next power of two.
+    HRESULT Initialize(UINT32 cbMinCapacity)
+    {
+        const UINT32 cbCapacity = RoundUpCapacity(cbMinCapacity);
+        RETURN_HR_IF(E_INVALIDARG, cbCapacity == 0);
+
+        m_Storage.reset(new (std::nothrow) BYTE[cbCapacity]);
+        RETURN_IF_NULL_ALLOC(m_Storage);
+
+        m_WritePosition.store(0, std::memory_order_relaxed);
+        m_ReadPosition.store(0, std::memory_order_relaxed);
+        Attach(m_Storage.get(), cbCapacity, &m_WritePosition, &m_ReadPosition);
+        return S_OK;
+    }
+
+    // Runs the ring over storage and cursors owned by someone else, e.g. a shared-memory section that
+    // another process reads from.  cbCapacity must be a power of two.
+    void Attach(BYTE* pStorage, UINT32 cbCapacity, std::atomic<UINT64>* pWritePosition, std::atomic<UINT64>* pReadPosition)
+    {
+        m_pStorage = pStorage;
+        m_cbCapacity = cbCapacity;
+        m_pWritePosition = pWritePosition;
+        m_pReadPosition = pReadPosition;
+        m_PendingWrite = m_pWritePosition->load(std::memory_order_relaxed);
+    }
+
+    // Smallest power of two >= cbMinCapacity, or 0 if that doesn't fit in 32 bits.
+    static UINT32 RoundUpCapacity(UINT32 cbMinCapacity)
+    {
+        UINT32 cbCapacity = 1;
+        while (cbCapacity < cbMinCapacity)
+        {
+            if (cbCapacity > (UINT32_MAX / 2))
+            {
+                return 0;
+            }
+            cbCapacity <<= 1;
+        }
+        return cbCapacity;
+    }
+
+    UINT32 GetCapacity() const { return m_cbCapacity; }
+
+    //
+    // Producer side.  Reserve/Append/Commit lets a caller publish several pieces (e.g. a header and
+    // its payload) as one unit: the consumer never observes a partially written record.
+    //
+    bool Reserve(UINT32 cbData)
+    {
+        const UINT64 readPosition = m_pReadPosition->load(std::memory_order_acquire);
+        const UINT64 used = m_PendingWrite - readPosition;
+        return (m_cbCapacity - used) >= cbData;
+    }
+
+    void Append(const void* pData, UINT32 cbData)
+    {
+        const UINT32 offset = static_cast<UINT32>(m_PendingWrite & (m_cbCapacity - 1));
+        const UINT32 cbFirst = (std::min)(cbData, m_cbCapacity - offset);
+        memcpy(m_pStorage + offset, pData, cbFirst);
+        memcpy(m_pStorage, static_cast<const BYTE*>(pData) + cbFirst, cbData - cbFirst);
+        m_PendingWrite += cbData;
+    }
+
+    void Commit()
+    {
+        m_pWritePosition->store(m_PendingWrite, std::memory_order_release);
+    }
+
+    // Writes the whole buffer or nothing.
+    bool TryWrite(const void* pData, UINT32 cbData)
+    {
+        if (!Reserve(cbData))
+        {
+            return false;
+        }
+        Append(pData, cbData);
+        Commit();
+        return true;
+    }
+
+    //
+    // Consumer side.  GetReadRegion returns the largest contiguous run of committed bytes so the writer
+    // can hand ring memory straight to the output without an intermediate copy.
+    //
+    UINT32 GetReadRegion(const BYTE** ppData) const
+    {
+        const UINT64 writePosition = m_pWritePosition->load(std::memory_order_acquire);
+        const UINT64 readPosition = m_pReadPosition->load(std::memory_order_relaxed);
+        const UINT32 offset = static_cast<UINT32>(readPosition & (m_cbCapacity - 1));
+        const UINT32 available = static_cast<UINT32>(writePosition - readPosition);
+
+        *ppData = m_pStorage + offset;
+        return (std::min)(available, m_cbCapacity - offset);
+    }
+
+    void Consume(UINT32 cbData)
+    {
+        m_pReadPosition->store(m_pReadPosition->load(std::memory_order_relaxed) + cbData, std::memory_order_release);
+    }
+
+    // Committed bytes not yet consumed.
+    UINT32 GetReadAvailable() const
+    {
+        return static_cast<UINT32>(m_pWritePosition->load(std::memory_order_acquire) - m_pReadPosition->load(std::memory_order_relaxed));
+    }
+
+    // Copies out and consumes cbData committed bytes, across the wrap if need be, for consumers that
+    // parse records rather than forwarding raw bytes.  The caller checks GetReadAvailable first.
+    void Read(void* pData, UINT32 cbData)
+    {
+        const UINT64 readPosition = m_pReadPosition->load(std::memory_order_relaxed);
+        const UINT32 offset = static_cast<UINT32>(readPosition & (m_cbCapacity - 1));
+        const UINT32 cbFirst = (std::min)(cbData, m_cbCapacity - offset);
+        memcpy(pData, m_pStorage + offset, cbFirst);
+        memcpy(static_cast<BYTE*>(pData) + cbFirst, m_pStorage, cbData - cbFirst);
+        m_pReadPosition->store(readPosition + cbData, std::memory_order_release);
+    }
+
+    bool IsEmpty() const
+    {
+        return m_pWritePosition->load(std::memory_order_acquire) == m_pReadPosition->load(std::memory_order_relaxed);
+    }
+
+private:
+    BYTE* m_pStorage = nullptr;
+    UINT32 m_cbCapacity = 0;
+    std::atomic<UINT64>* m_pWritePosition = nullptr;
+    std::atomic<UINT64>* m_pReadPosition = nullptr;
+
+    // Producer-only cursor of bytes appended but not yet committed.
+    UINT64 m_PendingWrite = 0;
+
+    // Backing store and cursors when the ring owns its memory.  The two cursors live on separate cache
+    // lines so the producer and consumer don't false-share.
+    std::unique_ptr<BYTE[]> m_Storage;
+    alignas(64) std::atomic<UINT64> m_WritePosition{ 0 };
+    alignas(64) std::atomic<UINT64> m_ReadPosition{ 0 };
+};
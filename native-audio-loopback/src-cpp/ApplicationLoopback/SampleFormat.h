@@ -0,0 +1,61 @@
+#pragma once
+
+#include <Windows.h>
+#include <mmreg.h>
+#include <ks.h>
+#include <ksmedia.h>
+
+//
+//  Sample encodings the capture path knows how to process.  Int32 also covers 24-bit samples carried
+//  left-justified in a 32-bit container (WAVE_FORMAT_EXTENSIBLE with wValidBitsPerSample = 24).
+//
+enum class SampleFormat
+{
+    Unknown,
+    Int16,
+    Int24,
+    Int32,
+    Float32,
+};
+
+inline SampleFormat GetSampleFormat(const WAVEFORMATEX* format)
+{
+    bool isFloat = (format->wFormatTag == WAVE_FORMAT_IEEE_FLOAT);
+    bool isPcm = (format->wFormatTag == WAVE_FORMAT_PCM);
+
+    if (format->wFormatTag == WAVE_FORMAT_EXTENSIBLE && format->cbSize >= (sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX)))
+    {
+        const WAVEFORMATEXTENSIBLE* extensible = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(format);
+        isFloat = IsEqualGUID(extensible->SubFormat, KSDATAFORMAT_SUBTYPE_IEEE_FLOAT);
+        isPcm = IsEqualGUID(extensible->SubFormat, KSDATAFORMAT_SUBTYPE_PCM);
+    }
+
+    if (isFloat && format->wBitsPerSample == 32)
+    {
+        return SampleFormat::Float32;
+    }
+
+    if (isPcm)
+    {
+        switch (format->wBitsPerSample)
+        {
+        case 16: return SampleFormat::Int16;
+        case 24: return SampleFormat::Int24;
+        case 32: return SampleFormat::Int32;
+        }
+    }
+
+    return SampleFormat::Unknown;
+}
+
+// Full-scale magnitude of one sample in the given encoding.
+inline double GetFullScale(SampleFormat sampleFormat)
+{
+    switch (sampleFormat)
+    {
+    case SampleFormat::Int16: return 32768.0;
+    case SampleFormat::Int24: return 8388608.0;
+    case SampleFormat::Int32: return 2147483648.0;
+    default: return 1.0;
+    }
+}
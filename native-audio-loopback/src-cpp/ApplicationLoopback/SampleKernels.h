@@ -0,0 +1,115 @@
+#pragma once
+
+#include <Windows.h>
+#include <algorithm>
+#include <cmath>
+
+#include "SampleFormat.h"
+
+//
+//  Sample kernels
+//
+//  Per-sample loops written once, as templates over the sample encoding and the channel counts, and
+//  instantiated for the layouts the engine hands out (mono, stereo, 5.1 and 7.1).  A stage picks its
+//  instantiation when a stream opens with the negotiated format, so the loops it runs per packet see
+//  the encoding and the channel counts as constants: no per-sample branches, and the channel loops
+//  unroll.  Other layouts get the SAMPLE_KERNEL_ANY_CHANNELS instantiation, which reads the count from
+//  its arguments instead.
+//
+#define SAMPLE_KERNEL_ANY_CHANNELS 0
+
+// Conversion between an encoding's samples and float at unity full scale.
+template <SampleFormat Format>
+struct SampleTraits;
+
+template <>
+struct SampleTraits<SampleFormat::Int16>
+{
+    typedef INT16 Type;
+
+    static float ToFloat(INT16 sample) { return sample * (1.0f / 32768.0f); }
+    static INT16 FromFloat(float sample)
+    {
+        return static_cast<INT16>(lrintf((std::min)((std::max)(sample * 32768.0f, -32768.0f), 32767.0f)));
+    }
+};
+
+template <>
+struct SampleTraits<SampleFormat::Float32>
+{
+    typedef float Type;
+
+    static float ToFloat(float sample) { return sample; }
+    static float FromFloat(float sample) { return sample; }
+};
+
+// Output channel o of every frame goes to pPlanes + o * planeStride.
+typedef void (*PFN_DOWNMIX)(const BYTE* pData, UINT32 frames, UINT32 inputChannels, UINT32 outputChannels,
+    const float* pMatrix, float* pPlanes, size_t planeStride);
+
+//
+//  DownmixToPlanes()
+//
+//  Converts interleaved frames to float and applies the channel matrix (output channel o is the sum
+//  over input channels i of pMatrix[o * inputChannels + i]), one output plane at a time.
+//
+template <SampleFormat Format, UINT32 InputChannels, UINT32 OutputChannels>
+void DownmixToPlanes(const BYTE* pData, UINT32 frames, UINT32 inputChannels, UINT32 outputChannels,
+    const float* pMatrix, float* pPlanes, size_t planeStride)
+{
+    typedef SampleTraits<Format> Traits;
+    const UINT32 in = (InputChannels != SAMPLE_KERNEL_ANY_CHANNELS) ? InputChannels : inputChannels;
+    const UINT32 out = (OutputChannels != SAMPLE_KERNEL_ANY_CHANNELS) ? OutputChannels : outputChannels;
+
+    for (UINT32 o = 0; o < out; o++)
+    {
+        const typename Traits::Type* pIn = reinterpret_cast<const typename Traits::Type*>(pData);
+        const float* weights = pMatrix + static_cast<size_t>(o) * in;
+        float* plane = pPlanes + o * planeStride;
+
+        for (UINT32 f = 0; f < frames; f++, pIn += in)
+        {
+            float sum = 0.0f;
+            for (UINT32 i = 0; i < in; i++)
+            {
+                sum += Traits::ToFloat(pIn[i]) * weights[i];
+            }
+            plane[f] = sum;
+        }
+    }
+}
+
+template <SampleFormat Format, UINT32 OutputChannels>
+PFN_DOWNMIX GetDownmixKernel(UINT32 inputChannels)
+{
+    switch (inputChannels)
+    {
+    case 1: return DownmixToPlanes<Format, 1, OutputChannels>;
+    case 2: return DownmixToPlanes<Format, 2, OutputChannels>;
+    case 6: return DownmixToPlanes<Format, 6, OutputChannels>;
+    case 8: return DownmixToPlanes<Format, 8, OutputChannels>;
+    default: return DownmixToPlanes<Format, SAMPLE_KERNEL_ANY_CHANNELS, OutputChannels>;
+    }
+}
+
+template <SampleFormat Format>
+PFN_DOWNMIX GetDownmixKernel(UINT32 inputChannels, UINT32 outputChannels)
+{
+    switch (outputChannels)
+    {
+    case 1: return GetDownmixKernel<Format, 1>(inputChannels);
+    case 2: return GetDownmixKernel<Format, 2>(inputChannels);
+    default: return GetDownmixKernel<Format, SAMPLE_KERNEL_ANY_CHANNELS>(inputChannels);
+    }
+}
+
+// nullptr for encodings without kernels.
+inline PFN_DOWNMIX GetDownmixKernel(SampleFormat sampleFormat, UINT32 inputChannels, UINT32 outputChannels)
+{
+    switch (sampleFormat)
+    {
+    case SampleFormat::Int16: return GetDownmixKernel<SampleFormat::Int16>(inputChannels, outputChannels);
+    case SampleFormat::Float32: return GetDownmixKernel<SampleFormat::Float32>(inputChannels, outputChannels);
+    default: return nullptr;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+
+//
+//  Layout of the named shared-memory ring used by --output shm.
+//
+//  The mapping starts with LOOPBACK_SHARED_RING_HEADER; the ring data follows at HeaderSize bytes.
+//  The capture process is the only writer of WritePosition and the reader (the Node side) is the only
+//  writer of ReadPosition.  Both are monotonically increasing byte counts; the byte for position P
+//  lives at data[P & (Capacity - 1)].  The "<name>.DataReady" auto-reset event is signaled after
+//  every capture callback that committed data.
+//
+#define LOOPBACK_SHARED_RING_MAGIC 0x474E5241 // 'ARNG'
+#define LOOPBACK_SHARED_RING_VERSION 1
+#define LOOPBACK_SHARED_RING_EVENT_SUFFIX L".DataReady"
+
+struct LOOPBACK_SHARED_RING_HEADER
+{
+    UINT32 Magic;
+    UINT32 Version;
+    UINT32 HeaderSize;
+    UINT32 Capacity;
+
+    // Format of the samples in the ring.  FormatTag is WAVE_FORMAT_PCM, WAVE_FORMAT_IEEE_FLOAT or
+    // WAVE_FORMAT_OPUS (LOOPBACK_PACKET_HEADER-prefixed packets).
+    UINT16 FormatTag;
+    UINT16 Channels;
+    UINT32 SamplesPerSec;
+    UINT16 BitsPerSample;
+    UINT16 BlockAlign;
+    UINT32 Reserved;
+
+    // Packets the writer had to drop because the reader fell behind.
+    std::atomic<UINT64> OverrunCount;
+    std::atomic<UINT64> OverrunBytes;
+
+    alignas(64) std::atomic<UINT64> WritePosition;
+    alignas(64) std::atomic<UINT64> ReadPosition;
+};
+
+static_assert(std::atomic<UINT64>::is_always_lock_free, "shared ring cursors must be lock-free");
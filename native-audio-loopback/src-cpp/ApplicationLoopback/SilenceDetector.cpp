@@ -0,0 +1,473 @@
+#include <immintrin.h>
+#include <math.h>
+
+#include <wil\result.h>
+
+#include "CpuFeatures.h"
+#include "SilenceDetector.h"
+
+// Samples per early-exit check: four vectors are folded into one compare.
+#define SSE2_BLOCK_INT16 32
+#define SSE2_BLOCK_32BIT 16
+#define AVX2_BLOCK_INT16 64
+#define AVX2_BLOCK_32BIT 32
+
+//
+//  Kernels
+//
+//  Each returns true as soon as any sample's magnitude is above the threshold.  Integer kernels compare
+//  against +threshold and -threshold instead of taking the absolute value so the most negative sample
+//  value needs no special casing.
+//
+
+static bool ExceedsInt16Sse2(const BYTE* pData, size_t samples, const CSilenceDetector::Threshold& threshold)
+{
+	const INT16* p = reinterpret_cast<const INT16*>(pData);
+	const __m128i high = _mm_set1_epi16(static_cast<INT16>(threshold.Int));
+	const __m128i low = _mm_set1_epi16(static_cast<INT16>(-threshold.Int));
+
+	size_t i = 0;
+	for (; i + SSE2_BLOCK_INT16 <= samples; i += SSE2_BLOCK_INT16)
+	{
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 8));
+		const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 16));
+		const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 24));
+
+		const __m128i maximum = _mm_max_epi16(_mm_max_epi16(a, b), _mm_max_epi16(c, d));
+		const __m128i minimum = _mm_min_epi16(_mm_min_epi16(a, b), _mm_min_epi16(c, d));
+		const __m128i loud = _mm_or_si128(_mm_cmpgt_epi16(maximum, high), _mm_cmplt_epi16(minimum, low));
+		if (_mm_movemask_epi8(loud) != 0)
+		{
+			return true;
+		}
+	}
+
+	for (; i < samples; i++)
+	{
+		if (p[i] > threshold.Int || p[i] < -threshold.Int)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ExceedsInt16Avx2(const BYTE* pData, size_t samples, const CSilenceDetector::Threshold& threshold)
+{
+	const INT16* p = reinterpret_cast<const INT16*>(pData);
+	const __m256i high = _mm256_set1_epi16(static_cast<INT16>(threshold.Int));
+	const __m256i low = _mm256_set1_epi16(static_cast<INT16>(-threshold.Int));
+
+	size_t i = 0;
+	for (; i + AVX2_BLOCK_INT16 <= samples; i += AVX2_BLOCK_INT16)
+	{
+		const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+		const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 16));
+		const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 32));
+		const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 48));
+
+		const __m256i maximum = _mm256_max_epi16(_mm256_max_epi16(a, b), _mm256_max_epi16(c, d));
+		const __m256i minimum = _mm256_min_epi16(_mm256_min_epi16(a, b), _mm256_min_epi16(c, d));
+		const __m256i loud = _mm256_or_si256(_mm256_cmpgt_epi16(maximum, high), _mm256_cmpgt_epi16(low, minimum));
+		if (_mm256_movemask_epi8(loud) != 0)
+		{
+			_mm256_zeroupper();
+			return true;
+		}
+	}
+	_mm256_zeroupper();
+
+	return ExceedsInt16Sse2(reinterpret_cast<const BYTE*>(p + i), samples - i, threshold);
+}
+
+static bool ExceedsInt32Sse2(const BYTE* pData, size_t samples, const CSilenceDetector::Threshold& threshold)
+{
+	const INT32* p = reinterpret_cast<const INT32*>(pData);
+	const __m128i high = _mm_set1_epi32(threshold.Int);
+	const __m128i low = _mm_set1_epi32(-threshold.Int);
+
+	size_t i = 0;
+	for (; i + SSE2_BLOCK_32BIT <= samples; i += SSE2_BLOCK_32BIT)
+	{
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 4));
+		const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 8));
+		const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 12));
+
+		// SSE2 has no 32-bit min/max, so compare every vector and fold the masks.
+		const __m128i loud = _mm_or_si128(
+			_mm_or_si128(_mm_or_si128(_mm_cmpgt_epi32(a, high), _mm_cmplt_epi32(a, low)),
+				_mm_or_si128(_mm_cmpgt_epi32(b, high), _mm_cmplt_epi32(b, low))),
+			_mm_or_si128(_mm_or_si128(_mm_cmpgt_epi32(c, high), _mm_cmplt_epi32(c, low)),
+				_mm_or_si128(_mm_cmpgt_epi32(d, high), _mm_cmplt_epi32(d, low))));
+		if (_mm_movemask_epi8(loud) != 0)
+		{
+			return true;
+		}
+	}
+
+	for (; i < samples; i++)
+	{
+		if (p[i] > threshold.Int || p[i] < -threshold.Int)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ExceedsInt32Avx2(const BYTE* pData, size_t samples, const CSilenceDetector::Threshold& threshold)
+{
+	const INT32* p = reinterpret_cast<const INT32*>(pData);
+	const __m256i high = _mm256_set1_epi32(threshold.Int);
+	const __m256i low = _mm256_set1_epi32(-threshold.Int);
+
+	size_t i = 0;
+	for (; i + AVX2_BLOCK_32BIT <= samples; i += AVX2_BLOCK_32BIT)
+	{
+		const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+		const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 8));
+		const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 16));
+		const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 24));
+
+		const __m256i maximum = _mm256_max_epi32(_mm256_max_epi32(a, b), _mm256_max_epi32(c, d));
+		const __m256i minimum = _mm256_min_epi32(_mm256_min_epi32(a, b), _mm256_min_epi32(c, d));
+		const __m256i loud = _mm256_or_si256(_mm256_cmpgt_epi32(maximum, high), _mm256_cmpgt_epi32(low, minimum));
+		if (_mm256_movemask_epi8(loud) != 0)
+		{
+			_mm256_zeroupper();
+			return true;
+		}
+	}
+	_mm256_zeroupper();
+
+	return ExceedsInt32Sse2(reinterpret_cast<const BYTE*>(p + i), samples - i, threshold);
+}
+
+// Packed 24-bit doesn't map onto vector lanes; sign-extend each sample into the top of an INT32.
+static bool ExceedsInt24(const BYTE* pData, size_t samples, const CSilenceDetector::Threshold& threshold)
+{
+	for (size_t i = 0; i < samples; i++, pData += 3)
+	{
+		const INT32 sample = static_cast<INT32>((static_cast<UINT32>(pData[0]) << 8) |
+			(static_cast<UINT32>(pData[1]) << 16) | (static_cast<UINT32>(pData[2]) << 24)) >> 8;
+		if (sample > threshold.Int || sample < -threshold.Int)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ExceedsFloat32Sse2(const BYTE* pData, size_t samples, const CSilenceDetector::Threshold& threshold)
+{
+	const float* p = reinterpret_cast<const float*>(pData);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128 limit = _mm_set1_ps(threshold.Float);
+
+	size_t i = 0;
+	for (; i + SSE2_BLOCK_32BIT <= samples; i += SSE2_BLOCK_32BIT)
+	{
+		const __m128 a = _mm_and_ps(_mm_loadu_ps(p + i), absMask);
+		const __m128 b = _mm_and_ps(_mm_loadu_ps(p + i + 4), absMask);
+		const __m128 c = _mm_and_ps(_mm_loadu_ps(p + i + 8), absMask);
+		const __m128 d = _mm_and_ps(_mm_loadu_ps(p + i + 12), absMask);
+
+		const __m128 peak = _mm_max_ps(_mm_max_ps(a, b), _mm_max_ps(c, d));
+		if (_mm_movemask_ps(_mm_cmpgt_ps(peak, limit)) != 0)
+		{
+			return true;
+		}
+	}
+
+	for (; i < samples; i++)
+	{
+		if (fabsf(p[i]) > threshold.Float)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ExceedsFloat32Avx2(const BYTE* pData, size_t samples, const CSilenceDetector::Threshold& threshold)
+{
+	const float* p = reinterpret_cast<const float*>(pData);
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	const __m256 limit = _mm256_set1_ps(threshold.Float);
+
+	size_t i = 0;
+	for (; i + AVX2_BLOCK_32BIT <= samples; i += AVX2_BLOCK_32BIT)
+	{
+		const __m256 a = _mm256_and_ps(_mm256_loadu_ps(p + i), absMask);
+		const __m256 b = _mm256_and_ps(_mm256_loadu_ps(p + i + 8), absMask);
+		const __m256 c = _mm256_and_ps(_mm256_loadu_ps(p + i + 16), absMask);
+		const __m256 d = _mm256_and_ps(_mm256_loadu_ps(p + i + 24), absMask);
+
+		const __m256 peak = _mm256_max_ps(_mm256_max_ps(a, b), _mm256_max_ps(c, d));
+		if (_mm256_movemask_ps(_mm256_cmp_ps(peak, limit, _CMP_GT_OQ)) != 0)
+		{
+			_mm256_zeroupper();
+			return true;
+		}
+	}
+	_mm256_zeroupper();
+
+	return ExceedsFloat32Sse2(reinterpret_cast<const BYTE*>(p + i), samples - i, threshold);
+}
+
+//
+//  Sum-of-squares kernels for RMS detection.  A pair of 16-bit squares summed by madd is at most 2^31,
+//  which fits an unsigned 32-bit lane, so the integer kernels widen to 64-bit lanes by zero-extension.
+//
+
+static double SumSquaresInt16Sse2(const BYTE* pData, size_t samples)
+{
+	const INT16* p = reinterpret_cast<const INT16*>(pData);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = _mm_setzero_si128();
+
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+		const __m128i squares = _mm_madd_epi16(v, v);
+		sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(squares, zero));
+		sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(squares, zero));
+	}
+
+	UINT64 lanes[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sum);
+	UINT64 total = lanes[0] + lanes[1];
+	for (; i < samples; i++)
+	{
+		total += static_cast<UINT64>(static_cast<INT32>(p[i]) * p[i]);
+	}
+
+	return static_cast<double>(total);
+}
+
+static double SumSquaresInt16Avx2(const BYTE* pData, size_t samples)
+{
+	const INT16* p = reinterpret_cast<const INT16*>(pData);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sum = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+	{
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+		const __m256i squares = _mm256_madd_epi16(v, v);
+		sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(squares, zero));
+		sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(squares, zero));
+	}
+
+	UINT64 lanes[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), sum);
+	_mm256_zeroupper();
+
+	return static_cast<double>(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+		SumSquaresInt16Sse2(reinterpret_cast<const BYTE*>(p + i), samples - i);
+}
+
+static double SumSquaresInt24(const BYTE* pData, size_t samples)
+{
+	double total = 0.0;
+	for (size_t i = 0; i < samples; i++, pData += 3)
+	{
+		const INT32 sample = static_cast<INT32>((static_cast<UINT32>(pData[0]) << 8) |
+			(static_cast<UINT32>(pData[1]) << 16) | (static_cast<UINT32>(pData[2]) << 24)) >> 8;
+		total += static_cast<double>(sample) * sample;
+	}
+
+	return total;
+}
+
+static double SumSquaresInt32(const BYTE* pData, size_t samples)
+{
+	const INT32* p = reinterpret_cast<const INT32*>(pData);
+	double total = 0.0;
+	for (size_t i = 0; i < samples; i++)
+	{
+		total += static_cast<double>(p[i]) * p[i];
+	}
+
+	return total;
+}
+
+static double SumSquaresFloat32Sse2(const BYTE* pData, size_t samples)
+{
+	const float* p = reinterpret_cast<const float*>(pData);
+	__m128 sum = _mm_setzero_ps();
+
+	size_t i = 0;
+	for (; i + 4 <= samples; i += 4)
+	{
+		const __m128 v = _mm_loadu_ps(p + i);
+		sum = _mm_add_ps(sum, _mm_mul_ps(v, v));
+	}
+
+	float lanes[4];
+	_mm_storeu_ps(lanes, sum);
+	double total = static_cast<double>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+	for (; i < samples; i++)
+	{
+		total += static_cast<double>(p[i]) * p[i];
+	}
+
+	return total;
+}
+
+static double SumSquaresFloat32Avx2(const BYTE* pData, size_t samples)
+{
+	const float* p = reinterpret_cast<const float*>(pData);
+	__m256 sum = _mm256_setzero_ps();
+
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		const __m256 v = _mm256_loadu_ps(p + i);
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(v, v));
+	}
+
+	float lanes[8];
+	_mm256_storeu_ps(lanes, sum);
+	_mm256_zeroupper();
+
+	double total = 0.0;
+	for (float lane : lanes)
+	{
+		total += lane;
+	}
+	return total + SumSquaresFloat32Sse2(reinterpret_cast<const BYTE*>(p + i), samples - i);
+}
+
+//
+//  Initialize()
+//
+//  Converts the dB threshold into the stream's sample units and picks the kernel for its format and
+//  detection mode.
+//
+HRESULT CSilenceDetector::Initialize(const WAVEFORMATEX* format, double thresholdDb, SilenceDetection detection)
+{
+	const SampleFormat sampleFormat = GetSampleFormat(format);
+	RETURN_HR_IF(E_INVALIDARG, sampleFormat == SampleFormat::Unknown || format->nChannels == 0);
+
+	const bool avx2 = IsAvx2Supported();
+	const double linear = pow(10.0, thresholdDb / 20.0);
+	const double fullScale = GetFullScale(sampleFormat);
+
+	// A sample is loud when |sample| > threshold; |sample| of an integer can't exceed fullScale - 1.
+	const double scaled = floor(linear * fullScale);
+	m_Threshold.Int = static_cast<INT32>(scaled >= fullScale - 1.0 ? fullScale - 1.0 : scaled);
+	m_Threshold.Float = static_cast<float>(linear);
+	m_Channels = format->nChannels;
+	m_MeanSquareLimit = (linear * fullScale) * (linear * fullScale);
+	m_pfnExceeds = nullptr;
+	m_pfnSumSquares = nullptr;
+
+	if (detection == SilenceDetection::Rms)
+	{
+		switch (sampleFormat)
+		{
+		case SampleFormat::Int16:
+			m_pfnSumSquares = avx2 ? SumSquaresInt16Avx2 : SumSquaresInt16Sse2;
+			break;
+		case SampleFormat::Int24:
+			m_pfnSumSquares = SumSquaresInt24;
+			break;
+		case SampleFormat::Int32:
+			m_pfnSumSquares = SumSquaresInt32;
+			break;
+		case SampleFormat::Float32:
+			m_pfnSumSquares = avx2 ? SumSquaresFloat32Avx2 : SumSquaresFloat32Sse2;
+			break;
+		}
+		return S_OK;
+	}
+
+	switch (sampleFormat)
+	{
+	case SampleFormat::Int16:
+		m_pfnExceeds = avx2 ? ExceedsInt16Avx2 : ExceedsInt16Sse2;
+		break;
+	case SampleFormat::Int24:
+		m_pfnExceeds = ExceedsInt24;
+		break;
+	case SampleFormat::Int32:
+		m_pfnExceeds = avx2 ? ExceedsInt32Avx2 : ExceedsInt32Sse2;
+		break;
+	case SampleFormat::Float32:
+		m_pfnExceeds = avx2 ? ExceedsFloat32Avx2 : ExceedsFloat32Sse2;
+		break;
+	}
+
+	return S_OK;
+}
+
+//
+//  CSilenceGate
+//
+
+HRESULT CSilenceGate::Initialize(const WAVEFORMATEX* format, double thresholdDb, double hysteresisDb, SilenceDetection detection,
+	double attackMs, double hangoverMs)
+{
+	RETURN_HR_IF(E_INVALIDARG, hysteresisDb < 0.0 || attackMs < 0.0 || hangoverMs < 0.0);
+
+	RETURN_IF_FAILED(m_OpenDetector.Initialize(format, thresholdDb, detection));
+	RETURN_IF_FAILED(m_CloseDetector.Initialize(format, thresholdDb - hysteresisDb, detection));
+	m_AttackFrames = static_cast<UINT64>(attackMs * format->nSamplesPerSec / 1000.0);
+	m_HangoverFrames = static_cast<UINT64>(hangoverMs * format->nSamplesPerSec / 1000.0);
+
+	// Start closed, so a capture that begins in silence sends none
+	m_Open = false;
+	m_RunFrames = 0;
+	return S_OK;
+}
+
+bool CSilenceGate::Process(const BYTE* pData, UINT32 frames, bool engineSilent, bool& opened, bool& closed)
+{
+	opened = false;
+	closed = false;
+
+	if (m_Open)
+	{
+		if (!engineSilent && !m_CloseDetector.IsSilent(pData, frames))
+		{
+			m_RunFrames = 0;
+			return false;
+		}
+
+		// This packet still passes: the hangover covers it until it has run out
+		m_RunFrames += frames;
+		if (m_RunFrames > m_HangoverFrames)
+		{
+			m_Open = false;
+			m_RunFrames = 0;
+			closed = true;
+			return true;
+		}
+		return false;
+	}
+
+	if (engineSilent || m_OpenDetector.IsSilent(pData, frames))
+	{
+		m_RunFrames = 0;
+		return true;
+	}
+
+	m_RunFrames += frames;
+	if (m_RunFrames >= m_AttackFrames)
+	{
+		m_Open = true;
+		m_RunFrames = 0;
+		opened = true;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <Windows.h>
+
+#include "SampleFormat.h"
+
+// How a packet's level is measured against the silence threshold.
+enum class SilenceDetection
+{
+    // Loudest sample; the scan exits on the first block that is loud enough.
+    Peak,
+    // Root mean square over the whole packet, so isolated clicks don't count as signal.
+    Rms,
+};
+
+//
+//  CSilenceDetector
+//
+//  Decides whether a captured packet is below the silence threshold.  The threshold is converted from
+//  dB to the stream's native sample units once per stream, and the kernel for the negotiated sample
+//  format (SSE2, or AVX2 when the CPU has it) is picked up front, so the per-packet call is a single
+//  indirect call into a max-abs scan that exits on the first block that is loud enough, or into a
+//  sum-of-squares pass for RMS.
+//
+class CSilenceDetector
+{
+public:
+    struct Threshold
+    {
+        INT32 Int;
+        float Float;
+    };
+
+    HRESULT Initialize(const WAVEFORMATEX* format, double thresholdDb, SilenceDetection detection = SilenceDetection::Peak);
+
+    bool IsSilent(const BYTE* pData, UINT32 frames) const
+    {
+        const size_t samples = static_cast<size_t>(frames) * m_Channels;
+        if (m_pfnSumSquares != nullptr)
+        {
+            return m_pfnSumSquares(pData, samples) <= m_MeanSquareLimit * static_cast<double>(samples);
+        }
+        return !m_pfnExceeds(pData, samples, m_Threshold);
+    }
+
+private:
+    typedef bool (*PFN_EXCEEDS)(const BYTE* pData, size_t samples, const Threshold& threshold);
+    typedef double (*PFN_SUM_SQUARES)(const BYTE* pData, size_t samples);
+
+    PFN_EXCEEDS m_pfnExceeds = nullptr;
+    PFN_SUM_SQUARES m_pfnSumSquares = nullptr;
+    UINT32 m_Channels = 0;
+    Threshold m_Threshold{};
+
+    // Rms: the threshold squared, in native sample units.
+    double m_MeanSquareLimit = 0.0;
+};
+
+//
+//  CSilenceGate
+//
+//  Stateful gate in front of the detector, so that quiet tails and fades aren't chopped off packet by
+//  packet.  The gate opens once the signal has been above the threshold for the attack time (0 opens
+//  on the first loud packet), and only closes after it has stayed below threshold - hysteresis for
+//  the whole hangover time.  While open every packet passes; while closed packets are reported as
+//  silent.  Capture thread only.
+//
+class CSilenceGate
+{
+public:
+    HRESULT Initialize(const WAVEFORMATEX* format, double thresholdDb, double hysteresisDb, SilenceDetection detection,
+        double attackMs, double hangoverMs);
+
+    // Runs one packet through the gate; returns true if it should be treated as silence.  engineSilent
+    // packets (AUDCLNT_BUFFERFLAGS_SILENT) are quiet without being scanned.  opened/closed report a
+    // transition on this packet.
+    bool Process(const BYTE* pData, UINT32 frames, bool engineSilent, bool& opened, bool& closed);
+
+    bool IsOpen() const { return m_Open; }
+
+private:
+    // Opening is judged against the threshold, staying open against threshold - hysteresis.
+    CSilenceDetector m_OpenDetector;
+    CSilenceDetector m_CloseDetector;
+    UINT64 m_AttackFrames = 0;
+    UINT64 m_HangoverFrames = 0;
+
+    bool m_Open = false;
+    // Frames in a row above the open threshold (while closed) or below the close threshold (while open).
+    UINT64 m_RunFrames = 0;
+};
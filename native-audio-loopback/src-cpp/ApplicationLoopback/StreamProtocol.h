@@ -0,0 +1,152 @@
+#pragma once
+
+#include <Windows.h>
+#include <mmreg.h>
+
+#include "SampleFormat.h"
+
+//
+//  Wire format of the ApplicationLoopback.exe output stream.
+//
+//  All structures are packed and little-endian so the Node side can read them with fixed offsets.
+//
+
+#define LOOPBACK_STREAM_MAGIC 0x4B424C41 // 'ALBK'
+#define LOOPBACK_STREAM_VERSION 2
+
+#ifndef WAVE_FORMAT_OPUS
+#define WAVE_FORMAT_OPUS 0x704F
+#endif
+
+#pragma pack(push, 1)
+
+//
+//  LOOPBACK_STREAM_HEADER
+//
+//  Written once, before the first sample, when the stream carries a header (always with --format
+//  float or --encode opus, or with --header).  FormatTag is WAVE_FORMAT_PCM, WAVE_FORMAT_IEEE_FLOAT or
+//  WAVE_FORMAT_OPUS, never EXTENSIBLE.  Opus streams have BitsPerSample and BlockAlign set to 0.
+//
+struct LOOPBACK_STREAM_HEADER
+{
+    UINT32 Magic;
+    UINT16 Version;
+    UINT16 HeaderSize;
+    UINT16 FormatTag;
+    UINT16 Channels;
+    UINT32 SamplesPerSec;
+    UINT16 BitsPerSample;
+    UINT16 BlockAlign;
+    UINT32 ChannelMask;
+};
+
+//
+//  LOOPBACK_FRAME_HEADER
+//
+//  With --framed (implied by --multi), every record starts with this header, and several capture
+//  streams can share one output channel.  A stream begins with a LOOPBACK_FRAME_FORMAT record whose
+//  payload is its LOOPBACK_STREAM_HEADER, carries LOOPBACK_FRAME_AUDIO records with FrameCount frames
+//  of samples, and ends with an empty LOOPBACK_FRAME_END record once it has been stopped.  Packets
+//  the silence detector suppressed come as empty LOOPBACK_FRAME_SILENCE records that only say how
+//  many frames of silence stand in for them, so the reader keeps its timeline without the bytes.
+//  With --meter, LOOPBACK_FRAME_METER records follow the audio they measure (see
+//  LOOPBACK_METER_PAYLOAD); with --meter-only they are all the stream carries between its format and
+//  end records.  Records of one stream are never split, but records of different streams interleave.
+//
+//  Version 2 added Flags and DevicePosition; version 1 headers were 24 bytes and had neither.
+//
+#define LOOPBACK_FRAME_MAGIC 0x4D524641 // 'AFRM'
+
+#define LOOPBACK_FRAME_FORMAT 1
+#define LOOPBACK_FRAME_AUDIO 2
+#define LOOPBACK_FRAME_END 3
+#define LOOPBACK_FRAME_SILENCE 4
+#define LOOPBACK_FRAME_METER 5
+
+// Flags: what the engine reported about the packet (AUDCLNT_BUFFERFLAGS_*)...
+#define LOOPBACK_FRAME_FLAG_DISCONTINUITY 0x1
+#define LOOPBACK_FRAME_FLAG_ENGINE_SILENT 0x2
+#define LOOPBACK_FRAME_FLAG_TIMESTAMP_ERROR 0x4
+// ...and the first packet after the silence gate opened; the gate's close is its first SILENCE record.
+#define LOOPBACK_FRAME_FLAG_GATE_OPENED 0x8
+
+struct LOOPBACK_FRAME_HEADER
+{
+    UINT32 Magic;
+    UINT16 Type;
+    UINT16 StreamId;
+    UINT32 PayloadSize;
+    UINT32 FrameCount;
+    UINT32 Flags;
+    UINT32 Reserved;
+    // Stream position of the first frame, in frames, as reported by GetBuffer (or the mixer timeline).
+    UINT64 DevicePosition;
+    // Performance counter position of the first frame, in 100-ns units, as reported by GetBuffer.
+    UINT64 QpcPosition;
+};
+
+//
+//  LOOPBACK_METER_PAYLOAD
+//
+//  Payload of a LOOPBACK_FRAME_METER record: the levels of the FrameCount frames starting at the
+//  record's positions, as measured on the captured samples before any resampling or encoding.  Peak
+//  and Rms are linear, 1.0 being full scale; only the first Channels entries are used, and streams
+//  with more channels than LOOPBACK_METER_MAX_CHANNELS report the first ones.  ShortTermLufs is the
+//  ITU-R BS.1770 loudness of the last 3 seconds with --meter-lufs, and NaN without it or while the
+//  window holds only silence.
+//
+#define LOOPBACK_METER_MAX_CHANNELS 8
+
+struct LOOPBACK_METER_PAYLOAD
+{
+    UINT16 Channels;
+    UINT16 Reserved;
+    float ShortTermLufs;
+    float Peak[LOOPBACK_METER_MAX_CHANNELS];
+    float Rms[LOOPBACK_METER_MAX_CHANNELS];
+};
+
+//
+//  LOOPBACK_PACKET_HEADER
+//
+//  Without --multi an Opus stream can't rely on frame records for packet boundaries, so every
+//  packet is preceded by this header instead.  FrameCount is the packet's duration in frames.
+//
+struct LOOPBACK_PACKET_HEADER
+{
+    UINT32 PayloadSize;
+    UINT32 FrameCount;
+    UINT64 QpcPosition;
+};
+
+#pragma pack(pop)
+
+// WAVE_FORMAT_PCM, WAVE_FORMAT_IEEE_FLOAT or WAVE_FORMAT_OPUS, resolving WAVE_FORMAT_EXTENSIBLE to its
+// subformat.
+inline UINT16 GetWireFormatTag(const WAVEFORMATEX* format)
+{
+    if (format->wFormatTag == WAVE_FORMAT_OPUS)
+    {
+        return WAVE_FORMAT_OPUS;
+    }
+
+    return (GetSampleFormat(format) == SampleFormat::Float32) ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+}
+
+inline void FillStreamHeader(const WAVEFORMATEX* format, LOOPBACK_STREAM_HEADER& header)
+{
+    header = {};
+    header.Magic = LOOPBACK_STREAM_MAGIC;
+    header.Version = LOOPBACK_STREAM_VERSION;
+    header.HeaderSize = sizeof(LOOPBACK_STREAM_HEADER);
+    header.FormatTag = GetWireFormatTag(format);
+    header.Channels = format->nChannels;
+    header.SamplesPerSec = format->nSamplesPerSec;
+    header.BitsPerSample = format->wBitsPerSample;
+    header.BlockAlign = format->nBlockAlign;
+
+    if (format->wFormatTag == WAVE_FORMAT_EXTENSIBLE && format->cbSize >= (sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX)))
+    {
+        header.ChannelMask = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(format)->dwChannelMask;
+    }
+}
@@ -0,0 +1,32 @@
+#include "Tracing.h"
+
+#include <wil\resource.h>
+
+// {bb93569f-c459-5a63-60aa-643a99437359}, the EventSource hash of the provider name
+TRACELOGGING_DEFINE_PROVIDER(g_hLoopbackTraceProvider, "AudioLoopback.ApplicationLoopback",
+	(0xbb93569f, 0xc459, 0x5a63, 0x60, 0xaa, 0x64, 0x3a, 0x99, 0x43, 0x73, 0x59));
+
+namespace
+{
+	wil::srwlock g_TraceLock;
+	UINT32 g_TraceUsers = 0;
+}
+
+void CCaptureTrace::Register()
+{
+	auto lock = g_TraceLock.lock_exclusive();
+	if (g_TraceUsers++ == 0)
+	{
+		// Tracing is best effort; a capture never fails because the provider couldn't register
+		TraceLoggingRegister(g_hLoopbackTraceProvider);
+	}
+}
+
+void CCaptureTrace::Unregister()
+{
+	auto lock = g_TraceLock.lock_exclusive();
+	if (g_TraceUsers != 0 && --g_TraceUsers == 0)
+	{
+		TraceLoggingUnregister(g_hLoopbackTraceProvider);
+	}
+}
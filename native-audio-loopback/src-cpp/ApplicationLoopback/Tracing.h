@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Windows.h>
+#include <TraceLoggingProvider.h>
+
+//
+//  Event tracing
+//
+//  The capture path's ETW provider, "AudioLoopback.ApplicationLoopback" (its GUID is derived from
+//  the name, so tools can enable it as *AudioLoopback.ApplicationLoopback).  Nothing is logged until
+//  a trace session enables the provider: until then every event is one test of the provider's enable
+//  state, so the capture callback pays next to nothing.  Events carry QPC positions in the same
+//  100-ns units as GetBuffer, which lines them up with the audio engine's own events in the same
+//  trace.  To record one, add the provider to the WPR profile used for the audio engine, or:
+//
+//      tracelog -start loopback -f loopback.etl -guid *AudioLoopback.ApplicationLoopback -level 5
+//      tracelog -stop loopback
+//
+//  At the information level the provider logs each capture's activation, start, status changes and
+//  stop, and output stalls and overruns; the per-packet and per-callback events are verbose.
+//
+TRACELOGGING_DECLARE_PROVIDER(g_hLoopbackTraceProvider);
+
+// Activation, start, status and stop of every capture.
+#define TRACE_KEYWORD_CAPTURE 0x1
+// Every packet and capture callback, at WINEVENT_LEVEL_VERBOSE.
+#define TRACE_KEYWORD_PACKETS 0x2
+// Writes to stdout or the pipe that blocked, and packets the full rings dropped.
+#define TRACE_KEYWORD_OUTPUT 0x4
+
+// Output writes that block longer than this are logged as stalls.
+#define TRACE_OUTPUT_STALL_MS 5
+
+//
+//  CCaptureTrace
+//
+//  Keeps the provider registered while any capture host is up, since the addon and the exe each
+//  have one.  Events written while it isn't registered are dropped.
+//
+class CCaptureTrace
+{
+public:
+    static void Register();
+    // After the host's last thread that traces has stopped.
+    static void Unregister();
+
+    static bool IsEnabled(UCHAR level, ULONGLONG keyword)
+    {
+        return TraceLoggingProviderEnabled(g_hLoopbackTraceProvider, level, keyword);
+    }
+};
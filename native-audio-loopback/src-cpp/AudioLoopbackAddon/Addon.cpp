@@ -0,0 +1,410 @@
+//
+//  Addon.cpp
+//
+//  In-process alternative to spawning ApplicationLoopback.exe: the same CCaptureHost pipeline runs
+//  inside Node, and captured packets reach JavaScript as batches of framed records (see
+//  StreamProtocol.h) without going through a pipe.
+//
+//      const id = addon.start(pid or [pid, ...], { includeProcessTree, format, batchMs, poolBlocks, bufferMs, engine,
+//                                                  meterMs, meterLufs, meterOnly }, onBatch);
+//      addon.stop(id);
+//      addon.getStats(id);   // { deliveredBatches, droppedPackets, droppedBytes }
+//
+//  onBatch(ArrayBuffer) is called on the JavaScript thread for every batch, and onBatch(null) once
+//  the stream has ended.  Batches are lent from a fixed CBufferPool sized from the capture's engine
+//  buffer; once JavaScript drops its last reference the memory is reused, so a consumer that holds
+//  on to batches will see drops.  With meterMs (or meterLufs, or meterOnly) the batches also carry
+//  LOOPBACK_FRAME_METER records with the capture's levels; with meterOnly they carry nothing else.
+//
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstdio>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <node_api.h>
+
+#include "AddonSink.h"
+#include "CaptureHost.h"
+
+#define ADDON_MAX_STREAM_ID 0xFFFF
+#define ADDON_MAX_BATCH_MS 1000
+#define ADDON_MAX_POOL_BLOCKS 1024
+#define ADDON_MAX_IDLE_AFTER_MS 3600000
+
+namespace
+{
+	struct AddonState
+	{
+		CCaptureHost Host;
+		CAddonSinkProvider Sinks;
+		bool HostInitialized = false;
+		UINT32 NextStreamId = 0;
+		std::set<UINT32> Streams;
+	};
+
+	//
+	//  Errors are thrown as JavaScript Errors whose code is the HRESULT in hex.
+	//
+	napi_value ThrowHResult(napi_env env, HRESULT hr, const char* message)
+	{
+		char code[16];
+		snprintf(code, sizeof(code), "0x%08lX", static_cast<unsigned long>(hr));
+		napi_throw_error(env, code, message);
+		return nullptr;
+	}
+
+	napi_value ThrowTypeError(napi_env env, const char* message)
+	{
+		napi_throw_type_error(env, nullptr, message);
+		return nullptr;
+	}
+
+	bool GetNamedProperty(napi_env env, napi_value object, const char* name, napi_valuetype type, napi_value* value)
+	{
+		bool hasProperty = false;
+		if (napi_has_named_property(env, object, name, &hasProperty) != napi_ok || !hasProperty)
+		{
+			return false;
+		}
+
+		napi_valuetype actualType;
+		return napi_get_named_property(env, object, name, value) == napi_ok &&
+			napi_typeof(env, *value, &actualType) == napi_ok && actualType == type;
+	}
+
+	bool GetUint32Option(napi_env env, napi_value options, const char* name, UINT32 minimum, UINT32 maximum, UINT32& value)
+	{
+		napi_value property;
+		if (!GetNamedProperty(env, options, name, napi_number, &property))
+		{
+			return true;
+		}
+
+		uint32_t number = 0;
+		if (napi_get_value_uint32(env, property, &number) != napi_ok || number < minimum || number > maximum)
+		{
+			return false;
+		}
+		value = number;
+		return true;
+	}
+
+	std::string GetStringOption(napi_env env, napi_value options, const char* name)
+	{
+		napi_value property;
+		char buffer[32] = {};
+		size_t length = 0;
+		if (!GetNamedProperty(env, options, name, napi_string, &property) ||
+			napi_get_value_string_utf8(env, property, buffer, sizeof(buffer), &length) != napi_ok)
+		{
+			return std::string();
+		}
+		return std::string(buffer, length);
+	}
+
+	//
+	//  GetProcessIds()
+	//
+	//  start()'s pid argument: one process id, or an array of up to CAPTURE_MAX_TARGETS distinct
+	//  ones whose trees are merged into the stream.
+	//
+	bool GetProcessIds(napi_env env, napi_value value, napi_valuetype type, std::vector<DWORD>& processIds)
+	{
+		bool isArray = false;
+		uint32_t length = 1;
+		if (type != napi_number && (napi_is_array(env, value, &isArray) != napi_ok || !isArray ||
+			napi_get_array_length(env, value, &length) != napi_ok || length == 0 || length > CAPTURE_MAX_TARGETS))
+		{
+			return false;
+		}
+
+		for (uint32_t i = 0; i < length; i++)
+		{
+			napi_value element = value;
+			napi_valuetype elementType = napi_undefined;
+			uint32_t processId = 0;
+			if ((isArray && napi_get_element(env, value, i, &element) != napi_ok) ||
+				napi_typeof(env, element, &elementType) != napi_ok || elementType != napi_number ||
+				napi_get_value_uint32(env, element, &processId) != napi_ok || processId == 0 ||
+				std::find(processIds.begin(), processIds.end(), processId) != processIds.end())
+			{
+				return false;
+			}
+			processIds.push_back(processId);
+		}
+		return true;
+	}
+
+	//
+	//  ParseStartOptions()
+	//
+	//  Reads the options object of start() into the capture's options and the stream's settings.
+	//  Anything not given keeps the ApplicationLoopback.exe default.
+	//
+	bool ParseStartOptions(napi_env env, napi_value options, CaptureOptions& captureOptions, AddonStreamSettings& settings)
+	{
+		napi_value property;
+		if (GetNamedProperty(env, options, "includeProcessTree", napi_boolean, &property))
+		{
+			napi_get_value_bool(env, property, &captureOptions.IncludeProcessTree);
+		}
+		if (GetNamedProperty(env, options, "meterLufs", napi_boolean, &property))
+		{
+			napi_get_value_bool(env, property, &captureOptions.MeterLoudness);
+		}
+		if (GetNamedProperty(env, options, "meterOnly", napi_boolean, &property))
+		{
+			napi_get_value_bool(env, property, &captureOptions.MeterOnly);
+		}
+
+		const std::string format = GetStringOption(env, options, "format");
+		if (format == "float")
+		{
+			captureOptions.Format = SampleFormat::Float32;
+		}
+		else if (!format.empty() && format != "pcm16")
+		{
+			return false;
+		}
+
+		const std::string engine = GetStringOption(env, options, "engine");
+		if (engine == "thread")
+		{
+			captureOptions.Engine = CaptureEngine::Thread;
+		}
+		else if (!engine.empty() && engine != "workqueue")
+		{
+			return false;
+		}
+
+		UINT32 bufferMs = static_cast<UINT32>(captureOptions.BufferDurationMs);
+		if (!GetUint32Option(env, options, "bufferMs", 1, 2000, bufferMs))
+		{
+			return false;
+		}
+		captureOptions.BufferDurationMs = bufferMs;
+
+		if (!GetUint32Option(env, options, "meterMs", METER_MIN_INTERVAL_MS, METER_MAX_INTERVAL_MS, captureOptions.MeterIntervalMs))
+		{
+			return false;
+		}
+		if ((captureOptions.MeterOnly || captureOptions.MeterLoudness) && captureOptions.MeterIntervalMs == 0)
+		{
+			captureOptions.MeterIntervalMs = METER_DEFAULT_INTERVAL_MS;
+		}
+
+		return GetUint32Option(env, options, "idleAfterMs", 0, ADDON_MAX_IDLE_AFTER_MS, captureOptions.IdleAfterMs) &&
+			GetUint32Option(env, options, "batchMs", 0, ADDON_MAX_BATCH_MS, settings.BatchMs) &&
+			GetUint32Option(env, options, "poolBlocks", 2, ADDON_MAX_POOL_BLOCKS, settings.PoolBlocks);
+	}
+
+	//
+	//  Start()
+	//
+	//  start(pid, options, callback) -> stream id.  Blocks until the capture has been activated, the
+	//  same as StartCapture does for the control channel.  pid may be an array of process ids, which
+	//  are captured together as one stream (excluding process trees is then not supported).
+	//
+	napi_value Start(napi_env env, napi_callback_info info)
+	{
+		size_t argc = 3;
+		napi_value argv[3];
+		AddonState* pState = nullptr;
+		if (napi_get_cb_info(env, info, &argc, argv, nullptr, reinterpret_cast<void**>(&pState)) != napi_ok)
+		{
+			return nullptr;
+		}
+
+		napi_valuetype types[3] = { napi_undefined, napi_undefined, napi_undefined };
+		for (size_t i = 0; i < argc; i++)
+		{
+			napi_typeof(env, argv[i], &types[i]);
+		}
+
+		std::vector<DWORD> processIds;
+		if (argc < 3 || !GetProcessIds(env, argv[0], types[0], processIds))
+		{
+			return ThrowTypeError(env, "start(pid, options, callback): pid must be a process id or an array of distinct process ids");
+		}
+		if (types[1] != napi_object && types[1] != napi_undefined)
+		{
+			return ThrowTypeError(env, "start(pid, options, callback): options must be an object");
+		}
+		if (types[2] != napi_function)
+		{
+			return ThrowTypeError(env, "start(pid, options, callback): callback must be a function");
+		}
+
+		CaptureOptions captureOptions;
+		captureOptions.ProcessId = processIds[0];
+		captureOptions.AdditionalProcessIds.assign(processIds.begin() + 1, processIds.end());
+		AddonStreamSettings settings;
+		if (types[1] == napi_object && !ParseStartOptions(env, argv[1], captureOptions, settings))
+		{
+			return ThrowTypeError(env, "start(pid, options, callback): invalid option");
+		}
+		if (!captureOptions.IncludeProcessTree && !captureOptions.AdditionalProcessIds.empty())
+		{
+			return ThrowTypeError(env, "start(pid, options, callback): only one process tree can be excluded");
+		}
+		if (captureOptions.MeterIntervalMs != 0 && !captureOptions.AdditionalProcessIds.empty())
+		{
+			return ThrowTypeError(env, "start(pid, options, callback): meters need a single process id");
+		}
+
+		if (!pState->HostInitialized)
+		{
+			const HRESULT hr = pState->Host.Initialize(CaptureOptions(), &pState->Sinks);
+			if (FAILED(hr))
+			{
+				pState->Host.Shutdown();
+				return ThrowHResult(env, hr, "Failed to initialize audio capture");
+			}
+			pState->HostInitialized = true;
+		}
+
+		if (pState->Streams.size() > ADDON_MAX_STREAM_ID)
+		{
+			return ThrowHResult(env, E_OUTOFMEMORY, "Too many captures");
+		}
+		UINT32 streamId = pState->NextStreamId;
+		while (pState->Streams.count(streamId) != 0)
+		{
+			streamId = (streamId + 1) & ADDON_MAX_STREAM_ID;
+		}
+		pState->NextStreamId = (streamId + 1) & ADDON_MAX_STREAM_ID;
+
+		std::shared_ptr<CAddonStream> stream;
+		HRESULT hr = CAddonStream::Create(env, argv[2], streamId, settings, stream);
+		if (FAILED(hr))
+		{
+			return ThrowHResult(env, hr, "Failed to create the capture callback");
+		}
+
+		pState->Sinks.Register(streamId, stream);
+		hr = pState->Host.StartCapture(streamId, captureOptions);
+		if (FAILED(hr))
+		{
+			// If the sink was opened the capture has closed it again, which ended the stream
+			pState->Sinks.Unregister(streamId);
+			return ThrowHResult(env, hr, "Failed to start capture");
+		}
+		pState->Streams.insert(streamId);
+
+		napi_value result;
+		napi_create_uint32(env, streamId, &result);
+		return result;
+	}
+
+	bool GetStreamId(napi_env env, napi_callback_info info, AddonState*& pState, UINT32& streamId)
+	{
+		size_t argc = 1;
+		napi_value argv[1];
+		napi_valuetype type = napi_undefined;
+		return napi_get_cb_info(env, info, &argc, argv, nullptr, reinterpret_cast<void**>(&pState)) == napi_ok &&
+			argc == 1 && napi_typeof(env, argv[0], &type) == napi_ok && type == napi_number &&
+			napi_get_value_uint32(env, argv[0], &streamId) == napi_ok;
+	}
+
+	//
+	//  Stop()
+	//
+	//  stop(id).  Returns once the capture has stopped; its last batch and the null that ends the
+	//  stream are already queued to the callback.
+	//
+	napi_value Stop(napi_env env, napi_callback_info info)
+	{
+		AddonState* pState = nullptr;
+		UINT32 streamId = 0;
+		if (!GetStreamId(env, info, pState, streamId))
+		{
+			return ThrowTypeError(env, "stop(id): id must be a stream id");
+		}
+
+		if (pState->Streams.erase(streamId) != 0)
+		{
+			const HRESULT hr = pState->Host.StopCapture(streamId);
+			if (FAILED(hr))
+			{
+				return ThrowHResult(env, hr, "Failed to stop capture");
+			}
+		}
+		return nullptr;
+	}
+
+	napi_value SetCounter(napi_env env, napi_value object, const char* name, UINT64 value)
+	{
+		napi_value number;
+		napi_create_double(env, static_cast<double>(value), &number);
+		napi_set_named_property(env, object, name, number);
+		return object;
+	}
+
+	//
+	//  GetStats()
+	//
+	//  getStats(id) -> { deliveredBatches, droppedPackets, droppedBytes }, or undefined once the stream
+	//  has ended.
+	//
+	napi_value GetStats(napi_env env, napi_callback_info info)
+	{
+		AddonState* pState = nullptr;
+		UINT32 streamId = 0;
+		if (!GetStreamId(env, info, pState, streamId))
+		{
+			return ThrowTypeError(env, "getStats(id): id must be a stream id");
+		}
+
+		std::shared_ptr<CAddonStream> stream = pState->Sinks.Find(streamId);
+		if (!stream)
+		{
+			return nullptr;
+		}
+
+		napi_value stats;
+		napi_create_object(env, &stats);
+		SetCounter(env, stats, "deliveredBatches", stream->GetDeliveredBlocks());
+		SetCounter(env, stats, "droppedPackets", stream->GetDroppedPackets());
+		SetCounter(env, stats, "droppedBytes", stream->GetDroppedBytes());
+		return stats;
+	}
+
+	//
+	//  Cleanup()
+	//
+	//  Environment teardown (process exit, worker termination): stop every capture before the
+	//  thread-safe functions go away.
+	//
+	void Cleanup(void* arg)
+	{
+		AddonState* pState = static_cast<AddonState*>(arg);
+		if (pState->HostInitialized)
+		{
+			pState->Host.Shutdown();
+		}
+		delete pState;
+	}
+}
+
+NAPI_MODULE_INIT()
+{
+	AddonState* pState = new (std::nothrow) AddonState();
+	if (pState == nullptr || napi_add_env_cleanup_hook(env, Cleanup, pState) != napi_ok)
+	{
+		delete pState;
+		napi_throw_error(env, nullptr, "Failed to initialize the audio loopback addon");
+		return nullptr;
+	}
+
+	const napi_property_descriptor properties[] =
+	{
+		{ "start", nullptr, Start, nullptr, nullptr, nullptr, napi_default, pState },
+		{ "stop", nullptr, Stop, nullptr, nullptr, nullptr, napi_default, pState },
+		{ "getStats", nullptr, GetStats, nullptr, nullptr, nullptr, napi_default, pState },
+	};
+	napi_define_properties(env, exports, sizeof(properties) / sizeof(properties[0]), properties);
+	return exports;
+}
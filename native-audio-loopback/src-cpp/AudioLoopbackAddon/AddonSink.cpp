@@ -0,0 +1,418 @@
+#include "AddonSink.h"
+
+#include "QpcClock.h"
+
+// Room for the records' headers on top of the batched audio.
+#define ADDON_BLOCK_HEADROOM 4096
+
+// Node's queue only ever holds one wake per stream; the second slot is slack.
+#define ADDON_CALLBACK_QUEUE_SIZE 2
+
+namespace
+{
+	void FinalizeBlock(napi_env /*env*/, void* data, void* /*hint*/)
+	{
+		CAddonBlockPool::Block* pBlock = static_cast<CAddonBlockPool::Block*>(data);
+		CAddonBlockPool* pPool = pBlock->Pool;
+		pPool->GetBuffers().Release(pBlock->Index);
+		pPool->Release();
+	}
+}
+
+//
+//  Create()
+//
+//  Allocates blockCount blocks of cbBlock bytes, all of them free.
+//
+HRESULT CAddonBlockPool::Create(UINT32 blockCount, UINT32 cbBlock, CAddonBlockPool** ppPool)
+{
+	*ppPool = nullptr;
+
+	std::unique_ptr<CAddonBlockPool> pool(new (std::nothrow) CAddonBlockPool());
+	RETURN_IF_NULL_ALLOC(pool);
+	RETURN_IF_FAILED(pool->m_Buffers.Initialize(blockCount, cbBlock));
+
+	pool->m_Blocks.reset(new (std::nothrow) Block[blockCount]);
+	RETURN_IF_NULL_ALLOC(pool->m_Blocks);
+	for (UINT32 index = 0; index < blockCount; index++)
+	{
+		pool->m_Blocks[index] = Block{ pool.get(), index, 0 };
+	}
+
+	*ppPool = pool.release();
+	return S_OK;
+}
+
+void CAddonBlockPool::Release()
+{
+	if (m_RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		delete this;
+	}
+}
+
+//
+//  Create()
+//
+//  The thread-safe function's context owns a reference to the stream, so the stream stays alive
+//  until Node has made its last CallJs and finalized the function.
+//
+HRESULT CAddonStream::Create(napi_env env, napi_value callback, UINT32 streamId, const AddonStreamSettings& settings,
+	std::shared_ptr<CAddonStream>& stream)
+{
+	auto newStream = std::make_shared<CAddonStream>(streamId, settings);
+	auto pContext = new (std::nothrow) std::shared_ptr<CAddonStream>(newStream);
+	RETURN_IF_NULL_ALLOC(pContext);
+
+	napi_value resourceName;
+	napi_create_string_utf8(env, "AudioLoopbackCapture", NAPI_AUTO_LENGTH, &resourceName);
+	if (napi_create_threadsafe_function(env, callback, nullptr, resourceName, ADDON_CALLBACK_QUEUE_SIZE, 1,
+		pContext, FinalizeCallback, pContext, CallJs, &newStream->m_Callback) != napi_ok)
+	{
+		delete pContext;
+		return E_FAIL;
+	}
+
+	stream = std::move(newStream);
+	return S_OK;
+}
+
+void CAddonStream::FinalizeCallback(napi_env /*env*/, void* data, void* /*hint*/)
+{
+	delete static_cast<std::shared_ptr<CAddonStream>*>(data);
+}
+
+CAddonStream::CAddonStream(UINT32 streamId, const AddonStreamSettings& settings) :
+	m_StreamId(streamId),
+	m_Settings(settings),
+	m_BatchHns(static_cast<UINT64>(settings.BatchMs) * (QPC_HNS_PER_SEC / 1000))
+{
+}
+
+CAddonStream::~CAddonStream()
+{
+	if (m_pPool != nullptr)
+	{
+		m_pPool->Release();
+	}
+}
+
+//
+//  Open()
+//
+//  A block holds two batch intervals of audio, so batches flush on time rather than on size, and
+//  never less than two of the largest packets the capture can deliver.
+//
+HRESULT CAddonStream::Open(const WAVEFORMATEX& format, UINT32 cbMaxPacket)
+{
+	const UINT64 cbBatch = static_cast<UINT64>(format.nAvgBytesPerSec) * m_Settings.BatchMs / 1000;
+	const UINT64 cbPacketRecord = static_cast<UINT64>(sizeof(LOOPBACK_FRAME_HEADER)) + cbMaxPacket;
+	const UINT64 cbBlock = 2 * (std::max)(cbBatch, cbPacketRecord) + ADDON_BLOCK_HEADROOM;
+	RETURN_HR_IF(E_INVALIDARG, cbBlock > UINT32_MAX);
+
+	RETURN_IF_FAILED(CAddonBlockPool::Create(m_Settings.PoolBlocks, static_cast<UINT32>(cbBlock), &m_pPool));
+	RETURN_IF_FAILED(m_ReadyBlocks.Initialize(m_Settings.PoolBlocks * sizeof(UINT32)));
+
+	LOOPBACK_STREAM_HEADER streamHeader;
+	FillStreamHeader(&format, streamHeader);
+	RETURN_HR_IF(E_OUTOFMEMORY, !WriteRecord(LOOPBACK_FRAME_FORMAT, &streamHeader, sizeof(streamHeader), CapturePacketInfo{}));
+	return S_OK;
+}
+
+bool CAddonStream::WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info)
+{
+	return WriteRecord(LOOPBACK_FRAME_AUDIO, pData, cbData, info);
+}
+
+bool CAddonStream::WriteSilence(const CapturePacketInfo& info)
+{
+	return WriteRecord(LOOPBACK_FRAME_SILENCE, nullptr, 0, info);
+}
+
+bool CAddonStream::WriteMeter(const LOOPBACK_METER_PAYLOAD& meter, const CapturePacketInfo& info)
+{
+	return WriteRecord(LOOPBACK_FRAME_METER, &meter, sizeof(meter), info);
+}
+
+//
+//  NotifyDataReady()
+//
+//  Hands the batch to JavaScript once it has been open for the batch interval.
+//
+void CAddonStream::NotifyDataReady()
+{
+	if (m_CurrentBlock != CBufferPool::NO_BUFFER && (GetQpcPosition() - m_CurrentStartQpc) >= m_BatchHns)
+	{
+		Flush();
+	}
+}
+
+//
+//  WriteRecord()
+//
+//  Appends one framed record to the current block, flushing it first if the record doesn't fit.
+//
+bool CAddonStream::WriteRecord(UINT16 type, const void* pPayload, UINT32 cbPayload, const CapturePacketInfo& info)
+{
+	CBufferPool& buffers = m_pPool->GetBuffers();
+	const UINT32 cbRecord = sizeof(LOOPBACK_FRAME_HEADER) + cbPayload;
+	if (cbRecord > buffers.GetBufferSize())
+	{
+		m_DroppedPackets.fetch_add(1, std::memory_order_relaxed);
+		m_DroppedBytes.fetch_add(cbPayload, std::memory_order_relaxed);
+		return false;
+	}
+
+	if (m_CurrentBlock != CBufferPool::NO_BUFFER && (buffers.GetBufferSize() - m_cbCurrent) < cbRecord)
+	{
+		Flush();
+	}
+
+	if (m_CurrentBlock == CBufferPool::NO_BUFFER)
+	{
+		if (!buffers.TryAcquire(m_CurrentBlock))
+		{
+			// JavaScript hasn't let go of any earlier batch
+			m_CurrentBlock = CBufferPool::NO_BUFFER;
+			m_DroppedPackets.fetch_add(1, std::memory_order_relaxed);
+			m_DroppedBytes.fetch_add(cbPayload, std::memory_order_relaxed);
+			return false;
+		}
+
+		m_cbCurrent = 0;
+		m_CurrentStartQpc = GetQpcPosition();
+	}
+
+	LOOPBACK_FRAME_HEADER header = {};
+	header.Magic = LOOPBACK_FRAME_MAGIC;
+	header.Type = type;
+	header.StreamId = static_cast<UINT16>(m_StreamId);
+	header.PayloadSize = cbPayload;
+	header.FrameCount = info.Frames;
+	header.Flags = info.Flags;
+	header.DevicePosition = info.DevicePosition;
+	header.QpcPosition = info.QpcPosition;
+
+	BYTE* pRecord = buffers.GetBuffer(m_CurrentBlock) + m_cbCurrent;
+	memcpy(pRecord, &header, sizeof(header));
+	if (cbPayload != 0)
+	{
+		memcpy(pRecord + sizeof(header), pPayload, cbPayload);
+	}
+	m_cbCurrent += cbRecord;
+	return true;
+}
+
+//
+//  Flush()
+//
+//  Puts the current block on the ready ring, which has room for every block of the pool.
+//
+void CAddonStream::Flush()
+{
+	if (m_CurrentBlock == CBufferPool::NO_BUFFER || m_cbCurrent == 0)
+	{
+		return;
+	}
+
+	m_pPool->GetBlock(m_CurrentBlock)->Length = m_cbCurrent;
+	m_ReadyBlocks.TryWrite(&m_CurrentBlock, sizeof(m_CurrentBlock));
+	m_DeliveredBlocks.fetch_add(1, std::memory_order_relaxed);
+
+	m_CurrentBlock = CBufferPool::NO_BUFFER;
+	m_cbCurrent = 0;
+	Wake();
+}
+
+//
+//  Wake()
+//
+//  Queues a CallJs unless one is already queued and hasn't started draining.  CallJs clears the flag
+//  before it drains, so whatever was on the ring when this saw it set is drained by that call.
+//
+void CAddonStream::Wake()
+{
+	if (!m_WakePending.exchange(true, std::memory_order_acq_rel))
+	{
+		napi_call_threadsafe_function(m_Callback, nullptr, napi_tsfn_nonblocking);
+	}
+}
+
+//
+//  Close()
+//
+//  Delivers the last batch and a null batch that ends the stream, then lets go of the callback.
+//
+void CAddonStream::Close()
+{
+	if (m_pPool != nullptr)
+	{
+		Flush();
+		if (m_CurrentBlock != CBufferPool::NO_BUFFER)
+		{
+			m_pPool->GetBuffers().Release(m_CurrentBlock);
+			m_CurrentBlock = CBufferPool::NO_BUFFER;
+		}
+	}
+
+	m_Ended.store(true, std::memory_order_release);
+	Wake();
+	Abandon();
+}
+
+void CAddonStream::Abandon()
+{
+	if (m_Callback != nullptr)
+	{
+		napi_release_threadsafe_function(m_Callback, napi_tsfn_release);
+		m_Callback = nullptr;
+	}
+}
+
+//
+//  CallJs()
+//
+//  Runs on the JavaScript thread for every wake.  When Node tears the function down (env is null)
+//  the ready blocks just go back to the pool.
+//
+void CAddonStream::CallJs(napi_env env, napi_value jsCallback, void* context, void* /*data*/)
+{
+	CAddonStream* pStream = static_cast<std::shared_ptr<CAddonStream>*>(context)->get();
+	if (env == nullptr)
+	{
+		if (pStream->m_pPool == nullptr)
+		{
+			return;
+		}
+
+		UINT32 index;
+		while (pStream->m_ReadyBlocks.GetReadAvailable() >= sizeof(index))
+		{
+			pStream->m_ReadyBlocks.Read(&index, sizeof(index));
+			pStream->m_pPool->GetBuffers().Release(index);
+		}
+		return;
+	}
+
+	pStream->m_WakePending.exchange(false, std::memory_order_acq_rel);
+	pStream->DrainReady(env, jsCallback);
+}
+
+//
+//  DrainReady()
+//
+//  Lends every ready block to the callback as an external ArrayBuffer.  Runtimes that don't allow
+//  external buffers (Electron) get a copy instead, and the block goes straight back to the pool.
+//
+void CAddonStream::DrainReady(napi_env env, napi_value jsCallback)
+{
+	// Everything flushed before the end is on the ring by the time m_Ended reads true.
+	const bool ended = m_Ended.load(std::memory_order_acquire);
+
+	napi_value global;
+	napi_get_global(env, &global);
+
+	UINT32 index;
+	while (m_ReadyBlocks.GetReadAvailable() >= sizeof(index))
+	{
+		m_ReadyBlocks.Read(&index, sizeof(index));
+
+		CAddonBlockPool::Block* pBlock = m_pPool->GetBlock(index);
+		BYTE* pData = m_pPool->GetBuffers().GetBuffer(index);
+		napi_value batch;
+		m_pPool->AddRef();
+		if (napi_create_external_arraybuffer(env, pData, pBlock->Length, FinalizeBlock, pBlock, &batch) != napi_ok)
+		{
+			void* pCopy = nullptr;
+			const napi_status status = napi_create_arraybuffer(env, pBlock->Length, &pCopy, &batch);
+			if (status == napi_ok)
+			{
+				memcpy(pCopy, pData, pBlock->Length);
+			}
+			FinalizeBlock(env, pBlock, nullptr);
+
+			if (status != napi_ok)
+			{
+				continue;
+			}
+		}
+
+		// A callback that threw leaves the rest for the next wake
+		if (napi_call_function(env, global, jsCallback, 1, &batch, nullptr) != napi_ok)
+		{
+			return;
+		}
+	}
+
+	if (ended && !m_EndDelivered)
+	{
+		m_EndDelivered = true;
+		napi_value end;
+		napi_get_null(env, &end);
+		napi_call_function(env, global, jsCallback, 1, &end, nullptr);
+	}
+}
+
+void CAddonSinkProvider::Register(UINT32 streamId, const std::shared_ptr<CAddonStream>& stream)
+{
+	auto lock = m_Lock.lock_exclusive();
+	m_Streams[streamId] = stream;
+}
+
+void CAddonSinkProvider::Unregister(UINT32 streamId)
+{
+	std::shared_ptr<CAddonStream> stream;
+	{
+		auto lock = m_Lock.lock_exclusive();
+		auto entry = m_Streams.find(streamId);
+		if (entry == m_Streams.end())
+		{
+			return;
+		}
+		stream = std::move(entry->second);
+		m_Streams.erase(entry);
+	}
+
+	stream->Abandon();
+}
+
+std::shared_ptr<CAddonStream> CAddonSinkProvider::Find(UINT32 streamId)
+{
+	auto lock = m_Lock.lock_shared();
+	auto entry = m_Streams.find(streamId);
+	return (entry != m_Streams.end()) ? entry->second : nullptr;
+}
+
+HRESULT CAddonSinkProvider::OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 /*cbMinCapacity*/, UINT32 cbMaxPacket,
+	bool /*writeHeader*/, std::shared_ptr<CCaptureSink>& sink)
+{
+	std::shared_ptr<CAddonStream> stream = Find(streamId);
+	RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_NOT_FOUND), !stream);
+	RETURN_IF_FAILED(stream->Open(format, cbMaxPacket));
+
+	sink = std::move(stream);
+	return S_OK;
+}
+
+void CAddonSinkProvider::CloseSink(const std::shared_ptr<CCaptureSink>& sink)
+{
+	if (!sink)
+	{
+		return;
+	}
+
+	auto stream = std::static_pointer_cast<CAddonStream>(sink);
+	{
+		auto lock = m_Lock.lock_exclusive();
+		for (auto entry = m_Streams.begin(); entry != m_Streams.end(); ++entry)
+		{
+			if (entry->second == stream)
+			{
+				m_Streams.erase(entry);
+				break;
+			}
+		}
+	}
+
+	stream->Close();
+}
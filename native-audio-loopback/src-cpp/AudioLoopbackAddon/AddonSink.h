@@ -0,0 +1,153 @@
+#pragma once
+
+#include <Windows.h>
+#include <atomic>
+#include <map>
+#include <memory>
+
+#include <node_api.h>
+#include <wil\resource.h>
+
+#include "BufferPool.h"
+#include "CaptureSink.h"
+#include "RingBuffer.h"
+#include "StreamProtocol.h"
+
+//
+//  CAddonBlockPool
+//
+//  The CBufferPool that one stream's batches are handed to JavaScript in.  Blocks are lent out as
+//  external ArrayBuffers, and the buffer's finalizer puts the block back, so nothing is copied or
+//  allocated once the pool exists.  The pool is refcounted because an ArrayBuffer can outlive the
+//  capture that filled it.
+//
+class CAddonBlockPool
+{
+public:
+    // What a lent-out block's finalizer gets.  Each lent-out block holds a reference on the pool.
+    struct Block
+    {
+        CAddonBlockPool* Pool;
+        UINT32 Index;
+        UINT32 Length;
+    };
+
+    static HRESULT Create(UINT32 blockCount, UINT32 cbBlock, CAddonBlockPool** ppPool);
+
+    void AddRef() { m_RefCount.fetch_add(1, std::memory_order_relaxed); }
+    void Release();
+
+    CBufferPool& GetBuffers() { return m_Buffers; }
+    Block* GetBlock(UINT32 index) const { return &m_Blocks[index]; }
+
+private:
+    CAddonBlockPool() = default;
+
+    std::atomic<ULONG> m_RefCount{ 1 };
+    CBufferPool m_Buffers;
+    std::unique_ptr<Block[]> m_Blocks;
+};
+
+struct AddonStreamSettings
+{
+    UINT32 BatchMs = 20;
+    UINT32 PoolBlocks = 32;
+};
+
+//
+//  CAddonStream
+//
+//  Terminal sink of one capture in the addon.  Records are laid out exactly like --framed output
+//  (LOOPBACK_FRAME_HEADER plus payload) so the JavaScript parser is shared with the child-process
+//  path, and are batched into a pool block until it is full or older than the batch interval.
+//
+//  Full blocks go on a ready ring of block indices, and the JavaScript thread is woken through a
+//  thread-safe function only if it isn't already due to drain the ring, so Node's own queue never
+//  holds more than one wake per stream and never grows on the capture thread.  If no block is free
+//  the packet is dropped and counted, which is the backpressure a slow consumer gets.
+//
+class CAddonStream : public CCaptureSink
+{
+public:
+    // Creates the stream and the thread-safe function of its JavaScript callback.  JavaScript thread.
+    static HRESULT Create(napi_env env, napi_value callback, UINT32 streamId, const AddonStreamSettings& settings,
+        std::shared_ptr<CAddonStream>& stream);
+
+    CAddonStream(UINT32 streamId, const AddonStreamSettings& settings);
+    ~CAddonStream();
+
+    // Sizes the pool from the capture's largest packet and writes the LOOPBACK_FRAME_FORMAT record.
+    HRESULT Open(const WAVEFORMATEX& format, UINT32 cbMaxPacket);
+
+    // Delivers whatever is batched, then the end of the stream.  The capture no longer runs.
+    void Close();
+
+    // Lets go of the callback of a stream that was never opened, without ending it.
+    void Abandon();
+
+    UINT64 GetDroppedPackets() const { return m_DroppedPackets.load(std::memory_order_relaxed); }
+    UINT64 GetDroppedBytes() const { return m_DroppedBytes.load(std::memory_order_relaxed); }
+    UINT64 GetDeliveredBlocks() const { return m_DeliveredBlocks.load(std::memory_order_relaxed); }
+
+    // CCaptureSink
+    bool WritePacket(const BYTE* pData, UINT32 cbData, const CapturePacketInfo& info) override;
+    bool WriteSilence(const CapturePacketInfo& info) override;
+    bool WriteMeter(const LOOPBACK_METER_PAYLOAD& meter, const CapturePacketInfo& info) override;
+    void NotifyDataReady() override;
+
+private:
+    static void CallJs(napi_env env, napi_value jsCallback, void* context, void* data);
+    static void FinalizeCallback(napi_env env, void* data, void* hint);
+
+    bool WriteRecord(UINT16 type, const void* pPayload, UINT32 cbPayload, const CapturePacketInfo& info);
+    void Flush();
+    void Wake();
+    void DrainReady(napi_env env, napi_value jsCallback);
+
+    UINT32 m_StreamId = 0;
+    AddonStreamSettings m_Settings;
+    napi_threadsafe_function m_Callback = nullptr;
+    CAddonBlockPool* m_pPool = nullptr;
+    UINT64 m_BatchHns = 0;
+
+    // Capture thread only.
+    UINT32 m_CurrentBlock = CBufferPool::NO_BUFFER;
+    UINT32 m_cbCurrent = 0;
+    UINT64 m_CurrentStartQpc = 0;
+
+    // Capture thread to JavaScript thread.  m_Ended is set once the last block is on the ring.
+    CPacketRing m_ReadyBlocks;
+    std::atomic<bool> m_WakePending{ false };
+    std::atomic<bool> m_Ended{ false };
+    bool m_EndDelivered = false;
+
+    std::atomic<UINT64> m_DroppedPackets{ 0 };
+    std::atomic<UINT64> m_DroppedBytes{ 0 };
+    std::atomic<UINT64> m_DeliveredBlocks{ 0 };
+};
+
+//
+//  CAddonSinkProvider
+//
+//  Output stage of the addon's CCaptureHost.  start() registers a stream before the capture is
+//  started; OpenSink, called once the format has been negotiated, opens it.
+//
+class CAddonSinkProvider : public CCaptureSinkProvider
+{
+public:
+    void Register(UINT32 streamId, const std::shared_ptr<CAddonStream>& stream);
+    // Drops a stream whose capture failed to start.  If its sink had been opened it was closed too.
+    void Unregister(UINT32 streamId);
+
+    std::shared_ptr<CAddonStream> Find(UINT32 streamId);
+
+    // CCaptureSinkProvider
+    HRESULT OpenSink(UINT32 streamId, const WAVEFORMATEX& format, UINT32 cbMinCapacity, UINT32 cbMaxPacket, bool writeHeader,
+        std::shared_ptr<CCaptureSink>& sink) override;
+    void CloseSink(const std::shared_ptr<CCaptureSink>& sink) override;
+
+private:
+    // OpenSink and CloseSink run on MF threads while start()/stop() wait for them.
+    wil::srwlock m_Lock;
+    std::map<UINT32, std::shared_ptr<CAddonStream>> m_Streams;
+};
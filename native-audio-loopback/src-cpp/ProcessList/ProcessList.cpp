@@ -1,12 +1,49 @@
 #include <windows.h>
 #include <tlhelp32.h>
-#include <psapi.h>
+#include <mmdeviceapi.h>
+#include <audiopolicy.h>
+#include <endpointvolume.h>
+#include <wrl/client.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <unordered_set>
 
-#pragma comment(lib, "psapi.lib")
+using Microsoft::WRL::ComPtr;
+
+// How long --watch waits for a burst of window events to settle before it re-enumerates
+#define WATCH_SETTLE_MS 100
+
+// How often --watch --audio re-reads the audio sessions, which change without any window event
+#define WATCH_AUDIO_REFRESH_MS 1000
+
+// How far up the process tree audio of a child process (a browser's audio service, say) counts
+// for its ancestors' windows
+#define AUDIO_MAX_TREE_DEPTH 16
+
+// How long WM_GETICON may take before a hung window is given up on
+#define ICON_QUERY_TIMEOUT_MS 50
+
+// Initial size of the output buffer; a full list of windows usually fits without growing it
+#define OUTPUT_RESERVE_BYTES (64 * 1024)
+
+struct Options
+{
+   bool watch = false;
+   // --audio adds audio session state to every line, --audio-only also drops windows without an
+   // active session
+   bool audio = false;
+   bool audioOnly = false;
+   // --json prints JSON instead of semicolon-separated lines
+   bool json = false;
+};
+
+Options options;
 
 // Helper function to convert wide string to UTF-8
 std::string WideToUtf8(const std::wstring &wide)
@@ -20,92 +57,691 @@ std::string WideToUtf8(const std::wstring &wide)
    return result;
 }
 
+enum class AudioState
+{
+   None,     // no audio session in the process tree
+   Inactive, // a session exists, but nothing is playing
+   Active,   // a session is playing
+};
+
+struct AudioActivity
+{
+   AudioState state = AudioState::None;
+   // Highest peak meter reading (0-1) of the tree's sessions, across all endpoints
+   float peak = 0.0f;
+
+   void Merge(const AudioActivity &other)
+   {
+      state = (std::max)(state, other.state);
+      peak = (std::max)(peak, other.peak);
+   }
+};
+
+struct ProcessInfo
+{
+   std::string name = "Unknown";
+   // Empty if the process couldn't be opened
+   std::string imagePath;
+};
+
 struct WindowInfo
 {
    HWND windowHandle;
    std::string windowTitle;
    std::string processName;
+   std::string imagePath;
    DWORD processId;
+   // Window or class icon, 0 if it has none
+   HICON icon;
+   AudioActivity audio;
 };
 
-BOOL CALLBACK EnumWindowsProc(HWND hwnd, LPARAM lParam)
+// Process names and image paths by PID.  A process usually owns several windows, and --watch
+// re-enumerates many times, so each process is opened once rather than once per window and pass.
+class ProcessCache
 {
-   std::vector<WindowInfo> *windows = reinterpret_cast<std::vector<WindowInfo> *>(lParam);
+public:
+   const ProcessInfo &Get(DWORD processId)
+   {
+      auto found = processes.find(processId);
+      if (found == processes.end())
+      {
+         found = processes.emplace(processId, Query(processId)).first;
+      }
+      return found->second;
+   }
+
+   // Forgets processes that no longer own a listed window, so a PID the system reuses isn't
+   // reported under the name of the process that had it before.
+   void Prune(const std::unordered_set<DWORD> &liveProcessIds)
+   {
+      for (auto it = processes.begin(); it != processes.end();)
+      {
+         it = liveProcessIds.count(it->first) ? std::next(it) : processes.erase(it);
+      }
+   }
 
-   // Check if window is visible and has a title
-   if (IsWindowVisible(hwnd))
+private:
+   static ProcessInfo Query(DWORD processId)
    {
-      char windowTitle[256];
-      GetWindowTextA(hwnd, windowTitle, sizeof(windowTitle));
+      ProcessInfo info;
 
-      // Skip windows without titles or with empty titles
-      if (strlen(windowTitle) > 0)
+      // PROCESS_QUERY_LIMITED_INFORMATION is granted for elevated and protected processes too, and
+      // QueryFullProcessImageNameW doesn't have to read the target's module list
+      HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+      if (!hProcess)
+      {
+         return info;
+      }
+
+      // Long paths don't fit MAX_PATH; grow up to the longest path the system supports
+      std::wstring path(MAX_PATH, L'\0');
+      for (;;)
+      {
+         DWORD length = static_cast<DWORD>(path.size());
+         if (QueryFullProcessImageNameW(hProcess, 0, &path[0], &length))
+         {
+            path.resize(length);
+            info.imagePath = WideToUtf8(path);
+            info.name = WideToUtf8(path.substr(path.find_last_of(L'\\') + 1));
+            break;
+         }
+         if (GetLastError() != ERROR_INSUFFICIENT_BUFFER || path.size() >= 32768)
+         {
+            break;
+         }
+         path.resize(path.size() * 2);
+      }
+      CloseHandle(hProcess);
+      return info;
+   }
+
+   std::unordered_map<DWORD, ProcessInfo> processes;
+};
+
+struct EnumContext
+{
+   std::vector<WindowInfo> *windows;
+   ProcessCache *processes;
+};
+
+// The icon the taskbar would show.  The class icon needs no message; WM_GETICON goes to the
+// window's thread, so it is only sent when there is no class icon and a hung window is skipped.
+HICON GetWindowIcon(HWND hwnd)
+{
+   HICON icon = reinterpret_cast<HICON>(GetClassLongPtrW(hwnd, GCLP_HICON));
+   if (!icon)
+   {
+      DWORD_PTR result = 0;
+      if (SendMessageTimeoutW(hwnd, WM_GETICON, ICON_BIG, 0, SMTO_ABORTIFHUNG, ICON_QUERY_TIMEOUT_MS, &result))
+      {
+         icon = reinterpret_cast<HICON>(result);
+      }
+   }
+   return icon;
+}
+
+BOOL CALLBACK EnumWindowsProc(HWND hwnd, LPARAM lParam)
+{
+   EnumContext *context = reinterpret_cast<EnumContext *>(lParam);
+
+   // Skip invisible windows and windows without titles
+   int length = IsWindowVisible(hwnd) ? GetWindowTextLengthW(hwnd) : 0;
+   if (length > 0)
+   {
+      // The length is only an upper bound, and the title can change in between
+      std::wstring windowTitle(length + 1, L'\0');
+      windowTitle.resize(GetWindowTextW(hwnd, &windowTitle[0], length + 1));
+      if (!windowTitle.empty())
       {
          WindowInfo info;
          info.windowHandle = hwnd;
-         info.windowTitle = windowTitle;
+         info.windowTitle = WideToUtf8(windowTitle);
 
          // Get process ID
          GetWindowThreadProcessId(hwnd, &info.processId);
+         const ProcessInfo &process = context->processes->Get(info.processId);
+         info.processName = process.name;
+         info.imagePath = process.imagePath;
+
+         // Only the JSON output carries the icon
+         info.icon = options.json ? GetWindowIcon(hwnd) : nullptr;
+
+         context->windows->push_back(std::move(info));
+      }
+   }
+
+   return TRUE; // Continue enumeration
+}
+
+//
+// Audio session state of every process that has a session on an active render endpoint, rolled up
+// to the process's ancestors so a window is flagged when any process of its tree plays sound.
+// This is what the loopback capture of that tree would pick up.
+//
+namespace Audio
+{
+   void AddEndpointSessions(IMMDevice *device, std::unordered_map<DWORD, AudioActivity> &sessions)
+   {
+      ComPtr<IAudioSessionManager2> manager;
+      ComPtr<IAudioSessionEnumerator> enumerator;
+      int count = 0;
+      if (FAILED(device->Activate(__uuidof(IAudioSessionManager2), CLSCTX_ALL, nullptr, reinterpret_cast<void **>(manager.GetAddressOf()))) ||
+          FAILED(manager->GetSessionEnumerator(&enumerator)) ||
+          FAILED(enumerator->GetCount(&count)))
+      {
+         return;
+      }
+
+      for (int i = 0; i < count; i++)
+      {
+         ComPtr<IAudioSessionControl> control;
+         ComPtr<IAudioSessionControl2> control2;
+         DWORD processId = 0;
+         if (FAILED(enumerator->GetSession(i, &control)) || FAILED(control.As(&control2)) ||
+             control2->IsSystemSoundsSession() == S_OK || FAILED(control2->GetProcessId(&processId)) || processId == 0)
+         {
+            continue;
+         }
+
+         AudioActivity activity;
+         ::AudioSessionState state = AudioSessionStateInactive;
+         control->GetState(&state);
+         activity.state = (state == AudioSessionStateActive) ? AudioState::Active : AudioState::Inactive;
+
+         ComPtr<IAudioMeterInformation> meter;
+         if (SUCCEEDED(control.As(&meter)))
+         {
+            meter->GetPeakValue(&activity.peak);
+         }
+
+         sessions[processId].Merge(activity);
+      }
+   }
+
+   std::unordered_map<DWORD, AudioActivity> QuerySessions()
+   {
+      std::unordered_map<DWORD, AudioActivity> sessions;
+
+      ComPtr<IMMDeviceEnumerator> deviceEnumerator;
+      ComPtr<IMMDeviceCollection> devices;
+      UINT count = 0;
+      if (FAILED(CoCreateInstance(__uuidof(MMDeviceEnumerator), nullptr, CLSCTX_ALL, IID_PPV_ARGS(&deviceEnumerator))) ||
+          FAILED(deviceEnumerator->EnumAudioEndpoints(eRender, DEVICE_STATE_ACTIVE, &devices)) ||
+          FAILED(devices->GetCount(&count)))
+      {
+         return sessions;
+      }
+
+      for (UINT i = 0; i < count; i++)
+      {
+         ComPtr<IMMDevice> device;
+         if (SUCCEEDED(devices->Item(i, &device)))
+         {
+            AddEndpointSessions(device.Get(), sessions);
+         }
+      }
+      return sessions;
+   }
+
+   std::unordered_map<DWORD, DWORD> QueryParents()
+   {
+      std::unordered_map<DWORD, DWORD> parents;
+      HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+      if (hSnapshot == INVALID_HANDLE_VALUE)
+      {
+         return parents;
+      }
+
+      PROCESSENTRY32W entry = {};
+      entry.dwSize = sizeof(entry);
+      for (BOOL more = Process32FirstW(hSnapshot, &entry); more; more = Process32NextW(hSnapshot, &entry))
+      {
+         parents[entry.th32ProcessID] = entry.th32ParentProcessID;
+      }
+      CloseHandle(hSnapshot);
+      return parents;
+   }
+
+   // Activity of every process whose tree has a session.  Parent PIDs in the snapshot can be stale
+   // (the parent exited and its PID was reused), so the walk stops at a fixed depth.
+   std::unordered_map<DWORD, AudioActivity> QueryTreeActivity()
+   {
+      std::unordered_map<DWORD, AudioActivity> activity;
+      const auto sessions = QuerySessions();
+      if (sessions.empty())
+      {
+         return activity;
+      }
+
+      const auto parents = QueryParents();
+      for (const auto &session : sessions)
+      {
+         DWORD processId = session.first;
+         for (int depth = 0; depth < AUDIO_MAX_TREE_DEPTH && processId != 0; depth++)
+         {
+            activity[processId].Merge(session.second);
+
+            auto parent = parents.find(processId);
+            if (parent == parents.end() || parent->second == processId)
+            {
+               break;
+            }
+            processId = parent->second;
+         }
+      }
+      return activity;
+   }
+
+   const char *GetStateName(AudioState state)
+   {
+      switch (state)
+      {
+      case AudioState::Active:
+         return "active";
+      case AudioState::Inactive:
+         return "inactive";
+      default:
+         return "none";
+      }
+   }
+}
+
+std::vector<WindowInfo> EnumerateWindows(ProcessCache &processes)
+{
+   std::vector<WindowInfo> windows;
+   EnumContext context = {&windows, &processes};
+   EnumWindows(EnumWindowsProc, reinterpret_cast<LPARAM>(&context));
+
+   std::unordered_set<DWORD> processIds;
+   for (const auto &window : windows)
+   {
+      processIds.insert(window.processId);
+   }
+   processes.Prune(processIds);
+
+   if (options.audio)
+   {
+      const auto activity = Audio::QueryTreeActivity();
+      for (auto &window : windows)
+      {
+         auto found = activity.find(window.processId);
+         if (found != activity.end())
+         {
+            window.audio = found->second;
+         }
+      }
+
+      if (options.audioOnly)
+      {
+         windows.erase(std::remove_if(windows.begin(), windows.end(), [](const WindowInfo &window)
+                                      { return window.audio.state != AudioState::Active; }),
+                       windows.end());
+      }
+   }
+
+   return windows;
+}
+
+//
+// Everything is printed into one buffer that is written to stdout in a single WriteFile, so a
+// list or a --watch batch reaches the reader in one piece and nothing is written per line.
+//
+namespace Output
+{
+   std::string buffer;
 
-         // Get process name
-         HANDLE hProcess = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, info.processId);
-         if (hProcess)
+   void AppendNumber(unsigned long long value)
+   {
+      char digits[24];
+      buffer.append(digits, snprintf(digits, sizeof(digits), "%llu", value));
+   }
+
+   void AppendPeak(float peak)
+   {
+      char digits[24];
+      buffer.append(digits, snprintf(digits, sizeof(digits), "%g", peak));
+   }
+
+   void AppendJsonString(const std::string &value)
+   {
+      buffer += '"';
+      for (char c : value)
+      {
+         switch (c)
          {
-            char processName[MAX_PATH];
-            if (GetModuleBaseNameA(hProcess, NULL, processName, sizeof(processName)))
+         case '"':
+            buffer += "\\\"";
+            break;
+         case '\\':
+            buffer += "\\\\";
+            break;
+         default:
+            if (static_cast<unsigned char>(c) < 0x20)
             {
-               info.processName = processName;
+               char escape[8];
+               buffer.append(escape, snprintf(escape, sizeof(escape), "\\u%04x", c));
             }
             else
             {
-               info.processName = "Unknown";
+               buffer += c;
             }
-            CloseHandle(hProcess);
          }
-         else
+      }
+      buffer += '"';
+   }
+
+   // pid;hwnd;title, or pid;hwnd;state;peak;title with --audio.  The title stays last since it may
+   // contain ';'.
+   void AppendLine(const WindowInfo &app, const char *prefix)
+   {
+      buffer += prefix;
+      AppendNumber(app.processId);
+      buffer += ';';
+      AppendNumber(reinterpret_cast<ULONG_PTR>(app.windowHandle));
+      buffer += ';';
+      if (options.audio)
+      {
+         buffer += Audio::GetStateName(app.audio.state);
+         buffer += ';';
+         AppendPeak(app.audio.peak);
+         buffer += ';';
+      }
+      buffer += app.windowTitle;
+      buffer += '\n';
+   }
+
+   // {"pid":..,"hwnd":..,"title":..,"processName":..,"imagePath":..,"icon":..[,"audio":{..}]}.
+   // Handles are numbers, as in the text output.
+   void AppendObject(const WindowInfo &app)
+   {
+      buffer += "{\"pid\":";
+      AppendNumber(app.processId);
+      buffer += ",\"hwnd\":";
+      AppendNumber(reinterpret_cast<ULONG_PTR>(app.windowHandle));
+      buffer += ",\"title\":";
+      AppendJsonString(app.windowTitle);
+      buffer += ",\"processName\":";
+      AppendJsonString(app.processName);
+      buffer += ",\"imagePath\":";
+      AppendJsonString(app.imagePath);
+      buffer += ",\"icon\":";
+      AppendNumber(reinterpret_cast<ULONG_PTR>(app.icon));
+      if (options.audio)
+      {
+         buffer += ",\"audio\":{\"state\":\"";
+         buffer += Audio::GetStateName(app.audio.state);
+         buffer += "\",\"peak\":";
+         AppendPeak(app.audio.peak);
+         buffer += '}';
+      }
+      buffer += '}';
+   }
+
+   void AppendArray(const std::vector<const WindowInfo *> &apps)
+   {
+      buffer += '[';
+      for (size_t i = 0; i < apps.size(); i++)
+      {
+         if (i > 0)
          {
-            info.processName = "Unknown";
+            buffer += ',';
          }
-
-         windows->push_back(info);
+         AppendObject(*apps[i]);
       }
+      buffer += ']';
    }
 
-   return TRUE; // Continue enumeration
+   // Writes and empties the buffer.  Returns false once the reader has gone away.
+   bool Flush()
+   {
+      HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+      const char *data = buffer.data();
+      size_t remaining = buffer.size();
+      bool succeeded = true;
+      while (remaining > 0)
+      {
+         DWORD written = 0;
+         if (!WriteFile(hStdout, data, static_cast<DWORD>((std::min)(remaining, size_t(1) << 30)), &written, nullptr))
+         {
+            succeeded = false;
+            break;
+         }
+         data += written;
+         remaining -= written;
+      }
+      buffer.clear();
+      return succeeded;
+   }
 }
 
 void PrintApplicationsWithWindows(const std::vector<WindowInfo> &apps)
 {
-   for (const auto &app : apps)
+   if (options.json)
+   {
+      std::vector<const WindowInfo *> all;
+      all.reserve(apps.size());
+      for (const auto &app : apps)
+      {
+         all.push_back(&app);
+      }
+      Output::AppendArray(all);
+      Output::buffer += '\n';
+   }
+   else
    {
-      std::cout
-          << app.processId << ";"
-          << (unsigned long)app.windowHandle << ";"
-          << app.windowTitle << "\n";
+      for (const auto &app : apps)
+      {
+         Output::AppendLine(app, "");
+      }
    }
+   Output::Flush();
 }
 
-int main()
+//
+// --watch: stays running and prints what changed instead of the whole list.  Every batch of changes
+// is a run of "+pid;hwnd;title" (window added) and "-pid;hwnd;title" (window removed) lines followed
+// by an empty line; the first batch lists every window.  With --json every batch is one line,
+// {"removed":[...],"added":[...]}, holding the same objects as the one-shot list.  A window whose title changed is removed
+// and added again, and so is one whose audio state changed with --audio.  Window events only tell us
+// something changed; the list is re-enumerated once they have settled, which is cheap now that
+// process names are cached.  Audio sessions come and go without window events, so with --audio the
+// list is also re-read every WATCH_AUDIO_REFRESH_MS.
+//
+namespace Watch
+{
+   ProcessCache processes;
+   std::unordered_map<HWND, WindowInfo> listed;
+   // The batch being published, kept so their storage is reused
+   std::vector<const WindowInfo *> removed;
+   std::vector<const WindowInfo *> added;
+   UINT_PTR settleTimer = 0;
+
+   bool IsChanged(const WindowInfo &before, const WindowInfo &after)
+   {
+      return before.windowTitle != after.windowTitle || before.processId != after.processId ||
+             before.audio.state != after.audio.state;
+   }
+
+   bool PublishChanges()
+   {
+      std::unordered_map<HWND, WindowInfo> current;
+      for (auto &window : EnumerateWindows(processes))
+      {
+         current.emplace(window.windowHandle, std::move(window));
+      }
+
+      for (const auto &entry : listed)
+      {
+         auto found = current.find(entry.first);
+         if (found == current.end() || IsChanged(entry.second, found->second))
+         {
+            removed.push_back(&entry.second);
+         }
+      }
+      for (const auto &entry : current)
+      {
+         auto found = listed.find(entry.first);
+         if (found == listed.end() || IsChanged(found->second, entry.second))
+         {
+            added.push_back(&entry.second);
+         }
+      }
+
+      if (options.json)
+      {
+         Output::buffer += "{\"removed\":";
+         Output::AppendArray(removed);
+         Output::buffer += ",\"added\":";
+         Output::AppendArray(added);
+         Output::buffer += "}\n";
+      }
+      else
+      {
+         for (const WindowInfo *window : removed)
+         {
+            Output::AppendLine(*window, "-");
+         }
+         for (const WindowInfo *window : added)
+         {
+            Output::AppendLine(*window, "+");
+         }
+         Output::buffer += '\n';
+      }
+      removed.clear();
+      added.clear();
+      listed = std::move(current);
+
+      // The reader went away
+      return Output::Flush();
+   }
+
+   void CALLBACK OnSettled(HWND, UINT, UINT_PTR, DWORD)
+   {
+      KillTimer(nullptr, settleTimer);
+      settleTimer = 0;
+      if (!PublishChanges())
+      {
+         PostQuitMessage(0);
+      }
+   }
+
+   void CALLBACK OnAudioRefresh(HWND, UINT, UINT_PTR, DWORD)
+   {
+      if (!PublishChanges())
+      {
+         PostQuitMessage(0);
+      }
+   }
+
+   void CALLBACK OnWinEvent(HWINEVENTHOOK, DWORD event, HWND hwnd, LONG idObject, LONG idChild, DWORD, DWORD)
+   {
+      // Only top-level windows themselves, not their carets, cursors or child controls.  A destroyed
+      // window has no parent left to check, so it only counts if it was listed.
+      if (idObject != OBJID_WINDOW || idChild != CHILDID_SELF || hwnd == nullptr)
+      {
+         return;
+      }
+      if (event == EVENT_OBJECT_DESTROY ? listed.count(hwnd) == 0 : GetAncestor(hwnd, GA_PARENT) != GetDesktopWindow())
+      {
+         return;
+      }
+
+      if (settleTimer == 0)
+      {
+         settleTimer = SetTimer(nullptr, 0, WATCH_SETTLE_MS, OnSettled);
+      }
+   }
+
+   int Run()
+   {
+      // Creation, destruction, showing and hiding, then title changes
+      const DWORD flags = WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS;
+      HWINEVENTHOOK hooks[] = {
+          SetWinEventHook(EVENT_OBJECT_CREATE, EVENT_OBJECT_HIDE, nullptr, OnWinEvent, 0, 0, flags),
+          SetWinEventHook(EVENT_OBJECT_NAMECHANGE, EVENT_OBJECT_NAMECHANGE, nullptr, OnWinEvent, 0, 0, flags),
+      };
+      if (!hooks[0] || !hooks[1])
+      {
+         std::cerr << "SetWinEventHook failed: " << GetLastError() << "\n";
+         return 1;
+      }
+
+      UINT_PTR audioTimer = options.audio ? SetTimer(nullptr, 0, WATCH_AUDIO_REFRESH_MS, OnAudioRefresh) : 0;
+
+      if (PublishChanges())
+      {
+         // Out-of-context hooks are delivered through this thread's message queue
+         MSG msg;
+         while (GetMessage(&msg, nullptr, 0, 0) > 0)
+         {
+            DispatchMessage(&msg);
+         }
+      }
+
+      if (audioTimer != 0)
+      {
+         KillTimer(nullptr, audioTimer);
+      }
+      for (HWINEVENTHOOK hook : hooks)
+      {
+         UnhookWinEvent(hook);
+      }
+      return 0;
+   }
+}
+
+int main(int argc, char *argv[])
 {
    // Set console to UTF-8 for proper character display
    SetConsoleOutputCP(CP_UTF8);
+   Output::buffer.reserve(OUTPUT_RESERVE_BYTES);
 
-   // Enumerate windows to get all windows with titles
-   std::vector<WindowInfo> windowApps;
-   EnumWindows(EnumWindowsProc, reinterpret_cast<LPARAM>(&windowApps));
-
-   // Filter only windows with titles (no duplicate removal)
-   std::vector<WindowInfo> appsWithTitles;
-   for (const auto &app : windowApps)
+   for (int i = 1; i < argc; i++)
    {
-      if (!app.windowTitle.empty())
+      if (strcmp(argv[i], "--watch") == 0)
       {
-         appsWithTitles.push_back(app);
+         options.watch = true;
+      }
+      else if (strcmp(argv[i], "--audio") == 0)
+      {
+         options.audio = true;
+      }
+      else if (strcmp(argv[i], "--audio-only") == 0)
+      {
+         options.audio = true;
+         options.audioOnly = true;
+      }
+      else if (strcmp(argv[i], "--json") == 0)
+      {
+         options.json = true;
+      }
+      else
+      {
+         std::cerr << "Usage: ProcessList.exe [--watch] [--audio | --audio-only] [--json]\n";
+         return 1;
       }
    }
 
-   PrintApplicationsWithWindows(appsWithTitles);
+   // The session manager is only needed with --audio.  Apartment-threaded, since --watch pumps
+   // messages on this thread anyway.
+   bool comInitialized = options.audio && SUCCEEDED(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED));
 
-   return 0;
+   int result = 0;
+   if (options.watch)
+   {
+      result = Watch::Run();
+   }
+   else
+   {
+      // Enumerate windows to get all windows with titles
+      ProcessCache processes;
+      PrintApplicationsWithWindows(EnumerateWindows(processes));
+   }
+
+   if (comInitialized)
+   {
+      CoUninitialize();
+   }
+   return result;
 }